@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aggregate.h"
+#include "string_table.h"
+
+int initAggregation(Aggregation *aggregation, GroupBy groupBy, int maxGroups) {
+    memset(aggregation, 0, sizeof(*aggregation));
+    if (maxGroups < 1) maxGroups = DEFAULT_MAX_GROUPS;
+
+    // Keep the index at most half full
+    unsigned int slotCount = 64;
+    while (slotCount < (unsigned int)maxGroups * 2) slotCount *= 2;
+
+    aggregation->groups = trackedAlloc((size_t)maxGroups * sizeof(AggregateGroup));
+    aggregation->heap = trackedAlloc((size_t)maxGroups * sizeof(int));
+    aggregation->order = trackedAlloc((size_t)maxGroups * sizeof(int));
+    aggregation->slots = trackedAlloc(slotCount * sizeof(unsigned int));
+    if (aggregation->groups == NULL || aggregation->heap == NULL || aggregation->order == NULL ||
+        aggregation->slots == NULL) {
+        freeAggregation(aggregation);
+        return -1;
+    }
+    aggregation->maxGroups = maxGroups;
+    aggregation->slotCount = slotCount;
+    resetAggregation(aggregation, groupBy);
+    return 0;
+}
+
+void freeAggregation(Aggregation *aggregation) {
+    trackedFree(aggregation->groups);
+    trackedFree(aggregation->heap);
+    trackedFree(aggregation->order);
+    trackedFree(aggregation->slots);
+    memset(aggregation, 0, sizeof(*aggregation));
+}
+
+void resetAggregation(Aggregation *aggregation, GroupBy groupBy) {
+    aggregation->groupBy = groupBy;
+    aggregation->groupCount = 0;
+    aggregation->rowCount = 0;
+    aggregation->replacedCount = 0;
+    if (aggregation->slots != NULL) memset(aggregation->slots, 0, aggregation->slotCount * sizeof(unsigned int));
+}
+
+const char *getGroupByName(GroupBy groupBy) {
+    switch (groupBy) {
+        case GROUP_REMOTE_NETWORK: return "REMOTE NETWORK";
+        case GROUP_LOCAL_PORT: return "LOCAL PORT";
+        case GROUP_STATE: return "STATE";
+        case GROUP_PROGRAM: return "PROGRAM";
+        case GROUP_NAMESPACE: return "NAMESPACE";
+        default: return "UNKNOWN";
+    }
+}
+
+// The group key of a row, zero-padded to 16 bytes. Returns the family to
+// show the key as.
+static AddressFamily keyForRow(GroupBy groupBy, const ConnectionSnapshot *snapshot, int row, unsigned char key[16]) {
+    memset(key, 0, 16);
+    switch (groupBy) {
+        case GROUP_REMOTE_NETWORK:
+            return getNetworkKey(snapshot->remoteAddress[row], key);
+        case GROUP_LOCAL_PORT:
+            memcpy(key, &snapshot->localPort[row], sizeof(unsigned short));
+            key[2] = snapshot->protocol[row];
+            break;
+        case GROUP_STATE:
+            key[0] = snapshot->state[row];
+            break;
+        case GROUP_PROGRAM:
+            memcpy(key, &snapshot->programId[row], sizeof(unsigned int));
+            memcpy(key + 4, &snapshot->programName[row], sizeof(unsigned int));
+            break;
+        case GROUP_NAMESPACE:
+            memcpy(key, &snapshot->networkNamespace[row], sizeof(unsigned int));
+            break;
+        default:
+            break;
+    }
+    return (AddressFamily)snapshot->family[row];
+}
+
+static unsigned int hashKey(const unsigned char key[16]) {
+    unsigned long long words[2];
+    memcpy(words, key, 16);
+    unsigned long long hash = (words[0] ^ (words[1] * 0x9E3779B97F4A7C15ull)) * 0xFF51AFD7ED558CCDull;
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+// The heap keeps the smallest group on top, which is the one a new key
+// takes over when the table is full
+static void swapHeap(Aggregation *aggregation, int a, int b) {
+    int group = aggregation->heap[a];
+    aggregation->heap[a] = aggregation->heap[b];
+    aggregation->heap[b] = group;
+    aggregation->groups[aggregation->heap[a]].heapIndex = a;
+    aggregation->groups[aggregation->heap[b]].heapIndex = b;
+}
+
+static void siftDown(Aggregation *aggregation, int index) {
+    while (1) {
+        int smallest = index;
+        int left = index * 2 + 1;
+        int right = left + 1;
+        if (left < aggregation->groupCount &&
+            aggregation->groups[aggregation->heap[left]].count < aggregation->groups[aggregation->heap[smallest]].count) {
+            smallest = left;
+        }
+        if (right < aggregation->groupCount &&
+            aggregation->groups[aggregation->heap[right]].count < aggregation->groups[aggregation->heap[smallest]].count) {
+            smallest = right;
+        }
+        if (smallest == index) return;
+        swapHeap(aggregation, index, smallest);
+        index = smallest;
+    }
+}
+
+static void siftUp(Aggregation *aggregation, int index) {
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (aggregation->groups[aggregation->heap[parent]].count <= aggregation->groups[aggregation->heap[index]].count) return;
+        swapHeap(aggregation, index, parent);
+        index = parent;
+    }
+}
+
+static void insertSlot(Aggregation *aggregation, int group) {
+    unsigned int mask = aggregation->slotCount - 1;
+    unsigned int slot = aggregation->groups[group].hash & mask;
+    while (aggregation->slots[slot] != 0) slot = (slot + 1) & mask;
+    aggregation->slots[slot] = (unsigned int)group + 1;
+}
+
+// Take a group out of the index. Later entries of the same run are moved
+// back into the hole, so lookups never need tombstones.
+static void removeSlot(Aggregation *aggregation, int group) {
+    unsigned int mask = aggregation->slotCount - 1;
+    unsigned int hole = aggregation->groups[group].hash & mask;
+    while (aggregation->slots[hole] != (unsigned int)group + 1) hole = (hole + 1) & mask;
+
+    for (unsigned int next = (hole + 1) & mask; aggregation->slots[next] != 0; next = (next + 1) & mask) {
+        unsigned int home = aggregation->groups[aggregation->slots[next] - 1].hash & mask;
+        // The entry can move if the hole is between its home slot and where it is
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            aggregation->slots[hole] = aggregation->slots[next];
+            hole = next;
+        }
+    }
+    aggregation->slots[hole] = 0;
+}
+
+static void addRow(Aggregation *aggregation, const ConnectionSnapshot *snapshot, int row) {
+    unsigned char key[16];
+    AddressFamily family = keyForRow(aggregation->groupBy, snapshot, row, key);
+    unsigned int hash = hashKey(key);
+    unsigned int mask = aggregation->slotCount - 1;
+    AggregateGroup *group = NULL;
+
+    for (unsigned int slot = hash & mask; aggregation->slots[slot] != 0; slot = (slot + 1) & mask) {
+        AggregateGroup *candidate = &aggregation->groups[aggregation->slots[slot] - 1];
+        if (candidate->hash == hash && memcmp(candidate->key, key, 16) == 0) {
+            group = candidate;
+            break;
+        }
+    }
+
+    if (group == NULL) {
+        int number;
+        if (aggregation->groupCount < aggregation->maxGroups) {
+            number = aggregation->groupCount++;
+            group = &aggregation->groups[number];
+            group->count = 0;
+            group->error = 0;
+            group->heapIndex = number;
+            aggregation->heap[number] = number;
+        } else {
+            // Full: the smallest group makes way, and its count carries
+            // over as the new group's possible error
+            number = aggregation->heap[0];
+            group = &aggregation->groups[number];
+            removeSlot(aggregation, number);
+            group->error = group->count;
+            aggregation->replacedCount++;
+        }
+        memcpy(group->key, key, 16);
+        group->family = (unsigned char)family;
+        group->hash = hash;
+        group->sendRate = 0;
+        group->receiveRate = 0;
+        group->newRetransmits = 0;
+        insertSlot(aggregation, number);
+    }
+
+    group->count++;
+    group->sendRate += snapshot->sendRate[row];
+    group->receiveRate += snapshot->receiveRate[row];
+    group->newRetransmits += snapshot->newRetransmits[row];
+
+    // Its count only went up, so it can only need to move down the heap
+    // (a brand new group starts at the bottom and moves up)
+    siftDown(aggregation, group->heapIndex);
+    siftUp(aggregation, group->heapIndex);
+}
+
+void aggregateSnapshot(Aggregation *aggregation, const ConnectionSnapshot *snapshot, const int *rows, int rowCount) {
+    if (aggregation->groups == NULL) return;
+
+    if (rows == NULL) {
+        for (int row = 0; row < snapshot->count; row++) addRow(aggregation, snapshot, row);
+        aggregation->rowCount += (unsigned long long)snapshot->count;
+    } else {
+        for (int i = 0; i < rowCount; i++) addRow(aggregation, snapshot, rows[i]);
+        aggregation->rowCount += (unsigned long long)rowCount;
+    }
+}
+
+// qsort has no context argument, so the comparison reads this
+static const Aggregation *sortAggregation;
+
+static int compareGroups(const void *left, const void *right) {
+    const AggregateGroup *a = &sortAggregation->groups[*(const int *)left];
+    const AggregateGroup *b = &sortAggregation->groups[*(const int *)right];
+    if (a->count != b->count) return a->count < b->count ? 1 : -1;
+    return memcmp(a->key, b->key, 16);
+}
+
+int getTopGroups(const Aggregation *aggregation, int *top, int count) {
+    if (aggregation->groupCount == 0 || count <= 0) return 0;
+
+    // Sort a copy of the heap's group numbers; at most maxGroups of them
+    int *order = aggregation->order;
+    memcpy(order, aggregation->heap, (size_t)aggregation->groupCount * sizeof(int));
+    sortAggregation = aggregation;
+    qsort(order, (size_t)aggregation->groupCount, sizeof(int), compareGroups);
+
+    if (count > aggregation->groupCount) count = aggregation->groupCount;
+    memcpy(top, order, (size_t)count * sizeof(int));
+    return count;
+}
+
+void formatGroupKey(const Aggregation *aggregation, const AggregateGroup *group, char *text, size_t size) {
+    switch (aggregation->groupBy) {
+        case GROUP_REMOTE_NETWORK: {
+            NetworkConnection connection;
+            char address[MAX_ADDRESS_TEXT];
+            memset(&connection, 0, sizeof(connection));
+            connection.family = group->family;
+            memcpy(connection.remoteAddress, group->key, 16);
+            formatAddress(&connection, 1, address, sizeof(address));
+            snprintf(text, size, "%s/%d", address, group->family == ADDRESS_IPV6 ? 64 : 24);
+            break;
+        }
+        case GROUP_LOCAL_PORT: {
+            unsigned short port;
+            memcpy(&port, group->key, sizeof(port));
+            snprintf(text, size, "%u/%s", port, getProtocolName(group->key[2]));
+            break;
+        }
+        case GROUP_STATE:
+            snprintf(text, size, "%s", getStateName(group->key[0]));
+            break;
+        case GROUP_PROGRAM: {
+            unsigned int programId, programName;
+            memcpy(&programId, group->key, sizeof(programId));
+            memcpy(&programName, group->key + 4, sizeof(programName));
+            if (programId == 0) snprintf(text, size, "%s", getProgramNameText(programName));
+            else snprintf(text, size, "%s (%u)", getProgramNameText(programName), programId);
+            break;
+        }
+        case GROUP_NAMESPACE: {
+            unsigned int name;
+            memcpy(&name, group->key, sizeof(name));
+            snprintf(text, size, "%s", getNamespaceNameText(name));
+            break;
+        }
+        default:
+            snprintf(text, size, "?");
+            break;
+    }
+}
+
+void countConnections(const ConnectionSnapshot *snapshot, ConnectionCounts *counts) {
+    memset(counts, 0, sizeof(*counts));
+    counts->total = snapshot->count;
+
+    for (int i = 0; i < snapshot->count; i++) {
+        counts->stateCounts[snapshot->state[i]]++;
+        counts->protocolCounts[snapshot->protocol[i]]++;
+        counts->ipv6Count += snapshot->family[i] == ADDRESS_IPV6;
+    }
+
+    // Local is the loopback, like the LOCAL filter
+    for (int i = 0; i < snapshot->count; i++) {
+        counts->localCount += getAddressScope(snapshot->localAddress[i]) == SCOPE_LOOPBACK;
+        counts->scopeCounts[getAddressScope(snapshot->remoteAddress[i])]++;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stddef.h>
+#include "snapshot.h"
+
+#define DEFAULT_MAX_GROUPS 1024
+
+// What rows are grouped by
+typedef enum {
+    GROUP_REMOTE_NETWORK,   // Remote /24 for IPv4, /64 for IPv6
+    GROUP_LOCAL_PORT,       // Local port and protocol
+    GROUP_STATE,
+    GROUP_PROGRAM,          // Owning process
+    GROUP_NAMESPACE,        // Network namespace (container or pod)
+    GROUP_BY_COUNT
+} GroupBy;
+
+// One group and what its rows add up to
+typedef struct {
+    unsigned char key[16];          // Masked address, port, state or program, see keyForRow
+    unsigned char family;           // AddressFamily, for GROUP_REMOTE_NETWORK
+    unsigned int hash;
+    int heapIndex;                  // Where the group is in the min-heap
+    unsigned long long count;       // Connections (may be high by up to error)
+    unsigned long long error;       // Count the group took over from the one it replaced
+    unsigned long long sendRate;    // Bytes per second, summed over its rows
+    unsigned long long receiveRate;
+    unsigned long long newRetransmits;
+} AggregateGroup;
+
+// Counts and rates per group for one snapshot. The number of groups is
+// capped: once the table is full, a new key takes over the group with the
+// smallest count (the space-saving heavy-hitters algorithm). The biggest
+// groups are then still found, with counts off by at most their error, so
+// a scan touching millions of remote hosts can't make the table grow.
+// All the memory is allocated once and reused for every snapshot.
+typedef struct {
+    GroupBy groupBy;
+    AggregateGroup *groups;
+    int groupCount;
+    int maxGroups;
+    int *heap;                  // Group numbers, smallest count first
+    int *order;                 // Work space for getTopGroups
+    unsigned int *slots;        // Open-addressed index of group + 1 (0 = empty)
+    unsigned int slotCount;     // Power of two
+    unsigned long long rowCount;        // Rows added since the last reset
+    unsigned long long replacedCount;   // Groups taken over; 0 = counts are exact
+} Aggregation;
+
+int initAggregation(Aggregation *aggregation, GroupBy groupBy, int maxGroups);
+void freeAggregation(Aggregation *aggregation);
+
+// Forget the groups (keeping the memory), possibly switching what to group by
+void resetAggregation(Aggregation *aggregation, GroupBy groupBy);
+
+// Add rows of the snapshot to the groups: the listed ones, or all of them
+// when rows is NULL
+void aggregateSnapshot(Aggregation *aggregation, const ConnectionSnapshot *snapshot, const int *rows, int rowCount);
+
+// Write the numbers of the (up to) count biggest groups to top, biggest
+// first. Returns how many were written.
+int getTopGroups(const Aggregation *aggregation, int *top, int count);
+
+void formatGroupKey(const Aggregation *aggregation, const AggregateGroup *group, char *text, size_t size);
+const char *getGroupByName(GroupBy groupBy);
+
+// The totals shown under the table, counted in one go over just the
+// columns they need
+typedef struct {
+    int total;
+    int stateCounts[STATE_COUNT];
+    int protocolCounts[2];
+    int ipv6Count;
+    int localCount;                     // Loopback on our end
+    int scopeCounts[SCOPE_ALL + 1];     // Indexed by the remote end's AddressScope
+} ConnectionCounts;
+
+void countConnections(const ConnectionSnapshot *snapshot, ConnectionCounts *counts);
+
+#endif
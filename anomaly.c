@@ -0,0 +1,315 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include "anomaly.h"
+
+void initAnomalyDetector(AnomalyDetector *detector) {
+    memset(detector, 0, sizeof(*detector));
+    detector->host.used = 1;
+}
+
+const char *getAlertName(AlertType type) {
+    switch (type) {
+        case ALERT_SYN_FLOOD: return "SYN flood";
+        case ALERT_PORT_SCAN: return "Port scan";
+        case ALERT_PEER_SURGE: return "Peer surge";
+        case ALERT_CHURN: return "Connection churn";
+        default: return "Unknown";
+    }
+}
+
+static unsigned long long mixHash(unsigned long long hash) {
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static unsigned int hashKey(const unsigned char key[16]) {
+    unsigned long long words[2];
+    memcpy(words, key, 16);
+    return (unsigned int)mixHash(words[0] ^ (words[1] * 0x9E3779B97F4A7C15ull));
+}
+
+// HyperLogLog: the top bits of the hash pick a register, which keeps the
+// longest run of leading zeros seen in the rest
+static void addToSketch(unsigned char sketch[ANOMALY_SKETCH_SIZE], unsigned long long hash) {
+    unsigned int index = (unsigned int)(hash >> 58);
+    unsigned long long rest = hash << 6;
+    unsigned char rank = 1;
+    while (rank <= 58 && (rest & (1ull << 63)) == 0) {
+        rest <<= 1;
+        rank++;
+    }
+    if (rank > sketch[index]) sketch[index] = rank;
+}
+
+static unsigned int countSketch(const unsigned char sketch[ANOMALY_SKETCH_SIZE]) {
+    double sum = 0;
+    int zeros = 0;
+    for (int i = 0; i < ANOMALY_SKETCH_SIZE; i++) {
+        sum += 1.0 / (double)(1ull << sketch[i]);
+        zeros += sketch[i] == 0;
+    }
+    double estimate = 0.709 * ANOMALY_SKETCH_SIZE * ANOMALY_SKETCH_SIZE / sum;
+    // Few values: counting the empty registers is more accurate
+    if (estimate <= 2.5 * ANOMALY_SKETCH_SIZE && zeros > 0) {
+        estimate = ANOMALY_SKETCH_SIZE * log((double)ANOMALY_SKETCH_SIZE / zeros);
+    }
+    return (unsigned int)(estimate + 0.5);
+}
+
+// Exponentially weighted mean and variance. The first samples are
+// averaged evenly, so the baseline settles fast instead of starting at 0.
+static void updateBaseline(Baseline *baseline, double value, unsigned int samples) {
+    double alpha = samples < (unsigned int)(1 / ANOMALY_ALPHA) ? 1.0 / (samples + 1) : ANOMALY_ALPHA;
+    double difference = value - baseline->mean;
+    double increment = alpha * difference;
+    baseline->mean += increment;
+    baseline->variance = (1 - alpha) * (baseline->variance + difference * increment);
+}
+
+static unsigned int getThreshold(const Baseline *baseline, unsigned int minimum) {
+    double threshold = baseline->mean + ANOMALY_SIGMAS * sqrt(baseline->variance);
+    if (threshold < baseline->mean * ANOMALY_FACTOR) threshold = baseline->mean * ANOMALY_FACTOR;
+    if (threshold < minimum) threshold = minimum;
+    return (unsigned int)threshold;
+}
+
+// A find-or-add in one of the fixed tables. When all the places for the
+// key are taken, the least busy of them is given up.
+static TrackedKey *findKey(AnomalyDetector *detector, TrackedKey *table, const unsigned char key[16]) {
+    unsigned int hash = hashKey(key);
+    TrackedKey *empty = NULL;
+    TrackedKey *quietest = NULL;
+
+    for (unsigned int probe = 0; probe < ANOMALY_PROBES; probe++) {
+        TrackedKey *entry = &table[(hash + probe) & (ANOMALY_TRACKED - 1)];
+        if (!entry->used) {
+            if (empty == NULL) empty = entry;
+            continue;
+        }
+        if (entry->hash == hash && memcmp(entry->key, key, 16) == 0) return entry;
+        if (quietest == NULL || entry->windowSum + entry->halfOpen < quietest->windowSum + quietest->halfOpen ||
+            (entry->windowSum + entry->halfOpen == quietest->windowSum + quietest->halfOpen &&
+             entry->lastActive < quietest->lastActive)) {
+            quietest = entry;
+        }
+    }
+
+    TrackedKey *entry = empty;
+    if (entry == NULL) {
+        entry = quietest;
+        detector->stats.evicted++;
+    } else if (table == detector->networks) {
+        detector->stats.networks++;
+    } else {
+        detector->stats.ports++;
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->used = 1;
+    entry->hash = hash;
+    memcpy(entry->key, key, 16);
+    return entry;
+}
+
+// The remote /24 or /64, the same key aggregate.c groups by
+static TrackedKey *findNetwork(AnomalyDetector *detector, const NetworkConnection *connection) {
+    unsigned char key[16];
+    AddressFamily family = getNetworkKey(connection->remoteAddress, key);
+    TrackedKey *entry = findKey(detector, detector->networks, key);
+    entry->family = (unsigned char)family;
+    return entry;
+}
+
+static TrackedKey *findPort(AnomalyDetector *detector, unsigned short port, unsigned char protocol) {
+    unsigned char key[16] = {0};
+    memcpy(key, &port, sizeof(port));
+    key[2] = protocol;
+    return findKey(detector, detector->ports, key);
+}
+
+static int isListening(const AnomalyDetector *detector, unsigned char protocol, unsigned short port) {
+    return (detector->listening[protocol & 1][port >> 3] >> (port & 7)) & 1;
+}
+
+// One pass over the snapshot: the listening ports, and the half-open
+// connections on each port
+static void countSnapshot(AnomalyDetector *detector, const ConnectionSnapshot *snapshot) {
+    memset(detector->listening, 0, sizeof(detector->listening));
+    for (int row = 0; row < snapshot->count; row++) {
+        unsigned short port = snapshot->localPort[row];
+        if (snapshot->state[row] == STATE_LISTENING) {
+            detector->listening[snapshot->protocol[row] & 1][port >> 3] |= (unsigned char)(1 << (port & 7));
+        } else if (snapshot->state[row] == STATE_SYN_RCVD) {
+            TrackedKey *entry = findPort(detector, port, snapshot->protocol[row]);
+            entry->halfOpen++;
+            entry->lastActive = detector->refresh;
+            detector->host.halfOpen++;
+        }
+    }
+}
+
+static void countEvent(AnomalyDetector *detector, const ConnectionEvent *event) {
+    const NetworkConnection *connection = &event->connection;
+    if (event->type == EVENT_STATE_CHANGED) return;
+    // Listeners and unconnected UDP sockets have no one at the other end
+    if (getAddressScope(connection->remoteAddress) == SCOPE_UNSPECIFIED) return;
+
+    detector->host.changes++;
+    TrackedKey *network = findNetwork(detector, connection);
+    network->changes++;
+    network->lastActive = detector->refresh;
+
+    // Ports are only followed for connections coming in: outgoing ones
+    // are on a new ephemeral port every time
+    if (!isListening(detector, connection->protocol, connection->localPort) && connection->state != STATE_SYN_RCVD) return;
+    TrackedKey *port = findPort(detector, connection->localPort, connection->protocol);
+    port->changes++;
+    port->lastActive = detector->refresh;
+
+    if (event->type == EVENT_OPENED) {
+        addToSketch(network->sketch, mixHash((unsigned long long)connection->localPort << 8 | connection->protocol));
+        unsigned long long words[2];
+        memcpy(words, connection->remoteAddress, 16);
+        addToSketch(port->sketch, mixHash(words[0] ^ mixHash(words[1])));
+    }
+}
+
+static void raiseAlert(AnomalyDetector *detector, TrackedKey *entry, AlertKey key, AlertType type,
+                       unsigned int value, const Baseline *baseline, unsigned int threshold, unsigned long long timestamp) {
+    entry->quietUntil[type] = detector->refresh + ANOMALY_COOLDOWN;
+    detector->stats.alerts++;
+    if (detector->alertCount == ANOMALY_MAX_ALERTS) {
+        detector->stats.suppressed++;
+        return;
+    }
+
+    AnomalyAlert *alert = &detector->alerts[detector->alertCount++];
+    memset(alert, 0, sizeof(*alert));
+    alert->timestamp = timestamp;
+    alert->type = (unsigned char)type;
+    alert->key = (unsigned char)key;
+    if (key == ALERT_KEY_NETWORK) {
+        alert->family = entry->family;
+        memcpy(alert->address, entry->key, 16);
+    } else if (key == ALERT_KEY_PORT) {
+        memcpy(&alert->port, entry->key, sizeof(alert->port));
+        alert->protocol = entry->key[2];
+    }
+    alert->value = value;
+    alert->baseline = baseline != NULL ? (unsigned int)(baseline->mean + 0.5) : 0;
+    alert->threshold = threshold;
+    detector->recent[detector->recentCount++ % ANOMALY_RECENT] = *alert;
+}
+
+// A value against its baseline: alert when it's well over, then learn
+// from it. What was over the threshold is learned as the threshold, so a
+// flood doesn't become the new normal at once but a lasting change does
+// in time.
+static void checkBaseline(AnomalyDetector *detector, TrackedKey *entry, AlertKey key, AlertType type, unsigned int value,
+                          Baseline *baseline, unsigned int samples, unsigned int minimum, unsigned long long timestamp) {
+    unsigned int threshold = getThreshold(baseline, minimum);
+    int trusted = type == ALERT_PEER_SURGE ? samples >= 3 : samples >= ANOMALY_WARMUP;
+    if (trusted && value > threshold && detector->refresh >= entry->quietUntil[type]) {
+        raiseAlert(detector, entry, key, type, value, baseline, threshold, timestamp);
+    }
+    updateBaseline(baseline, trusted && value > threshold ? threshold : value, samples);
+}
+
+// Move the window on by a refresh and check everything about the key
+static void checkKey(AnomalyDetector *detector, TrackedKey *entry, AlertKey key, int windowEnds,
+                     unsigned long long timestamp) {
+    unsigned int slot = (unsigned int)(detector->refresh % ANOMALY_WINDOW);
+    entry->windowSum += entry->changes - entry->window[slot];
+    entry->window[slot] = entry->changes;
+
+    if (key != ALERT_KEY_NETWORK) {
+        checkBaseline(detector, entry, key, ALERT_SYN_FLOOD, entry->halfOpen, &entry->halfOpenBaseline, entry->samples,
+                      key == ALERT_KEY_HOST ? SYN_FLOOD_HOST_MIN : SYN_FLOOD_PORT_MIN, timestamp);
+    }
+    checkBaseline(detector, entry, key, ALERT_CHURN, entry->windowSum, &entry->churn, entry->samples,
+                  key == ALERT_KEY_HOST ? CHURN_HOST_MIN : CHURN_MIN, timestamp);
+
+    // The sketches are counted as they fill; a scan needs no baseline
+    if (key == ALERT_KEY_NETWORK && entry->changes > 0) {
+        unsigned int ports = countSketch(entry->sketch);
+        if (ports > PORT_SCAN_MIN && detector->refresh >= entry->quietUntil[ALERT_PORT_SCAN]) {
+            raiseAlert(detector, entry, key, ALERT_PORT_SCAN, ports, NULL, PORT_SCAN_MIN, timestamp);
+        }
+    }
+    if (key == ALERT_KEY_PORT && (entry->changes > 0 || windowEnds)) {
+        // Part of a window's peers against a whole one's baseline errs on
+        // the quiet side
+        unsigned int peers = countSketch(entry->sketch);
+        unsigned int threshold = getThreshold(&entry->peers, PEER_SURGE_MIN);
+        if (entry->windows >= 3 && peers > threshold && detector->refresh >= entry->quietUntil[ALERT_PEER_SURGE]) {
+            raiseAlert(detector, entry, key, ALERT_PEER_SURGE, peers, &entry->peers, threshold, timestamp);
+        }
+        if (windowEnds) {
+            updateBaseline(&entry->peers, entry->windows >= 3 && peers > threshold ? threshold : peers, entry->windows);
+            entry->windows++;
+        }
+    }
+
+    if (windowEnds) memset(entry->sketch, 0, sizeof(entry->sketch));
+    entry->samples++;
+    entry->changes = 0;
+    entry->halfOpen = 0;
+}
+
+int detectAnomalies(AnomalyDetector *detector, const ConnectionSnapshot *snapshot, const ConnectionDiff *diff,
+                    unsigned long long timestamp) {
+    detector->alertCount = 0;
+    detector->stats.refreshes++;
+
+    countSnapshot(detector, snapshot);
+    if (diff != NULL) {
+        for (int i = 0; i < diff->count; i++) countEvent(detector, &diff->events[i]);
+    }
+
+    // Every key is moved on every refresh, busy or not: the tables are a
+    // fixed size, so this costs the same whatever the traffic
+    int windowEnds = detector->refresh % ANOMALY_WINDOW == ANOMALY_WINDOW - 1;
+    checkKey(detector, &detector->host, ALERT_KEY_HOST, windowEnds, timestamp);
+    for (int i = 0; i < ANOMALY_TRACKED; i++) {
+        if (detector->networks[i].used) checkKey(detector, &detector->networks[i], ALERT_KEY_NETWORK, windowEnds, timestamp);
+        if (detector->ports[i].used) checkKey(detector, &detector->ports[i], ALERT_KEY_PORT, windowEnds, timestamp);
+    }
+    detector->refresh++;
+    return detector->alertCount;
+}
+
+void formatAlert(const AnomalyAlert *alert, char *text, size_t size) {
+    char key[MAX_ADDRESS_TEXT + 16];
+    if (alert->key == ALERT_KEY_NETWORK) {
+        NetworkConnection connection;
+        char address[MAX_ADDRESS_TEXT];
+        memset(&connection, 0, sizeof(connection));
+        connection.family = alert->family;
+        memcpy(connection.remoteAddress, alert->address, 16);
+        formatAddress(&connection, 1, address, sizeof(address));
+        snprintf(key, sizeof(key), "from %s/%d", address, alert->family == ADDRESS_IPV6 ? 64 : 24);
+    } else if (alert->key == ALERT_KEY_PORT) {
+        snprintf(key, sizeof(key), "on %u/%s", alert->port, getProtocolName(alert->protocol));
+    } else {
+        snprintf(key, sizeof(key), "on all ports");
+    }
+
+    const char *what;
+    switch (alert->type) {
+        case ALERT_SYN_FLOOD: what = "half-open"; break;
+        case ALERT_PORT_SCAN: what = "ports reached"; break;
+        case ALERT_PEER_SURGE: what = "peers"; break;
+        default: what = "opened and closed"; break;
+    }
+    if (alert->type == ALERT_PORT_SCAN) {
+        snprintf(text, size, "%s %s: about %u %s (limit %u)", getAlertName(alert->type), key, alert->value, what,
+                 alert->threshold);
+    } else {
+        snprintf(text, size, "%s %s: %s%u %s, usually %u (limit %u)", getAlertName(alert->type), key,
+                 alert->type == ALERT_PEER_SURGE ? "about " : "", alert->value, what, alert->baseline, alert->threshold);
+    }
+}
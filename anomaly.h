@@ -0,0 +1,145 @@
+#ifndef ANOMALY_H
+#define ANOMALY_H
+
+#include <stddef.h>
+#include "snapshot.h"
+#include "diff.h"
+
+// Spotting floods, scans and churn as the refreshes go by. Every refresh
+// the detector is handed the snapshot and what changed since the last
+// one, and keeps, per remote network (/24, /64) and per listening port:
+//
+//   - a sliding window of the connections opened and closed over the
+//     last ANOMALY_WINDOW refreshes
+//   - running baselines (exponentially weighted mean and variance) of
+//     that window and of the half-open (SYN_RCVD) count
+//   - a HyperLogLog sketch of the distinct local ports a network reached,
+//     or the distinct peers a port was reached from, started over every
+//     window
+//
+// A count well over its baseline (and over a floor, so quiet keys don't
+// alert on a handful of connections) raises an alert. A key that raised
+// one stays quiet about it for ANOMALY_COOLDOWN refreshes.
+//
+// The tables are fixed-size and bucketed: a new key takes a free place
+// among the ANOMALY_PROBES next to its hash, or else the least busy one,
+// so a scan from millions of addresses churns the quiet entries but
+// can't grow the memory or push out the busy keys. The whole-host counts
+// are kept apart and catch what is spread over too many keys.
+//
+// Only what shows up as sockets is seen: probes to closed ports never
+// make one, so a scan counts the listening ports it reached.
+
+#define ANOMALY_TRACKED 1024            // Networks, and ports, followed at once (a power of 2)
+#define ANOMALY_PROBES 8                // Places a key can go in its table
+#define ANOMALY_WINDOW 12               // Refreshes in the sliding window
+#define ANOMALY_SKETCH_SIZE 64          // HyperLogLog registers, about 13% error
+#define ANOMALY_ALPHA 0.05              // Weight of the newest sample in the baselines
+#define ANOMALY_SIGMAS 4.0              // Standard deviations over the mean that count as unusual
+#define ANOMALY_FACTOR 2.0              // And at least this many times the mean
+#define ANOMALY_WARMUP (2 * ANOMALY_WINDOW)     // Refreshes before a baseline is trusted
+#define ANOMALY_COOLDOWN (5 * ANOMALY_WINDOW)   // Refreshes before the same alert is raised again
+#define ANOMALY_MAX_ALERTS 16           // Raised in one refresh; more are only counted
+#define ANOMALY_RECENT 8                // Kept for the screen
+
+// Floors: nothing below these raises an alert, whatever the baseline
+#define SYN_FLOOD_PORT_MIN 32           // Half-open connections on one port
+#define SYN_FLOOD_HOST_MIN 128          // And on all of them
+#define PORT_SCAN_MIN 20                // Distinct listening ports one network reached in a window
+#define PEER_SURGE_MIN 100              // Distinct peers one port was reached from in a window
+#define CHURN_MIN 200                   // Connections opened and closed in a window, per key
+#define CHURN_HOST_MIN 1000             // And for the whole host
+
+typedef enum {
+    ALERT_SYN_FLOOD,                    // Half-open connections far over normal
+    ALERT_PORT_SCAN,                    // One network reaching many of our ports
+    ALERT_PEER_SURGE,                   // One port reached from far more peers than normal
+    ALERT_CHURN,                        // Connections opening and closing far faster than normal
+    ALERT_TYPE_COUNT
+} AlertType;
+
+typedef enum {
+    ALERT_KEY_HOST,                     // All connections
+    ALERT_KEY_NETWORK,                  // A remote /24 or /64
+    ALERT_KEY_PORT                      // A local port and protocol
+} AlertKey;
+
+typedef struct {
+    unsigned long long timestamp;       // Milliseconds since 1970
+    unsigned char type;                 // AlertType
+    unsigned char key;                  // AlertKey
+    unsigned char family;               // AddressFamily, for ALERT_KEY_NETWORK
+    unsigned char protocol;             // ConnectionProtocol, for ALERT_KEY_PORT
+    unsigned char address[16];          // The network, host bits zero
+    unsigned short port;
+    unsigned int value;                 // What was counted
+    unsigned int baseline;              // The usual value, 0 when there is no baseline
+    unsigned int threshold;             // What value had to go over
+} AnomalyAlert;
+
+typedef struct {
+    double mean;
+    double variance;
+} Baseline;
+
+typedef struct {
+    unsigned char used;
+    unsigned char family;               // AddressFamily, for networks
+    unsigned char key[16];              // Masked address, or port and protocol (like aggregate.c)
+    unsigned int hash;
+    unsigned int samples;               // Refreshes the baselines have seen
+    unsigned int windows;               // Windows the peer baseline has seen
+    unsigned long long lastActive;      // Refresh it last had something counted
+    unsigned long long quietUntil[ALERT_TYPE_COUNT];
+
+    unsigned int changes;               // Opened + closed this refresh
+    unsigned int halfOpen;              // SYN_RCVD now (ports and the host)
+    unsigned int window[ANOMALY_WINDOW];        // changes, one per refresh, as a ring
+    unsigned int windowSum;
+    Baseline churn;                     // Of windowSum
+    Baseline halfOpenBaseline;
+    Baseline peers;                     // Of the sketch's count at the end of a window (ports)
+    unsigned char sketch[ANOMALY_SKETCH_SIZE];  // Local ports (networks) or peers (ports) this window
+} TrackedKey;
+
+typedef struct {
+    unsigned long long refreshes;
+    unsigned long long alerts;
+    unsigned long long suppressed;      // Over ANOMALY_MAX_ALERTS in one refresh
+    unsigned long long evicted;         // Keys pushed out of a full bucket
+    int networks;                       // Keys in use
+    int ports;
+} AnomalyStats;
+
+typedef struct {
+    TrackedKey networks[ANOMALY_TRACKED];
+    TrackedKey ports[ANOMALY_TRACKED];
+    TrackedKey host;
+    unsigned long long refresh;
+
+    // Which local ports have a listener, rebuilt every refresh. A
+    // connection on one of them (or half-open) came in from outside.
+    unsigned char listening[2][65536 / 8];
+
+    AnomalyAlert alerts[ANOMALY_MAX_ALERTS];    // Raised by the last detectAnomalies
+    int alertCount;
+    AnomalyAlert recent[ANOMALY_RECENT];        // The last few raised, as a ring
+    unsigned long long recentCount;
+
+    AnomalyStats stats;
+} AnomalyDetector;
+
+void initAnomalyDetector(AnomalyDetector *detector);
+
+// Feed one refresh: the snapshot and the changes that led to it (NULL
+// when it can't be compared with the one before, e.g. the first one).
+// Returns how many alerts were raised, and leaves them in alerts.
+int detectAnomalies(AnomalyDetector *detector, const ConnectionSnapshot *snapshot, const ConnectionDiff *diff,
+                    unsigned long long timestamp);
+
+const char *getAlertName(AlertType type);
+
+// "SYN flood on 443/TCP: 2300 half-open, usually 40 (limit 160)"
+void formatAlert(const AnomalyAlert *alert, char *text, size_t size);
+
+#endif
@@ -0,0 +1,121 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "arena.h"
+
+#define ARENA_ALIGNMENT 16
+
+struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size;            // Usable bytes after the header
+    size_t used;
+    // Block data follows, padded so it starts 16-byte aligned
+};
+
+#define BLOCK_HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+// The log writer thread allocates too, so the counters are atomic
+static atomic_ullong allocations;
+static atomic_ullong frees;
+static atomic_ullong bytesAllocated;
+
+void *trackedAlloc(size_t size) {
+    void *memory = malloc(size);
+    if (memory != NULL) {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytesAllocated, size, memory_order_relaxed);
+    }
+    return memory;
+}
+
+void *trackedRealloc(void *memory, size_t size) {
+    void *newMemory = realloc(memory, size);
+    if (newMemory != NULL) {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&bytesAllocated, size, memory_order_relaxed);
+    }
+    return newMemory;
+}
+
+void trackedFree(void *memory) {
+    if (memory == NULL) return;
+    atomic_fetch_add_explicit(&frees, 1, memory_order_relaxed);
+    free(memory);
+}
+
+AllocationStats getAllocationStats() {
+    AllocationStats stats;
+    stats.allocations = atomic_load_explicit(&allocations, memory_order_relaxed);
+    stats.frees = atomic_load_explicit(&frees, memory_order_relaxed);
+    stats.bytesAllocated = atomic_load_explicit(&bytesAllocated, memory_order_relaxed);
+    return stats;
+}
+
+static ArenaBlock *newBlock(size_t size) {
+    ArenaBlock *block = trackedAlloc(BLOCK_HEADER_SIZE + size);
+    if (block == NULL) return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void arenaInit(Arena *arena, size_t blockSize) {
+    arena->blocks = NULL;
+    arena->blockSize = blockSize;
+    arena->used = 0;
+    arena->highWater = 0;
+}
+
+void *arenaAlloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->size - block->used < size) {
+        // Grow at least as fast as the arena already is, so a big table
+        // only needs a handful of blocks the first time round
+        size_t blockSize = arena->blockSize;
+        if (blockSize < arena->used) blockSize = arena->used;
+        if (blockSize < size) blockSize = size;
+
+        block = newBlock(blockSize);
+        if (block == NULL) return NULL;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    void *memory = (char *)block + BLOCK_HEADER_SIZE + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->highWater) arena->highWater = arena->used;
+    return memory;
+}
+
+void arenaReset(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+
+    // If the last round needed more than one block, swap them all for a
+    // single block that fits the whole round
+    if (block != NULL && block->next != NULL) {
+        while (block != NULL) {
+            ArenaBlock *next = block->next;
+            trackedFree(block);
+            block = next;
+        }
+        arena->blocks = newBlock(arena->highWater);
+    } else if (block != NULL) {
+        block->used = 0;
+    }
+
+    arena->used = 0;
+}
+
+void arenaFree(Arena *arena) {
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        trackedFree(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->used = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// A simple bump allocator. Memory is handed out from big blocks and is
+// only given back all at once with arenaReset. After a reset the arena
+// keeps one block as big as everything it handed out last time, so a
+// program that does the same work every refresh stops calling malloc
+// after the first couple of rounds.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;     // Newest block first
+    size_t blockSize;       // Smallest block we ask malloc for
+    size_t used;            // Bytes handed out since the last reset
+    size_t highWater;       // Most bytes ever handed out between resets
+} Arena;
+
+void arenaInit(Arena *arena, size_t blockSize);
+void *arenaAlloc(Arena *arena, size_t size);   // 16-byte aligned, NULL when out of memory
+void arenaReset(Arena *arena);
+void arenaFree(Arena *arena);
+
+// Every malloc/realloc/free the monitor does on its hot paths goes through
+// these, so we can check that steady-state polling doesn't allocate
+typedef struct {
+    unsigned long long allocations;     // malloc + realloc calls
+    unsigned long long frees;
+    unsigned long long bytesAllocated;
+} AllocationStats;
+
+void *trackedAlloc(size_t size);
+void *trackedRealloc(void *memory, size_t size);
+void trackedFree(void *memory);
+AllocationStats getAllocationStats();
+
+#endif
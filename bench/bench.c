@@ -0,0 +1,396 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "network_monitoring.h"
+#include "collector.h"
+#include "snapshot.h"
+#include "filter.h"
+#include "diff.h"
+#include "aggregate.h"
+#include "anomaly.h"
+#include "binlog.h"
+#include "compress.h"
+#include "string_table.h"
+#include "platform.h"
+#include "synthetic.h"
+
+// Times each stage of a refresh on made-up tables of 1k, 100k and 1M rows
+// and prints ns/row, rows per second and how many mallocs a refresh does
+// once everything has warmed up.
+//
+//   netmon_bench [--rows 1000,100000] [--repeat 5] [--check]
+//
+// --check fails (exit 1) if a stage is slower per row than its limit in
+// the stages table, or if a stage that is meant to be allocation-free
+// allocated. ctest runs it that way. The limits are set well above what
+// a laptop does, so only a real regression trips them.
+
+#define BENCH_LOG_PREFIX "netmon_bench_log"
+#define ROWS_PER_REPETITION 1000000     // Small tables are run over and over to get this many rows timed
+#define MAX_SIZES 8
+
+typedef struct {
+    int rows;
+
+    NetworkConnection *connections;     // The table at the last refresh
+    NetworkConnection *churned;         // And at this one
+    char *procText[4];                  // tcp, tcp6, udp, udp6
+    size_t procLength[4];
+    SyntheticTcpRow *tcpTable;
+    int tcpTableRows;
+
+    ConnectionSnapshot parsed;
+    ConnectionSnapshot previous;
+    ConnectionSnapshot current;
+    ConnectionFilter filter;
+    int *matches;
+    int matchCount;
+    Aggregation rollup;
+    ConnectionCounts counts;
+    ConnectionDiff diff;
+    AnomalyDetector *anomalies;
+    BinaryLog log;
+    int logOpen;
+    unsigned char *record;              // A keyframe for the fleet collector
+    unsigned char *packed;              // And compressed
+    unsigned char *expanded;            // And back again, as the collector sees it
+    size_t recordSize;
+    size_t recordLength;
+    size_t packedLength;
+} BenchData;
+
+typedef struct {
+    const char *name;
+    void (*run)(BenchData *data);
+    double maxNanosPerRow;      // --check fails above this (at 100k rows and up)
+    int allocationFree;         // --check fails if it allocates once warmed up
+} BenchStage;
+
+static const AddressFamily procFamilies[4] = {ADDRESS_IPV4, ADDRESS_IPV6, ADDRESS_IPV4, ADDRESS_IPV6};
+static const ConnectionProtocol procProtocols[4] = {PROTOCOL_TCP, PROTOCOL_TCP, PROTOCOL_UDP, PROTOCOL_UDP};
+
+// /proc/net text -> snapshot, like the procfs source
+static void runParse(BenchData *data) {
+    clearSnapshot(&data->parsed);
+    for (int i = 0; i < 4; i++) {
+        parseProcNetTable(data->procText[i], data->procLength[i], procFamilies[i], procProtocols[i],
+                          NULL, &data->parsed);
+    }
+}
+
+// MIB_TCPTABLE_OWNER_PID rows -> snapshot, the same work as
+// getTcpConnections in collector_windows.c (less the pid lookup)
+static void runIngest(BenchData *data) {
+    clearSnapshot(&data->parsed);
+    for (int i = 0; i < data->tcpTableRows; i++) {
+        const SyntheticTcpRow *row = &data->tcpTable[i];
+        const unsigned char *localPort = (const unsigned char *)&row->dwLocalPort;
+        const unsigned char *remotePort = (const unsigned char *)&row->dwRemotePort;
+        NetworkConnection connection;
+
+        connection.family = ADDRESS_IPV4;
+        setIpv4Address(connection.localAddress, row->dwLocalAddr);
+        connection.localPort = (unsigned short)(localPort[0] << 8 | localPort[1]);
+        setIpv4Address(connection.remoteAddress, row->dwRemoteAddr);
+        connection.remotePort = (unsigned short)(remotePort[0] << 8 | remotePort[1]);
+        connection.protocol = PROTOCOL_TCP;
+        connection.state = (unsigned char)(row->dwState <= STATE_DELETE_TCB ? row->dwState : STATE_UNKNOWN);
+        connection.programId = row->dwOwningPid;
+        connection.programName = PROGRAM_NAME_UNKNOWN;
+        addSnapshotRow(&data->parsed, &connection);
+    }
+}
+
+// The rows the table would show
+static void runFilter(BenchData *data) {
+    data->matchCount = applyFilter(&data->filter, &data->current, data->matches);
+}
+
+static void runSort(BenchData *data) {
+    // Sorting sorted rows is a different test, so start from table order
+    for (int i = 0; i < data->matchCount; i++) data->matches[i] = i;
+    sortSnapshotRows(&data->current, data->matches, data->matchCount, SORT_REMOTE_ADDRESS);
+}
+
+// What the statistics under the table do
+static void runStatistics(BenchData *data) {
+    int top[5];
+    countConnections(&data->current, &data->counts);
+    resetAggregation(&data->rollup, GROUP_REMOTE_NETWORK);
+    aggregateSnapshot(&data->rollup, &data->current, NULL, data->current.count);
+    getTopGroups(&data->rollup, top, 5);
+}
+
+static void runDiff(BenchData *data) {
+    diffSnapshots(&data->diff, &data->previous, &data->current);
+    computeConnectionRates(&data->diff, &data->previous, &data->current);
+}
+
+// The same changes every time, so the baselines settle and nothing is
+// raised after the first few rounds
+static void runAnomalies(BenchData *data) {
+    detectAnomalies(data->anomalies, &data->current, &data->diff, 0);
+}
+
+static void runLogKeyframe(BenchData *data) {
+    appendToLog(&data->log, &data->current, NULL);
+}
+
+static void runLogDelta(BenchData *data) {
+    appendToLog(&data->log, &data->current, &data->diff);
+}
+
+// What the fleet agent does with a keyframe: the refresh loop encodes it
+// and the sender compresses it
+static void runFleetFrame(BenchData *data) {
+    data->recordLength = encodeKeyframeRecord(data->record, data->recordSize, &data->current, 0);
+    data->packedLength = compressBlock(data->record, data->recordLength, data->packed, COMPRESS_BOUND(data->recordSize));
+}
+
+// And what the collector does with it before applying the rows
+static void runFleetExpand(BenchData *data) {
+    expandBlock(data->packed, data->packedLength, data->expanded, data->recordLength);
+}
+
+static const BenchStage stages[] = {
+    {"parse /proc/net", runParse, 400, 1},
+    {"ingest MIB rows", runIngest, 100, 1},
+    {"filter", runFilter, 50, 1},
+    {"sort", runSort, 1500, 1},
+    {"statistics", runStatistics, 1000, 1},
+    {"diff + rates", runDiff, 400, 1},
+    {"anomalies", runAnomalies, 100, 1},
+    // The log's writer thread grows its index and allocates one for each
+    // segment it closes, so those two aren't allocation-free
+    {"log keyframe", runLogKeyframe, 400, 0},
+    {"log delta", runLogDelta, 200, 0},
+    {"fleet frame", runFleetFrame, 400, 1},
+    {"fleet expand", runFleetExpand, 200, 1},
+};
+#define STAGE_COUNT ((int)(sizeof(stages) / sizeof(stages[0])))
+
+// The tcp_info counters, so computeConnectionRates has something to do
+static void fillSnapshot(ConnectionSnapshot *snapshot, const NetworkConnection *rows, int count,
+                         unsigned long long collectedAt, unsigned long long bytes) {
+    clearSnapshot(snapshot);
+    for (int i = 0; i < count; i++) {
+        addSnapshotRow(snapshot, &rows[i]);
+        if (rows[i].protocol != PROTOCOL_TCP || rows[i].state != STATE_ESTABLISHED) continue;
+
+        ConnectionMetrics metrics = {0};
+        metrics.bytesSent = bytes * (unsigned long long)(i % 97 + 1);
+        metrics.bytesReceived = bytes * (unsigned long long)(i % 13 + 1);
+        metrics.roundTripTime = 500 + (unsigned int)i % 20000;
+        metrics.retransmits = (unsigned int)(bytes / 100000) * (i % 3 == 0);
+        metrics.congestionWindow = 10;
+        setSnapshotMetrics(snapshot, i, &metrics);
+    }
+    snapshot->hasMetrics = 1;
+    snapshot->collectedAt = collectedAt;
+}
+
+static void removeBenchLog() {
+    unsigned int first, last;
+    if (!findLogSegments(BENCH_LOG_PREFIX, &first, &last)) return;
+    for (unsigned int number = first; number <= last; number++) {
+        char path[256];
+        getSegmentPath(BENCH_LOG_PREFIX, number, path, sizeof(path));
+        remove(path);
+    }
+}
+
+static int setUp(BenchData *data, int rows) {
+    memset(data, 0, sizeof(*data));
+    data->rows = rows;
+
+    data->connections = malloc((size_t)rows * sizeof(NetworkConnection));
+    data->churned = malloc((size_t)rows * sizeof(NetworkConnection));
+    data->tcpTable = malloc((size_t)rows * sizeof(SyntheticTcpRow));
+    data->matches = malloc((size_t)rows * sizeof(int));
+    if (data->connections == NULL || data->churned == NULL || data->tcpTable == NULL || data->matches == NULL) return -1;
+
+    generateConnections(data->connections, rows, 12345);
+    memcpy(data->churned, data->connections, (size_t)rows * sizeof(NetworkConnection));
+    churnConnections(data->churned, rows, 5, 678);
+
+    size_t textSize = (size_t)rows * SYNTHETIC_PROC_LINE + 256;
+    for (int i = 0; i < 4; i++) {
+        data->procText[i] = malloc(textSize);
+        if (data->procText[i] == NULL) return -1;
+        data->procLength[i] = formatProcNetTable(data->connections, rows, procFamilies[i], procProtocols[i],
+                                                 data->procText[i], textSize);
+    }
+    data->tcpTableRows = formatTcpTable(data->connections, rows, data->tcpTable);
+
+    // The generated text has to read back as the same table, or the parse
+    // timings mean nothing
+    initSnapshot(&data->parsed);
+    runParse(data);
+    if (data->parsed.count != rows) {
+        fprintf(stderr, "Parsed %d rows of the %d generated\n", data->parsed.count, rows);
+        return -1;
+    }
+
+    initSnapshot(&data->previous);
+    initSnapshot(&data->current);
+    fillSnapshot(&data->previous, data->connections, rows, 0, 1000000);
+    fillSnapshot(&data->current, data->churned, rows, 5000, 1100000);
+    initDiff(&data->diff);
+    diffSnapshots(&data->diff, &data->previous, &data->current);   // The log delta needs the events
+
+    char error[128];
+    if (parseFilter("proto=tcp state=established,time_wait rport=443,80 lnet!=127.0.0.0/8",
+                    &data->filter, error, sizeof(error)) != 0) {
+        fprintf(stderr, "Bad filter: %s\n", error);
+        return -1;
+    }
+    runFilter(data);
+    if (initAggregation(&data->rollup, GROUP_REMOTE_NETWORK, DEFAULT_MAX_GROUPS) != 0) return -1;
+    data->anomalies = malloc(sizeof(AnomalyDetector));
+    if (data->anomalies == NULL) return -1;
+    initAnomalyDetector(data->anomalies);
+
+    // Big enough that the writer falling behind only shows up with the
+    // biggest tables, and then it counts: the refresh loop would wait too
+    LogOptions options;
+    getDefaultLogOptions(&options);
+    options.keepSegments = 2;
+    options.queueSize = (size_t)rows * sizeof(NetworkConnection) * 4 + 1024 * 1024;
+    options.fullPolicy = LOG_BLOCK_WHEN_FULL;
+    options.syncPolicy = LOG_SYNC_NEVER;
+    removeBenchLog();
+    if (openBinaryLog(&data->log, BENCH_LOG_PREFIX, &options) != 0) {
+        fprintf(stderr, "Could not open %s\n", BENCH_LOG_PREFIX);
+        return -1;
+    }
+    data->logOpen = 1;
+
+    data->recordSize = encodeKeyframeRecord(NULL, 0, &data->current, 0);
+    data->record = malloc(data->recordSize);
+    data->packed = malloc(COMPRESS_BOUND(data->recordSize));
+    data->expanded = malloc(data->recordSize);
+    if (data->record == NULL || data->packed == NULL || data->expanded == NULL) return -1;
+    return 0;
+}
+
+static void tearDown(BenchData *data) {
+    if (data->logOpen) {
+        closeBinaryLog(&data->log);
+        removeBenchLog();
+    }
+    freeAggregation(&data->rollup);
+    free(data->anomalies);
+    freeDiff(&data->diff);
+    freeSnapshot(&data->parsed);
+    freeSnapshot(&data->previous);
+    freeSnapshot(&data->current);
+    for (int i = 0; i < 4; i++) free(data->procText[i]);
+    free(data->connections);
+    free(data->churned);
+    free(data->tcpTable);
+    free(data->matches);
+    free(data->record);
+    free(data->packed);
+    free(data->expanded);
+}
+
+// Best of repeat runs, each going over at least ROWS_PER_REPETITION rows.
+// The first two runs are a warm-up (the arenas settle on one block, pages
+// fault in) and aren't counted, so the allocations are what a steady
+// refresh does.
+static int runStage(BenchData *data, const BenchStage *stage, int repeat, int check) {
+    int iterations = ROWS_PER_REPETITION / data->rows;
+    if (iterations < 1) iterations = 1;
+    stage->run(data);
+    stage->run(data);
+
+    unsigned long long best = 0;
+    AllocationStats before = getAllocationStats();
+    for (int r = 0; r < repeat; r++) {
+        unsigned long long start = monotonicNanos();
+        for (int i = 0; i < iterations; i++) stage->run(data);
+        unsigned long long elapsed = monotonicNanos() - start;
+        if (r == 0 || elapsed < best) best = elapsed;
+    }
+    AllocationStats after = getAllocationStats();
+
+    double rowsPerRun = (double)data->rows;
+    double nanosPerRow = (double)best / ((double)iterations * rowsPerRun);
+    double runs = (double)repeat * iterations;
+    double allocations = (double)(after.allocations - before.allocations) / runs;
+    double kilobytes = (double)(after.bytesAllocated - before.bytesAllocated) / runs / 1024;
+
+    const char *verdict = "";
+    int failed = 0;
+    if (check && data->rows >= 100000 && nanosPerRow > stage->maxNanosPerRow) {
+        verdict = "  SLOWER THAN LIMIT";
+        failed = 1;
+    }
+    if (check && stage->allocationFree && after.allocations != before.allocations) {
+        verdict = "  ALLOCATES";
+        failed = 1;
+    }
+    printf("%9d  %-16s %9.1f %10.1f %10.2f %10.1f%s\n", data->rows, stage->name, nanosPerRow,
+           1000.0 / nanosPerRow, allocations, kilobytes, verdict);
+    return failed;
+}
+
+static int parseSizes(const char *text, int *sizes) {
+    int count = 0;
+    while (*text != '\0' && count < MAX_SIZES) {
+        char *end;
+        long rows = strtol(text, &end, 10);
+        if (end == text || rows < 1 || rows > 50000000) return -1;
+        if (*end == 'k') { rows *= 1000; end++; }
+        else if (*end == 'M') { rows *= 1000000; end++; }
+        sizes[count++] = (int)rows;
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        text = end;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[MAX_SIZES] = {1000, 100000, 1000000};
+    int sizeCount = 3;
+    int repeat = 5;
+    int check = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            sizeCount = parseSizes(argv[++i], sizes);
+            if (sizeCount <= 0) {
+                fprintf(stderr, "--rows wants sizes like 1k,100k,1M\n");
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+            if (repeat < 1) repeat = 1;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--rows 1k,100k,1M] [--repeat N] [--check]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("%9s  %-16s %9s %10s %10s %10s\n", "rows", "stage", "ns/row", "Mrows/s", "allocs/run", "KiB/run");
+    int failures = 0;
+    for (int s = 0; s < sizeCount; s++) {
+        BenchData data;
+        if (setUp(&data, sizes[s]) != 0) {
+            fprintf(stderr, "Could not set up %d rows\n", sizes[s]);
+            tearDown(&data);
+            return 1;
+        }
+        for (int i = 0; i < STAGE_COUNT; i++) failures += runStage(&data, &stages[i], repeat, check);
+        tearDown(&data);
+    }
+
+    if (check && failures > 0) {
+        printf("%d stage(s) failed the check\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "network_monitoring.h"
+#include "snapshot.h"
+#include "filter.h"
+#include "diff.h"
+#include "aggregate.h"
+#include "anomaly.h"
+#include "binlog.h"
+#include "logquery.h"
+#include "string_table.h"
+#include "platform.h"
+#include "socket_owners.h"
+#include "fleet.h"
+
+// Small hand-made tables with known answers, for the parts whose output
+// the bench and the wire check never look at: filters, diffs and rates,
+// grouping, the anomaly keys, the log round trip and the log query.
+// Each case names what it expects, so a failure says what broke.
+//
+//   netmon_cases
+//
+// Exits 1 if any case fails. ctest runs it.
+
+#define CASES_LOG_PREFIX "netmon_cases_log"
+#define INTERNED_NAMES 20000    // Program names added while another thread reads them
+#define CASES_FLEET_PORT 47470  // First port tried for a collector of our own
+#define TOO_MANY_ROWS 360000    // A keyframe bigger than FLEET_QUEUE_SIZE
+#define SMALL_LOG_QUEUE 65536   // Too small for TOO_MANY_ALERTS
+#define TOO_MANY_ALERTS 2000
+
+static int failures = 0;
+static int checks = 0;
+
+static void expect(int passed, const char *what) {
+    checks++;
+    if (passed) return;
+    printf("FAILED: %s\n", what);
+    failures++;
+}
+
+static void expectCount(int got, int wanted, const char *what) {
+    checks++;
+    if (got == wanted) return;
+    printf("FAILED: %s (got %d, wanted %d)\n", what, got, wanted);
+    failures++;
+}
+
+// One row from text. An IPv4 address with ADDRESS_IPV6 is how a
+// dual-stack socket reports an IPv4 peer.
+static void addRow(ConnectionSnapshot *snapshot, ConnectionProtocol protocol, const char *local, unsigned short localPort,
+                   const char *remote, unsigned short remotePort, ConnectionState state, AddressFamily family) {
+    NetworkConnection connection;
+    AddressFamily parsed;
+    memset(&connection, 0, sizeof(connection));
+    parseAddress(local, connection.localAddress, &parsed);
+    parseAddress(remote, connection.remoteAddress, &parsed);
+    connection.localPort = localPort;
+    connection.remotePort = remotePort;
+    connection.family = (unsigned char)family;
+    connection.protocol = (unsigned char)protocol;
+    connection.state = (unsigned char)state;
+    connection.programName = PROGRAM_NAME_UNKNOWN;
+    addSnapshotRow(snapshot, &connection);
+}
+
+// The table most cases run on
+static void fillTable(ConnectionSnapshot *snapshot) {
+    clearSnapshot(snapshot);
+    addRow(snapshot, PROTOCOL_TCP, "0.0.0.0", 80, "0.0.0.0", 0, STATE_LISTENING, ADDRESS_IPV4);
+    addRow(snapshot, PROTOCOL_TCP, "192.168.1.5", 80, "10.2.3.4", 50000, STATE_ESTABLISHED, ADDRESS_IPV4);
+    addRow(snapshot, PROTOCOL_TCP, "192.168.1.5", 80, "10.1.2.3", 50001, STATE_ESTABLISHED, ADDRESS_IPV4);
+    addRow(snapshot, PROTOCOL_TCP, "192.168.1.5", 443, "192.168.1.1", 50002, STATE_TIME_WAIT, ADDRESS_IPV4);
+    addRow(snapshot, PROTOCOL_UDP, "0.0.0.0", 53, "0.0.0.0", 0, STATE_LISTENING, ADDRESS_IPV4);
+    addRow(snapshot, PROTOCOL_UDP, "192.168.1.5", 40000, "8.8.8.8", 53, STATE_ESTABLISHED, ADDRESS_IPV4);
+    addRow(snapshot, PROTOCOL_TCP, "2001:db8::5", 443, "2001:db8:1::9", 50003, STATE_ESTABLISHED, ADDRESS_IPV6);
+}
+
+// applyFilter and filterMatchesRow must agree, so every filter case
+// checks both
+static int countMatches(const char *text, const ConnectionSnapshot *snapshot) {
+    ConnectionFilter filter;
+    char error[128];
+    if (parseFilter(text, &filter, error, sizeof(error)) != 0) {
+        printf("FAILED: '%s' didn't parse: %s\n", text, error);
+        failures++;
+        return -1;
+    }
+
+    int count = applyFilter(&filter, snapshot, NULL);
+    int rowCount = 0;
+    for (int i = 0; i < snapshot->count; i++) {
+        NetworkConnection connection;
+        getSnapshotRow(snapshot, i, &connection);
+        rowCount += filterMatchesRow(&filter, &connection);
+    }
+    if (rowCount != count) {
+        printf("FAILED: '%s' matches %d rows a block at a time but %d one by one\n", text, count, rowCount);
+        failures++;
+    }
+    return count;
+}
+
+static void checkFilters(void) {
+    static const struct {
+        const char *text;
+        int matches;
+    } cases[] = {
+        {"", 7},
+        {"proto=tcp", 5},
+        {"proto=udp state=listen", 1},
+        {"state=established lport=80", 2},
+        {"lport=1-1024", 6},
+        {"rnet=10.0.0.0/8", 2},
+        {"rnet!=10.0.0.0/8", 5},
+        {"rnet=2001:db8::/32", 1},
+        {"rscope=private", 3},
+        // Negated set terms take their values out of everything, or out
+        // of what the terms before them allowed
+        {"state!=listen", 5},
+        {"proto=tcp,udp proto!=udp", 5},
+        {"proto=tcp proto!=tcp", 0},
+        {"proto!=tcp,udp", 0},
+        {"rscope!=private,public,unspecified", 0},
+        // Networks with = and != are separate lists: in one of the first,
+        // in none of the second, whatever order they come in
+        {"rnet=10.0.0.0/8 rnet!=10.1.0.0/16", 1},
+        {"rnet!=10.1.0.0/16 rnet=10.0.0.0/8", 1},
+        {"rnet!=10.0.0.0/8 rnet!=192.168.0.0/16", 4},
+        {"lnet=192.168.0.0/16 lnet!=192.168.1.5", 0},
+    };
+    ConnectionSnapshot snapshot;
+    initSnapshot(&snapshot);
+    fillTable(&snapshot);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char what[128];
+        snprintf(what, sizeof(what), "filter '%s'", cases[i].text);
+        expectCount(countMatches(cases[i].text, &snapshot), cases[i].matches, what);
+    }
+
+    static const char *const bad[] = {"proto=icmp", "lport!=80", "state=sleepy", "rnet=10.0.0.0/33", "nope=1", "proto"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        ConnectionFilter filter;
+        char error[128];
+        char what[128];
+        snprintf(what, sizeof(what), "filter '%s' is turned down", bad[i]);
+        expect(parseFilter(bad[i], &filter, error, sizeof(error)) != 0, what);
+    }
+    freeSnapshot(&snapshot);
+}
+
+static void setSent(ConnectionSnapshot *snapshot, int row, unsigned long long bytesSent) {
+    ConnectionMetrics metrics;
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.bytesSent = bytesSent;
+    setSnapshotMetrics(snapshot, row, &metrics);
+}
+
+static void checkDiff(void) {
+    ConnectionSnapshot previous, current;
+    ConnectionDiff diff;
+    initSnapshot(&previous);
+    initSnapshot(&current);
+    initDiff(&diff);
+
+    fillTable(&previous);
+    fillTable(&current);
+    // Row 1 closes, row 3 changes state, one row opens
+    current.state[3] = STATE_CLOSE_WAIT;
+    memcpy(current.remoteAddress[1], current.remoteAddress[2], 16);
+    current.remotePort[1] = 60000;
+
+    previous.collectedAt = 1000;
+    current.collectedAt = 3000;
+    setSent(&previous, 2, 1000);
+    setSent(&current, 2, 5000);         // 4000 bytes over 2 s
+
+    diffSnapshots(&diff, &previous, &current);
+    expectCount(diff.openedCount, 1, "diff opened");
+    expectCount(diff.closedCount, 1, "diff closed");
+    expectCount(diff.changedCount, 1, "diff changed");
+    expectCount(diff.count, 3, "diff events");
+
+    computeConnectionRates(&diff, &previous, &current);
+    expect(current.sendRate[2] == 2000, "send rate of a row that stayed");
+
+    // A diff that dropped events has matches that can't be trusted, so
+    // the rates are left alone
+    current.sendRate[2] = 0;
+    diff.droppedCount = 1;
+    computeConnectionRates(&diff, &previous, &current);
+    expect(current.sendRate[2] == 0, "no rates from a diff that dropped events");
+
+    freeDiff(&diff);
+    freeSnapshot(&previous);
+    freeSnapshot(&current);
+}
+
+// IPv4 peers on a dual-stack socket have the IPv6 family but an IPv4
+// address, and group by their /24 like any other
+static void checkNetworks(void) {
+    ConnectionSnapshot empty, snapshot;
+    initSnapshot(&empty);
+    initSnapshot(&snapshot);
+    addRow(&snapshot, PROTOCOL_TCP, "::", 443, "10.1.2.3", 50000, STATE_ESTABLISHED, ADDRESS_IPV6);
+    addRow(&snapshot, PROTOCOL_TCP, "::", 443, "10.1.2.9", 50001, STATE_ESTABLISHED, ADDRESS_IPV4);
+    addRow(&snapshot, PROTOCOL_TCP, "::", 443, "10.9.9.9", 50002, STATE_ESTABLISHED, ADDRESS_IPV6);
+    addRow(&snapshot, PROTOCOL_TCP, "::", 443, "2001:db8::1", 50003, STATE_ESTABLISHED, ADDRESS_IPV6);
+    addRow(&snapshot, PROTOCOL_TCP, "::", 443, "2001:db8::2", 50004, STATE_ESTABLISHED, ADDRESS_IPV6);
+
+    unsigned char key[16];
+    expect(getNetworkKey(snapshot.remoteAddress[0], key) == ADDRESS_IPV4, "v4-mapped address keys as IPv4");
+    expect(getNetworkKey(snapshot.remoteAddress[3], key) == ADDRESS_IPV6, "IPv6 address keys as IPv6");
+
+    Aggregation aggregation;
+    initAggregation(&aggregation, GROUP_REMOTE_NETWORK, 16);
+    aggregateSnapshot(&aggregation, &snapshot, NULL, snapshot.count);
+    int top[16];
+    int count = getTopGroups(&aggregation, top, 16);
+    expectCount(count, 3, "remote network groups");
+    if (count == 3) {
+        char text[3][64];
+        for (int i = 0; i < 3; i++) formatGroupKey(&aggregation, &aggregation.groups[top[i]], text[i], sizeof(text[i]));
+        expect(strcmp(text[0], "10.1.2.0/24") == 0 || strcmp(text[1], "10.1.2.0/24") == 0, "10.1.2.0/24 group");
+        expect(strcmp(text[0], "2001:db8::/64") == 0 || strcmp(text[1], "2001:db8::/64") == 0, "2001:db8::/64 group");
+        expect(strcmp(text[2], "10.9.9.0/24") == 0, "10.9.9.0/24 group");
+    }
+    freeAggregation(&aggregation);
+
+    // The anomaly detector keys its networks the same way
+    AnomalyDetector *detector = malloc(sizeof(AnomalyDetector));
+    ConnectionDiff diff;
+    initDiff(&diff);
+    if (detector == NULL) {
+        expect(0, "memory for the anomaly detector");
+    } else {
+        initAnomalyDetector(detector);
+        diffSnapshots(&diff, &empty, &snapshot);
+        detectAnomalies(detector, &snapshot, &diff, 0);
+        int ipv4 = 0, ipv6 = 0;
+        for (int i = 0; i < ANOMALY_TRACKED; i++) {
+            if (!detector->networks[i].used) continue;
+            if (detector->networks[i].family == ADDRESS_IPV4) ipv4++;
+            else ipv6++;
+        }
+        expectCount(ipv4, 2, "IPv4 networks the anomaly detector follows");
+        expectCount(ipv6, 1, "IPv6 networks the anomaly detector follows");
+    }
+    free(detector);
+    freeDiff(&diff);
+    freeSnapshot(&empty);
+    freeSnapshot(&snapshot);
+}
+
+static void removeCasesLog(void) {
+    unsigned int first, last;
+    if (!findLogSegments(CASES_LOG_PREFIX, &first, &last)) return;
+    for (unsigned int number = first; number <= last; number++) {
+        char path[256];
+        getSegmentPath(CASES_LOG_PREFIX, number, path, sizeof(path));
+        remove(path);
+    }
+}
+
+static void countQueryMatches(const LogQueryResult *result, int counts[4]) {
+    memset(counts, 0, 4 * sizeof(int));
+    for (int i = 0; i < result->count; i++) counts[result->matches[i].type]++;
+}
+
+// Two refreshes into the log and back out through runLogQuery
+static void checkLog(void) {
+    ConnectionSnapshot previous, current;
+    ConnectionDiff diff;
+    BinaryLog log;
+    LogOptions options;
+    initSnapshot(&previous);
+    initSnapshot(&current);
+    initDiff(&diff);
+    getDefaultLogOptions(&options);
+    options.fullPolicy = LOG_BLOCK_WHEN_FULL;
+
+    removeCasesLog();
+    if (openBinaryLog(&log, CASES_LOG_PREFIX, &options) != 0) {
+        expect(0, "opening the log");
+        return;
+    }
+    fillTable(&previous);
+    fillTable(&current);
+    current.state[3] = STATE_CLOSE_WAIT;
+    memcpy(current.remoteAddress[1], current.remoteAddress[2], 16);
+    current.remotePort[1] = 60000;
+
+    expect(appendToLog(&log, &previous, NULL) == 0, "logging a keyframe");
+    diffSnapshots(&diff, &previous, &current);
+    expect(appendToLog(&log, &current, &diff) == 0, "logging a delta");
+    closeBinaryLog(&log);
+
+    LogQuery query;
+    LogQueryResult result;
+    int counts[4];
+    memset(&query, 0, sizeof(query));
+    memset(&result, 0, sizeof(result));
+    clearFilter(&query.filter);
+    expect(runLogQuery(CASES_LOG_PREFIX, &query, &result) == 0, "querying the whole log");
+    countQueryMatches(&result, counts);
+    expectCount(counts[MATCH_PRESENT], 7, "rows present at the start of the log");
+    expectCount(counts[MATCH_OPENED], 1, "rows opened in the log");
+    expectCount(counts[MATCH_CLOSED], 1, "rows closed in the log");
+    expectCount(counts[MATCH_CHANGED], 1, "rows changed in the log");
+    freeLogQueryResult(&result);
+
+    char error[128];
+    memset(&result, 0, sizeof(result));
+    parseFilter("lport=443", &query.filter, error, sizeof(error));
+    expect(runLogQuery(CASES_LOG_PREFIX, &query, &result) == 0, "querying the log with a filter");
+    countQueryMatches(&result, counts);
+    expectCount(counts[MATCH_PRESENT], 2, "lport=443 rows present");
+    expectCount(counts[MATCH_CHANGED], 1, "lport=443 rows changed");
+    expectCount(counts[MATCH_OPENED] + counts[MATCH_CLOSED], 0, "lport=443 rows opened or closed");
+    freeLogQueryResult(&result);
+
+    removeCasesLog();
+    freeDiff(&diff);
+    freeSnapshot(&previous);
+    freeSnapshot(&current);
+}
+
+static atomic_int internDone;
+
+static int internNames(void *argument) {
+    (void)argument;
+    for (int i = 0; i < INTERNED_NAMES; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "cases-%d", i);
+        internProgramName(name);
+    }
+    atomic_store(&internDone, 1);
+    return 0;
+}
+
+// One thread adds program names (and grows the list many times over)
+// while this one reads every number handed out so far, like the fleet
+// collector's shards and its queries do. A reader must never see a
+// number without its text.
+static void checkSharedNames(void) {
+    unsigned int first = internProgramName("cases-0");
+    atomic_store(&internDone, 0);
+    Thread *thread = startThread(internNames, NULL);
+    if (thread == NULL) {
+        expect(0, "starting the interning thread");
+        return;
+    }
+
+    int missing = 0;
+    int done = 0;
+    while (!done) {
+        done = atomic_load(&internDone);
+        unsigned int count = getProgramNameCount();
+        for (unsigned int id = first; id < count; id++) {
+            const char *text = getProgramNameText(id);
+            if (text == NULL || strncmp(text, "cases-", 6) != 0) missing++;
+        }
+    }
+    joinThread(thread);
+    expectCount(missing, 0, "names read while another thread adds them");
+    expect(getProgramNameCount() >= first + INTERNED_NAMES, "every added name is counted");
+}
+
+#ifdef __linux__
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Our own socket is found. A socket nobody has is remembered after a
+// look through everybody and doesn't set off another, and a new one
+// counts once however often it is looked up.
+static void checkSocketOwners(void) {
+    SocketOwners owners;
+    struct stat info;
+    int ours = socket(AF_INET, SOCK_STREAM, 0);
+    if (ours < 0 || fstat(ours, &info) != 0) {
+        expect(0, "a socket of our own");
+        return;
+    }
+    unsigned long long nobodys = 1ull << 60;
+    unsigned int pid = 0, programName = 0;
+
+    initSocketOwners(&owners);
+    refreshSocketOwners(&owners);
+    expect(owners.fullRescan, "the first refresh looks through everybody");
+    expect(findSocketOwner(&owners, info.st_ino, &pid, &programName) && pid == (unsigned int)getpid(), "our socket's owner");
+    expect(!findSocketOwner(&owners, nobodys, &pid, &programName), "nobody has the made-up socket");
+    expectCount((int)owners.unresolved, 0, "misses right after a look through everybody");
+
+    owners.lastRescan = 0;      // As if OWNERS_RESCAN_INTERVAL had gone by
+    refreshSocketOwners(&owners);
+    expect(!owners.fullRescan, "a socket missed before doesn't set off a look through everybody");
+    findSocketOwner(&owners, nobodys, &pid, &programName);
+    findSocketOwner(&owners, nobodys + 1, &pid, &programName);
+    findSocketOwner(&owners, nobodys + 1, &pid, &programName);
+    expectCount((int)owners.unresolved, 1, "new missed sockets, counted once each");
+
+    owners.lastRescan = 0;
+    refreshSocketOwners(&owners);
+    expect(owners.fullRescan, "a new missed socket sets off a look through everybody");
+
+    freeSocketOwners(&owners);
+    close(ours);
+}
+
+#else
+
+static void checkSocketOwners(void) {
+}
+
+#endif
+
+// Wait up to five seconds for done(context)
+static int waitFor(int (*done)(void *context), void *context) {
+    for (int waited = 0; waited < 5000; waited += 10) {
+        if (done(context)) return 1;
+        sleepMilliseconds(10);
+    }
+    return done(context);
+}
+
+static int agentConnected(void *context) {
+    FleetAgentStats stats;
+    getFleetAgentStats(context, &stats);
+    return stats.connected;
+}
+
+static unsigned long long wantedRows;
+
+static int collectorHasWantedRows(void *context) {
+    FleetServerStats stats;
+    getFleetServerStats(context, &stats);
+    return stats.rows == wantedRows;
+}
+
+// Send the change from previous to current and wait for the collector's
+// table to follow
+static void sendChange(FleetAgent *agent, FleetServer *server, const ConnectionSnapshot *previous,
+                       const ConnectionSnapshot *current, const char *what) {
+    ConnectionDiff diff;
+    initDiff(&diff);
+    diffSnapshots(&diff, previous, current);
+    wantedRows = (unsigned long long)current->count;
+    expect(sendToFleet(agent, current, &diff) == 0 && waitFor(collectorHasWantedRows, server), what);
+    freeDiff(&diff);
+}
+
+// A host with more connections than fit the agent's queue: the keyframe
+// is turned down once per refresh without being dropped over and over,
+// and the host syncs as soon as its table fits again. Then the collector
+// follows rows opening and closing, down to none.
+static void checkFleetKeyframe(void) {
+    static FleetServer server;
+    static FleetAgent agent;
+    int port = CASES_FLEET_PORT;
+    initNetworking();
+    while (startFleetServer(&server, "127.0.0.1", port, 1) != 0) {
+        if (++port == CASES_FLEET_PORT + 20) {
+            expect(0, "a collector of our own");
+            return;
+        }
+    }
+    if (startFleetAgent(&agent, "127.0.0.1", port, "cases") != 0 || !waitFor(agentConnected, &agent)) {
+        expect(0, "an agent connected to it");
+        stopFleetAgent(&agent);
+        stopFleetServer(&server);
+        return;
+    }
+
+    ConnectionSnapshot big;
+    initSnapshot(&big);
+    for (int i = 0; i < TOO_MANY_ROWS; i++) {
+        char remote[32];
+        snprintf(remote, sizeof(remote), "10.%d.%d.%d", i >> 16, (i >> 8) & 255, i & 255);
+        addRow(&big, PROTOCOL_TCP, "192.168.1.5", 40000, remote, 443, STATE_ESTABLISHED, ADDRESS_IPV4);
+    }
+    FleetAgentStats stats;
+    expect(sendToFleet(&agent, &big, NULL) != 0, "a keyframe bigger than the queue isn't sent");
+    expect(sendToFleet(&agent, &big, NULL) != 0, "nor on the next refresh");
+    getFleetAgentStats(&agent, &stats);
+    expectCount(stats.tooLarge, TOO_MANY_ROWS, "connections reported as too many");
+    expectCount((int)stats.recordsDropped, 0, "records dropped for a keyframe that can never fit");
+    freeSnapshot(&big);
+
+    ConnectionSnapshot table;
+    initSnapshot(&table);
+    fillTable(&table);
+    expect(sendToFleet(&agent, &table, NULL) == 0, "a keyframe that fits again");
+    getFleetAgentStats(&agent, &stats);
+    expectCount(stats.tooLarge, 0, "connections reported as too many once it fits");
+    wantedRows = 7;
+    expect(waitFor(collectorHasWantedRows, &server), "the collector has the host's table");
+
+    ConnectionSnapshot more, none;
+    initSnapshot(&more);
+    initSnapshot(&none);
+    fillTable(&more);
+    addRow(&more, PROTOCOL_TCP, "192.168.1.5", 40001, "10.9.9.9", 22, STATE_ESTABLISHED, ADDRESS_IPV4);
+    sendChange(&agent, &server, &table, &more, "the collector adds an opened row");
+    sendChange(&agent, &server, &more, &table, "the collector takes out a closed row");
+    sendChange(&agent, &server, &table, &none, "the collector takes out every row");
+    freeSnapshot(&more);
+    freeSnapshot(&none);
+    freeSnapshot(&table);
+
+    stopFleetAgent(&agent);
+    stopFleetServer(&server);
+    cleanupNetworking();
+}
+
+// Alerts that don't fit the queue are dropped on their own: the table
+// has no gap, so the log doesn't need a keyframe for them
+static void checkAlertDrops(void) {
+    static AnomalyAlert alerts[TOO_MANY_ALERTS];
+    ConnectionSnapshot table;
+    BinaryLog log;
+    LogOptions options;
+    LogStats stats;
+    getDefaultLogOptions(&options);
+    options.queueSize = SMALL_LOG_QUEUE;
+    options.fullPolicy = LOG_DROP_WHEN_FULL;
+
+    removeCasesLog();
+    if (openBinaryLog(&log, CASES_LOG_PREFIX, &options) != 0) {
+        expect(0, "opening a log with a small queue");
+        return;
+    }
+    initSnapshot(&table);
+    fillTable(&table);
+    expect(appendToLog(&log, &table, NULL) == 0, "logging a keyframe before the alerts");
+    expect(appendAlertsToLog(&log, alerts, TOO_MANY_ALERTS) != 0, "alerts too big for the queue are dropped");
+    getLogStats(&log, &stats);
+    expectCount((int)stats.recordsDropped, 1, "records dropped for the alerts");
+    expect(!log.needKeyframe, "dropped alerts don't ask for a keyframe");
+
+    closeBinaryLog(&log);
+    freeSnapshot(&table);
+    removeCasesLog();
+}
+
+static void checkAddresses(void) {
+    static const char *const good[] = {"::", "::1", "1::", "1::8", "1:2:3:4:5:6:7:8", "1:2:3:4:5:6::8",
+                                       "::ffff:10.0.0.1", "10.0.0.1"};
+    static const char *const bad[] = {"1:2:3:4:5:6:7:8::", "::1:2:3:4:5:6:7:8", "1:2:3:4::5:6:7:8",
+                                      "1:2:3:4:5:6:7", "1::2::3", "1:", "12345::", "::ffff:10.0.0.256"};
+    unsigned char address[16];
+    AddressFamily family;
+    for (size_t i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+        char what[64];
+        snprintf(what, sizeof(what), "address '%s'", good[i]);
+        expect(parseAddress(good[i], address, &family) == 0, what);
+    }
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        char what[64];
+        snprintf(what, sizeof(what), "address '%s' is turned down", bad[i]);
+        expect(parseAddress(bad[i], address, &family) != 0, what);
+    }
+
+    static const unsigned char oneEight[16] = {0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 8};
+    expect(parseAddress("1::8", address, &family) == 0 && memcmp(address, oneEight, 16) == 0 &&
+           family == ADDRESS_IPV6, "address '1::8' fills the gap with zeros");
+}
+
+static void checkLogTimes(void) {
+    unsigned long long now = 1700000000000ull;
+    unsigned long long millis;
+    expect(parseLogTime("now", now, &millis) == 0 && millis == now, "time 'now'");
+    expect(parseLogTime("-15m", now, &millis) == 0 && millis == now - 15 * 60000, "time '-15m'");
+    expect(parseLogTime("-2h", now, &millis) == 0 && millis == now - 2 * 3600000, "time '-2h'");
+    expect(parseLogTime("-30s", now, &millis) == 0 && millis == now - 30000, "time '-30s'");
+    expect(parseLogTime("2024-05-01 13:00", now, &millis) == 0, "time '2024-05-01 13:00'");
+    static const char *const bad[] = {"", "yesterday", "-5x", "25:00", "13:00:00junk"};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        char what[64];
+        snprintf(what, sizeof(what), "time '%s' is turned down", bad[i]);
+        expect(parseLogTime(bad[i], now, &millis) != 0, what);
+    }
+}
+
+int main(void) {
+    checkFilters();
+    checkDiff();
+    checkNetworks();
+    checkAddresses();
+    checkLog();
+    checkAlertDrops();
+    checkLogTimes();
+    checkSharedNames();
+    checkSocketOwners();
+    checkFleetKeyframe();
+
+    if (failures > 0) {
+        printf("%d of %d checks failed\n", failures, checks);
+        return 1;
+    }
+    printf("All %d checks passed\n", checks);
+    return 0;
+}
@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <string.h>
+#include "synthetic.h"
+#include "string_table.h"
+
+#define PORTS_PER_ADDRESS 60000     // Local ports handed out before moving to the next local address
+#define POPULAR_HOSTS 256
+
+// xorshift32, plenty for made-up tables and the same everywhere
+static unsigned int nextRandom(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static unsigned int programNames[SYNTHETIC_PROGRAMS];
+static int programsInterned = 0;
+
+static void internPrograms() {
+    if (programsInterned) return;
+    for (int i = 0; i < SYNTHETIC_PROGRAMS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "service%02d", i);
+        programNames[i] = internProgramName(name);
+    }
+    programsInterned = 1;
+}
+
+static void setIpv4Bytes(unsigned char address[16], unsigned char a, unsigned char b, unsigned char c, unsigned char d) {
+    unsigned char bytes[4] = {a, b, c, d};
+    unsigned int value;
+    memcpy(&value, bytes, 4);
+    setIpv4Address(address, value);
+}
+
+// A remote host: one of a few popular ones (CDNs, the database) or
+// anywhere on the public internet
+static void pickRemote(NetworkConnection *row, unsigned int *random) {
+    unsigned int r = nextRandom(random);
+    int popular = r % 100 < 40;
+    unsigned int host = popular ? (r >> 8) % POPULAR_HOSTS : nextRandom(random);
+
+    if (row->family == ADDRESS_IPV6) {
+        unsigned char bytes[16] = {0x20, 0x01, 0x0d, 0xb8};
+        if (popular) bytes[5] = 1;
+        memcpy(bytes + 12, &host, 4);
+        setIpv6Address(row->remoteAddress, bytes);
+    } else if (popular) {
+        setIpv4Bytes(row->remoteAddress, 151, 101, (unsigned char)host, 1);
+    } else {
+        // First octet 11-99 keeps clear of the private and special blocks
+        setIpv4Bytes(row->remoteAddress, (unsigned char)(11 + host % 89), (unsigned char)(host >> 8),
+                     (unsigned char)(host >> 16), (unsigned char)(host >> 24));
+    }
+
+    r = nextRandom(random) % 100;
+    if (r < 60) row->remotePort = 443;
+    else if (r < 70) row->remotePort = 80;
+    else if (r < 80) row->remotePort = 5432;
+    else row->remotePort = (unsigned short)(1024 + nextRandom(random) % 64000);
+}
+
+void generateConnections(NetworkConnection *rows, int count, unsigned int seed) {
+    unsigned int random = seed ? seed : 1;
+    internPrograms();
+
+    for (int i = 0; i < count; i++) {
+        NetworkConnection *row = &rows[i];
+        memset(row, 0, sizeof(*row));
+
+        // The local end alone makes every row different
+        unsigned int block = (unsigned int)i / PORTS_PER_ADDRESS;
+        row->localPort = (unsigned short)(1024 + i % PORTS_PER_ADDRESS);
+        int loopback = nextRandom(&random) % 100 < 10;
+        row->family = (nextRandom(&random) % 5 == 0 && !loopback) ? ADDRESS_IPV6 : ADDRESS_IPV4;
+        if (row->family == ADDRESS_IPV6) {
+            unsigned char bytes[16] = {0xfd, 0x00};
+            bytes[14] = (unsigned char)(block >> 8);
+            bytes[15] = (unsigned char)(block + 1);
+            setIpv6Address(row->localAddress, bytes);
+        } else if (loopback) {
+            setIpv4Bytes(row->localAddress, 127, 0, (unsigned char)(block >> 8), (unsigned char)(block + 1));
+        } else {
+            setIpv4Bytes(row->localAddress, 10, 1, (unsigned char)(block >> 8), (unsigned char)(block + 1));
+        }
+
+        unsigned int kind = nextRandom(&random) % 100;
+        row->protocol = PROTOCOL_TCP;
+        if (kind < 4) {
+            row->state = STATE_LISTENING;
+        } else if (kind < 9) {
+            row->protocol = PROTOCOL_UDP;
+            row->state = STATE_LISTENING;
+        } else if (kind < 14) {
+            row->protocol = PROTOCOL_UDP;
+            row->state = STATE_ESTABLISHED;
+        } else if (kind < 84) {
+            row->state = STATE_ESTABLISHED;
+        } else if (kind < 94) {
+            row->state = STATE_TIME_WAIT;
+        } else if (kind < 97) {
+            row->state = STATE_CLOSE_WAIT;
+        } else {
+            row->state = STATE_SYN_SENT;
+        }
+
+        if (row->state != STATE_LISTENING) {
+            if (loopback) {
+                setIpv4Bytes(row->remoteAddress, 127, 0, 0, 1);
+                row->remotePort = (unsigned short)(1024 + nextRandom(&random) % 64000);
+            } else {
+                pickRemote(row, &random);
+            }
+        } else if (row->family == ADDRESS_IPV4) {
+            setIpv4Address(row->remoteAddress, 0);
+        }
+
+        unsigned int program = (unsigned int)(i * 7919u) % SYNTHETIC_PROGRAMS;
+        row->programId = 1000 + program;
+        row->programName = programNames[program];
+    }
+}
+
+void churnConnections(NetworkConnection *rows, int count, int percent, unsigned int seed) {
+    unsigned int random = seed ? seed : 1;
+
+    for (int i = 0; i < count; i++) {
+        if ((int)(nextRandom(&random) % 100) >= percent) continue;
+        NetworkConnection *row = &rows[i];
+
+        if (nextRandom(&random) % 4 == 0 && row->state != STATE_LISTENING) {
+            row->state = (row->state == STATE_ESTABLISHED) ? STATE_CLOSE_WAIT : STATE_ESTABLISHED;
+        } else {
+            // Gone, and a new one in its place
+            if (row->state == STATE_LISTENING) row->state = STATE_ESTABLISHED;
+            pickRemote(row, &random);
+            row->remotePort = (unsigned short)(1024 + nextRandom(&random) % 64000);
+        }
+    }
+}
+
+// Ours back to the kernel's numbers
+static int getKernelState(const NetworkConnection *row) {
+    static const unsigned char kernelStates[STATE_COUNT] = {
+        [STATE_UNKNOWN] = 7, [STATE_CLOSED] = 7, [STATE_LISTENING] = 10, [STATE_SYN_SENT] = 2,
+        [STATE_SYN_RCVD] = 3, [STATE_ESTABLISHED] = 1, [STATE_FIN_WAIT1] = 4, [STATE_FIN_WAIT2] = 5,
+        [STATE_CLOSE_WAIT] = 8, [STATE_CLOSING] = 11, [STATE_LAST_ACK] = 9, [STATE_TIME_WAIT] = 6,
+        [STATE_DELETE_TCB] = 7
+    };
+    if (row->protocol == PROTOCOL_UDP && row->state == STATE_LISTENING) return 7;
+    return kernelStates[row->state];
+}
+
+// The kernel prints each 32-bit word of the address as a number, in host
+// byte order
+static int formatProcAddress(const unsigned char address[16], AddressFamily family, char *text) {
+    if (family == ADDRESS_IPV4) {
+        unsigned int word;
+        memcpy(&word, address + 12, 4);
+        return sprintf(text, "%08X", word);
+    }
+    int length = 0;
+    for (int i = 0; i < 4; i++) {
+        unsigned int word;
+        memcpy(&word, address + i * 4, 4);
+        length += sprintf(text + length, "%08X", word);
+    }
+    return length;
+}
+
+size_t formatProcNetTable(const NetworkConnection *rows, int count, AddressFamily family, ConnectionProtocol protocol,
+                          char *text, size_t size) {
+    size_t length = (size_t)snprintf(text, size,
+        "  sl  local_address rem_address   st tx_queue rx_queue tr tm->when retrnsmt   uid  timeout inode\n");
+    int line = 0;
+
+    for (int i = 0; i < count; i++) {
+        const NetworkConnection *row = &rows[i];
+        if (row->family != family || row->protocol != protocol) continue;
+        if (length + SYNTHETIC_PROC_LINE > size) break;
+
+        char local[33], remote[33];
+        formatProcAddress(row->localAddress, family, local);
+        formatProcAddress(row->remoteAddress, family, remote);
+        length += (size_t)sprintf(text + length,
+            "%4d: %s:%04X %s:%04X %02X 00000000:00000000 00:00000000 00000000  %4u        0 %d 1 0000000000000000 20 4 30 10 -1\n",
+            line++, local, row->localPort, remote, row->remotePort, getKernelState(row), 1000 + (unsigned int)i % 7, 10000 + i);
+    }
+    return length;
+}
+
+int formatTcpTable(const NetworkConnection *rows, int count, SyntheticTcpRow *table) {
+    int written = 0;
+
+    for (int i = 0; i < count; i++) {
+        const NetworkConnection *row = &rows[i];
+        if (row->family != ADDRESS_IPV4 || row->protocol != PROTOCOL_TCP) continue;
+
+        SyntheticTcpRow *out = &table[written++];
+        unsigned char localPort[4] = {(unsigned char)(row->localPort >> 8), (unsigned char)row->localPort, 0, 0};
+        unsigned char remotePort[4] = {(unsigned char)(row->remotePort >> 8), (unsigned char)row->remotePort, 0, 0};
+        out->dwState = row->state;      // MIB_TCP_STATE_* are numbered like our states
+        memcpy(&out->dwLocalAddr, row->localAddress + 12, 4);
+        memcpy(&out->dwLocalPort, localPort, 4);
+        memcpy(&out->dwRemoteAddr, row->remoteAddress + 12, 4);
+        memcpy(&out->dwRemotePort, remotePort, 4);
+        out->dwOwningPid = row->programId;
+    }
+    return written;
+}
@@ -0,0 +1,42 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <stddef.h>
+#include "network_monitoring.h"
+
+// Made-up socket tables for the benchmark, shaped like a busy server: a
+// few listeners, mostly established TCP spread over a lot of remote
+// hosts (a few of them very popular), some TIME_WAIT, some UDP, a fifth
+// of it IPv6. The same seed always gives the same table.
+
+// The fields of a MIB_TCPROW_OWNER_PID, so the Windows conversion can be
+// timed anywhere. Addresses and ports are in network byte order.
+typedef struct {
+    unsigned int dwState;
+    unsigned int dwLocalAddr;
+    unsigned int dwLocalPort;
+    unsigned int dwRemoteAddr;
+    unsigned int dwRemotePort;
+    unsigned int dwOwningPid;
+} SyntheticTcpRow;
+
+#define SYNTHETIC_PROGRAMS 50           // Different program names used
+
+// Fill rows with count connections. Every row has its own 5-tuple.
+void generateConnections(NetworkConnection *rows, int count, unsigned int seed);
+
+// Change about percent of the rows the way a refresh would see it: most
+// of them closed and replaced by a new connection, the rest changing state
+void churnConnections(NetworkConnection *rows, int count, int percent, unsigned int seed);
+
+// Write the rows of one family and protocol the way /proc/net/tcp (tcp6,
+// udp, udp6) shows them, header line included. size should allow
+// SYNTHETIC_PROC_LINE bytes per row. Returns the length of the text.
+#define SYNTHETIC_PROC_LINE 180
+size_t formatProcNetTable(const NetworkConnection *rows, int count, AddressFamily family, ConnectionProtocol protocol,
+                          char *text, size_t size);
+
+// The IPv4 TCP rows as MIB rows. Returns how many were written.
+int formatTcpTable(const NetworkConnection *rows, int count, SyntheticTcpRow *table);
+
+#endif
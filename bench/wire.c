@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "network_monitoring.h"
+#include "snapshot.h"
+#include "binlog.h"
+#include "compress.h"
+#include "fleet.h"
+#include "string_table.h"
+#include "synthetic.h"
+
+// Feeds the wire decoders what a broken or hostile agent could send: the
+// frame header, compressed blocks and log records, both as random bytes
+// and as hand-made cases aimed at each length and offset check. A decoder
+// may turn anything down, but it must never read or write outside what it
+// was given, claim a record bigger than its bytes, or hang.
+//
+//   netmon_wire [--rounds 200000]
+//
+// Exits 1 on the first broken promise. ctest runs it with a time limit,
+// so a decoder that loops forever fails too.
+
+#define RANDOM_BLOCK 256        // Bytes of random input per round
+#define GUARD_SIZE 64           // Bytes after an output buffer that must stay untouched
+#define GUARD_BYTE 0xA5
+#define KEYFRAME_ROWS 2000
+
+static int failures = 0;
+
+static void fail(const char *what, int round) {
+    printf("FAILED: %s (round %d)\n", what, round);
+    failures++;
+}
+
+// xorshift32, so the same rounds run every time
+static unsigned int nextRandom(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static void fillRandom(unsigned char *p, size_t size, unsigned int *state) {
+    for (size_t i = 0; i < size; i++) p[i] = (unsigned char)nextRandom(state);
+}
+
+static void putU16(unsigned char *p, unsigned int value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void putU32(unsigned char *p, unsigned int value) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static void putRecordHeader(unsigned char *p, unsigned int length, unsigned char type, unsigned int rowSize,
+                            unsigned int count) {
+    memset(p, 0, 24);
+    putU32(p, length);
+    p[4] = type;
+    putU16(p + 6, rowSize);
+    putU32(p + 16, count);
+}
+
+static int guardIntact(const unsigned char *guard) {
+    for (int i = 0; i < GUARD_SIZE; i++) {
+        if (guard[i] != GUARD_BYTE) return 0;
+    }
+    return 1;
+}
+
+// Expand into exactly outSize bytes with a guard behind them. Returns what
+// expandBlock did, or -2 when it wrote past the end.
+static int guardedExpand(const unsigned char *in, size_t size, unsigned char *out, size_t outSize) {
+    memset(out + outSize, GUARD_BYTE, GUARD_SIZE);
+    int result = expandBlock(in, size, out, outSize);
+    return guardIntact(out + outSize) ? result : -2;
+}
+
+static void checkFrameHeaders(int rounds, unsigned int *state) {
+    unsigned char header[FLEET_FRAME_HEADER_SIZE];
+    for (int round = 0; round < rounds; round++) {
+        fillRandom(header, sizeof(header), state);
+        // Most random types are out of range, so aim half of them at real ones
+        if (round & 1) header[4] = (unsigned char)(FRAME_HELLO + round % 4);
+        if (round & 2) header[5] &= FLEET_COMPRESSED;
+
+        FleetFrameHeader frame;
+        if (readFrameHeader(header, &frame) != 0) continue;
+        if (frame.type < FRAME_HELLO || frame.type > FRAME_ANSWER) fail("frame header took an unknown type", round);
+        if (frame.length > FLEET_MAX_FRAME || frame.expandedSize > FLEET_MAX_FRAME) {
+            fail("frame header took a size over the limit", round);
+        }
+        if (!(frame.flags & FLEET_COMPRESSED) && frame.length != frame.expandedSize) {
+            fail("frame header took a plain body with two sizes", round);
+        }
+    }
+
+    static const struct {
+        unsigned int length, expanded;
+        unsigned char type, flags;
+    } bad[] = {
+        {0, 0, 0, 0},                                           // No such type
+        {0, 0, FRAME_ANSWER + 1, 0},
+        {FLEET_MAX_FRAME + 1, FLEET_MAX_FRAME + 1, FRAME_RECORDS, 0},
+        {16, FLEET_MAX_FRAME + 1, FRAME_RECORDS, FLEET_COMPRESSED},
+        {0xFFFFFFFFu, 16, FRAME_RECORDS, FLEET_COMPRESSED},
+        {16, 32, FRAME_RECORDS, 0},                             // Plain, but the sizes differ
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        memset(header, 0, sizeof(header));
+        putU32(header, bad[i].length);
+        header[4] = bad[i].type;
+        header[5] = bad[i].flags;
+        putU32(header + 8, bad[i].expanded);
+        FleetFrameHeader frame;
+        if (readFrameHeader(header, &frame) == 0) fail("frame header took a hand-made bad header", (int)i);
+    }
+}
+
+// A real keyframe must come back byte for byte, through packFrame and
+// readFrameHeader the way the collector sees it
+static void checkRoundTrip(void) {
+    NetworkConnection *rows = malloc(KEYFRAME_ROWS * sizeof(NetworkConnection));
+    ConnectionSnapshot snapshot;
+    initSnapshot(&snapshot);
+    if (rows == NULL) {
+        fail("no memory for the keyframe", 0);
+        return;
+    }
+    generateConnections(rows, KEYFRAME_ROWS, 7);
+    for (int i = 0; i < KEYFRAME_ROWS; i++) addSnapshotRow(&snapshot, &rows[i]);
+
+    size_t size = encodeKeyframeRecord(NULL, 0, &snapshot, 0);
+    unsigned char *record = malloc(size);
+    unsigned char *frame = malloc(FLEET_FRAME_HEADER_SIZE + size);
+    unsigned char *expanded = malloc(size + GUARD_SIZE);
+    if (record == NULL || frame == NULL || expanded == NULL) {
+        fail("no memory for the keyframe", 0);
+    } else {
+        encodeKeyframeRecord(record, size, &snapshot, 0);
+        packFrame(frame, FRAME_RECORDS, record, size, 1);
+
+        FleetFrameHeader header;
+        if (readFrameHeader(frame, &header) != 0 || header.expandedSize != size) {
+            fail("a packed keyframe has a bad header", 0);
+        } else if (!(header.flags & FLEET_COMPRESSED)) {
+            fail("a keyframe didn't compress", 0);
+        } else if (guardedExpand(frame + FLEET_FRAME_HEADER_SIZE, header.length, expanded, size) != 0 ||
+                   memcmp(expanded, record, size) != 0) {
+            fail("a keyframe didn't expand back to itself", 0);
+        } else {
+            // Too little room, or half the block: neither may come out
+            if (guardedExpand(frame + FLEET_FRAME_HEADER_SIZE, header.length, expanded, size - 1) != -1) {
+                fail("a block expanded into too little room", 0);
+            }
+            if (guardedExpand(frame + FLEET_FRAME_HEADER_SIZE, header.length / 2, expanded, size) != -1) {
+                fail("a cut-off block expanded", 0);
+            }
+        }
+    }
+
+    free(record);
+    free(frame);
+    free(expanded);
+    free(rows);
+    freeSnapshot(&snapshot);
+}
+
+static void checkExpand(int rounds, unsigned int *state) {
+    unsigned char in[RANDOM_BLOCK];
+    unsigned char packed[COMPRESS_BOUND(RANDOM_BLOCK)];
+    unsigned char out[RANDOM_BLOCK * 4 + GUARD_SIZE];
+
+    for (int round = 0; round < rounds; round++) {
+        size_t size = 1 + nextRandom(state) % RANDOM_BLOCK;
+        size_t outSize = nextRandom(state) % (RANDOM_BLOCK * 4);
+
+        // Pure noise
+        fillRandom(in, size, state);
+        int result = guardedExpand(in, size, out, outSize);
+        if (result == -2) fail("random block wrote past the end", round);
+
+        // Something that compresses (runs of a few byte values), then
+        // packed, checked and damaged in one place
+        for (size_t i = 0; i < size; i++) in[i] = (unsigned char)(nextRandom(state) % 4 == 0 ? nextRandom(state) % 8 : 0);
+        size_t packedSize = compressBlock(in, size, packed, sizeof(packed));
+        if (packedSize == 0) {
+            fail("a block didn't fit in COMPRESS_BOUND", round);
+            continue;
+        }
+        if (guardedExpand(packed, packedSize, out, size) != 0 || memcmp(out, in, size) != 0) {
+            fail("a block didn't expand back to itself", round);
+        }
+        packed[nextRandom(state) % packedSize] ^= (unsigned char)(1 + nextRandom(state) % 255);
+        if (guardedExpand(packed, packedSize, out, size) == -2) fail("damaged block wrote past the end", round);
+    }
+
+    static const struct {
+        const char *what;
+        unsigned char bytes[8];
+        size_t size;
+        size_t outSize;
+    } bad[] = {
+        {"match before the start", {0x10, 'a', 0x02, 0x00}, 4, 5},
+        {"match at offset 0", {0x10, 'a', 0x00, 0x00}, 4, 5},
+        {"literals past the input", {0x50, 'a', 'b'}, 3, 5},
+        {"literals past the output", {0x30, 'a', 'b', 'c'}, 4, 2},
+        {"match past the output", {0x1F, 'a', 0x01, 0x00, 0x00}, 5, 8},
+        {"length bytes that never end", {0xF0, 0xFF, 0xFF, 0xFF}, 4, 1000},
+        {"offset cut in half", {0x10, 'a', 0x01}, 3, 5},
+        {"short of the size", {0x20, 'a', 'b'}, 3, 3},
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        int result = guardedExpand(bad[i].bytes, bad[i].size, out, bad[i].outSize);
+        if (result != -1) fail(bad[i].what, (int)i);
+    }
+}
+
+static void checkRecords(int rounds, unsigned int *state) {
+    unsigned char in[RANDOM_BLOCK];
+    for (int round = 0; round < rounds; round++) {
+        size_t size = nextRandom(state) % RANDOM_BLOCK;
+        fillRandom(in, size, state);
+        // Lengths that fit the bytes and known types are the interesting ones
+        if (size >= 24 && (round & 1)) {
+            putU32(in, (unsigned int)(24 + nextRandom(state) % (size - 23)));
+            in[4] = (unsigned char)(RECORD_KEYFRAME + round % 5);
+        }
+
+        LogRecord record;
+        if (parseLogRecord(in, size, &record) != 0) continue;
+        if (record.body < in + 24 || record.body + record.bodySize > in + size) {
+            fail("record reaches outside its bytes", round);
+        } else if (record.type >= RECORD_KEYFRAME && record.type <= RECORD_INTERFACES && record.type != RECORD_STRINGS &&
+                   (unsigned long long)record.count * record.rowSize > record.bodySize) {
+            fail("record has more rows than bytes", round);
+        }
+    }
+
+    static const struct {
+        const char *what;
+        unsigned int length;
+        unsigned char type;
+        unsigned int rowSize;
+        unsigned int count;
+    } bad[] = {
+        {"record shorter than its header", 23, RECORD_KEYFRAME, 48, 0},
+        {"record longer than its bytes", 25, RECORD_KEYFRAME, 48, 0},
+        {"keyframe rows smaller than a row", 24, RECORD_KEYFRAME, 47, 0},
+        {"keyframe rows past the body", 24, RECORD_KEYFRAME, 48, 1},
+        {"row count that overflows 32 bits", 24, RECORD_DELTA, 0xFFFF, 0x10001},
+    };
+    unsigned char header[24];
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        putRecordHeader(header, bad[i].length, bad[i].type, bad[i].rowSize, bad[i].count);
+        LogRecord record;
+        if (parseLogRecord(header, sizeof(header), &record) == 0) fail(bad[i].what, (int)i);
+    }
+}
+
+// One STRINGS record with a single name, number id, as an agent sends it
+static int addString(LogSegment *names, unsigned int id, const char *text, unsigned int claimedLength) {
+    unsigned char record[64];
+    size_t textLength = strlen(text);
+    size_t length = 24 + 6 + textLength;
+    putRecordHeader(record, (unsigned int)length, RECORD_STRINGS, 0, 1);
+    putU32(record + 24, id);
+    putU16(record + 28, claimedLength);
+    memcpy(record + 30, text, textLength);
+
+    LogRecord parsed;
+    if (parseLogRecord(record, length, &parsed) != 0) return -2;
+    return addLogRecordStrings(names, &parsed);
+}
+
+static void checkStrings(void) {
+    LogSegment names;
+    memset(&names, 0, sizeof(names));
+
+    if (addString(&names, 5, "nginx", 5) != 0) fail("a good name was turned down", 0);
+    if (names.programNameCount <= 5 || strcmp(getProgramNameText(names.programNames[5]), "nginx") != 0) {
+        fail("a good name didn't land", 0);
+    }
+
+    // Each of these used to grow the map to the number (or never stop
+    // doubling, past 2^31). They must be turned down and grow nothing.
+    static const unsigned int hostile[] = {1u << 20, 1u << 30, 0x80000000u, 0xFFFFFFFFu};
+    unsigned int before = names.programNameCount;
+    for (size_t i = 0; i < sizeof(hostile) / sizeof(hostile[0]); i++) {
+        if (addString(&names, hostile[i], "evil", 4) != -1) fail("a huge name number was taken", (int)i);
+    }
+    if (names.programNameCount != before) fail("a huge name number grew the map", 0);
+
+    // A name running past its record is left alone
+    if (addString(&names, 6, "cut", 200) == -2) fail("the cut-off name's record didn't parse", 0);
+    if (names.programNameCount > 6 && names.programNames[6] != PROGRAM_NAME_UNKNOWN) {
+        fail("a name running past its record was taken", 0);
+    }
+    closeLogSegment(&names);
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = 200000;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--rounds N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    unsigned int state = 0x9E3779B9u;
+    checkFrameHeaders(rounds, &state);
+    checkRoundTrip();
+    checkExpand(rounds, &state);
+    checkRecords(rounds, &state);
+    checkStrings();
+
+    if (failures > 0) {
+        printf("%d wire check(s) failed\n", failures);
+        return 1;
+    }
+    printf("Wire decoders held up over %d rounds each\n", rounds);
+    return 0;
+}
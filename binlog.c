@@ -0,0 +1,1090 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "binlog.h"
+#include "platform.h"
+#include "string_table.h"
+
+#define SEGMENT_MAGIC "NMLOG01"         // With its terminating 0, 8 bytes
+#define TRAILER_MAGIC "NMINDEX"
+#define SEGMENT_HEADER_SIZE 24
+#define RECORD_HEADER_SIZE 24
+#define INDEX_ENTRY_SIZE 16
+#define TRAILER_SIZE 56
+#define OLD_TRAILER_SIZE 40             // Before the blocks were added
+#define BLOCK_SUMMARY_SIZE 96
+#define ROW_SIZE 48                     // One connection in a keyframe
+#define EVENT_SIZE 52                   // Event type, old state, 2 spare, row
+#define STRING_HEADER_SIZE 6            // Name number, length
+#define MAX_LOG_NAMES (1u << 20)        // Name numbers from here up can only be damage
+#define ALERT_SIZE 36                   // Type, key, family, protocol, address, port, 2 spare, value, baseline, threshold
+#define INTERFACE_SIZE 104              // Name, milliseconds, 4 spare, the changes of each counter
+
+// Little-endian encoding, whatever the machine is
+static void putU16(unsigned char *p, unsigned int value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void putU32(unsigned char *p, unsigned int value) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static void putU64(unsigned char *p, unsigned long long value) {
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned int getU16(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+static unsigned int getU32(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long getU64(const unsigned char *p) {
+    return (unsigned long long)getU32(p) | ((unsigned long long)getU32(p + 4) << 32);
+}
+
+void getSegmentPath(const char *prefix, unsigned int number, char *path, size_t pathSize) {
+    snprintf(path, pathSize, "%s.%06u.nml", prefix, number);
+}
+
+typedef struct {
+    const char *baseName;       // The prefix without its directory
+    size_t baseLength;
+    unsigned int first;
+    unsigned int last;
+    int found;
+} SegmentSearch;
+
+static void checkSegmentName(const char *name, void *context) {
+    SegmentSearch *search = context;
+    if (strncmp(name, search->baseName, search->baseLength) != 0) return;
+
+    unsigned int number;
+    char extension[8];
+    if (sscanf(name + search->baseLength, ".%u.%7s", &number, extension) != 2 || strcmp(extension, "nml") != 0) return;
+
+    if (!search->found || number < search->first) search->first = number;
+    if (!search->found || number > search->last) search->last = number;
+    search->found = 1;
+}
+
+int findLogSegments(const char *prefix, unsigned int *first, unsigned int *last) {
+    char directory[200] = ".";
+    const char *slash = strrchr(prefix, '/');
+    const char *backslash = strrchr(prefix, '\\');
+    if (backslash > slash) slash = backslash;
+
+    SegmentSearch search = {prefix, strlen(prefix), 0, 0, 0};
+    if (slash != NULL) {
+        size_t length = (size_t)(slash - prefix);
+        if (length >= sizeof(directory)) return 0;
+        memcpy(directory, prefix, length);
+        directory[length] = '\0';
+        if (length == 0) strcpy(directory, "/");
+        search.baseName = slash + 1;
+        search.baseLength = strlen(slash + 1);
+    }
+
+    listDirectory(directory, checkSegmentName, &search);
+    *first = search.first;
+    *last = search.last;
+    return search.found;
+}
+
+
+// Writing
+
+#define RECORD_ROTATE 0xFF              // Queue only: the writer starts a new segment here
+
+void getDefaultLogOptions(LogOptions *options) {
+    options->segmentLimit = LOG_SEGMENT_SIZE;
+    options->keepSegments = LOG_KEEP_SEGMENTS;
+    options->queueSize = LOG_QUEUE_SIZE;
+    options->fullPolicy = LOG_DROP_WHEN_FULL;
+    options->syncPolicy = LOG_SYNC_PERIODIC;
+    options->syncInterval = LOG_SYNC_INTERVAL;
+}
+
+// Put a record header at the front of a record
+static void putRecordHeader(unsigned char *p, unsigned int length, unsigned int type, unsigned int rowSize,
+                            unsigned long long timestamp, unsigned int count, unsigned int connectionCount) {
+    putU32(p, length);
+    p[4] = (unsigned char)type;
+    p[5] = 0;
+    putU16(p + 6, rowSize);
+    putU64(p + 8, timestamp);
+    putU32(p + 16, count);
+    putU32(p + 20, connectionCount);
+}
+
+// Wait until bytes more can go in the queue. Under LOG_DROP_WHEN_FULL
+// we don't wait, we just say there's no room.
+static int waitForRoom(BinaryLog *log, unsigned long long head, size_t bytes) {
+    while (head + bytes - atomic_load_explicit(&log->tail, memory_order_acquire) > log->options.queueSize) {
+        if (log->options.fullPolicy == LOG_DROP_WHEN_FULL) return -1;
+        waitEvent(log->spaceFreed, 100);
+    }
+    return 0;
+}
+
+// Room for a record of length bytes in the queue, in one piece. A record
+// that would run past the end of the ring starts at the front instead:
+// the gap is handed to the writer first (marked with a zero length if
+// there's room for one), so even a record almost as big as the ring
+// fits once the writer has caught up.
+static unsigned char *reserveRecord(BinaryLog *log, size_t length) {
+    size_t size = log->options.queueSize;
+    if (length > size) return NULL;
+
+    unsigned long long head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    size_t position = (size_t)(head % size);
+    size_t toEnd = size - position;
+
+    if (toEnd < length) {
+        if (waitForRoom(log, head, toEnd) != 0) return NULL;
+        if (toEnd >= 4) putU32(log->queue + position, 0);
+        head += toEnd;
+        atomic_store_explicit(&log->head, head, memory_order_release);
+        position = 0;
+    }
+
+    if (waitForRoom(log, head, length) != 0) return NULL;
+    return log->queue + position;
+}
+
+// Hand a reserved record to the writer
+static void commitRecord(BinaryLog *log, size_t length) {
+    unsigned long long head = atomic_load_explicit(&log->head, memory_order_relaxed);
+    atomic_store_explicit(&log->head, head + length, memory_order_release);
+    log->queuedSegmentSize += length;
+    log->recordsQueued++;
+    signalEvent(log->dataReady);
+}
+
+static void dropRecord(BinaryLog *log) {
+    log->recordsDropped++;
+    log->needKeyframe = 1;
+}
+
+static void encodeRow(unsigned char *p, const NetworkConnection *connection) {
+    memcpy(p, connection->localAddress, 16);
+    memcpy(p + 16, connection->remoteAddress, 16);
+    putU16(p + 32, connection->localPort);
+    putU16(p + 34, connection->remotePort);
+    p[36] = connection->family;
+    p[37] = connection->protocol;
+    p[38] = connection->state;
+    p[39] = 0;
+    putU32(p + 40, connection->programId);
+    putU32(p + 44, connection->programName);
+}
+
+size_t encodeKeyframeRecord(unsigned char *record, size_t capacity, const ConnectionSnapshot *snapshot,
+                            unsigned long long timestamp) {
+    size_t length = RECORD_HEADER_SIZE + (size_t)snapshot->count * ROW_SIZE;
+    if (length > capacity) return length;
+
+    unsigned char *p = record + RECORD_HEADER_SIZE;
+    for (int i = 0; i < snapshot->count; i++, p += ROW_SIZE) {
+        NetworkConnection connection;
+        getSnapshotRow(snapshot, i, &connection);
+        encodeRow(p, &connection);
+    }
+
+    putRecordHeader(record, (unsigned int)length, RECORD_KEYFRAME, ROW_SIZE, timestamp,
+                    (unsigned int)snapshot->count, (unsigned int)snapshot->count);
+    return length;
+}
+
+size_t encodeDeltaRecord(unsigned char *record, size_t capacity, const ConnectionDiff *diff, int connectionCount,
+                         unsigned long long timestamp) {
+    size_t length = RECORD_HEADER_SIZE + (size_t)diff->count * EVENT_SIZE;
+    if (length > capacity) return length;
+
+    unsigned char *p = record + RECORD_HEADER_SIZE;
+    for (int i = 0; i < diff->count; i++, p += EVENT_SIZE) {
+        p[0] = diff->events[i].type;
+        p[1] = diff->events[i].oldState;
+        p[2] = 0;
+        p[3] = 0;
+        encodeRow(p + 4, &diff->events[i].connection);
+    }
+
+    putRecordHeader(record, (unsigned int)length, RECORD_DELTA, EVENT_SIZE, timestamp,
+                    (unsigned int)diff->count, (unsigned int)connectionCount);
+    return length;
+}
+
+size_t encodeStringsRecord(unsigned char *record, size_t capacity, unsigned int first, unsigned int total,
+                           unsigned long long timestamp) {
+    size_t length = RECORD_HEADER_SIZE;
+    for (unsigned int id = first; id < total; id++) {
+        length += STRING_HEADER_SIZE + strlen(getProgramNameText(id));
+    }
+    if (length > capacity) return length;
+
+    unsigned char *p = record + RECORD_HEADER_SIZE;
+    for (unsigned int id = first; id < total; id++) {
+        const char *text = getProgramNameText(id);
+        size_t textLength = strlen(text);
+        putU32(p, id);
+        putU16(p + 4, (unsigned int)textLength);
+        memcpy(p + STRING_HEADER_SIZE, text, textLength);
+        p += STRING_HEADER_SIZE + textLength;
+    }
+
+    putRecordHeader(record, (unsigned int)length, RECORD_STRINGS, 0, timestamp, total - first, 0);
+    return length;
+}
+
+static int queueKeyframe(BinaryLog *log, const ConnectionSnapshot *snapshot, unsigned long long timestamp) {
+    size_t length = RECORD_HEADER_SIZE + (size_t)snapshot->count * ROW_SIZE;
+    unsigned char *record = reserveRecord(log, length);
+    if (record == NULL) {
+        dropRecord(log);
+        return -1;
+    }
+
+    encodeKeyframeRecord(record, length, snapshot, timestamp);
+    commitRecord(log, length);
+    log->recordsSinceKeyframe = 0;
+    log->needKeyframe = 0;
+    return 0;
+}
+
+static int queueDelta(BinaryLog *log, const ConnectionDiff *diff, int connectionCount, unsigned long long timestamp) {
+    size_t length = RECORD_HEADER_SIZE + (size_t)diff->count * EVENT_SIZE;
+    unsigned char *record = reserveRecord(log, length);
+    if (record == NULL) {
+        dropRecord(log);
+        return -1;
+    }
+
+    encodeDeltaRecord(record, length, diff, connectionCount, timestamp);
+    commitRecord(log, length);
+    log->recordsSinceKeyframe++;
+    return 0;
+}
+
+// Queue the program names handed out since the last STRINGS record
+static int queueNewStrings(BinaryLog *log, unsigned long long timestamp) {
+    unsigned int total = getProgramNameCount();
+    if (log->stringsWritten >= total) return 0;
+
+    size_t length = encodeStringsRecord(NULL, 0, log->stringsWritten, total, timestamp);
+    unsigned char *record = reserveRecord(log, length);
+    if (record == NULL) {
+        dropRecord(log);
+        return -1;
+    }
+
+    encodeStringsRecord(record, length, log->stringsWritten, total, timestamp);
+    commitRecord(log, length);
+    log->stringsWritten = total;
+    return 0;
+}
+
+// Tell the writer to close this segment and start the next one. Every
+// segment starts with its own names and a keyframe.
+static int queueRotate(BinaryLog *log) {
+    unsigned char *record = reserveRecord(log, RECORD_HEADER_SIZE);
+    if (record == NULL) {
+        dropRecord(log);
+        return -1;
+    }
+
+    putRecordHeader(record, RECORD_HEADER_SIZE, RECORD_ROTATE, 0, 0, 0, 0);
+    commitRecord(log, RECORD_HEADER_SIZE);
+    log->recordsQueued--;       // Not a real record
+    log->queuedSegmentSize = SEGMENT_HEADER_SIZE;
+    log->stringsWritten = 0;
+    log->needKeyframe = 1;
+    return 0;
+}
+
+int appendToLog(BinaryLog *log, const ConnectionSnapshot *snapshot, const ConnectionDiff *diff) {
+    if (log->writer == NULL) return -1;
+
+    // A diff with dropped events doesn't describe the table fully, so we
+    // start again from a keyframe
+    int rotate = atomic_exchange(&log->rotateRequested, 0) || log->queuedSegmentSize >= log->options.segmentLimit;
+    int keyframe = rotate || diff == NULL || diff->droppedCount > 0 || log->needKeyframe ||
+                   log->recordsSinceKeyframe >= LOG_KEYFRAME_EVERY;
+    if (!keyframe && diff->count == 0) return 0;
+
+    unsigned long long now = wallClockMillis();
+    if (queueNewStrings(log, now) != 0) return -1;
+    if (!keyframe) return queueDelta(log, diff, snapshot->count, now);
+
+    // The changes that led up to the keyframe still go in, at the end of
+    // the block before it, so a query sees every change and not just the
+    // table they made
+    if (diff != NULL && diff->count > 0 && diff->droppedCount == 0 && !log->needKeyframe) {
+        queueDelta(log, diff, snapshot->count, now);
+    }
+    if (rotate && (queueRotate(log) != 0 || queueNewStrings(log, now) != 0)) return -1;
+    return queueKeyframe(log, snapshot, now);
+}
+
+int appendAlertsToLog(BinaryLog *log, const AnomalyAlert *alerts, int count) {
+    if (log->writer == NULL || count == 0) return 0;
+
+    size_t length = RECORD_HEADER_SIZE + (size_t)count * ALERT_SIZE;
+    unsigned char *record = reserveRecord(log, length);
+    if (record == NULL) {
+        log->recordsDropped++;      // Alerts aren't part of the table, so no keyframe is needed
+        return -1;
+    }
+
+    unsigned char *p = record + RECORD_HEADER_SIZE;
+    for (int i = 0; i < count; i++, p += ALERT_SIZE) {
+        p[0] = alerts[i].type;
+        p[1] = alerts[i].key;
+        p[2] = alerts[i].family;
+        p[3] = alerts[i].protocol;
+        memcpy(p + 4, alerts[i].address, 16);
+        putU16(p + 20, alerts[i].port);
+        putU16(p + 22, 0);
+        putU32(p + 24, alerts[i].value);
+        putU32(p + 28, alerts[i].baseline);
+        putU32(p + 32, alerts[i].threshold);
+    }
+
+    putRecordHeader(record, (unsigned int)length, RECORD_ALERT, ALERT_SIZE, alerts[0].timestamp, (unsigned int)count, 0);
+    commitRecord(log, length);
+    return 0;
+}
+
+static int hasChanges(const InterfaceCounters *counters) {
+    for (int counter = 0; counter < INTERFACE_COUNTER_COUNT; counter++) {
+        if (counters->change[counter] != 0) return 1;
+    }
+    return 0;
+}
+
+int appendInterfacesToLog(BinaryLog *log, const ConnectionSnapshot *snapshot) {
+    if (log->writer == NULL || snapshot->interfaceMillis == 0) return 0;
+
+    // Only the interfaces that saw anything
+    int count = 0;
+    for (int i = 0; i < snapshot->interfaceCount; i++) count += hasChanges(&snapshot->interfaces[i]);
+    if (count == 0) return 0;
+
+    size_t length = RECORD_HEADER_SIZE + (size_t)count * INTERFACE_SIZE;
+    unsigned char *record = reserveRecord(log, length);
+    if (record == NULL) {
+        log->recordsDropped++;      // The table has no gap, so no keyframe is needed
+        return -1;
+    }
+
+    unsigned char *p = record + RECORD_HEADER_SIZE;
+    for (int i = 0; i < snapshot->interfaceCount; i++) {
+        const InterfaceCounters *counters = &snapshot->interfaces[i];
+        if (!hasChanges(counters)) continue;
+
+        memset(p, 0, MAX_INTERFACE_NAME);
+        memcpy(p, counters->name, strlen(counters->name));
+        putU32(p + 32, (unsigned int)snapshot->interfaceMillis);
+        putU32(p + 36, 0);
+        for (int counter = 0; counter < INTERFACE_COUNTER_COUNT; counter++) putU64(p + 40 + counter * 8, counters->change[counter]);
+        p += INTERFACE_SIZE;
+    }
+
+    putRecordHeader(record, (unsigned int)length, RECORD_INTERFACES, INTERFACE_SIZE, wallClockMillis(),
+                    (unsigned int)count, 0);
+    commitRecord(log, length);
+    return 0;
+}
+
+void getLogStats(BinaryLog *log, LogStats *stats) {
+    stats->recordsQueued = log->recordsQueued;
+    stats->recordsDropped = log->recordsDropped;
+    stats->recordsWritten = atomic_load(&log->recordsWritten);
+    stats->bytesWritten = atomic_load(&log->bytesWritten);
+    stats->writeErrors = atomic_load(&log->writeErrors);
+    stats->syncs = atomic_load(&log->syncs);
+    stats->queueUsed = (size_t)(atomic_load(&log->head) - atomic_load(&log->tail));
+    stats->queueSize = log->options.queueSize;
+}
+
+
+// The writer thread. Everything below runs on it, apart from the first
+// startSegment in openBinaryLog.
+
+static int addIndexEntry(BinaryLog *log, unsigned long long timestamp, unsigned char type, unsigned long long offset) {
+    if (log->indexCount == log->indexCapacity) {
+        int newCapacity = log->indexCapacity ? log->indexCapacity * 2 : 256;
+        LogIndexEntry *index = trackedRealloc(log->index, (size_t)newCapacity * sizeof(LogIndexEntry));
+        if (index == NULL) return -1;
+        log->index = index;
+        log->indexCapacity = newCapacity;
+    }
+
+    LogIndexEntry *entry = &log->index[log->indexCount++];
+    entry->timestamp = timestamp;
+    entry->offset = (unsigned int)offset;
+    entry->type = type;
+    return 0;
+}
+
+// Widen a block's ranges to take in one encoded row
+static void addToBlock(LogBlockSummary *block, const unsigned char *row) {
+    unsigned int localPort = getU16(row + 32), remotePort = getU16(row + 34);
+    unsigned int programId = getU32(row + 40);
+
+    if (block->rows == 0) {
+        memcpy(block->minLocalAddress, row, 16);
+        memcpy(block->maxLocalAddress, row, 16);
+        memcpy(block->minRemoteAddress, row + 16, 16);
+        memcpy(block->maxRemoteAddress, row + 16, 16);
+        block->minLocalPort = block->maxLocalPort = (unsigned short)localPort;
+        block->minRemotePort = block->maxRemotePort = (unsigned short)remotePort;
+        block->minProgramId = block->maxProgramId = programId;
+    } else {
+        if (memcmp(row, block->minLocalAddress, 16) < 0) memcpy(block->minLocalAddress, row, 16);
+        if (memcmp(row, block->maxLocalAddress, 16) > 0) memcpy(block->maxLocalAddress, row, 16);
+        if (memcmp(row + 16, block->minRemoteAddress, 16) < 0) memcpy(block->minRemoteAddress, row + 16, 16);
+        if (memcmp(row + 16, block->maxRemoteAddress, 16) > 0) memcpy(block->maxRemoteAddress, row + 16, 16);
+        if (localPort < block->minLocalPort) block->minLocalPort = (unsigned short)localPort;
+        if (localPort > block->maxLocalPort) block->maxLocalPort = (unsigned short)localPort;
+        if (remotePort < block->minRemotePort) block->minRemotePort = (unsigned short)remotePort;
+        if (remotePort > block->maxRemotePort) block->maxRemotePort = (unsigned short)remotePort;
+        if (programId < block->minProgramId) block->minProgramId = programId;
+        if (programId > block->maxProgramId) block->maxProgramId = programId;
+    }
+    if (row[37] < 8) block->protocols |= (unsigned char)(1u << row[37]);
+    if (row[38] < 16) block->states |= (unsigned short)(1u << row[38]);
+    block->rows++;
+}
+
+// Keep the block summaries up to date with a record the writer is about
+// to write. A keyframe starts a new block. This is the writer's time, not
+// the refresh loop's.
+static void summarizeRecord(BinaryLog *log, const unsigned char *record) {
+    unsigned int type = record[4];
+    if (type != RECORD_KEYFRAME && type != RECORD_DELTA) return;
+
+    if (type == RECORD_KEYFRAME) {
+        if (log->blockCount == log->blockCapacity) {
+            int newCapacity = log->blockCapacity ? log->blockCapacity * 2 : 64;
+            LogBlockSummary *blocks = trackedRealloc(log->blocks, (size_t)newCapacity * sizeof(LogBlockSummary));
+            if (blocks == NULL) return;
+            log->blocks = blocks;
+            log->blockCapacity = newCapacity;
+        }
+        LogBlockSummary *block = &log->blocks[log->blockCount++];
+        memset(block, 0, sizeof(*block));
+        block->firstRecord = log->indexCount - 1;
+        block->summarized = 1;
+    }
+    if (log->blockCount == 0) return;
+    LogBlockSummary *block = &log->blocks[log->blockCount - 1];
+
+    unsigned int rowSize = getU16(record + 6);
+    unsigned int count = getU32(record + 16);
+    const unsigned char *row = record + RECORD_HEADER_SIZE + (type == RECORD_DELTA ? 4 : 0);
+    for (unsigned int i = 0; i < count; i++, row += rowSize) addToBlock(block, row);
+}
+
+static void putBlockSummary(unsigned char *p, const LogBlockSummary *block) {
+    memset(p, 0, BLOCK_SUMMARY_SIZE);
+    putU32(p, (unsigned int)block->firstRecord);
+    putU32(p + 4, block->rows);
+    memcpy(p + 8, block->minLocalAddress, 16);
+    memcpy(p + 24, block->maxLocalAddress, 16);
+    memcpy(p + 40, block->minRemoteAddress, 16);
+    memcpy(p + 56, block->maxRemoteAddress, 16);
+    putU16(p + 72, block->minLocalPort);
+    putU16(p + 74, block->maxLocalPort);
+    putU16(p + 76, block->minRemotePort);
+    putU16(p + 78, block->maxRemotePort);
+    putU32(p + 80, block->minProgramId);
+    putU32(p + 84, block->maxProgramId);
+    putU16(p + 88, block->states);
+    p[90] = block->protocols;
+}
+
+static void syncSegment(BinaryLog *log) {
+    if (log->file < 0 || log->segmentBroken || !log->unsynced) return;
+    syncFile(log->file);
+    log->unsynced = 0;
+    log->lastSync = wallClockMillis();
+    atomic_fetch_add(&log->syncs, 1);
+}
+
+// Write the index and trailer and close the segment
+static void finishSegment(BinaryLog *log) {
+    if (log->file < 0) return;
+
+    if (!log->segmentBroken) {
+        // The index and the blocks go out in one piece
+        size_t indexSize = (size_t)log->indexCount * INDEX_ENTRY_SIZE;
+        size_t blocksSize = (size_t)log->blockCount * BLOCK_SUMMARY_SIZE;
+        unsigned char *index = trackedAlloc(indexSize + blocksSize ? indexSize + blocksSize : 1);
+        unsigned char trailer[TRAILER_SIZE];
+
+        if (index != NULL) {
+            unsigned char *entry = index;
+            for (int i = 0; i < log->indexCount; i++, entry += INDEX_ENTRY_SIZE) {
+                putU64(entry, log->index[i].timestamp);
+                putU32(entry + 8, log->index[i].offset);
+                memset(entry + 12, 0, 4);
+                entry[12] = log->index[i].type;
+            }
+            for (int i = 0; i < log->blockCount; i++, entry += BLOCK_SUMMARY_SIZE) {
+                putBlockSummary(entry, &log->blocks[i]);
+            }
+
+            // Readers from before the blocks find the size and magic at
+            // the end and the old fields at the front, so they still work
+            memset(trailer, 0, sizeof(trailer));
+            putU64(trailer, log->segmentSize);
+            putU32(trailer + 8, (unsigned int)log->indexCount);
+            putU64(trailer + 12, log->indexCount ? log->index[0].timestamp : 0);
+            putU64(trailer + 20, log->indexCount ? log->index[log->indexCount - 1].timestamp : 0);
+            putU64(trailer + 28, log->segmentSize + indexSize);
+            putU32(trailer + 36, (unsigned int)log->blockCount);
+            putU32(trailer + 44, TRAILER_SIZE);
+            memcpy(trailer + 48, TRAILER_MAGIC, 8);
+
+            // Without a trailer the reader walks the records instead, so a
+            // failure here loses nothing
+            const void *parts[2] = {index, trailer};
+            size_t sizes[2] = {indexSize + blocksSize, sizeof(trailer)};
+            if (writeFileParts(log->file, parts, sizes, 2) != 0) atomic_fetch_add(&log->writeErrors, 1);
+            trackedFree(index);
+            log->unsynced = 1;
+        }
+        if (log->options.syncPolicy != LOG_SYNC_NEVER) syncSegment(log);
+    }
+
+    closeFile(log->file);
+    log->file = -1;
+}
+
+static int startSegment(BinaryLog *log) {
+    char path[256];
+    log->segmentNumber++;
+    getSegmentPath(log->prefix, log->segmentNumber, path, sizeof(path));
+
+    log->indexCount = 0;
+    log->blockCount = 0;
+    log->segmentBroken = 0;
+    log->segmentSize = SEGMENT_HEADER_SIZE;
+    log->file = createFile(path);
+
+    unsigned char header[SEGMENT_HEADER_SIZE];
+    memcpy(header, SEGMENT_MAGIC, 8);
+    putU32(header + 8, log->segmentNumber);
+    putU32(header + 12, SEGMENT_HEADER_SIZE);
+    putU64(header + 16, wallClockMillis());
+    const void *parts[1] = {header};
+    size_t sizes[1] = {sizeof(header)};
+
+    if (log->file < 0 || writeFileParts(log->file, parts, sizes, 1) != 0) {
+        atomic_fetch_add(&log->writeErrors, 1);
+        log->segmentBroken = 1;
+        return -1;
+    }
+
+    // Drop the oldest segments
+    while (log->options.keepSegments > 0 &&
+           log->segmentNumber - log->firstSegmentNumber >= (unsigned int)log->options.keepSegments) {
+        getSegmentPath(log->prefix, log->firstSegmentNumber, path, sizeof(path));
+        remove(path);
+        log->firstSegmentNumber++;
+    }
+    return 0;
+}
+
+#define WRITE_BATCH_PARTS 64
+
+typedef struct {
+    const void *parts[WRITE_BATCH_PARTS];
+    size_t sizes[WRITE_BATCH_PARTS];
+    int count;
+    size_t bytes;
+    int records;
+    int firstIndex;             // Index entries added for this batch start here
+} WriteBatch;
+
+// Write what has been gathered, then let the refresh loop reuse the space
+static void flushBatch(BinaryLog *log, WriteBatch *batch, unsigned long long tail) {
+    if (batch->count > 0 && !log->segmentBroken) {
+        if (writeFileParts(log->file, batch->parts, batch->sizes, batch->count) == 0) {
+            log->segmentSize += batch->bytes;
+            log->unsynced = 1;
+            atomic_fetch_add(&log->recordsWritten, (unsigned long long)batch->records);
+            atomic_fetch_add(&log->bytesWritten, batch->bytes);
+        } else {
+            // We don't know how much of it made it to the file, so this
+            // segment is done. Ask the refresh loop for a new one (which
+            // starts with a keyframe).
+            atomic_fetch_add(&log->writeErrors, 1);
+            log->indexCount = batch->firstIndex;
+            log->segmentBroken = 1;
+            atomic_store(&log->rotateRequested, 1);
+        }
+    }
+
+    batch->count = 0;
+    batch->bytes = 0;
+    batch->records = 0;
+    batch->firstIndex = log->indexCount;
+    atomic_store_explicit(&log->tail, tail, memory_order_release);
+    signalEvent(log->spaceFreed);
+}
+
+// Take every record between tail and head out of the queue
+static void writeQueued(BinaryLog *log, unsigned long long tail, unsigned long long head) {
+    size_t size = log->options.queueSize;
+    WriteBatch batch;
+    batch.count = 0;
+    batch.bytes = 0;
+    batch.records = 0;
+    batch.firstIndex = log->indexCount;
+
+    while (tail < head) {
+        size_t position = (size_t)(tail % size);
+        size_t toEnd = size - position;
+        const unsigned char *record = log->queue + position;
+
+        // The gap left when a record didn't fit before the end of the ring
+        if (toEnd < RECORD_HEADER_SIZE || getU32(record) == 0) {
+            tail += toEnd;
+            continue;
+        }
+
+        unsigned int length = getU32(record);
+        if (record[4] == RECORD_ROTATE) {
+            flushBatch(log, &batch, tail);
+            finishSegment(log);
+            startSegment(log);
+            tail += length;
+            batch.firstIndex = log->indexCount;
+            continue;
+        }
+
+        if (!log->segmentBroken) {
+            addIndexEntry(log, getU64(record + 8), record[4], log->segmentSize + batch.bytes);
+            summarizeRecord(log, record);
+            if (batch.count > 0 && (const unsigned char *)batch.parts[batch.count - 1] + batch.sizes[batch.count - 1] == record) {
+                batch.sizes[batch.count - 1] += length;     // Right behind the last one
+            } else {
+                batch.parts[batch.count] = record;
+                batch.sizes[batch.count] = length;
+                batch.count++;
+            }
+            batch.bytes += length;
+            batch.records++;
+        }
+        tail += length;
+
+        if (batch.count == WRITE_BATCH_PARTS) flushBatch(log, &batch, tail);
+    }
+    flushBatch(log, &batch, tail);
+}
+
+static int runWriter(void *argument) {
+    BinaryLog *log = argument;
+
+    while (1) {
+        // Read stopping first: anything queued before it was set is then
+        // guaranteed to be seen below
+        int stopping = atomic_load(&log->stopping);
+        unsigned long long head = atomic_load_explicit(&log->head, memory_order_acquire);
+        unsigned long long tail = atomic_load_explicit(&log->tail, memory_order_relaxed);
+
+        if (head != tail) {
+            writeQueued(log, tail, head);
+            if (log->options.syncPolicy == LOG_SYNC_EVERY_BATCH) syncSegment(log);
+        } else if (stopping) {
+            break;
+        }
+
+        if (log->options.syncPolicy == LOG_SYNC_PERIODIC &&
+            wallClockMillis() - log->lastSync >= (unsigned long long)log->options.syncInterval) {
+            syncSegment(log);
+        }
+
+        if (head == tail) waitEvent(log->dataReady, log->options.syncInterval > 0 ? log->options.syncInterval : 1000);
+    }
+
+    finishSegment(log);
+    return 0;
+}
+
+int openBinaryLog(BinaryLog *log, const char *prefix, const LogOptions *options) {
+    memset(log, 0, sizeof(*log));
+    snprintf(log->prefix, sizeof(log->prefix), "%s", prefix);
+    log->options = *options;
+    log->file = -1;
+    log->queuedSegmentSize = SEGMENT_HEADER_SIZE;
+    log->needKeyframe = 1;
+    atomic_init(&log->head, 0);
+    atomic_init(&log->tail, 0);
+    atomic_init(&log->stopping, 0);
+    atomic_init(&log->rotateRequested, 0);
+    atomic_init(&log->recordsWritten, 0);
+    atomic_init(&log->bytesWritten, 0);
+    atomic_init(&log->writeErrors, 0);
+    atomic_init(&log->syncs, 0);
+
+    // Carry on after the segments already there rather than overwrite them
+    unsigned int first, last;
+    if (findLogSegments(prefix, &first, &last)) {
+        log->firstSegmentNumber = first;
+        log->segmentNumber = last;
+    } else {
+        log->firstSegmentNumber = 1;
+    }
+
+    // The first segment is opened here so a bad path is reported now
+    if (startSegment(log) != 0) {
+        char path[256];
+        getSegmentPath(prefix, log->segmentNumber, path, sizeof(path));
+        printf("Can't create log file %s\n", path);
+        if (log->file >= 0) closeFile(log->file);
+        return -1;
+    }
+    log->lastSync = wallClockMillis();
+
+    log->queue = trackedAlloc(log->options.queueSize);
+    log->dataReady = createEvent();
+    log->spaceFreed = createEvent();
+    if (log->queue != NULL && log->dataReady != NULL && log->spaceFreed != NULL) {
+        log->writer = startThread(runWriter, log);
+    }
+    if (log->writer == NULL) {
+        printf("Can't start the log writer\n");
+        closeBinaryLog(log);
+        return -1;
+    }
+    return 0;
+}
+
+void closeBinaryLog(BinaryLog *log) {
+    if (log->writer != NULL) {
+        atomic_store(&log->stopping, 1);
+        signalEvent(log->dataReady);
+        joinThread(log->writer);
+        log->writer = NULL;
+    } else {
+        finishSegment(log);
+    }
+
+    if (log->dataReady != NULL) destroyEvent(log->dataReady);
+    if (log->spaceFreed != NULL) destroyEvent(log->spaceFreed);
+    trackedFree(log->queue);
+    trackedFree(log->index);
+    trackedFree(log->blocks);
+    log->dataReady = NULL;
+    log->spaceFreed = NULL;
+    log->queue = NULL;
+    log->index = NULL;
+    log->blocks = NULL;
+}
+
+
+// Reading
+
+// Walk the records of a segment that has no trailer
+static int scanRecords(LogSegment *segment) {
+    int capacity = 0;
+    size_t offset = SEGMENT_HEADER_SIZE;
+
+    while (offset + RECORD_HEADER_SIZE <= segment->size) {
+        const unsigned char *p = segment->data + offset;
+        unsigned int length = getU32(p);
+        if (length < RECORD_HEADER_SIZE || length > segment->size - offset) break;   // Cut short
+
+        if (segment->indexCount == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            LogIndexEntry *index = trackedRealloc(segment->index, (size_t)capacity * sizeof(LogIndexEntry));
+            if (index == NULL) return -1;
+            segment->index = index;
+        }
+
+        LogIndexEntry *entry = &segment->index[segment->indexCount++];
+        entry->timestamp = getU64(p + 8);
+        entry->offset = (unsigned int)offset;
+        entry->type = p[4];
+        offset += length;
+    }
+    return 0;
+}
+
+// Load the index written at the end of a closed segment. Returns 1 if
+// there is one.
+static int readTrailer(LogSegment *segment) {
+    if (segment->size < SEGMENT_HEADER_SIZE + OLD_TRAILER_SIZE) return 0;
+
+    const unsigned char *end = segment->data + segment->size;
+    if (memcmp(end - 8, TRAILER_MAGIC, 8) != 0) return 0;
+
+    unsigned int trailerSize = getU32(end - 12);
+    if (trailerSize < OLD_TRAILER_SIZE || trailerSize > segment->size - SEGMENT_HEADER_SIZE) return 0;
+    const unsigned char *trailer = end - trailerSize;
+
+    unsigned long long indexOffset = getU64(trailer);
+    unsigned int count = getU32(trailer + 8);
+    if (indexOffset + (unsigned long long)count * INDEX_ENTRY_SIZE > (unsigned long long)(trailer - segment->data)) return 0;
+
+    segment->index = trackedAlloc((count ? count : 1) * sizeof(LogIndexEntry));
+    if (segment->index == NULL) return 0;
+
+    const unsigned char *p = segment->data + indexOffset;
+    for (unsigned int i = 0; i < count; i++, p += INDEX_ENTRY_SIZE) {
+        segment->index[i].timestamp = getU64(p);
+        segment->index[i].offset = getU32(p + 8);
+        segment->index[i].type = p[12];
+    }
+    segment->indexCount = (int)count;
+
+    // The block summaries, if the segment has them
+    if (trailerSize < TRAILER_SIZE) return 1;
+    unsigned long long blocksOffset = getU64(trailer + 28);
+    unsigned int blockCount = getU32(trailer + 36);
+    if (blockCount == 0 ||
+        blocksOffset + (unsigned long long)blockCount * BLOCK_SUMMARY_SIZE > (unsigned long long)(trailer - segment->data)) {
+        return 1;
+    }
+    segment->blocks = trackedAlloc(blockCount * sizeof(LogBlockSummary));
+    if (segment->blocks == NULL) return 1;
+
+    p = segment->data + blocksOffset;
+    for (unsigned int i = 0; i < blockCount; i++, p += BLOCK_SUMMARY_SIZE) {
+        LogBlockSummary *block = &segment->blocks[i];
+        block->firstRecord = (int)getU32(p);
+        block->summarized = 1;
+        block->rows = getU32(p + 4);
+        memcpy(block->minLocalAddress, p + 8, 16);
+        memcpy(block->maxLocalAddress, p + 24, 16);
+        memcpy(block->minRemoteAddress, p + 40, 16);
+        memcpy(block->maxRemoteAddress, p + 56, 16);
+        block->minLocalPort = (unsigned short)getU16(p + 72);
+        block->maxLocalPort = (unsigned short)getU16(p + 74);
+        block->minRemotePort = (unsigned short)getU16(p + 76);
+        block->maxRemotePort = (unsigned short)getU16(p + 78);
+        block->minProgramId = getU32(p + 80);
+        block->maxProgramId = getU32(p + 84);
+        block->states = (unsigned short)getU16(p + 88);
+        block->protocols = p[90];
+        if (block->firstRecord >= segment->indexCount) {
+            // Doesn't go with this index; go without
+            trackedFree(segment->blocks);
+            segment->blocks = NULL;
+            return 1;
+        }
+    }
+    segment->blockCount = (int)blockCount;
+    return 1;
+}
+
+// Without summaries the blocks are still there, just with nothing known
+// about what's in them
+static int findBlocks(LogSegment *segment) {
+    int count = 0;
+    for (int i = 0; i < segment->indexCount; i++) count += segment->index[i].type == RECORD_KEYFRAME;
+
+    segment->blocks = trackedAlloc((count ? (size_t)count : 1) * sizeof(LogBlockSummary));
+    if (segment->blocks == NULL) return -1;
+    memset(segment->blocks, 0, (count ? (size_t)count : 1) * sizeof(LogBlockSummary));
+    for (int i = 0; i < segment->indexCount; i++) {
+        if (segment->index[i].type == RECORD_KEYFRAME) segment->blocks[segment->blockCount++].firstRecord = i;
+    }
+    return 0;
+}
+
+int openLogSegment(LogSegment *segment, const char *path) {
+    memset(segment, 0, sizeof(*segment));
+
+    segment->data = mapFile(path, &segment->size, &segment->mapping);
+    if (segment->data == NULL) return -1;
+
+    if (segment->size < SEGMENT_HEADER_SIZE || memcmp(segment->data, SEGMENT_MAGIC, 8) != 0) {
+        closeLogSegment(segment);
+        return -1;
+    }
+    segment->segmentNumber = getU32(segment->data + 8);
+
+    if ((!readTrailer(segment) && scanRecords(segment) != 0) ||
+        (segment->blocks == NULL && findBlocks(segment) != 0)) {
+        closeLogSegment(segment);
+        return -1;
+    }
+    return 0;
+}
+
+void closeLogSegment(LogSegment *segment) {
+    unmapFile(segment->data, segment->size, segment->mapping);
+    trackedFree(segment->index);
+    trackedFree(segment->blocks);
+    trackedFree(segment->programNames);
+    memset(segment, 0, sizeof(*segment));
+}
+
+int findLogRecord(const LogSegment *segment, unsigned long long time, int keyframe) {
+    // First record at or after time
+    int low = 0, high = segment->indexCount;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (segment->index[middle].timestamp < time) low = middle + 1;
+        else high = middle;
+    }
+    if (!keyframe) return low;
+
+    // The keyframe the table at that time has to be rebuilt from
+    int i = low < segment->indexCount && segment->index[low].timestamp == time ? low : low - 1;
+    while (i >= 0 && segment->index[i].type != RECORD_KEYFRAME) i--;
+    if (i >= 0) return i;
+
+    for (i = 0; i < segment->indexCount; i++) {
+        if (segment->index[i].type == RECORD_KEYFRAME) return i;
+    }
+    return segment->indexCount;
+}
+
+// Pass our own numbers for the names in a STRINGS record. A name number
+// no log could have (a damaged segment, or a hostile sender) is skipped
+// rather than grown to. Returns -1 if any name was skipped.
+static int loadStrings(LogSegment *segment, const unsigned char *body, unsigned int count, const unsigned char *end) {
+    int skipped = 0;
+    for (unsigned int i = 0; i < count && body + STRING_HEADER_SIZE <= end; i++) {
+        unsigned int id = getU32(body);
+        unsigned int length = getU16(body + 4);
+        body += STRING_HEADER_SIZE;
+        if (body + length > end) break;
+
+        if (id >= MAX_LOG_NAMES) {
+            skipped = 1;
+            body += length;
+            continue;
+        }
+        if (id >= segment->programNameCount) {
+            size_t newCount = segment->programNameCount ? segment->programNameCount : 64;
+            while (newCount <= id) newCount *= 2;
+            unsigned int *names = newCount <= (size_t)-1 / sizeof(unsigned int) ?
+                                  trackedRealloc(segment->programNames, newCount * sizeof(unsigned int)) : NULL;
+            if (names == NULL) return -1;
+            for (size_t n = segment->programNameCount; n < newCount; n++) names[n] = PROGRAM_NAME_UNKNOWN;
+            segment->programNames = names;
+            segment->programNameCount = (unsigned int)newCount;
+        }
+
+        char text[MAX_NAME_LENGTH];
+        size_t copy = length < sizeof(text) ? length : sizeof(text) - 1;
+        memcpy(text, body, copy);
+        text[copy] = '\0';
+        segment->programNames[id] = internProgramName(text);
+        body += length;
+    }
+    return skipped ? -1 : 0;
+}
+
+int parseLogRecord(const unsigned char *p, size_t size, LogRecord *record) {
+    if (size < RECORD_HEADER_SIZE) return -1;
+    unsigned int length = getU32(p);
+    if (length < RECORD_HEADER_SIZE || length > size) return -1;
+
+    record->type = p[4];
+    record->rowSize = getU16(p + 6);
+    record->timestamp = getU64(p + 8);
+    record->count = getU32(p + 16);
+    record->connectionCount = getU32(p + 20);
+    record->body = p + RECORD_HEADER_SIZE;
+    record->bodySize = length - RECORD_HEADER_SIZE;
+
+    // A reader from before a field was added can still step over rows
+    // written with it, but not rows smaller than it knows
+    unsigned int minimum = record->type == RECORD_KEYFRAME ? ROW_SIZE : record->type == RECORD_DELTA ? EVENT_SIZE :
+                           record->type == RECORD_ALERT ? ALERT_SIZE :
+                           record->type == RECORD_INTERFACES ? INTERFACE_SIZE : 0;
+    if (record->rowSize < minimum) return -1;
+    if (minimum > 0 && (unsigned long long)record->count * record->rowSize > record->bodySize) return -1;
+    return 0;
+}
+
+// Check a record's header against the segment
+static int decodeRecord(const LogSegment *segment, int i, LogRecord *record) {
+    if (i < 0 || i >= segment->indexCount) return -1;
+
+    unsigned int offset = segment->index[i].offset;
+    if (offset > segment->size) return -1;
+    return parseLogRecord(segment->data + offset, segment->size - offset, record);
+}
+
+int addLogRecordStrings(LogSegment *segment, const LogRecord *record) {
+    if (record->type != RECORD_STRINGS) return 0;
+    return loadStrings(segment, record->body, record->count, record->body + record->bodySize);
+}
+
+// Names can only come from STRINGS records before position end
+static void loadStringsBefore(LogSegment *segment, int end) {
+    for (; segment->namesLoaded < end; segment->namesLoaded++) {
+        LogRecord strings;
+        if (segment->index[segment->namesLoaded].type != RECORD_STRINGS) continue;
+        if (decodeRecord(segment, segment->namesLoaded, &strings) != 0) continue;
+        loadStrings(segment, strings.body, strings.count, strings.body + strings.bodySize);
+    }
+}
+
+int readLogRecord(LogSegment *segment, int i, LogRecord *record) {
+    if (decodeRecord(segment, i, record) != 0) return -1;
+    loadStringsBefore(segment, i + 1);
+    return 0;
+}
+
+void loadLogStrings(LogSegment *segment) {
+    loadStringsBefore(segment, segment->indexCount);
+}
+
+static void decodeRow(const LogSegment *segment, const unsigned char *p, NetworkConnection *connection) {
+    memcpy(connection->localAddress, p, 16);
+    memcpy(connection->remoteAddress, p + 16, 16);
+    connection->localPort = (unsigned short)getU16(p + 32);
+    connection->remotePort = (unsigned short)getU16(p + 34);
+    connection->family = p[36];
+    connection->protocol = p[37];
+    connection->state = p[38];
+    connection->programId = getU32(p + 40);
+
+    unsigned int name = getU32(p + 44);
+    connection->programName = name < segment->programNameCount ? segment->programNames[name] : PROGRAM_NAME_UNKNOWN;
+}
+
+void getLogRecordRow(const LogSegment *segment, const LogRecord *record, unsigned int n, NetworkConnection *connection) {
+    decodeRow(segment, record->body + (size_t)n * record->rowSize, connection);
+}
+
+void getLogRecordEvent(const LogSegment *segment, const LogRecord *record, unsigned int n, ConnectionEvent *event) {
+    const unsigned char *p = record->body + (size_t)n * record->rowSize;
+    event->type = p[0];
+    event->oldState = p[1];
+    decodeRow(segment, p + 4, &event->connection);
+}
+
+void getLogRecordAlert(const LogRecord *record, unsigned int n, AnomalyAlert *alert) {
+    const unsigned char *p = record->body + (size_t)n * record->rowSize;
+    alert->timestamp = record->timestamp;
+    alert->type = p[0];
+    alert->key = p[1];
+    alert->family = p[2];
+    alert->protocol = p[3];
+    memcpy(alert->address, p + 4, 16);
+    alert->port = (unsigned short)getU16(p + 20);
+    alert->value = getU32(p + 24);
+    alert->baseline = getU32(p + 28);
+    alert->threshold = getU32(p + 32);
+}
+
+void getLogRecordInterface(const LogRecord *record, unsigned int n, InterfaceCounters *counters, unsigned int *millis) {
+    const unsigned char *p = record->body + (size_t)n * record->rowSize;
+    memset(counters, 0, sizeof(*counters));
+    memcpy(counters->name, p, MAX_INTERFACE_NAME - 1);
+    *millis = getU32(p + 32);
+    for (int counter = 0; counter < INTERFACE_COUNTER_COUNT; counter++) counters->change[counter] = getU64(p + 40 + counter * 8);
+}
@@ -0,0 +1,255 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include "snapshot.h"
+#include "diff.h"
+#include "anomaly.h"
+#include "platform.h"
+
+// The connection log is a series of binary segment files
+// (network_monitoring_log.000001.nml, .000002.nml, ...). A segment is:
+//
+//   header    "NMLOG01\0", segment number, header size, creation time
+//   records   each one: length, type, row size, timestamp, count, body
+//   index     one entry (timestamp, offset, type) per record
+//   blocks    min/max of the rows of each block (a keyframe and the deltas
+//             after it), for queries to skip by
+//   trailer   where the index and blocks are, first/last timestamp,
+//             "NMINDEX\0"
+//
+// Records are a KEYFRAME (the whole table), a DELTA (just the events since
+// the record before), STRINGS (program names used by later records),
+// ALERT (what the anomaly detector raised) or INTERFACES (how much each
+// network interface sent, received, and dropped since the refresh before).
+// Every segment starts with a keyframe and another one is written every
+// LOG_KEYFRAME_EVERY records, so a reader can jump to any time by finding
+// the keyframe before it in the index and replaying a few deltas.
+//
+// Records are written by a background thread (see BinaryLog below).
+// The index and trailer are written when a segment is closed. A segment
+// that was never closed (the live one, or after a crash) is still
+// readable, the reader just builds the index by walking the records.
+// All numbers are little-endian.
+
+#define LOG_FILE_PREFIX "network_monitoring_log"
+#define LOG_SEGMENT_SIZE (64u * 1024 * 1024)    // Start a new segment after this many bytes
+#define LOG_KEEP_SEGMENTS 100                   // Delete the oldest segments beyond this
+#define LOG_KEYFRAME_EVERY 60                   // Records between keyframes
+#define LOG_QUEUE_SIZE (32u * 1024 * 1024)      // Encoded records waiting for the writer
+#define LOG_SYNC_INTERVAL 1000                  // Milliseconds between fsyncs
+
+typedef enum {
+    RECORD_KEYFRAME = 1,
+    RECORD_DELTA = 2,
+    RECORD_STRINGS = 3,
+    RECORD_ALERT = 4,
+    RECORD_INTERFACES = 5
+} LogRecordType;
+
+typedef struct {
+    unsigned long long timestamp;   // Milliseconds since 1970
+    unsigned int offset;            // Where the record starts in the segment
+    unsigned char type;             // LogRecordType
+} LogIndexEntry;
+
+// What the rows and events of one block (a keyframe and the deltas up to
+// the next keyframe) hold, as ranges. A query whose filter can't match
+// anything inside the ranges skips the block without decoding it.
+typedef struct {
+    int firstRecord;                // Index position of the keyframe
+    int summarized;                 // 0 = nothing known (the segment was never closed)
+    unsigned int rows;              // Rows and events in the block
+    unsigned char minLocalAddress[16], maxLocalAddress[16];     // Compared as 128-bit numbers
+    unsigned char minRemoteAddress[16], maxRemoteAddress[16];
+    unsigned short minLocalPort, maxLocalPort;
+    unsigned short minRemotePort, maxRemotePort;
+    unsigned int minProgramId, maxProgramId;
+    unsigned short states;          // Bit per ConnectionState
+    unsigned char protocols;        // Bit per ConnectionProtocol
+} LogBlockSummary;
+
+// What to do with a record when the writer has fallen so far behind that
+// the queue is full
+typedef enum {
+    LOG_DROP_WHEN_FULL,     // Throw it away (the next record is a keyframe); sampling never waits
+    LOG_BLOCK_WHEN_FULL     // Wait for room; nothing is lost but a slow disk slows the refresh
+} LogFullPolicy;
+
+typedef enum {
+    LOG_SYNC_NEVER,         // Leave it to the OS
+    LOG_SYNC_PERIODIC,      // fsync every syncInterval milliseconds
+    LOG_SYNC_EVERY_BATCH    // fsync after every write
+} LogSyncPolicy;
+
+typedef struct {
+    unsigned long long segmentLimit;
+    int keepSegments;
+    size_t queueSize;
+    LogFullPolicy fullPolicy;
+    LogSyncPolicy syncPolicy;
+    int syncInterval;
+} LogOptions;
+
+void getDefaultLogOptions(LogOptions *options);
+
+typedef struct {
+    unsigned long long recordsQueued;
+    unsigned long long recordsDropped;  // Queue full, or too big for it
+    unsigned long long recordsWritten;
+    unsigned long long bytesWritten;
+    unsigned long long writeErrors;
+    unsigned long long syncs;
+    size_t queueUsed;
+    size_t queueSize;
+} LogStats;
+
+// The refresh loop encodes records straight into a ring buffer and a
+// writer thread takes them out and writes them, several records to one
+// writev. The ring has one producer and one consumer, so it only needs
+// the two atomic positions: head is moved by the refresh loop, tail by
+// the writer. The refresh loop never touches the file, so a slow or full
+// disk can't hold up sampling or the screen.
+typedef struct {
+    char prefix[200];
+    LogOptions options;
+
+    // Refresh loop side
+    unsigned long long queuedSegmentSize;   // Bytes sent to the current segment
+    int recordsSinceKeyframe;
+    int needKeyframe;                       // A record was dropped, so the deltas have a gap
+    unsigned int stringsWritten;            // Program names already in this segment
+    unsigned long long recordsQueued;
+    unsigned long long recordsDropped;
+
+    // The queue
+    unsigned char *queue;
+    atomic_ullong head;                     // Total bytes ever queued
+    atomic_ullong tail;                     // Total bytes ever taken out
+    atomic_int stopping;
+    atomic_int rotateRequested;             // The writer wants a fresh segment after an error
+    Event *dataReady;                       // Signalled by the refresh loop
+    Event *spaceFreed;                      // Signalled by the writer
+    Thread *writer;
+
+    // Writer side
+    int file;
+    int segmentBroken;                      // A write failed; skip records until the next segment
+    int unsynced;                           // Written to since the last fsync
+    unsigned int segmentNumber;
+    unsigned int firstSegmentNumber;        // Oldest segment still on disk
+    unsigned long long segmentSize;         // Bytes written to the open segment
+    unsigned long long lastSync;
+    LogIndexEntry *index;                   // Records in the open segment
+    int indexCount;
+    int indexCapacity;
+    LogBlockSummary *blocks;                // Blocks in the open segment, the last one still growing
+    int blockCount;
+    int blockCapacity;
+    atomic_ullong recordsWritten;
+    atomic_ullong bytesWritten;
+    atomic_ullong writeErrors;
+    atomic_ullong syncs;
+} BinaryLog;
+
+int openBinaryLog(BinaryLog *log, const char *prefix, const LogOptions *options);
+
+// Waits for the writer to write everything queued, then closes the segment
+void closeBinaryLog(BinaryLog *log);
+
+// Add this refresh to the log: a keyframe when diff is NULL, when a new
+// segment starts, or when one is due (after the diff's events, so none
+// are missing from the log); otherwise just the diff's events. A refresh
+// with no events writes nothing. Returns -1 if the record was dropped.
+int appendToLog(BinaryLog *log, const ConnectionSnapshot *snapshot, const ConnectionDiff *diff);
+
+// Add the alerts raised this refresh, as one ALERT record. Call it after
+// appendToLog, so a new segment still starts with its keyframe.
+int appendAlertsToLog(BinaryLog *log, const AnomalyAlert *alerts, int count);
+
+// Add the interfaces' changes since the refresh before (the ones with
+// any), as one INTERFACES record. Also after appendToLog.
+int appendInterfacesToLog(BinaryLog *log, const ConnectionSnapshot *snapshot);
+
+void getLogStats(BinaryLog *log, LogStats *stats);
+
+// The records on their own, for sending elsewhere (the fleet agent).
+// Each returns the record's length, and writes it only if that fits in
+// capacity, so a first call with capacity 0 sizes the buffer.
+size_t encodeKeyframeRecord(unsigned char *record, size_t capacity, const ConnectionSnapshot *snapshot,
+                            unsigned long long timestamp);
+size_t encodeDeltaRecord(unsigned char *record, size_t capacity, const ConnectionDiff *diff, int connectionCount,
+                         unsigned long long timestamp);
+
+// Program names first to total - 1 (see getProgramNameCount)
+size_t encodeStringsRecord(unsigned char *record, size_t capacity, unsigned int first, unsigned int total,
+                           unsigned long long timestamp);
+
+// Reading. A segment is mapped into memory, so jumping to a time is a
+// binary search over the index and nothing before it is read.
+typedef struct {
+    unsigned char type;             // LogRecordType
+    unsigned long long timestamp;
+    unsigned int count;             // Rows or events in the record
+    unsigned int connectionCount;   // Size of the table after this record
+    const unsigned char *body;
+    unsigned int bodySize;
+    unsigned int rowSize;           // Bytes per row/event in the body
+} LogRecord;
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    void *mapping;                  // Platform handle for unmapping
+    unsigned int segmentNumber;
+    LogIndexEntry *index;
+    int indexCount;
+    LogBlockSummary *blocks;        // One per keyframe, in order
+    int blockCount;
+    unsigned int *programNames;     // This segment's name numbers -> ours
+    unsigned int programNameCount;
+    int namesLoaded;                // Index positions already checked for STRINGS
+} LogSegment;
+
+// Path of segment number n
+void getSegmentPath(const char *prefix, unsigned int number, char *path, size_t pathSize);
+
+// The oldest and newest segment numbers on disk. Returns 0 if there are none.
+int findLogSegments(const char *prefix, unsigned int *first, unsigned int *last);
+
+int openLogSegment(LogSegment *segment, const char *path);
+
+// Check the record at the front of size bytes. The record points into them.
+int parseLogRecord(const unsigned char *p, size_t size, LogRecord *record);
+
+// Take the names from a STRINGS record that came from somewhere else. A
+// zeroed LogSegment with no file does as a name map for such records, and
+// closeLogSegment frees it. Returns -1 if a name number was out of range
+// or there was no memory for it.
+int addLogRecordStrings(LogSegment *segment, const LogRecord *record);
+void closeLogSegment(LogSegment *segment);
+
+// First index position with timestamp >= time (indexCount if none). With
+// keyframe set, backs up to the keyframe at or before that record instead.
+int findLogRecord(const LogSegment *segment, unsigned long long time, int keyframe);
+
+// Decode the record at index position i. Program names from the STRINGS
+// records before it are loaded as needed.
+int readLogRecord(LogSegment *segment, int i, LogRecord *record);
+
+// Load all the program names the segment has. After that, records can be
+// read from several threads at once.
+void loadLogStrings(LogSegment *segment);
+
+// Decode row/event n of a KEYFRAME/DELTA record
+void getLogRecordRow(const LogSegment *segment, const LogRecord *record, unsigned int n, NetworkConnection *connection);
+void getLogRecordEvent(const LogSegment *segment, const LogRecord *record, unsigned int n, ConnectionEvent *event);
+
+// Decode alert n of an ALERT record
+void getLogRecordAlert(const LogRecord *record, unsigned int n, AnomalyAlert *alert);
+
+// Decode interface n of an INTERFACES record: its changes, over millis
+void getLogRecordInterface(const LogRecord *record, unsigned int n, InterfaceCounters *counters, unsigned int *millis);
+
+#endif
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <string.h>
+#include "collector.h"
+#include "platform.h"
+
+// The source getNetworkConnections reads from
+static ConnectionSource *activeSource = NULL;
+
+// What setCollectorFilter was given, copied
+static ConnectionFilter collectorFilter;
+static int filtering = 0;
+static unsigned int filterVersion = 0;
+
+ConnectionSource *createConnectionSource(const char *name) {
+    if (name == NULL) {
+        // Try the fastest source first and fall back to the slower ones
+        ConnectionSource *source = createWindowsSource();
+        if (source == NULL) source = createNetlinkSource();
+        if (source == NULL) source = createProcfsSource();
+        return source;
+    }
+
+    if (strcmp(name, "windows") == 0) return createWindowsSource();
+    if (strcmp(name, "netlink") == 0) return createNetlinkSource();
+    if (strcmp(name, "procfs") == 0) return createProcfsSource();
+    if (strcmp(name, "netns") == 0) return createNamespaceSource();
+    if (strcmp(name, "events") == 0) return createEventSource();
+    return NULL;
+}
+
+void destroyConnectionSource(ConnectionSource *source) {
+    if (source == NULL) return;
+    if (activeSource == source) activeSource = NULL;
+    source->destroy(source);
+}
+
+void setConnectionSource(ConnectionSource *source) {
+    activeSource = source;
+}
+
+ConnectionSource *getConnectionSource() {
+    return activeSource;
+}
+
+// Get all network connections (both TCP and UDP)
+void getNetworkConnections(ConnectionSnapshot *snapshot) {
+    clearSnapshot(snapshot);
+
+    if (activeSource == NULL) {
+        printf("Error: No connection source selected\n");
+        return;
+    }
+
+    snapshot->collectedAt = monotonicMillis();
+    if (activeSource->collect(activeSource, snapshot) != 0) {
+        printf("Error: Could not read connections from %s\n", activeSource->name);
+    }
+    // The interfaces come along with the sockets, so both are as of the same moment
+    collectInterfaces(snapshot);
+    if (snapshot->droppedCount > 0) {
+        printf("Error: Out of memory, %d connections were left out\n", snapshot->droppedCount);
+    }
+}
+
+void setCollectorFilter(const ConnectionFilter *filter) {
+    filtering = filter != NULL;
+    if (filter != NULL) collectorFilter = *filter;
+    filterVersion++;
+}
+
+const ConnectionFilter *getCollectorFilter(unsigned int *version) {
+    *version = filterVersion;
+    return filtering ? &collectorFilter : NULL;
+}
+
+// Linux TCP state numbers from include/net/tcp_states.h
+ConnectionState getLinuxTcpState(int state) {
+    switch (state) {
+        case 1: return STATE_ESTABLISHED;
+        case 2: return STATE_SYN_SENT;
+        case 3: return STATE_SYN_RCVD;
+        case 4: return STATE_FIN_WAIT1;
+        case 5: return STATE_FIN_WAIT2;
+        case 6: return STATE_TIME_WAIT;
+        case 7: return STATE_CLOSED;
+        case 8: return STATE_CLOSE_WAIT;
+        case 9: return STATE_LAST_ACK;
+        case 10: return STATE_LISTENING;
+        case 11: return STATE_CLOSING;
+        case 12: return STATE_SYN_RCVD;   // TCP_NEW_SYN_RECV
+        default: return STATE_UNKNOWN;
+    }
+}
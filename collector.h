@@ -0,0 +1,98 @@
+#ifndef COLLECTOR_H
+#define COLLECTOR_H
+
+#include <stddef.h>
+#include "network_monitoring.h"
+#include "snapshot.h"
+#include "filter.h"
+#include "socket_owners.h"
+
+// A connection source knows how to read the socket table from one place
+// (the Windows IP Helper API, Linux netlink, or the /proc/net files).
+// getNetworkConnections goes through whichever source is active, so the
+// rest of the program doesn't care where the rows came from.
+typedef struct ConnectionSource ConnectionSource;
+
+struct ConnectionSource {
+    const char *name;
+
+    // Add this source's rows to the end of the snapshot. Returns 0 on
+    // success or -1 if the source could not be read at all.
+    int (*collect)(ConnectionSource *source, ConnectionSnapshot *snapshot);
+
+    void (*destroy)(ConnectionSource *source);
+};
+
+// Each create function returns NULL when the source is not available on
+// this system (wrong platform, missing kernel support, no permission)
+ConnectionSource *createWindowsSource();
+ConnectionSource *createNetlinkSource();
+ConnectionSource *createProcfsSource();
+ConnectionSource *createNamespaceSource();
+ConnectionSource *createEventSource();
+
+// Create a source by name ("windows", "netlink", "procfs", "netns",
+// "events"), or the best one available when name is NULL
+ConnectionSource *createConnectionSource(const char *name);
+void destroyConnectionSource(ConnectionSource *source);
+
+void setConnectionSource(ConnectionSource *source);
+ConnectionSource *getConnectionSource();
+
+void getNetworkConnections(ConnectionSnapshot *snapshot);
+
+// The rows the user wants, for sources that can have the kernel leave the
+// rest out before anything is copied (netlink and netns). Only part of a
+// filter may be pushed down, so the rows that come back still go through
+// applyFilter. NULL (the default) collects everything. version goes up
+// with every change, so sources only rebuild what they send when it does.
+void setCollectorFilter(const ConnectionFilter *filter);
+const ConnectionFilter *getCollectorFilter(unsigned int *version);
+
+// Add every network interface's counters to the snapshot: rtnetlink
+// RTM_GETLINK (the 64-bit stats) on Linux, /proc/net/dev when that can't
+// be had, GetIfTable2 on Windows. getNetworkConnections does this after
+// the sockets, in the same refresh, with the snapshot's own memory.
+// Returns -1 if there are no counters to be had.
+int collectInterfaces(ConnectionSnapshot *snapshot);
+
+// Parse the text of /proc/net/dev, like parseProcNetTable
+void parseProcNetDev(const char *text, size_t length, ConnectionSnapshot *snapshot);
+
+// Parse the text of /proc/net/tcp, tcp6, udp or udp6. Kept separate from
+// the file reading so it can be fed canned text. owners (if not NULL)
+// fills in the process for each socket inode.
+void parseProcNetTable(const char *text, size_t length, AddressFamily family, ConnectionProtocol protocol,
+                       SocketOwners *owners, ConnectionSnapshot *snapshot);
+
+// One NETLINK_SOCK_DIAG socket and its receive buffer. A netlink socket
+// stays in the network namespace it was opened in, so the namespace
+// source keeps one per namespace. NULL when sock_diag isn't available.
+typedef struct NetlinkDumper NetlinkDumper;
+NetlinkDumper *openNetlinkDumper();
+void closeNetlinkDumper(NetlinkDumper *dumper);
+
+// Have this dumper's dumps ask only for sockets the filter can match: a
+// state mask per protocol, protocols left out, and ports and networks as
+// an inet_diag bytecode program. Rebuilt only when version changes.
+void setDumperFilter(NetlinkDumper *dumper, const ConnectionFilter *filter, unsigned int version);
+
+// Add every TCP and UDP socket the dumper can see to the snapshot. With
+// owners NULL the process is left for later, going by the socketInode
+// column. Returns -1 if none of the tables could be read.
+int dumpSocketTables(NetlinkDumper *dumper, SocketOwners *owners, ConnectionSnapshot *snapshot);
+
+// Turn one inet_diag message (a struct nlmsghdr: a dump reply, or the
+// notice the kernel sends when a socket is destroyed) into a row, with no
+// process yet. Returns 1 if it carried TCP counters, put in metrics.
+int decodeDiagMessage(const void *message, ConnectionProtocol protocol, NetworkConnection *connection,
+                      unsigned long long *inode, ConnectionMetrics *metrics);
+
+// Turn a Linux kernel TCP state (the numbers in /proc/net/tcp and in
+// inet_diag replies) into ours
+ConnectionState getLinuxTcpState(int state);
+
+// UDP sockets that aren't connected report TCP_CLOSE on Linux
+#define LINUX_UDP_UNCONNECTED 7
+
+#endif
@@ -0,0 +1,497 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "collector.h"
+#include "string_table.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include "platform.h"
+
+#define EVENT_BUFFER_SIZE (64 * 1024)
+#define EVENT_SOCKET_BUFFER (8 * 1024 * 1024)   // Kernel-side queue of notices between refreshes
+#define EVENT_RECONCILE_INTERVAL 5000           // Milliseconds between full dumps when conntrack says what opened
+#define MAX_LOCAL_ADDRESSES 64
+
+// Polling only sees the table at each refresh, so a connection that opens
+// and closes in between never shows up, and that is just what a connection
+// storm is made of. This source listens for the kernel's notices instead:
+// sock_diag sends one for every TCP and UDP socket destroyed (Linux 4.2,
+// needs CAP_NET_ADMIN), with its last state and counters, and conntrack
+// (when netfilter is tracking connections) sends one when a connection
+// opens, changes state or ends. The notices are kept in the sockets'
+// receive buffers and read at each refresh, so between refreshes we use
+// no CPU at all.
+//
+// A socket that was destroyed before any snapshot had it is put into the
+// next one, once, with its last state, so the diff and the log see it open
+// and close like any other. Full sock_diag dumps are still done to put
+// things right (states and counters conntrack doesn't have, sockets it
+// doesn't see, notices the kernel dropped): at every refresh when there is
+// no conntrack, since nothing else says what opened, and otherwise every
+// EVENT_RECONCILE_INTERVAL, and straight away when a buffer overflowed.
+typedef struct {
+    NetworkConnection connection;
+    ConnectionMetrics metrics;
+    unsigned long long inode;
+    unsigned char alive;
+    unsigned char shown;            // Has been in a snapshot
+    unsigned char hasMetrics;
+} TrackedSocket;
+
+typedef struct {
+    ConnectionSource base;
+    NetlinkDumper *dumper;          // For the full dumps
+    SocketOwners owners;
+    int tcpEvents;                  // sock_diag destroy notices, a socket per protocol
+    int udpEvents;                  // (the notice itself doesn't say which)
+    int flowEvents;                 // conntrack, -1 without it
+    char *buffer;
+
+    // What we think is open. Rows that close stay in the array, not alive,
+    // until the next dump builds it again, so the index never deletes.
+    TrackedSocket *sockets;
+    int socketCount;
+    int socketCapacity;
+    ConnectionIndex index;          // 5-tuple -> socket + 1
+
+    TrackedSocket *closed;          // Gone before any snapshot had them
+    int closedCount;
+    int closedCapacity;
+
+    // From the last dump, to tell which end of a conntrack flow is ours
+    unsigned char listening[2][65536 / 8];      // Port bits for TCP and UDP
+    unsigned char localAddresses[MAX_LOCAL_ADDRESSES][16];
+    int localAddressCount;
+
+    unsigned long long lastDump;
+    int dumpNeeded;                 // First refresh, or the kernel dropped notices
+} EventSource;
+
+// The slot a connection is in, or the empty one where it would go
+static unsigned int *findSlot(EventSource *events, const NetworkConnection *connection) {
+    return findConnectionSlot(&events->index, connection, &events->sockets->connection, sizeof(TrackedSocket));
+}
+
+// Room for count sockets, with the index at most half full
+static int reserveSockets(EventSource *events, int count) {
+    if (count <= events->socketCapacity) return 0;
+    int newCapacity = events->socketCapacity ? events->socketCapacity : 1024;
+    while (newCapacity < count) newCapacity *= 2;
+
+    TrackedSocket *sockets = trackedRealloc(events->sockets, (size_t)newCapacity * sizeof(TrackedSocket));
+    if (sockets == NULL) return -1;
+    events->sockets = sockets;
+    if (resizeConnectionIndex(&events->index, newCapacity, &sockets->connection, sizeof(TrackedSocket),
+                              events->socketCount) != 0) {
+        return -1;
+    }
+    events->socketCapacity = newCapacity;
+    return 0;
+}
+
+static void setMetrics(TrackedSocket *socket, const ConnectionMetrics *metrics) {
+    socket->hasMetrics = metrics != NULL;
+    if (metrics != NULL) socket->metrics = *metrics;
+    else memset(&socket->metrics, 0, sizeof(socket->metrics));
+}
+
+// A socket that opened or changed. Keeps the process we already know.
+static void trackOpened(EventSource *events, const NetworkConnection *connection) {
+    if (events->index.slotCount == 0 || events->socketCount == events->socketCapacity) {
+        if (reserveSockets(events, events->socketCount + 1) != 0) return;
+    }
+    unsigned int *slot = findSlot(events, connection);
+    if (*slot == 0) {
+        TrackedSocket *socket = &events->sockets[events->socketCount];
+        memset(socket, 0, sizeof(*socket));
+        socket->connection = *connection;
+        *slot = (unsigned int)++events->socketCount;
+    }
+    TrackedSocket *socket = &events->sockets[*slot - 1];
+    if (!socket->alive) socket->shown = 0;
+    socket->alive = 1;
+    socket->connection.state = connection->state;
+}
+
+// A socket that is gone. If no snapshot had it yet, the next one gets it.
+// Conntrack only ends a flow long after the socket closed, so for it
+// (unknown set to 0) a connection we don't know is left alone.
+static void trackClosed(EventSource *events, const NetworkConnection *connection, unsigned long long inode,
+                        const ConnectionMetrics *metrics, int unknown) {
+    TrackedSocket *socket = NULL;
+    if (events->index.slotCount > 0) {
+        unsigned int slot = *findSlot(events, connection);
+        if (slot != 0) socket = &events->sockets[slot - 1];
+    }
+    if (socket == NULL && !unknown) return;
+    if (socket != NULL) {
+        if (!socket->alive) return;     // Heard about already
+        socket->alive = 0;
+        if (socket->shown) return;
+    }
+
+    if (events->closedCount == events->closedCapacity) {
+        int newCapacity = events->closedCapacity ? events->closedCapacity * 2 : 256;
+        TrackedSocket *closed = trackedRealloc(events->closed, (size_t)newCapacity * sizeof(TrackedSocket));
+        if (closed == NULL) return;
+        events->closed = closed;
+        events->closedCapacity = newCapacity;
+    }
+    TrackedSocket *gone = &events->closed[events->closedCount++];
+    memset(gone, 0, sizeof(*gone));
+    gone->connection = *connection;
+    gone->inode = inode;
+    if (socket != NULL) {
+        // Conntrack saw it open; the process may be known from the inode
+        gone->connection.programId = socket->connection.programId;
+        gone->connection.programName = socket->connection.programName;
+    }
+    setMetrics(gone, metrics);
+}
+
+// A socket that closed into TIME_WAIT is destroyed, but the kernel keeps a
+// smaller one in its place that the next dump still shows. Only conntrack
+// can tell us that happened.
+static int inTimeWait(EventSource *events, const NetworkConnection *connection) {
+    if (events->index.slotCount == 0) return 0;
+    unsigned int slot = *findSlot(events, connection);
+    return slot != 0 && events->sockets[slot - 1].alive && events->sockets[slot - 1].connection.state == STATE_TIME_WAIT;
+}
+
+// Read every sock_diag destroy notice waiting. Returns -1 if the kernel
+// had to drop some.
+static int readDestroyNotices(EventSource *events, int socket, ConnectionProtocol protocol) {
+    while (1) {
+        ssize_t length = recv(socket, events->buffer, EVENT_BUFFER_SIZE, MSG_DONTWAIT);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            return errno == ENOBUFS ? -1 : 0;
+        }
+
+        struct nlmsghdr *header = (struct nlmsghdr *)events->buffer;
+        for (; NLMSG_OK(header, (unsigned int)length); header = NLMSG_NEXT(header, length)) {
+            if (header->nlmsg_type != SOCK_DIAG_BY_FAMILY) continue;
+            NetworkConnection connection;
+            ConnectionMetrics metrics;
+            unsigned long long inode;
+            int hasMetrics = decodeDiagMessage(header, protocol, &connection, &inode, &metrics);
+            if (inTimeWait(events, &connection)) continue;
+            trackClosed(events, &connection, inode, hasMetrics ? &metrics : NULL, 1);
+        }
+    }
+}
+
+// Conntrack messages are nested attributes: find one by type
+static const struct nlattr *findAttribute(const void *data, int length, int type) {
+    const struct nlattr *attribute = data;
+    while (length >= NLA_HDRLEN && attribute->nla_len >= NLA_HDRLEN && attribute->nla_len <= length) {
+        if ((attribute->nla_type & NLA_TYPE_MASK) == type) return attribute;
+        int step = NLA_ALIGN(attribute->nla_len);
+        length -= step;
+        attribute = (const struct nlattr *)((const char *)attribute + step);
+    }
+    return NULL;
+}
+
+static const struct nlattr *findNested(const struct nlattr *parent, int type) {
+    if (parent == NULL) return NULL;
+    return findAttribute((const char *)parent + NLA_HDRLEN, parent->nla_len - NLA_HDRLEN, type);
+}
+
+static const void *attributeData(const struct nlattr *attribute, int size) {
+    if (attribute == NULL || attribute->nla_len < NLA_HDRLEN + size) return NULL;
+    return (const char *)attribute + NLA_HDRLEN;
+}
+
+static int isListening(const EventSource *events, ConnectionProtocol protocol, unsigned short port) {
+    return (events->listening[protocol == PROTOCOL_UDP][port / 8] >> (port % 8)) & 1;
+}
+
+static int isLocalAddress(const EventSource *events, const unsigned char address[16]) {
+    for (int i = 0; i < events->localAddressCount; i++) {
+        if (memcmp(events->localAddresses[i], address, 16) == 0) return 1;
+    }
+    return 0;
+}
+
+// Conntrack's TCP states are for the whole flow; near enough for either
+// end, apart from the handshake
+static ConnectionState getFlowState(int state, int incoming) {
+    switch (state) {
+        case 1: return incoming ? STATE_SYN_RCVD : STATE_SYN_SENT;     // TCP_CONNTRACK_SYN_SENT
+        case 2: return incoming ? STATE_SYN_RCVD : STATE_SYN_SENT;     // SYN_RECV
+        case 3: return STATE_ESTABLISHED;
+        case 4: return STATE_FIN_WAIT1;
+        case 5: return STATE_CLOSE_WAIT;
+        case 6: return STATE_LAST_ACK;
+        case 7: return STATE_TIME_WAIT;
+        case 8: return STATE_CLOSED;
+        case 9: return STATE_SYN_SENT;                                  // SYN_SENT2
+        default: return STATE_UNKNOWN;
+    }
+}
+
+// One conntrack notice. A flow only says who started it, so it is ours
+// going in when its destination port is one we listen on, and going out
+// when its source is one of our addresses. Forwarded flows are neither.
+static void readFlow(EventSource *events, const struct nlmsghdr *header) {
+    int type = header->nlmsg_type & 0xFF;
+    if ((header->nlmsg_type >> 8) != NFNL_SUBSYS_CTNETLINK) return;
+    if (type != IPCTNL_MSG_CT_NEW && type != IPCTNL_MSG_CT_DELETE) return;
+
+    int length = (int)header->nlmsg_len - NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    if (length <= 0) return;
+    const struct nfgenmsg *message = NLMSG_DATA(header);
+    const void *attributes = (const char *)NLMSG_DATA(header) + NLMSG_ALIGN(sizeof(struct nfgenmsg));
+
+    const struct nlattr *tuple = findAttribute(attributes, length, CTA_TUPLE_ORIG);
+    const struct nlattr *ip = findNested(tuple, CTA_TUPLE_IP);
+    const struct nlattr *proto = findNested(tuple, CTA_TUPLE_PROTO);
+    const unsigned char *number = attributeData(findNested(proto, CTA_PROTO_NUM), 1);
+    const unsigned short *sourcePort = attributeData(findNested(proto, CTA_PROTO_SRC_PORT), 2);
+    const unsigned short *destinationPort = attributeData(findNested(proto, CTA_PROTO_DST_PORT), 2);
+    if (number == NULL || sourcePort == NULL || destinationPort == NULL) return;
+    if (*number != IPPROTO_TCP && *number != IPPROTO_UDP) return;
+
+    NetworkConnection flow;
+    memset(&flow, 0, sizeof(flow));
+    flow.protocol = *number == IPPROTO_TCP ? PROTOCOL_TCP : PROTOCOL_UDP;
+    flow.programName = PROGRAM_NAME_UNKNOWN;
+    unsigned char source[16], destination[16];
+    if (message->nfgen_family == AF_INET6) {
+        const unsigned char *from = attributeData(findNested(ip, CTA_IP_V6_SRC), 16);
+        const unsigned char *to = attributeData(findNested(ip, CTA_IP_V6_DST), 16);
+        if (from == NULL || to == NULL) return;
+        flow.family = ADDRESS_IPV6;
+        setIpv6Address(source, from);
+        setIpv6Address(destination, to);
+    } else {
+        const unsigned int *from = attributeData(findNested(ip, CTA_IP_V4_SRC), 4);
+        const unsigned int *to = attributeData(findNested(ip, CTA_IP_V4_DST), 4);
+        if (from == NULL || to == NULL) return;
+        flow.family = ADDRESS_IPV4;
+        setIpv4Address(source, *from);
+        setIpv4Address(destination, *to);
+    }
+
+    int flowState = -1;
+    const struct nlattr *tcp = findNested(findAttribute(attributes, length, CTA_PROTOINFO), CTA_PROTOINFO_TCP);
+    const unsigned char *tcpState = attributeData(findNested(tcp, CTA_PROTOINFO_TCP_STATE), 1);
+    if (tcpState != NULL) flowState = *tcpState;
+
+    // A flow between two of our own sockets (loopback) is both
+    for (int incoming = 1; incoming >= 0; incoming--) {
+        NetworkConnection connection = flow;
+        if (incoming) {
+            if (!isListening(events, (ConnectionProtocol)flow.protocol, ntohs(*destinationPort))) continue;
+            memcpy(connection.localAddress, destination, 16);
+            memcpy(connection.remoteAddress, source, 16);
+            connection.localPort = ntohs(*destinationPort);
+            connection.remotePort = ntohs(*sourcePort);
+        } else {
+            if (!isLocalAddress(events, source)) continue;
+            memcpy(connection.localAddress, source, 16);
+            memcpy(connection.remoteAddress, destination, 16);
+            connection.localPort = ntohs(*sourcePort);
+            connection.remotePort = ntohs(*destinationPort);
+        }
+
+        if (flow.protocol == PROTOCOL_UDP) connection.state = STATE_ESTABLISHED;
+        else if (flowState >= 0) connection.state = (unsigned char)getFlowState(flowState, incoming);
+        else connection.state = incoming ? STATE_SYN_RCVD : STATE_SYN_SENT;
+
+        if (type == IPCTNL_MSG_CT_DELETE) trackClosed(events, &connection, 0, NULL, 0);
+        else trackOpened(events, &connection);
+    }
+}
+
+static int readFlowNotices(EventSource *events) {
+    while (1) {
+        ssize_t length = recv(events->flowEvents, events->buffer, EVENT_BUFFER_SIZE, MSG_DONTWAIT);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            return errno == ENOBUFS ? -1 : 0;
+        }
+
+        struct nlmsghdr *header = (struct nlmsghdr *)events->buffer;
+        for (; NLMSG_OK(header, (unsigned int)length); header = NLMSG_NEXT(header, length)) {
+            readFlow(events, header);
+        }
+    }
+}
+
+// Start over from a full dump, which is in the snapshot. Everything in it
+// counts as shown, since it's about to be.
+static void rebuildFromDump(EventSource *events, const ConnectionSnapshot *snapshot) {
+    events->socketCount = 0;
+    if (reserveSockets(events, snapshot->count) != 0) {
+        // Can't track anything; the next refresh tries again
+        events->dumpNeeded = 1;
+        return;
+    }
+    clearConnectionIndex(&events->index);
+    memset(events->listening, 0, sizeof(events->listening));
+    events->localAddressCount = 0;
+
+    for (int i = 0; i < snapshot->count; i++) {
+        TrackedSocket *socket = &events->sockets[events->socketCount];
+        getSnapshotRow(snapshot, i, &socket->connection);
+        unsigned int *slot = findSlot(events, &socket->connection);
+        if (*slot != 0) continue;
+        *slot = (unsigned int)++events->socketCount;
+
+        socket->inode = snapshot->socketInode[i];
+        socket->alive = 1;
+        socket->shown = 1;
+        socket->hasMetrics = 1;
+        socket->metrics.bytesSent = snapshot->bytesSent[i];
+        socket->metrics.bytesReceived = snapshot->bytesReceived[i];
+        socket->metrics.roundTripTime = snapshot->roundTripTime[i];
+        socket->metrics.retransmits = snapshot->retransmits[i];
+        socket->metrics.congestionWindow = snapshot->congestionWindow[i];
+
+        const NetworkConnection *connection = &socket->connection;
+        if (connection->state == STATE_LISTENING) {
+            unsigned short port = connection->localPort;
+            events->listening[connection->protocol == PROTOCOL_UDP][port / 8] |= (unsigned char)(1u << (port % 8));
+        } else if (events->localAddressCount < MAX_LOCAL_ADDRESSES &&
+                   !isLocalAddress(events, connection->localAddress)) {
+            memcpy(events->localAddresses[events->localAddressCount++], connection->localAddress, 16);
+        }
+    }
+}
+
+static void addTrackedRow(EventSource *events, const TrackedSocket *socket, ConnectionSnapshot *snapshot) {
+    NetworkConnection connection = socket->connection;
+    if (connection.programName == PROGRAM_NAME_UNKNOWN) {
+        findSocketOwner(&events->owners, socket->inode, &connection.programId, &connection.programName);
+    }
+    if (addSnapshotRow(snapshot, &connection) != 0) return;
+    snapshot->socketInode[snapshot->count - 1] = socket->inode;
+    if (socket->hasMetrics) setSnapshotMetrics(snapshot, snapshot->count - 1, &socket->metrics);
+}
+
+static int collectEvents(ConnectionSource *source, ConnectionSnapshot *snapshot) {
+    EventSource *events = (EventSource *)source;
+
+    if (readDestroyNotices(events, events->tcpEvents, PROTOCOL_TCP) != 0) events->dumpNeeded = 1;
+    if (readDestroyNotices(events, events->udpEvents, PROTOCOL_UDP) != 0) events->dumpNeeded = 1;
+    if (events->flowEvents >= 0 && readFlowNotices(events) != 0) events->dumpNeeded = 1;
+
+    unsigned long long now = monotonicMillis();
+    int interval = events->flowEvents >= 0 ? EVENT_RECONCILE_INTERVAL : 0;
+    if (events->dumpNeeded || now - events->lastDump >= (unsigned long long)interval) {
+        refreshSocketOwners(&events->owners);
+        if (dumpSocketTables(events->dumper, &events->owners, snapshot) != 0) return -1;
+        rebuildFromDump(events, snapshot);
+        events->lastDump = now;
+        events->dumpNeeded = 0;
+    } else {
+        for (int i = 0; i < events->socketCount; i++) {
+            TrackedSocket *socket = &events->sockets[i];
+            if (!socket->alive) continue;
+            addTrackedRow(events, socket, snapshot);
+            socket->shown = 1;
+        }
+    }
+
+    // The ones that came and went since the last refresh, unless the dump
+    // found the same 5-tuple open again
+    for (int i = 0; i < events->closedCount; i++) {
+        const TrackedSocket *socket = &events->closed[i];
+        if (events->index.slotCount > 0) {
+            unsigned int slot = *findSlot(events, &socket->connection);
+            if (slot != 0 && events->sockets[slot - 1].alive) continue;
+        }
+        addTrackedRow(events, socket, snapshot);
+    }
+    events->closedCount = 0;
+    return 0;
+}
+
+static void destroyEvents(ConnectionSource *source) {
+    EventSource *events = (EventSource *)source;
+    closeNetlinkDumper(events->dumper);
+    freeSocketOwners(&events->owners);
+    if (events->tcpEvents >= 0) close(events->tcpEvents);
+    if (events->udpEvents >= 0) close(events->udpEvents);
+    if (events->flowEvents >= 0) close(events->flowEvents);
+    free(events->buffer);
+    trackedFree(events->sockets);
+    freeConnectionIndex(&events->index);
+    trackedFree(events->closed);
+    free(events);
+}
+
+// A netlink socket that hears the given multicast groups, with a big
+// receive buffer so a burst between refreshes fits. -1 if we may not.
+static int openNoticeSocket(int protocol, const int *groups, int groupCount) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, protocol);
+    if (fd < 0) return -1;
+
+    struct sockaddr_nl local;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) != 0) {
+        close(fd);
+        return -1;
+    }
+    for (int i = 0; i < groupCount; i++) {
+        if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &groups[i], sizeof(groups[i])) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // Past the system limit only with CAP_NET_ADMIN, which we have if we
+    // got this far with sock_diag
+    int size = EVENT_SOCKET_BUFFER;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    return fd;
+}
+
+ConnectionSource *createEventSource() {
+    static const int tcpGroups[] = {SKNLGRP_INET_TCP_DESTROY, SKNLGRP_INET6_TCP_DESTROY};
+    static const int udpGroups[] = {SKNLGRP_INET_UDP_DESTROY, SKNLGRP_INET6_UDP_DESTROY};
+    static const int flowGroups[] = {NFNLGRP_CONNTRACK_NEW, NFNLGRP_CONNTRACK_UPDATE, NFNLGRP_CONNTRACK_DESTROY};
+
+    EventSource *events = calloc(1, sizeof(EventSource));
+    if (events == NULL) return NULL;
+    events->tcpEvents = openNoticeSocket(NETLINK_SOCK_DIAG, tcpGroups, 2);
+    events->udpEvents = openNoticeSocket(NETLINK_SOCK_DIAG, udpGroups, 2);
+    events->flowEvents = openNoticeSocket(NETLINK_NETFILTER, flowGroups, 3);
+    events->buffer = malloc(EVENT_BUFFER_SIZE);
+    events->dumper = openNetlinkDumper();
+    if (events->tcpEvents < 0 || events->udpEvents < 0 || events->buffer == NULL || events->dumper == NULL) {
+        destroyEvents(&events->base);
+        return NULL;
+    }
+
+    events->base.name = "events";
+    events->base.collect = collectEvents;
+    events->base.destroy = destroyEvents;
+    events->dumpNeeded = 1;
+    initSocketOwners(&events->owners);
+    return &events->base;
+}
+
+#else
+
+ConnectionSource *createEventSource() {
+    return NULL;
+}
+
+#endif
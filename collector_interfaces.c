@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <string.h>
+#include "collector.h"
+
+// Where each of our counters is in a /proc/net/dev line, counting the
+// numbers after the "name:"
+static const int procDevColumns[INTERFACE_COUNTER_COUNT] = {
+    [COUNTER_RX_BYTES] = 0, [COUNTER_RX_PACKETS] = 1, [COUNTER_RX_ERRORS] = 2, [COUNTER_RX_DROPPED] = 3,
+    [COUNTER_TX_BYTES] = 8, [COUNTER_TX_PACKETS] = 9, [COUNTER_TX_ERRORS] = 10, [COUNTER_TX_DROPPED] = 11
+};
+
+#define PROC_DEV_COLUMNS 16
+
+void parseProcNetDev(const char *text, size_t length, ConnectionSnapshot *snapshot) {
+    const char *end = text + length;
+    const char *line = text;
+
+    // Two lines of column headers
+    for (int skip = 0; skip < 2 && line < end; skip++) {
+        line = memchr(line, '\n', (size_t)(end - line));
+        if (line == NULL) return;
+        line++;
+    }
+
+    while (line < end) {
+        const char *lineEnd = memchr(line, '\n', (size_t)(end - line));
+        if (lineEnd == NULL) lineEnd = end;
+
+        // "  eth0: 1234 56 0 0 0 0 0 0 7890 12 0 0 0 0 0 0"
+        const char *colon = memchr(line, ':', (size_t)(lineEnd - line));
+        if (colon != NULL) {
+            while (line < colon && *line == ' ') line++;
+            InterfaceCounters *counters = addSnapshotInterface(snapshot);
+            if (counters == NULL) return;
+
+            size_t nameLength = (size_t)(colon - line);
+            if (nameLength >= MAX_INTERFACE_NAME) nameLength = MAX_INTERFACE_NAME - 1;
+            memcpy(counters->name, line, nameLength);
+            counters->name[nameLength] = '\0';
+
+            unsigned long long values[PROC_DEV_COLUMNS] = {0};
+            const char *p = colon + 1;
+            for (int column = 0; column < PROC_DEV_COLUMNS; column++) {
+                while (p < lineEnd && *p == ' ') p++;
+                while (p < lineEnd && *p >= '0' && *p <= '9') values[column] = values[column] * 10 + (unsigned long long)(*p++ - '0');
+            }
+            for (int counter = 0; counter < INTERFACE_COUNTER_COUNT; counter++) {
+                counters->total[counter] = values[procDevColumns[counter]];
+            }
+        }
+        line = lineEnd + 1;
+    }
+}
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+
+#define ROUTE_BUFFER_SIZE (64 * 1024)   // As big as a dump reply gets
+#define PROC_DEV_READ 16384             // First guess at /proc/net/dev's size
+
+// The NETLINK_ROUTE socket, opened the first time it's needed and kept.
+// When the kernel won't give us link dumps, /proc/net/dev is read
+// instead from then on.
+static int routeSocket = -1;
+static int routeBroken = 0;
+static unsigned int routeSequence = 0;
+
+static int sendLinkDump() {
+    struct {
+        struct nlmsghdr header;
+        struct ifinfomsg info;
+    } request;
+    struct sockaddr_nl kernel;
+
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = NLMSG_LENGTH(sizeof(request.info));
+    request.header.nlmsg_type = RTM_GETLINK;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++routeSequence;
+    request.info.ifi_family = AF_UNSPEC;
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(routeSocket, &request, request.header.nlmsg_len, 0, (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// The name and counters of one RTM_NEWLINK. Kernels too old for
+// IFLA_STATS64 still send the 32-bit IFLA_STATS.
+static void addLinkMessage(const struct nlmsghdr *header, ConnectionSnapshot *snapshot) {
+    const struct ifinfomsg *info = NLMSG_DATA(header);
+    struct rtattr *attribute = IFLA_RTA(info);
+    int length = (int)IFLA_PAYLOAD(header);
+    const char *name = NULL;
+    int nameSize = 0;
+    struct rtnl_link_stats64 stats64;
+    int haveStats = 0;
+
+    memset(&stats64, 0, sizeof(stats64));
+    for (; RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+        size_t size = RTA_PAYLOAD(attribute);
+        if (attribute->rta_type == IFLA_IFNAME) {
+            name = RTA_DATA(attribute);
+            const char *end = memchr(name, '\0', size);
+            nameSize = end != NULL ? (int)(end - name) : (int)size;
+        } else if (attribute->rta_type == IFLA_STATS64) {
+            memcpy(&stats64, RTA_DATA(attribute), size < sizeof(stats64) ? size : sizeof(stats64));
+            haveStats = 2;
+        } else if (attribute->rta_type == IFLA_STATS && haveStats < 2) {
+            struct rtnl_link_stats stats;
+            memset(&stats, 0, sizeof(stats));
+            memcpy(&stats, RTA_DATA(attribute), size < sizeof(stats) ? size : sizeof(stats));
+            stats64.rx_bytes = stats.rx_bytes;
+            stats64.tx_bytes = stats.tx_bytes;
+            stats64.rx_packets = stats.rx_packets;
+            stats64.tx_packets = stats.tx_packets;
+            stats64.rx_errors = stats.rx_errors;
+            stats64.tx_errors = stats.tx_errors;
+            stats64.rx_dropped = stats.rx_dropped;
+            stats64.tx_dropped = stats.tx_dropped;
+            haveStats = 1;
+        }
+    }
+    if (name == NULL || !haveStats) return;
+
+    InterfaceCounters *counters = addSnapshotInterface(snapshot);
+    if (counters == NULL) return;
+    snprintf(counters->name, sizeof(counters->name), "%.*s", nameSize, name);
+    counters->total[COUNTER_RX_BYTES] = stats64.rx_bytes;
+    counters->total[COUNTER_TX_BYTES] = stats64.tx_bytes;
+    counters->total[COUNTER_RX_PACKETS] = stats64.rx_packets;
+    counters->total[COUNTER_TX_PACKETS] = stats64.tx_packets;
+    counters->total[COUNTER_RX_ERRORS] = stats64.rx_errors;
+    counters->total[COUNTER_TX_ERRORS] = stats64.tx_errors;
+    counters->total[COUNTER_RX_DROPPED] = stats64.rx_dropped;
+    counters->total[COUNTER_TX_DROPPED] = stats64.tx_dropped;
+}
+
+// One RTM_GETLINK dump, received into scratch memory from the snapshot
+static int dumpLinks(ConnectionSnapshot *snapshot) {
+    if (routeSocket < 0) {
+        routeSocket = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+        if (routeSocket < 0) return -1;
+    }
+    char *buffer = snapshotScratch(snapshot, ROUTE_BUFFER_SIZE);
+    if (buffer == NULL || sendLinkDump() != 0) return -1;
+
+    while (1) {
+        ssize_t length = recv(routeSocket, buffer, ROUTE_BUFFER_SIZE, 0);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        struct nlmsghdr *header = (struct nlmsghdr *)buffer;
+        for (; NLMSG_OK(header, (unsigned int)length); header = NLMSG_NEXT(header, length)) {
+            if (header->nlmsg_seq != routeSequence) continue;
+            if (header->nlmsg_type == NLMSG_DONE) return 0;
+            if (header->nlmsg_type == NLMSG_ERROR) return -1;
+            if (header->nlmsg_type == RTM_NEWLINK) addLinkMessage(header, snapshot);
+        }
+    }
+}
+
+// /proc/net/dev, read into scratch memory from the snapshot (twice as
+// much each time it doesn't fit)
+static int readProcNetDev(ConnectionSnapshot *snapshot) {
+    int file = open("/proc/net/dev", O_RDONLY | O_CLOEXEC);
+    if (file < 0) return -1;
+
+    size_t size = PROC_DEV_READ;
+    size_t used = 0;
+    char *text = snapshotScratch(snapshot, size);
+    while (text != NULL) {
+        if (used == size) {
+            char *bigger = snapshotScratch(snapshot, size * 2);
+            if (bigger != NULL) memcpy(bigger, text, used);
+            text = bigger;
+            size *= 2;
+            continue;
+        }
+        ssize_t got = read(file, text + used, size - used);
+        if (got <= 0) break;
+        used += (size_t)got;
+    }
+    close(file);
+    if (text == NULL) return -1;
+
+    parseProcNetDev(text, used, snapshot);
+    return 0;
+}
+
+int collectInterfaces(ConnectionSnapshot *snapshot) {
+    if (!routeBroken) {
+        if (dumpLinks(snapshot) == 0) return 0;
+
+        // Whatever a broken dump got as far as is thrown away
+        routeBroken = 1;
+        snapshot->interfaceCount = 0;
+        if (routeSocket >= 0) close(routeSocket);
+        routeSocket = -1;
+    }
+    return readProcNetDev(snapshot);
+}
+
+#elif defined(_WIN32)
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <iphlpapi.h>   // For the interface table
+
+#pragma comment(lib, "iphlpapi.lib")
+
+// The Windows API hands the table back in memory of its own, which is
+// freed again straight away
+int collectInterfaces(ConnectionSnapshot *snapshot) {
+    MIB_IF_TABLE2 *table = NULL;
+    if (GetIfTable2(&table) != NO_ERROR) return -1;
+
+    for (ULONG i = 0; i < table->NumEntries; i++) {
+        const MIB_IF_ROW2 *row = &table->Table[i];
+
+        // Every filter driver on an adapter shows up as an interface of
+        // its own, with the adapter's counters
+        if (row->InterfaceAndOperStatusFlags.FilterInterface) continue;
+
+        InterfaceCounters *counters = addSnapshotInterface(snapshot);
+        if (counters == NULL) break;
+        if (WideCharToMultiByte(CP_UTF8, 0, row->Alias, -1, counters->name, sizeof(counters->name), NULL, NULL) == 0) {
+            snprintf(counters->name, sizeof(counters->name), "if%lu", (unsigned long)row->InterfaceIndex);
+        }
+        counters->total[COUNTER_RX_BYTES] = row->InOctets;
+        counters->total[COUNTER_TX_BYTES] = row->OutOctets;
+        counters->total[COUNTER_RX_PACKETS] = row->InUcastPkts + row->InNUcastPkts;
+        counters->total[COUNTER_TX_PACKETS] = row->OutUcastPkts + row->OutNUcastPkts;
+        counters->total[COUNTER_RX_ERRORS] = row->InErrors;
+        counters->total[COUNTER_TX_ERRORS] = row->OutErrors;
+        counters->total[COUNTER_RX_DROPPED] = row->InDiscards;
+        counters->total[COUNTER_TX_DROPPED] = row->OutDiscards;
+    }
+
+    FreeMibTable(table);
+    return 0;
+}
+
+#else
+
+int collectInterfaces(ConnectionSnapshot *snapshot) {
+    (void)snapshot;
+    return -1;
+}
+
+#endif
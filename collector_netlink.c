@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "collector.h"
+#include "string_table.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
+#include <linux/rtnetlink.h>
+#include <linux/tcp.h>
+
+#define NETLINK_BUFFER_SIZE (64 * 1024)
+#define MAX_FILTER_BYTECODE 1024    // Enough for every port range and network a filter can hold
+
+// The filter as the kernel gets it: which states to dump for each
+// protocol, and a program run on every socket of each family
+typedef struct {
+    unsigned int states[2];                     // Per ConnectionProtocol, 0 = don't dump it at all
+    unsigned char code[2][MAX_FILTER_BYTECODE]; // [0] AF_INET, [1] AF_INET6
+    int length[2];                              // 0 = no program, -1 = nothing of that family can match
+} DiagFilter;
+
+// Each op jumps ahead by yes bytes when its test passes and by no bytes
+// when it fails. Landing exactly on the end accepts the socket, jumping
+// past it rejects it. The kernel checks a program by walking the yes
+// jumps, so those always go to the next op; the ORs inside a clause are
+// made with the no jumps and JMP ops (which always take no).
+typedef struct {
+    unsigned char *code;
+    int length;
+    int full;
+    int toNextTerm[4];              // Tests of this alternative, that try the next one when they fail
+    int nextTermCount;
+    int toNextClause[MAX_FILTER_PREFIXES + MAX_FILTER_RANGES];  // JMPs past the clause
+    int nextClauseCount;
+    int toReject[MAX_FILTER_BYTECODE / 4];
+    int rejectCount;
+} BytecodeWriter;
+
+static struct inet_diag_bc_op *addOp(BytecodeWriter *writer, unsigned char code, int size) {
+    if (writer->length + size > MAX_FILTER_BYTECODE) {
+        writer->full = 1;
+        return NULL;
+    }
+    struct inet_diag_bc_op *op = (struct inet_diag_bc_op *)(writer->code + writer->length);
+    memset(op, 0, (size_t)size);
+    op->code = code;
+    op->yes = (unsigned char)size;
+    op->no = (unsigned short)size;
+    writer->length += size;
+    return op;
+}
+
+static void setJump(BytecodeWriter *writer, int position, int target) {
+    ((struct inet_diag_bc_op *)(writer->code + position))->no = (unsigned short)(target - position);
+}
+
+static void addReject(BytecodeWriter *writer, int position) {
+    writer->toReject[writer->rejectCount++] = position;
+}
+
+// The alternatives of a clause, one after the other. Every test of an
+// alternative has to pass; when one fails, the next alternative is tried.
+static void beginTerm(BytecodeWriter *writer) {
+    for (int i = 0; i < writer->nextTermCount; i++) setJump(writer, writer->toNextTerm[i], writer->length);
+    writer->nextTermCount = 0;
+}
+
+static void addTest(BytecodeWriter *writer, unsigned char code, const void *payload, int payloadSize) {
+    int position = writer->length;
+    struct inet_diag_bc_op *op = addOp(writer, code, (int)sizeof(*op) + payloadSize);
+    if (op == NULL) return;
+    memcpy(op + 1, payload, (size_t)payloadSize);
+    writer->toNextTerm[writer->nextTermCount++] = position;
+}
+
+// Getting here means the alternative passed: skip the rest of the clause
+static void endTerm(BytecodeWriter *writer) {
+    int position = writer->length;
+    if (addOp(writer, INET_DIAG_BC_JMP, sizeof(struct inet_diag_bc_op)) == NULL) return;
+    writer->toNextClause[writer->nextClauseCount++] = position;
+}
+
+// The last alternative needs no JMP (the next clause is right there), and
+// when its tests fail nothing is left to try
+static void endClause(BytecodeWriter *writer) {
+    if (writer->full || writer->nextClauseCount == 0) return;
+    writer->length -= sizeof(struct inet_diag_bc_op);
+    writer->nextClauseCount--;
+    for (int i = 0; i < writer->nextTermCount; i++) addReject(writer, writer->toNextTerm[i]);
+    for (int i = 0; i < writer->nextClauseCount; i++) setJump(writer, writer->toNextClause[i], writer->length);
+    writer->nextTermCount = 0;
+    writer->nextClauseCount = 0;
+}
+
+// The port ranges as a clause: each range is one alternative, a >= and a
+// <= test (either left out when it's the end of the port space)
+static void addPortClause(BytecodeWriter *writer, const PortFilter *ports, int local) {
+    for (int r = 0; r < ports->count; r++) {
+        if (ports->ranges[r].low == 0 && ports->ranges[r].high == 65535) return;    // Any port
+    }
+
+    for (int r = 0; r < ports->count; r++) {
+        // The port goes in the no field of a second op
+        struct inet_diag_bc_op low = {0, 0, ports->ranges[r].low};
+        struct inet_diag_bc_op high = {0, 0, ports->ranges[r].high};
+        beginTerm(writer);
+        if (low.no > 0) addTest(writer, local ? INET_DIAG_BC_S_GE : INET_DIAG_BC_D_GE, &low, sizeof(low));
+        if (high.no < 65535) addTest(writer, local ? INET_DIAG_BC_S_LE : INET_DIAG_BC_D_LE, &high, sizeof(high));
+        endTerm(writer);
+    }
+    endClause(writer);
+}
+
+typedef enum {
+    PREFIX_NEVER,
+    PREFIX_ALWAYS,
+    PREFIX_TEST
+} PrefixTest;
+
+// How a prefix looks to one family's sockets. IPv4 sockets are stored as
+// ::ffff:a.b.c.d, so an IPv4 prefix is only the bits after the first 96,
+// and an IPv6 prefix either covers all of them or none.
+static PrefixTest getPrefixTest(const AddressPrefix *prefix, int ipv6, unsigned char *condition, int *conditionSize) {
+    static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+    struct inet_diag_hostcond host;
+    int length = prefix->prefixLength;
+
+    if (!ipv6) {
+        int compared = length < 96 ? length : 96;
+        for (int bit = 0; bit < compared; bit++) {
+            int mask = 0x80 >> (bit % 8);
+            if ((prefix->address[bit / 8] & mask) != (mapped[bit / 8] & mask)) return PREFIX_NEVER;
+        }
+        if (length <= 96) return PREFIX_ALWAYS;
+        length -= 96;
+    } else if (length == 0) {
+        return PREFIX_ALWAYS;
+    }
+
+    host.family = ipv6 ? AF_INET6 : AF_INET;
+    host.prefix_len = (unsigned char)length;
+    host.port = -1;
+    memcpy(condition, &host, sizeof(host));
+    memcpy(condition + sizeof(host), ipv6 ? prefix->address : prefix->address + 12, ipv6 ? 16 : 4);
+    *conditionSize = (int)sizeof(host) + (ipv6 ? 16 : 4);
+    return PREFIX_TEST;
+}
+
+// One clause for the networks: in any of them, or with != in none of
+// them. Returns -1 when no socket of this family can pass.
+static int addPrefixClause(BytecodeWriter *writer, const PrefixFilter *networks, int local, int ipv6) {
+    unsigned char code = local ? INET_DIAG_BC_S_COND : INET_DIAG_BC_D_COND;
+    unsigned char condition[sizeof(struct inet_diag_hostcond) + 16];
+    int conditionSize;
+    int tests = 0;
+    if (networks->count == 0) return 0;
+
+    for (int p = 0; p < networks->count; p++) {
+        PrefixTest test = getPrefixTest(&networks->prefixes[p], ipv6, condition, &conditionSize);
+        if (test == PREFIX_ALWAYS) return networks->negate ? -1 : 0;
+        if (test == PREFIX_TEST) tests++;
+    }
+    if (tests == 0) return networks->negate ? 0 : -1;
+
+    for (int p = 0; p < networks->count; p++) {
+        if (getPrefixTest(&networks->prefixes[p], ipv6, condition, &conditionSize) != PREFIX_TEST) continue;
+        if (networks->negate) {
+            // In the network: fall through to a JMP that rejects.
+            // Not in it: jump over that JMP.
+            struct inet_diag_bc_op *op = addOp(writer, code, (int)sizeof(*op) + conditionSize);
+            if (op == NULL) return 0;
+            memcpy(op + 1, condition, (size_t)conditionSize);
+            op->no = (unsigned short)(op->yes + sizeof(*op));
+            int position = writer->length;
+            if (addOp(writer, INET_DIAG_BC_JMP, sizeof(*op)) != NULL) addReject(writer, position);
+        } else {
+            beginTerm(writer);
+            addTest(writer, code, condition, conditionSize);
+            endTerm(writer);
+        }
+    }
+    if (!networks->negate) endClause(writer);
+    return 0;
+}
+
+// Linux state bits (1 << TCP_*) for the states the filter wants
+static unsigned int getKernelStates(const ConnectionFilter *filter, ConnectionProtocol protocol) {
+    if (filter->matchNone) return 0;
+    if (filter->protocolMask && !((filter->protocolMask >> protocol) & 1u)) return 0;
+    if (filter->stateMask == 0) return 0xFFFFFFFF;
+
+    unsigned int states = 0;
+    for (int state = 1; state <= 12; state++) {
+        ConnectionState ours = getLinuxTcpState(state);
+        if (protocol == PROTOCOL_UDP && state == LINUX_UDP_UNCONNECTED) ours = STATE_LISTENING;
+        if ((filter->stateMask >> ours) & 1u) states |= 1u << state;
+    }
+    return states;
+}
+
+static void compileDiagFilter(const ConnectionFilter *filter, DiagFilter *compiled) {
+    compiled->states[PROTOCOL_TCP] = getKernelStates(filter, PROTOCOL_TCP);
+    compiled->states[PROTOCOL_UDP] = getKernelStates(filter, PROTOCOL_UDP);
+
+    for (int ipv6 = 0; ipv6 < 2; ipv6++) {
+        BytecodeWriter writer;
+        memset(&writer, 0, sizeof(writer));
+        writer.code = compiled->code[ipv6];
+
+        addPortClause(&writer, &filter->localPorts, 1);
+        addPortClause(&writer, &filter->remotePorts, 0);
+        int possible = addPrefixClause(&writer, &filter->localNetworks, 1, ipv6) == 0 &&
+                       addPrefixClause(&writer, &filter->remoteNetworks, 0, ipv6) == 0 &&
+                       addPrefixClause(&writer, &filter->localExcluded, 1, ipv6) == 0 &&
+                       addPrefixClause(&writer, &filter->remoteExcluded, 0, ipv6) == 0;
+
+        for (int i = 0; i < writer.rejectCount; i++) setJump(&writer, writer.toReject[i], writer.length + 4);
+        // Too big for the buffer: the kernel just doesn't filter
+        compiled->length[ipv6] = !possible ? -1 : writer.full ? 0 : writer.length;
+    }
+}
+
+
+// Asks the kernel for its socket tables over NETLINK_SOCK_DIAG, the same
+// interface "ss" uses. Each dump is one request and the kernel streams the
+// matching sockets back in large binary batches, so there is no text to
+// format or parse.
+struct NetlinkDumper {
+    int socket;
+    unsigned int sequence;
+    char *buffer;           // Receive buffer, reused for every dump
+    DiagFilter *filter;     // NULL = dump everything
+    unsigned int filterVersion;
+};
+
+typedef struct {
+    ConnectionSource base;
+    NetlinkDumper *dumper;
+    SocketOwners owners;    // Which process has each socket
+} NetlinkSource;
+
+static int sendDumpRequest(NetlinkDumper *dumper, int family, int protocol, unsigned int states,
+                           const unsigned char *bytecode, int bytecodeLength) {
+    struct {
+        struct nlmsghdr header;
+        struct inet_diag_req_v2 request;
+        struct rtattr attribute;
+        unsigned char bytecode[MAX_FILTER_BYTECODE];
+    } message;
+    struct sockaddr_nl kernel;
+
+    memset(&message, 0, sizeof(message));
+    message.header.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    message.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    message.header.nlmsg_seq = ++dumper->sequence;
+    message.request.sdiag_family = (unsigned char)family;
+    message.request.sdiag_protocol = (unsigned char)protocol;
+    message.request.idiag_states = states;
+    if (protocol == IPPROTO_TCP) {
+        // Have struct tcp_info sent along with every TCP socket
+        message.request.idiag_ext = 1 << (INET_DIAG_INFO - 1);
+    }
+    if (bytecodeLength > 0) {
+        // Only sockets the program accepts are sent back
+        message.attribute.rta_type = INET_DIAG_REQ_BYTECODE;
+        message.attribute.rta_len = (unsigned short)RTA_LENGTH(bytecodeLength);
+        memcpy(message.bytecode, bytecode, (size_t)bytecodeLength);
+        message.header.nlmsg_len = NLMSG_LENGTH(sizeof(message.request)) + RTA_LENGTH(bytecodeLength);
+    } else {
+        message.header.nlmsg_len = NLMSG_LENGTH(sizeof(message.request));
+    }
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    if (sendto(dumper->socket, &message, message.header.nlmsg_len, 0,
+               (struct sockaddr *)&kernel, sizeof(kernel)) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Pick the counters we keep out of the INET_DIAG_INFO attribute, if the
+// reply has one. Older kernels send a shorter tcp_info, so whatever they
+// leave out stays 0.
+static int readTcpInfo(const struct nlmsghdr *header, ConnectionMetrics *metrics) {
+    const struct inet_diag_msg *diag = NLMSG_DATA(header);
+    struct rtattr *attribute = (struct rtattr *)(diag + 1);
+    int length = (int)header->nlmsg_len - NLMSG_LENGTH(sizeof(*diag));
+
+    for (; RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+        if (attribute->rta_type != INET_DIAG_INFO) continue;
+
+        struct tcp_info info;
+        size_t size = RTA_PAYLOAD(attribute);
+        if (size > sizeof(info)) size = sizeof(info);
+        memset(&info, 0, sizeof(info));
+        memcpy(&info, RTA_DATA(attribute), size);
+
+        metrics->bytesSent = info.tcpi_bytes_acked;
+        metrics->bytesReceived = info.tcpi_bytes_received;
+        metrics->roundTripTime = info.tcpi_rtt;
+        metrics->retransmits = info.tcpi_total_retrans;
+        metrics->congestionWindow = info.tcpi_snd_cwnd;
+        return 1;
+    }
+    return 0;
+}
+
+int decodeDiagMessage(const void *message, ConnectionProtocol protocol, NetworkConnection *connection,
+                      unsigned long long *inode, ConnectionMetrics *metrics) {
+    const struct nlmsghdr *header = message;
+    const struct inet_diag_msg *diag = NLMSG_DATA(header);
+
+    // The kernel hands us binary addresses, so they are copied as they are
+    if (diag->idiag_family == AF_INET6) {
+        connection->family = ADDRESS_IPV6;
+        setIpv6Address(connection->localAddress, (const unsigned char *)diag->id.idiag_src);
+        setIpv6Address(connection->remoteAddress, (const unsigned char *)diag->id.idiag_dst);
+    } else {
+        connection->family = ADDRESS_IPV4;
+        setIpv4Address(connection->localAddress, diag->id.idiag_src[0]);
+        setIpv4Address(connection->remoteAddress, diag->id.idiag_dst[0]);
+    }
+    connection->localPort = ntohs(diag->id.idiag_sport);
+    connection->remotePort = ntohs(diag->id.idiag_dport);
+
+    connection->protocol = (unsigned char)protocol;
+    if (protocol == PROTOCOL_UDP && diag->idiag_state == LINUX_UDP_UNCONNECTED) {
+        // Unconnected UDP socket, same as what the Windows table shows
+        connection->state = STATE_LISTENING;
+    } else {
+        connection->state = (unsigned char)getLinuxTcpState(diag->idiag_state);
+    }
+
+    connection->programId = 0;
+    connection->programName = PROGRAM_NAME_UNKNOWN;
+    *inode = diag->idiag_inode;
+    return protocol == PROTOCOL_TCP && readTcpInfo(header, metrics);
+}
+
+// Turn one inet_diag reply into a row
+static void addDiagRow(const struct nlmsghdr *header, ConnectionProtocol protocol, SocketOwners *owners,
+                       ConnectionSnapshot *snapshot) {
+    NetworkConnection connection;
+    ConnectionMetrics metrics;
+    unsigned long long inode;
+    int hasMetrics = decodeDiagMessage(header, protocol, &connection, &inode, &metrics);
+
+    if (owners != NULL) findSocketOwner(owners, inode, &connection.programId, &connection.programName);
+    if (addSnapshotRow(snapshot, &connection) != 0) return;
+    snapshot->socketInode[snapshot->count - 1] = inode;
+    if (hasMetrics) setSnapshotMetrics(snapshot, snapshot->count - 1, &metrics);
+}
+
+// Read replies until the kernel says the dump is done
+static int receiveDump(NetlinkDumper *dumper, ConnectionProtocol protocol, SocketOwners *owners,
+                       ConnectionSnapshot *snapshot) {
+    while (1) {
+        ssize_t length = recv(dumper->socket, dumper->buffer, NETLINK_BUFFER_SIZE, 0);
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        struct nlmsghdr *header = (struct nlmsghdr *)dumper->buffer;
+        for (; NLMSG_OK(header, (unsigned int)length); header = NLMSG_NEXT(header, length)) {
+            if (header->nlmsg_seq != dumper->sequence) continue;
+            if (header->nlmsg_type == NLMSG_DONE) return 0;
+            if (header->nlmsg_type == NLMSG_ERROR) return -1;
+            if (header->nlmsg_type != SOCK_DIAG_BY_FAMILY) continue;
+
+            if (snapshot != NULL) addDiagRow(header, protocol, owners, snapshot);
+        }
+    }
+}
+
+int dumpSocketTables(NetlinkDumper *dumper, SocketOwners *owners, ConnectionSnapshot *snapshot) {
+    static const struct {
+        int family;
+        int protocol;
+        ConnectionProtocol ours;
+    } dumps[] = {
+        {AF_INET, IPPROTO_TCP, PROTOCOL_TCP},
+        {AF_INET6, IPPROTO_TCP, PROTOCOL_TCP},
+        {AF_INET, IPPROTO_UDP, PROTOCOL_UDP},
+        {AF_INET6, IPPROTO_UDP, PROTOCOL_UDP},
+    };
+    int dumpsRead = 0;
+    const DiagFilter *filter = dumper->filter;
+
+    // The kernel only runs one dump per socket at a time, so the four
+    // tables are asked for one after the other
+    for (size_t i = 0; i < sizeof(dumps) / sizeof(dumps[0]); i++) {
+        unsigned int states = filter ? filter->states[dumps[i].ours] : 0xFFFFFFFF;
+        int ipv6 = dumps[i].family == AF_INET6;
+        int length = filter ? filter->length[ipv6] : 0;
+        if (states == 0 || length < 0) {
+            dumpsRead++;    // Nothing in it could pass the filter
+            continue;
+        }
+
+        if (sendDumpRequest(dumper, dumps[i].family, dumps[i].protocol, states,
+                            filter ? filter->code[ipv6] : NULL, length) != 0) continue;
+        if (receiveDump(dumper, dumps[i].ours, owners, snapshot) != 0) continue;
+        dumpsRead++;
+    }
+
+    return dumpsRead > 0 ? 0 : -1;
+}
+
+void setDumperFilter(NetlinkDumper *dumper, const ConnectionFilter *filter, unsigned int version) {
+    if (version == dumper->filterVersion) return;
+    dumper->filterVersion = version;
+    if (filter == NULL) {
+        free(dumper->filter);
+        dumper->filter = NULL;
+        return;
+    }
+
+    if (dumper->filter == NULL) dumper->filter = malloc(sizeof(DiagFilter));
+    if (dumper->filter != NULL) compileDiagFilter(filter, dumper->filter);
+}
+
+void closeNetlinkDumper(NetlinkDumper *dumper) {
+    if (dumper == NULL) return;
+    close(dumper->socket);
+    free(dumper->buffer);
+    free(dumper->filter);
+    free(dumper);
+}
+
+NetlinkDumper *openNetlinkDumper() {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+    if (fd < 0) return NULL;
+
+    NetlinkDumper *dumper = calloc(1, sizeof(NetlinkDumper));
+    char *buffer = malloc(NETLINK_BUFFER_SIZE);
+    if (dumper == NULL || buffer == NULL) {
+        free(dumper);
+        free(buffer);
+        close(fd);
+        return NULL;
+    }
+    dumper->socket = fd;
+    dumper->buffer = buffer;
+
+    // Make sure the kernel actually answers sock_diag requests (it can be
+    // compiled out, or blocked inside some sandboxes). Asking for no states
+    // gets an empty dump back.
+    if (sendDumpRequest(dumper, AF_INET, IPPROTO_TCP, 0, NULL, 0) != 0 ||
+        receiveDump(dumper, PROTOCOL_TCP, NULL, NULL) != 0) {
+        closeNetlinkDumper(dumper);
+        return NULL;
+    }
+    return dumper;
+}
+
+static int collectNetlink(ConnectionSource *source, ConnectionSnapshot *snapshot) {
+    NetlinkSource *netlink = (NetlinkSource *)source;
+    unsigned int version;
+    const ConnectionFilter *filter = getCollectorFilter(&version);
+    setDumperFilter(netlink->dumper, filter, version);
+    refreshSocketOwners(&netlink->owners);
+    return dumpSocketTables(netlink->dumper, &netlink->owners, snapshot);
+}
+
+static void destroyNetlink(ConnectionSource *source) {
+    NetlinkSource *netlink = (NetlinkSource *)source;
+    closeNetlinkDumper(netlink->dumper);
+    freeSocketOwners(&netlink->owners);
+    free(netlink);
+}
+
+ConnectionSource *createNetlinkSource() {
+    NetlinkDumper *dumper = openNetlinkDumper();
+    if (dumper == NULL) return NULL;
+
+    NetlinkSource *netlink = calloc(1, sizeof(NetlinkSource));
+    if (netlink == NULL) {
+        closeNetlinkDumper(dumper);
+        return NULL;
+    }
+
+    netlink->base.name = "netlink";
+    netlink->base.collect = collectNetlink;
+    netlink->base.destroy = destroyNetlink;
+    netlink->dumper = dumper;
+    initSocketOwners(&netlink->owners);
+    return &netlink->base;
+}
+
+#else
+
+NetlinkDumper *openNetlinkDumper() {
+    return NULL;
+}
+
+void closeNetlinkDumper(NetlinkDumper *dumper) {
+    (void)dumper;
+}
+
+void setDumperFilter(NetlinkDumper *dumper, const ConnectionFilter *filter, unsigned int version) {
+    (void)dumper;
+    (void)filter;
+    (void)version;
+}
+
+int dumpSocketTables(NetlinkDumper *dumper, SocketOwners *owners, ConnectionSnapshot *snapshot) {
+    (void)dumper;
+    (void)owners;
+    (void)snapshot;
+    return -1;
+}
+
+int decodeDiagMessage(const void *message, ConnectionProtocol protocol, NetworkConnection *connection,
+                      unsigned long long *inode, ConnectionMetrics *metrics) {
+    (void)message;
+    (void)protocol;
+    (void)connection;
+    (void)inode;
+    (void)metrics;
+    return 0;
+}
+
+ConnectionSource *createNetlinkSource() {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,380 @@
+#ifdef __linux__
+#define _GNU_SOURCE     // setns
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "collector.h"
+#include "string_table.h"
+
+#ifdef __linux__
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "platform.h"
+
+#define MAX_NAMESPACE_WORKERS 8
+
+// Reads every network namespace on the machine (each container or pod has
+// its own), not just ours. A netlink socket belongs to the namespace it
+// was opened in, so a worker thread steps into each new namespace with
+// setns just long enough to open one, and after that any thread can dump
+// it. Each refresh the namespaces are shared out between a few worker
+// threads, which dump into their own snapshots, and the rows are then
+// merged into one snapshot tagged with the namespace they came from.
+typedef struct {
+    unsigned long long inode;       // What tells namespaces apart
+    unsigned int name;              // Interned, NAMESPACE_HOST for ours
+    int file;                       // Open namespace file until there's a dumper, else -1
+    NetlinkDumper *dumper;
+    int seen;                       // Still there this refresh
+    int failed;                     // Couldn't open a socket in it, not tried again
+} NetworkNamespace;
+
+typedef struct NamespaceSource NamespaceSource;
+
+typedef struct {
+    NamespaceSource *source;
+    Thread *thread;
+    Event *start;
+    Event *done;
+    ConnectionSnapshot rows;        // What this worker read this refresh
+} NamespaceWorker;
+
+struct NamespaceSource {
+    ConnectionSource base;
+    NetworkNamespace *namespaces;   // Ours is always first
+    int namespaceCount;
+    int namespaceCapacity;
+    unsigned int *slots;            // Open-addressed index of inode -> namespace + 1
+    unsigned int slotCount;
+    int homeFile;                   // Our own namespace, for workers to go back to
+    NamespaceWorker workers[MAX_NAMESPACE_WORKERS];
+    int workerCount;
+    atomic_int nextNamespace;       // The next one for a worker to take
+    atomic_int dumpsRead;
+    atomic_int stopping;
+    SocketOwners owners;            // Socket inodes are unique across namespaces
+    const ConnectionFilter *filter; // Pushed down to every namespace's dumps
+    unsigned int filterVersion;
+};
+
+static unsigned int hashInode(unsigned long long inode) {
+    inode *= 0x9E3779B97F4A7C15ull;
+    return (unsigned int)(inode >> 32);
+}
+
+// Rebuild the index with room for at least count namespaces
+static int indexNamespaces(NamespaceSource *source, int count) {
+    unsigned int slotCount = 64;
+    while (slotCount < (unsigned int)count * 2) slotCount *= 2;
+    if (slotCount != source->slotCount) {
+        unsigned int *slots = realloc(source->slots, slotCount * sizeof(unsigned int));
+        if (slots == NULL) return -1;
+        source->slots = slots;
+        source->slotCount = slotCount;
+    }
+
+    memset(source->slots, 0, source->slotCount * sizeof(unsigned int));
+    for (int i = 0; i < source->namespaceCount; i++) {
+        unsigned int slot = hashInode(source->namespaces[i].inode) & (source->slotCount - 1);
+        while (source->slots[slot] != 0) slot = (slot + 1) & (source->slotCount - 1);
+        source->slots[slot] = (unsigned int)i + 1;
+    }
+    return 0;
+}
+
+static NetworkNamespace *findNamespace(NamespaceSource *source, unsigned long long inode) {
+    unsigned int slot = hashInode(inode) & (source->slotCount - 1);
+    while (source->slots[slot] != 0) {
+        NetworkNamespace *space = &source->namespaces[source->slots[slot] - 1];
+        if (space->inode == inode) return space;
+        slot = (slot + 1) & (source->slotCount - 1);
+    }
+    return NULL;
+}
+
+// Name a namespace found through a process: the container ID from its
+// cgroup path if it has one (64 hex digits, as Docker, containerd and
+// CRI-O write them), otherwise the namespace's inode (the number
+// "ls -l /proc/<pid>/ns/net" shows)
+static void nameFromProcess(const char *pid, unsigned long long inode, char *name, size_t size) {
+    char path[64];
+    char text[4096];
+    snprintf(path, sizeof(path), "/proc/%s/cgroup", pid);
+    snprintf(name, size, "netns:%llu", inode);
+
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) return;
+    ssize_t length = read(file, text, sizeof(text) - 1);
+    close(file);
+    if (length <= 0) return;
+    text[length] = '\0';
+
+    int run = 0;
+    for (ssize_t i = 0; i <= length; i++) {
+        if (i < length && isxdigit((unsigned char)text[i])) {
+            run++;
+            continue;
+        }
+        if (run == 64) {
+            snprintf(name, size, "container:%.12s", text + i - 64);
+            return;
+        }
+        run = 0;
+    }
+}
+
+// Note a namespace from one of its files (/proc/<pid>/ns/net or a bind
+// mount under /run/netns). pid is NULL for a named one.
+static void addNamespace(NamespaceSource *source, const char *path, const char *name, const char *pid) {
+    struct stat info;
+    if (stat(path, &info) != 0) return;
+
+    NetworkNamespace *space = findNamespace(source, (unsigned long long)info.st_ino);
+    if (space != NULL) {
+        space->seen = 1;
+        return;
+    }
+
+    if (source->namespaceCount == source->namespaceCapacity) {
+        int newCapacity = source->namespaceCapacity ? source->namespaceCapacity * 2 : 16;
+        NetworkNamespace *namespaces = realloc(source->namespaces, (size_t)newCapacity * sizeof(NetworkNamespace));
+        if (namespaces == NULL) return;
+        source->namespaces = namespaces;
+        source->namespaceCapacity = newCapacity;
+    }
+    if ((unsigned int)(source->namespaceCount + 1) * 2 > source->slotCount &&
+        indexNamespaces(source, source->namespaceCount + 1) != 0) {
+        return;
+    }
+
+    // Keep the file open, so the namespace can still be entered even if
+    // the process is gone by the time a worker gets to it
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) return;
+
+    char label[64];
+    if (name == NULL) {
+        nameFromProcess(pid, (unsigned long long)info.st_ino, label, sizeof(label));
+        name = label;
+    }
+
+    space = &source->namespaces[source->namespaceCount++];
+    memset(space, 0, sizeof(*space));
+    space->inode = (unsigned long long)info.st_ino;
+    space->name = internNamespaceName(name);
+    space->file = file;
+    space->seen = 1;
+
+    unsigned int slot = hashInode(space->inode) & (source->slotCount - 1);
+    while (source->slots[slot] != 0) slot = (slot + 1) & (source->slotCount - 1);
+    source->slots[slot] = (unsigned int)source->namespaceCount;
+}
+
+static void forgetNamespace(NetworkNamespace *space) {
+    closeNetlinkDumper(space->dumper);
+    if (space->file >= 0) close(space->file);
+}
+
+// Bring the list up to date: named namespaces first (so pods get their
+// CNI names), then whatever the processes are in
+static void findNamespaces(NamespaceSource *source) {
+    for (int i = 0; i < source->namespaceCount; i++) source->namespaces[i].seen = 0;
+    source->namespaces[0].seen = 1;     // Ours, which we're always in
+
+    const char *namedDirectory = "/run/netns";
+    DIR *directory = opendir(namedDirectory);
+    if (directory != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != NULL) {
+            if (entry->d_name[0] == '.') continue;
+            char path[300];
+            snprintf(path, sizeof(path), "%s/%s", namedDirectory, entry->d_name);
+            addNamespace(source, path, entry->d_name, NULL);
+        }
+        closedir(directory);
+    }
+
+    directory = opendir("/proc");
+    if (directory != NULL) {
+        struct dirent *entry;
+        while ((entry = readdir(directory)) != NULL) {
+            if (entry->d_name[0] < '1' || entry->d_name[0] > '9') continue;
+            char path[300];
+            snprintf(path, sizeof(path), "/proc/%s/ns/net", entry->d_name);
+            addNamespace(source, path, NULL, entry->d_name);
+        }
+        closedir(directory);
+    }
+
+    // Drop the namespaces that are gone. Our sockets hold them alive, so
+    // this is what lets the kernel free them.
+    int kept = 0;
+    for (int i = 0; i < source->namespaceCount; i++) {
+        if (!source->namespaces[i].seen) {
+            forgetNamespace(&source->namespaces[i]);
+            continue;
+        }
+        source->namespaces[kept++] = source->namespaces[i];
+    }
+    if (kept != source->namespaceCount) {
+        source->namespaceCount = kept;
+        indexNamespaces(source, kept);
+    }
+}
+
+// Open a netlink socket inside a namespace. Only this thread moves, and
+// it moves back straight after.
+static NetlinkDumper *openInNamespace(NamespaceSource *source, NetworkNamespace *space) {
+    if (setns(space->file, CLONE_NEWNET) != 0) return NULL;
+    NetlinkDumper *dumper = openNetlinkDumper();
+    setns(source->homeFile, CLONE_NEWNET);
+    return dumper;
+}
+
+static int runWorker(void *argument) {
+    NamespaceWorker *worker = argument;
+    NamespaceSource *source = worker->source;
+
+    while (1) {
+        while (!waitEvent(worker->start, 1000)) {}
+        if (atomic_load(&source->stopping)) break;
+
+        clearSnapshot(&worker->rows);
+        int next;
+        while ((next = atomic_fetch_add(&source->nextNamespace, 1)) < source->namespaceCount) {
+            NetworkNamespace *space = &source->namespaces[next];
+            if (space->dumper == NULL && !space->failed) {
+                space->dumper = openInNamespace(source, space);
+                space->failed = space->dumper == NULL;
+                close(space->file);
+                space->file = -1;
+            }
+            if (space->dumper == NULL) continue;
+
+            int first = worker->rows.count;
+            setDumperFilter(space->dumper, source->filter, source->filterVersion);
+            if (dumpSocketTables(space->dumper, NULL, &worker->rows) == 0) atomic_fetch_add(&source->dumpsRead, 1);
+            for (int row = first; row < worker->rows.count; row++) worker->rows.networkNamespace[row] = space->name;
+        }
+        signalEvent(worker->done);
+    }
+    return 0;
+}
+
+static int collectNamespaces(ConnectionSource *base, ConnectionSnapshot *snapshot) {
+    NamespaceSource *source = (NamespaceSource *)base;
+
+    refreshSocketOwners(&source->owners);
+    findNamespaces(source);
+
+    source->filter = getCollectorFilter(&source->filterVersion);
+    atomic_store(&source->nextNamespace, 0);
+    atomic_store(&source->dumpsRead, 0);
+    for (int i = 0; i < source->workerCount; i++) signalEvent(source->workers[i].start);
+    for (int i = 0; i < source->workerCount; i++) {
+        while (!waitEvent(source->workers[i].done, 1000)) {}
+    }
+
+    // Merge, and find the processes here rather than in the workers: the
+    // owner index isn't safe to share
+    for (int i = 0; i < source->workerCount; i++) {
+        int first = snapshot->count;
+        appendSnapshotRows(snapshot, &source->workers[i].rows);
+        for (int row = first; row < snapshot->count; row++) {
+            findSocketOwner(&source->owners, snapshot->socketInode[row],
+                            &snapshot->programId[row], &snapshot->programName[row]);
+        }
+    }
+    snapshot->hasNamespaces = source->namespaceCount > 1;
+
+    return atomic_load(&source->dumpsRead) > 0 ? 0 : -1;
+}
+
+static void destroyNamespaces(ConnectionSource *base) {
+    NamespaceSource *source = (NamespaceSource *)base;
+
+    atomic_store(&source->stopping, 1);
+    for (int i = 0; i < source->workerCount; i++) {
+        NamespaceWorker *worker = &source->workers[i];
+        signalEvent(worker->start);
+        joinThread(worker->thread);
+        destroyEvent(worker->start);
+        destroyEvent(worker->done);
+        freeSnapshot(&worker->rows);
+    }
+
+    for (int i = 0; i < source->namespaceCount; i++) forgetNamespace(&source->namespaces[i]);
+    free(source->namespaces);
+    free(source->slots);
+    if (source->homeFile >= 0) close(source->homeFile);
+    freeSocketOwners(&source->owners);
+    free(source);
+}
+
+ConnectionSource *createNamespaceSource() {
+    NamespaceSource *source = calloc(1, sizeof(NamespaceSource));
+    if (source == NULL) return NULL;
+    source->base.name = "netns";
+    source->base.collect = collectNamespaces;
+    source->base.destroy = destroyNamespaces;
+    source->homeFile = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    initSocketOwners(&source->owners);
+
+    // Our own namespace goes first, with a socket opened right here. If
+    // that doesn't work, sock_diag isn't there and nothing else will.
+    NetlinkDumper *home = openNetlinkDumper();
+    if (source->homeFile < 0 || home == NULL || indexNamespaces(source, 1) != 0) {
+        closeNetlinkDumper(home);
+        destroyNamespaces(&source->base);
+        return NULL;
+    }
+    addNamespace(source, "/proc/self/ns/net", "host", NULL);
+    if (source->namespaceCount != 1) {
+        closeNetlinkDumper(home);
+        destroyNamespaces(&source->base);
+        return NULL;
+    }
+    source->namespaces[0].dumper = home;
+    close(source->namespaces[0].file);
+    source->namespaces[0].file = -1;
+
+    int workers = getProcessorCount();
+    if (workers > MAX_NAMESPACE_WORKERS) workers = MAX_NAMESPACE_WORKERS;
+    for (int i = 0; i < workers; i++) {
+        NamespaceWorker *worker = &source->workers[source->workerCount];
+        worker->source = source;
+        worker->start = createEvent();
+        worker->done = createEvent();
+        initSnapshot(&worker->rows);
+        if (worker->start != NULL && worker->done != NULL) worker->thread = startThread(runWorker, worker);
+        if (worker->thread == NULL) {
+            if (worker->start != NULL) destroyEvent(worker->start);
+            if (worker->done != NULL) destroyEvent(worker->done);
+            freeSnapshot(&worker->rows);
+            break;
+        }
+        source->workerCount++;
+    }
+    if (source->workerCount == 0) {
+        destroyNamespaces(&source->base);
+        return NULL;
+    }
+
+    return &source->base;
+}
+
+#else
+
+ConnectionSource *createNamespaceSource() {
+    return NULL;
+}
+
+#endif
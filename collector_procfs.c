@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "collector.h"
+#include "string_table.h"
+
+// Read a hex number from text, stopping at the first non-hex character.
+// Returns a pointer just past the digits.
+static const char *readHex(const char *text, const char *end, unsigned long *value) {
+    *value = 0;
+    while (text < end) {
+        char c = *text;
+        int digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else break;
+        *value = (*value << 4) | (unsigned long)digit;
+        text++;
+    }
+    return text;
+}
+
+static const char *skipSpaces(const char *text, const char *end) {
+    while (text < end && (*text == ' ' || *text == '\t')) text++;
+    return text;
+}
+
+static const char *skipField(const char *text, const char *end) {
+    while (text < end && *text != ' ' && *text != '\t') text++;
+    return skipSpaces(text, end);
+}
+
+// Read an "ADDRESS:PORT" field. The kernel prints the address as 32-bit
+// words in host byte order, so each word goes straight back into memory.
+static const char *readEndpoint(const char *text, const char *end, AddressFamily family,
+                                unsigned char address[16], unsigned short *port) {
+    unsigned char bytes[16];
+    int words = (family == ADDRESS_IPV6) ? 4 : 1;
+
+    for (int i = 0; i < words; i++) {
+        const char *wordEnd = (text + 8 < end) ? text + 8 : end;
+        unsigned long word;
+        text = readHex(text, wordEnd, &word);
+        unsigned int word32 = (unsigned int)word;
+        memcpy(bytes + i * 4, &word32, 4);
+    }
+
+    if (family == ADDRESS_IPV6) {
+        setIpv6Address(address, bytes);
+    } else {
+        unsigned int ipv4;
+        memcpy(&ipv4, bytes, 4);
+        setIpv4Address(address, ipv4);
+    }
+
+    if (text < end && *text == ':') text++;
+    unsigned long portValue;
+    text = readHex(text, end, &portValue);
+    *port = (unsigned short)portValue;
+    return text;
+}
+
+void parseProcNetTable(const char *text, size_t length, AddressFamily family, ConnectionProtocol protocol,
+                       SocketOwners *owners, ConnectionSnapshot *snapshot) {
+    const char *end = text + length;
+
+    // The first line is the column header
+    const char *line = memchr(text, '\n', length);
+    if (line == NULL) return;
+    line++;
+
+    while (line < end) {
+        const char *lineEnd = memchr(line, '\n', (size_t)(end - line));
+        if (lineEnd == NULL) lineEnd = end;
+
+        // "  sl  local_address rem_address   st ..."
+        const char *field = skipSpaces(line, lineEnd);
+        field = memchr(field, ':', (size_t)(lineEnd - field));
+        if (field == NULL) {
+            line = lineEnd + 1;
+            continue;
+        }
+        field = skipSpaces(field + 1, lineEnd);
+
+        NetworkConnection connection;
+        field = readEndpoint(field, lineEnd, family, connection.localAddress, &connection.localPort);
+        field = skipSpaces(field, lineEnd);
+        field = readEndpoint(field, lineEnd, family, connection.remoteAddress, &connection.remotePort);
+        field = skipSpaces(field, lineEnd);
+
+        unsigned long state;
+        field = readHex(field, lineEnd, &state);
+
+        connection.family = (unsigned char)family;
+        connection.protocol = (unsigned char)protocol;
+        if (protocol == PROTOCOL_UDP && state == LINUX_UDP_UNCONNECTED) {
+            // Unconnected UDP socket, same as what the Windows table shows
+            connection.state = STATE_LISTENING;
+        } else {
+            connection.state = (unsigned char)getLinuxTcpState((int)state);
+        }
+
+        connection.programId = 0;
+        connection.programName = PROGRAM_NAME_UNKNOWN;
+
+        // "... st tx_queue:rx_queue tr:tm->when retrnsmt uid timeout inode"
+        if (owners != NULL) {
+            field = skipSpaces(field, lineEnd);
+            for (int skip = 0; skip < 5; skip++) field = skipField(field, lineEnd);
+
+            unsigned long long inode = 0;
+            while (field < lineEnd && *field >= '0' && *field <= '9') inode = inode * 10 + (unsigned long long)(*field++ - '0');
+            findSocketOwner(owners, inode, &connection.programId, &connection.programName);
+        }
+
+        addSnapshotRow(snapshot, &connection);
+        line = lineEnd + 1;
+    }
+}
+
+#ifdef __linux__
+
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct {
+    ConnectionSource base;
+    char *buffer;           // Holds one whole /proc/net file
+    size_t bufferSize;
+    SocketOwners owners;    // Which process has each socket
+} ProcfsSource;
+
+// Read a whole /proc file into the source's buffer. /proc files report a
+// size of 0, so we have to keep reading until the end. Plain open/read is
+// used instead of fopen so there's no FILE to allocate every refresh.
+static long readWholeFile(ProcfsSource *procfs, const char *path) {
+    int file = open(path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) return -1;
+
+    size_t used = 0;
+    while (1) {
+        if (used == procfs->bufferSize) {
+            size_t newSize = procfs->bufferSize ? procfs->bufferSize * 2 : 65536;
+            char *newBuffer = trackedRealloc(procfs->buffer, newSize);
+            if (newBuffer == NULL) {
+                printf("Error: Out of memory\n");
+                close(file);
+                return -1;
+            }
+            procfs->buffer = newBuffer;
+            procfs->bufferSize = newSize;
+        }
+
+        ssize_t got = read(file, procfs->buffer + used, procfs->bufferSize - used);
+        if (got <= 0) break;
+        used += (size_t)got;
+    }
+
+    close(file);
+    return (long)used;
+}
+
+static int collectProcfs(ConnectionSource *source, ConnectionSnapshot *snapshot) {
+    ProcfsSource *procfs = (ProcfsSource *)source;
+    static const struct {
+        const char *path;
+        AddressFamily family;
+        ConnectionProtocol protocol;
+    } tables[] = {
+        {"/proc/net/tcp", ADDRESS_IPV4, PROTOCOL_TCP},
+        {"/proc/net/tcp6", ADDRESS_IPV6, PROTOCOL_TCP},
+        {"/proc/net/udp", ADDRESS_IPV4, PROTOCOL_UDP},
+        {"/proc/net/udp6", ADDRESS_IPV6, PROTOCOL_UDP},
+    };
+    int tablesRead = 0;
+
+    refreshSocketOwners(&procfs->owners);
+    for (size_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+        // tcp6/udp6 are missing when IPv6 is turned off, that's fine
+        long length = readWholeFile(procfs, tables[i].path);
+        if (length < 0) continue;
+
+        parseProcNetTable(procfs->buffer, (size_t)length, tables[i].family, tables[i].protocol,
+                          &procfs->owners, snapshot);
+        tablesRead++;
+    }
+
+    return tablesRead > 0 ? 0 : -1;
+}
+
+static void destroyProcfs(ConnectionSource *source) {
+    ProcfsSource *procfs = (ProcfsSource *)source;
+    trackedFree(procfs->buffer);
+    freeSocketOwners(&procfs->owners);
+    free(procfs);
+}
+
+ConnectionSource *createProcfsSource() {
+    FILE *check = fopen("/proc/net/tcp", "r");
+    if (check == NULL) return NULL;
+    fclose(check);
+
+    ProcfsSource *procfs = calloc(1, sizeof(ProcfsSource));
+    if (procfs == NULL) return NULL;
+
+    procfs->base.name = "procfs";
+    procfs->base.collect = collectProcfs;
+    procfs->base.destroy = destroyProcfs;
+    initSocketOwners(&procfs->owners);
+    return &procfs->base;
+}
+
+#else
+
+ConnectionSource *createProcfsSource() {
+    return NULL;
+}
+
+#endif
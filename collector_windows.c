@@ -0,0 +1,358 @@
+#include "arena.h"
+#include "collector.h"
+#include "string_table.h"
+#include "services.h"
+
+#ifdef _WIN32
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <iphlpapi.h>   // For IP information
+#include <tlhelp32.h>   // For process names
+
+// for compiler to use these files
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "iphlpapi.lib")
+
+// pid -> program name, so we only ask Windows for the process list when
+// a pid we haven't seen turns up
+typedef struct {
+    DWORD pid;
+    unsigned int programName;
+} ProcessName;
+
+// The tables are read into buffers that are kept between refreshes and
+// only grown when Windows says they are too small, so a normal refresh
+// is a single GetExtendedTcpTable/GetExtendedUdpTable call with no
+// malloc/free. The "owner pid" tables also say which process has each
+// socket.
+typedef struct {
+    ConnectionSource base;
+    MIB_TCPTABLE_OWNER_PID* tcpTable;
+    DWORD tcpTableSize;
+    MIB_UDPTABLE_OWNER_PID* udpTable;
+    DWORD udpTableSize;
+    MIB_TCP6TABLE_OWNER_PID* tcp6Table;     // IPv6 has its own tables
+    DWORD tcp6TableSize;
+    MIB_UDP6TABLE_OWNER_PID* udp6Table;
+    DWORD udp6TableSize;
+
+    ProcessName *names;         // Open-addressed by pid, pid 0 = empty slot
+    unsigned int nameSlotCount; // Power of two
+    int namesLoaded;            // The process list was read this refresh
+} WindowsSource;
+
+static WindowsSource windowsSource;
+
+static ConnectionState getConnectionState(DWORD state);
+
+// Read the TCP or UDP owner table for one family (AF_INET or AF_INET6),
+// growing the kept buffer until it fits
+static int readTable(ConnectionProtocol protocol, ULONG family, void **table, DWORD *tableSize) {
+    DWORD bufferSize = *tableSize;
+
+    while (1) {
+        DWORD result = (protocol == PROTOCOL_TCP)
+            ? GetExtendedTcpTable(*table, &bufferSize, TRUE, family, TCP_TABLE_OWNER_PID_ALL, 0)
+            : GetExtendedUdpTable(*table, &bufferSize, TRUE, family, UDP_TABLE_OWNER_PID, 0);
+        if (result == NO_ERROR) return 0;
+        if (result != ERROR_INSUFFICIENT_BUFFER) return -1;
+
+        // The table can grow between the two calls, so leave a bit of room
+        bufferSize += bufferSize / 8;
+        void *newTable = trackedRealloc(*table, bufferSize);
+        if (newTable == NULL) {
+            printf("Error: Out of memory\n");
+            return -1;
+        }
+        *table = newTable;
+        *tableSize = bufferSize;
+    }
+}
+
+static ProcessName *findNameSlot(WindowsSource *windows, DWORD pid) {
+    unsigned int mask = windows->nameSlotCount - 1;
+    unsigned int slot = (unsigned int)(pid * 2654435761u) & mask;
+    while (windows->names[slot].pid != 0 && windows->names[slot].pid != pid) slot = (slot + 1) & mask;
+    return &windows->names[slot];
+}
+
+// Read the whole process list into the name cache, dropping the processes
+// that have gone
+static void loadProcessNames(WindowsSource *windows) {
+    HANDLE processes = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (processes == INVALID_HANDLE_VALUE) return;
+
+    PROCESSENTRY32 entry;
+    entry.dwSize = sizeof(entry);
+    int count = 0;
+    if (Process32First(processes, &entry)) {
+        do count++; while (Process32Next(processes, &entry));
+    }
+
+    unsigned int slotCount = 256;
+    while (slotCount < (unsigned int)count * 2) slotCount *= 2;
+    if (slotCount > windows->nameSlotCount) {
+        ProcessName *names = trackedRealloc(windows->names, slotCount * sizeof(ProcessName));
+        if (names == NULL) {
+            CloseHandle(processes);
+            return;
+        }
+        windows->names = names;
+        windows->nameSlotCount = slotCount;
+    }
+    memset(windows->names, 0, windows->nameSlotCount * sizeof(ProcessName));
+
+    entry.dwSize = sizeof(entry);
+    if (Process32First(processes, &entry)) {
+        do {
+            if (entry.th32ProcessID == 0) continue;
+            ProcessName *name = findNameSlot(windows, entry.th32ProcessID);
+            name->pid = entry.th32ProcessID;
+            name->programName = internProgramName(entry.szExeFile);
+        } while (Process32Next(processes, &entry));
+    }
+    CloseHandle(processes);
+}
+
+// Program name for a pid. The process list is read again (at most once a
+// refresh) when the pid isn't known yet.
+static unsigned int getProcessName(WindowsSource *windows, DWORD pid) {
+    if (pid == 0) return PROGRAM_NAME_UNKNOWN;
+
+    if (windows->nameSlotCount > 0) {
+        ProcessName *name = findNameSlot(windows, pid);
+        if (name->pid == pid) return name->programName;
+    }
+    if (windows->namesLoaded) return PROGRAM_NAME_UNKNOWN;
+
+    windows->namesLoaded = 1;
+    loadProcessNames(windows);
+    if (windows->nameSlotCount == 0) return PROGRAM_NAME_UNKNOWN;
+    ProcessName *name = findNameSlot(windows, pid);
+    return name->pid == pid ? name->programName : PROGRAM_NAME_UNKNOWN;
+}
+
+// getting TCP information
+static int getTcpConnections(WindowsSource *windows, ConnectionSnapshot *snapshot) {
+    if (readTable(PROTOCOL_TCP, AF_INET, (void **)&windows->tcpTable, &windows->tcpTableSize) != 0) {
+        printf("Error: Could not get TCP connection information\n");
+        return -1;
+    }
+    MIB_TCPTABLE_OWNER_PID* tcpTable = windows->tcpTable;
+
+
+    for (DWORD i = 0; i < tcpTable->dwNumEntries; i++) {
+        MIB_TCPROW_OWNER_PID* row = &tcpTable->table[i];
+        NetworkConnection newConnection;
+        NetworkConnection* connection = &newConnection;
+
+        // Get local address and port (kept binary, printed later)
+        connection->family = ADDRESS_IPV4;
+        setIpv4Address(connection->localAddress, row->dwLocalAddr);
+        connection->localPort = ntohs((u_short)row->dwLocalPort);  // Get port number
+
+        // Get remote address and port
+        setIpv4Address(connection->remoteAddress, row->dwRemoteAddr);
+        connection->remotePort = ntohs((u_short)row->dwRemotePort);
+
+
+        connection->protocol = PROTOCOL_TCP;
+        connection->state = (unsigned char)getConnectionState(row->dwState);
+
+
+        connection->programId = row->dwOwningPid;
+        connection->programName = getProcessName(windows, row->dwOwningPid);
+
+        addSnapshotRow(snapshot, connection);
+    }
+    return 0;
+}
+
+// The same for IPv6. The addresses are already 16 bytes in network order.
+static int getTcp6Connections(WindowsSource *windows, ConnectionSnapshot *snapshot) {
+    if (readTable(PROTOCOL_TCP, AF_INET6, (void **)&windows->tcp6Table, &windows->tcp6TableSize) != 0) {
+        printf("Error: Could not get TCP IPv6 connection information\n");
+        return -1;
+    }
+    MIB_TCP6TABLE_OWNER_PID* tcpTable = windows->tcp6Table;
+
+    for (DWORD i = 0; i < tcpTable->dwNumEntries; i++) {
+        MIB_TCP6ROW_OWNER_PID* row = &tcpTable->table[i];
+        NetworkConnection connection;
+
+        connection.family = ADDRESS_IPV6;
+        setIpv6Address(connection.localAddress, row->ucLocalAddr);
+        connection.localPort = ntohs((u_short)row->dwLocalPort);
+        setIpv6Address(connection.remoteAddress, row->ucRemoteAddr);
+        connection.remotePort = ntohs((u_short)row->dwRemotePort);
+        connection.protocol = PROTOCOL_TCP;
+        connection.state = (unsigned char)getConnectionState(row->dwState);
+        connection.programId = row->dwOwningPid;
+        connection.programName = getProcessName(windows, row->dwOwningPid);
+
+        addSnapshotRow(snapshot, &connection);
+    }
+    return 0;
+}
+
+// Only guess from the port when we don't know the process: whatever the
+// services table calls it ("domain", "ntp", "netbios-ns", ...)
+static unsigned int guessUdpProgram(unsigned short port) {
+    const char *service = getServiceName(port, PROTOCOL_UDP);
+    return service != NULL ? internProgramName(service) : PROGRAM_NAME_UNKNOWN;
+}
+
+// getting UDP connection information
+static int getUdpConnections(WindowsSource *windows, ConnectionSnapshot *snapshot) {
+    if (readTable(PROTOCOL_UDP, AF_INET, (void **)&windows->udpTable, &windows->udpTableSize) != 0) {
+        printf("Error: Could not get UDP connection information\n");
+        return -1;  // Stop if there's an error
+    }
+    MIB_UDPTABLE_OWNER_PID* udpTable = windows->udpTable;
+
+
+    for (DWORD i = 0; i < udpTable->dwNumEntries; i++) {
+        MIB_UDPROW_OWNER_PID* row = &udpTable->table[i];
+        NetworkConnection newConnection;
+        NetworkConnection* connection = &newConnection;
+
+        // Get local address and port
+        connection->family = ADDRESS_IPV4;
+        setIpv4Address(connection->localAddress, row->dwLocalAddr);
+        connection->localPort = ntohs((u_short)row->dwLocalPort);  // Get port number
+
+        // UDP doesn't have a remote address because it's connectionless
+        setIpv4Address(connection->remoteAddress, 0);
+        connection->remotePort = 0;
+
+        // Set protocol and state
+        connection->protocol = PROTOCOL_UDP;
+        connection->state = STATE_LISTENING;
+
+
+        connection->programId = row->dwOwningPid;
+        connection->programName = getProcessName(windows, row->dwOwningPid);
+        if (connection->programName == PROGRAM_NAME_UNKNOWN) {
+            connection->programName = guessUdpProgram(connection->localPort);
+        }
+
+        addSnapshotRow(snapshot, connection);
+    }
+    return 0;
+}
+
+static int getUdp6Connections(WindowsSource *windows, ConnectionSnapshot *snapshot) {
+    static const unsigned char noAddress[16] = {0};
+
+    if (readTable(PROTOCOL_UDP, AF_INET6, (void **)&windows->udp6Table, &windows->udp6TableSize) != 0) {
+        printf("Error: Could not get UDP IPv6 connection information\n");
+        return -1;
+    }
+    MIB_UDP6TABLE_OWNER_PID* udpTable = windows->udp6Table;
+
+    for (DWORD i = 0; i < udpTable->dwNumEntries; i++) {
+        MIB_UDP6ROW_OWNER_PID* row = &udpTable->table[i];
+        NetworkConnection connection;
+
+        connection.family = ADDRESS_IPV6;
+        setIpv6Address(connection.localAddress, row->ucLocalAddr);
+        connection.localPort = ntohs((u_short)row->dwLocalPort);
+        setIpv6Address(connection.remoteAddress, noAddress);
+        connection.remotePort = 0;
+        connection.protocol = PROTOCOL_UDP;
+        connection.state = STATE_LISTENING;
+        connection.programId = row->dwOwningPid;
+        connection.programName = getProcessName(windows, row->dwOwningPid);
+        if (connection.programName == PROGRAM_NAME_UNKNOWN) {
+            connection.programName = guessUdpProgram(connection.localPort);
+        }
+
+        addSnapshotRow(snapshot, &connection);
+    }
+    return 0;
+}
+
+// Convert a Windows TCP state number to ours
+static ConnectionState getConnectionState(DWORD state) {
+    switch (state) {
+        case MIB_TCP_STATE_CLOSED:
+            return STATE_CLOSED;
+        case MIB_TCP_STATE_LISTEN:
+            return STATE_LISTENING;
+        case MIB_TCP_STATE_SYN_SENT:
+            return STATE_SYN_SENT;
+        case MIB_TCP_STATE_SYN_RCVD:
+            return STATE_SYN_RCVD;
+        case MIB_TCP_STATE_ESTAB:
+            return STATE_ESTABLISHED;
+        case MIB_TCP_STATE_FIN_WAIT1:
+            return STATE_FIN_WAIT1;
+        case MIB_TCP_STATE_FIN_WAIT2:
+            return STATE_FIN_WAIT2;
+        case MIB_TCP_STATE_CLOSE_WAIT:
+            return STATE_CLOSE_WAIT;
+        case MIB_TCP_STATE_CLOSING:
+            return STATE_CLOSING;
+        case MIB_TCP_STATE_LAST_ACK:
+            return STATE_LAST_ACK;
+        case MIB_TCP_STATE_TIME_WAIT:
+            return STATE_TIME_WAIT;
+        case MIB_TCP_STATE_DELETE_TCB:
+            return STATE_DELETE_TCB;
+        default:
+            return STATE_UNKNOWN;
+    }
+}
+
+static int collectWindows(ConnectionSource *source, ConnectionSnapshot *snapshot) {
+    WindowsSource *windows = (WindowsSource *)source;
+    windows->namesLoaded = 0;
+
+    // One table we can't read still leaves the others worth showing
+    int tablesRead = 0;
+    tablesRead += getTcpConnections(windows, snapshot) == 0;
+    tablesRead += getTcp6Connections(windows, snapshot) == 0;
+    tablesRead += getUdpConnections(windows, snapshot) == 0;
+    tablesRead += getUdp6Connections(windows, snapshot) == 0;
+    return tablesRead > 0 ? 0 : -1;
+}
+
+static void destroyWindows(ConnectionSource *source) {
+    WindowsSource *windows = (WindowsSource *)source;
+    trackedFree(windows->tcpTable);
+    trackedFree(windows->udpTable);
+    windows->tcpTable = NULL;
+    windows->tcpTableSize = 0;
+    windows->udpTable = NULL;
+    windows->udpTableSize = 0;
+    trackedFree(windows->tcp6Table);
+    trackedFree(windows->udp6Table);
+    windows->tcp6Table = NULL;
+    windows->tcp6TableSize = 0;
+    windows->udp6Table = NULL;
+    windows->udp6TableSize = 0;
+    trackedFree(windows->names);
+    windows->names = NULL;
+    windows->nameSlotCount = 0;
+}
+
+ConnectionSource *createWindowsSource() {
+    windowsSource.base.name = "windows";
+    windowsSource.base.collect = collectWindows;
+    windowsSource.base.destroy = destroyWindows;
+    return &windowsSource.base;
+}
+
+#else
+
+// The IP Helper API only exists on Windows
+ConnectionSource *createWindowsSource() {
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include <string.h>
+#include "compress.h"
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+
+static unsigned int read32(const unsigned char *p) {
+    unsigned int value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+static unsigned int hashSequence(unsigned int sequence) {
+    return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// The bytes after a 15 in the token: 255s, then what's left
+static int putLength(unsigned char *out, size_t *o, size_t capacity, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (*o >= capacity) return -1;
+        out[(*o)++] = 255;
+    }
+    if (*o >= capacity) return -1;
+    out[(*o)++] = (unsigned char)length;
+    return 0;
+}
+
+// One sequence: literals, then a match unless offset is 0
+static int putSequence(unsigned char *out, size_t *o, size_t capacity, const unsigned char *literals, size_t literalCount,
+                       size_t offset, size_t matchLength) {
+    if (*o >= capacity) return -1;
+    size_t token = *o;
+    size_t matchExtra = offset ? matchLength - MIN_MATCH : 0;
+    out[token] = (unsigned char)(((literalCount < 15 ? literalCount : 15) << 4) | (matchExtra < 15 ? matchExtra : 15));
+    (*o)++;
+
+    if (literalCount >= 15 && putLength(out, o, capacity, literalCount - 15) != 0) return -1;
+    if (capacity - *o < literalCount) return -1;
+    memcpy(out + *o, literals, literalCount);
+    *o += literalCount;
+    if (offset == 0) return 0;
+
+    if (capacity - *o < 2) return -1;
+    out[(*o)++] = (unsigned char)offset;
+    out[(*o)++] = (unsigned char)(offset >> 8);
+    if (matchExtra >= 15 && putLength(out, o, capacity, matchExtra - 15) != 0) return -1;
+    return 0;
+}
+
+size_t compressBlock(const unsigned char *in, size_t size, unsigned char *out, size_t capacity) {
+    unsigned int table[1 << HASH_BITS];     // Last position each hash was seen at
+    memset(table, 0, sizeof(table));
+
+    size_t o = 0;
+    size_t anchor = 0;      // Start of the literals not written yet
+    size_t i = 0;
+    while (i + MIN_MATCH <= size) {
+        unsigned int sequence = read32(in + i);
+        unsigned int hash = hashSequence(sequence);
+        size_t candidate = table[hash];
+        table[hash] = (unsigned int)i;
+
+        if (candidate >= i || i - candidate > MAX_OFFSET || read32(in + candidate) != sequence) {
+            // Step faster through data that isn't matching, like LZ4 does
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+
+        size_t length = MIN_MATCH;
+        while (i + length < size && in[candidate + length] == in[i + length]) length++;
+        if (putSequence(out, &o, capacity, in + anchor, i - anchor, i - candidate, length) != 0) return 0;
+        i += length;
+        anchor = i;
+    }
+
+    if (putSequence(out, &o, capacity, in + anchor, size - anchor, 0, 0) != 0) return 0;
+    return o;
+}
+
+// The bytes after a 15 in the token
+static int getLength(const unsigned char *in, size_t size, size_t *i, size_t *length) {
+    unsigned char more;
+    do {
+        if (*i >= size) return -1;
+        more = in[(*i)++];
+        *length += more;
+    } while (more == 255);
+    return 0;
+}
+
+int expandBlock(const unsigned char *in, size_t size, unsigned char *out, size_t outSize) {
+    size_t i = 0, o = 0;
+
+    while (i < size) {
+        unsigned char token = in[i++];
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 && getLength(in, size, &i, &literalCount) != 0) return -1;
+        if (literalCount > size - i || literalCount > outSize - o) return -1;
+        memcpy(out + o, in + i, literalCount);
+        i += literalCount;
+        o += literalCount;
+        if (i == size) break;       // The last sequence has no match
+
+        if (size - i < 2) return -1;
+        size_t offset = (size_t)in[i] | ((size_t)in[i + 1] << 8);
+        i += 2;
+        size_t length = token & 15;
+        if (length == 15 && getLength(in, size, &i, &length) != 0) return -1;
+        length += MIN_MATCH;
+        if (offset == 0 || offset > o || length > outSize - o) return -1;
+
+        // Byte by byte: the match may overlap what it is writing
+        for (size_t n = 0; n < length; n++, o++) out[o] = out[o - offset];
+    }
+    return o == outSize ? 0 : -1;
+}
@@ -0,0 +1,27 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+// A small LZ77 block compressor, for what the fleet agent sends. The
+// format is the LZ4 block one: each sequence is a token (literal count
+// and match length, 4 bits each, 15 meaning more bytes of up to 255
+// follow), the literals, a 2-byte offset back into what was already
+// written and the rest of the match length. The last sequence is
+// literals only. Connection rows repeat a lot (the same local address,
+// the same few ports and programs), so even this simple matcher shrinks
+// a keyframe several times over.
+
+// Worst case for size bytes that don't compress at all
+#define COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Compress size bytes into out. Returns the compressed size, or 0 when it
+// doesn't fit in capacity.
+size_t compressBlock(const unsigned char *in, size_t size, unsigned char *out, size_t capacity);
+
+// Expand a block that must come out to exactly outSize bytes. Checks every
+// length and offset, so a damaged or hostile block can't write outside
+// out. Returns 0, or -1 when the block is bad.
+int expandBlock(const unsigned char *in, size_t size, unsigned char *out, size_t outSize);
+
+#endif
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <string.h>
+#include "network_monitoring.h"
+#include "arena.h"
+
+static const unsigned char ipv4MappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+void setIpv4Address(unsigned char address[16], unsigned int networkOrderAddress) {
+    memcpy(address, ipv4MappedPrefix, 12);
+    memcpy(address + 12, &networkOrderAddress, 4);
+}
+
+void setIpv6Address(unsigned char address[16], const unsigned char bytes[16]) {
+    memcpy(address, bytes, 16);
+}
+
+AddressScope getAddressScope(const unsigned char address[16]) {
+    unsigned long long high, low;
+    memcpy(&high, address, 8);
+    memcpy(&low, address + 8, 8);
+
+    if (high == 0 && memcmp(address + 8, ipv4MappedPrefix + 8, 4) == 0) {
+        unsigned int ipv4 = ((unsigned int)address[12] << 24) | ((unsigned int)address[13] << 16) |
+                            ((unsigned int)address[14] << 8) | address[15];
+        if (ipv4 == 0) return SCOPE_UNSPECIFIED;
+        if ((ipv4 & 0xFF000000u) == 0x7F000000u) return SCOPE_LOOPBACK;
+        if ((ipv4 & 0xFFFF0000u) == 0xA9FE0000u) return SCOPE_LINK_LOCAL;
+        if ((ipv4 & 0xFF000000u) == 0x0A000000u || (ipv4 & 0xFFF00000u) == 0xAC100000u ||
+            (ipv4 & 0xFFFF0000u) == 0xC0A80000u || (ipv4 & 0xFFC00000u) == 0x64400000u) {
+            return SCOPE_PRIVATE;
+        }
+        if ((ipv4 & 0xF0000000u) == 0xE0000000u || ipv4 == 0xFFFFFFFFu) return SCOPE_MULTICAST;
+        return SCOPE_PUBLIC;
+    }
+
+    if (high == 0 && low == 0) return SCOPE_UNSPECIFIED;
+    if (high == 0 && memcmp(address + 8, "\0\0\0\0\0\0\0\1", 8) == 0) return SCOPE_LOOPBACK;
+    if (address[0] == 0xFE && (address[1] & 0xC0) == 0x80) return SCOPE_LINK_LOCAL;
+    if ((address[0] & 0xFE) == 0xFC) return SCOPE_PRIVATE;
+    if (address[0] == 0xFF) return SCOPE_MULTICAST;
+    return SCOPE_PUBLIC;
+}
+
+AddressFamily getNetworkKey(const unsigned char address[16], unsigned char key[16]) {
+    memset(key, 0, 16);
+    if (memcmp(address, ipv4MappedPrefix, 12) == 0) {
+        memcpy(key, address, 15);
+        return ADDRESS_IPV4;
+    }
+    memcpy(key, address, 8);
+    return ADDRESS_IPV6;
+}
+
+const char *getScopeName(AddressScope scope) {
+    switch (scope) {
+        case SCOPE_UNSPECIFIED: return "UNSPECIFIED";
+        case SCOPE_LOOPBACK: return "LOOPBACK";
+        case SCOPE_LINK_LOCAL: return "LINK_LOCAL";
+        case SCOPE_PRIVATE: return "PRIVATE";
+        case SCOPE_MULTICAST: return "MULTICAST";
+        case SCOPE_PUBLIC: return "PUBLIC";
+        default: return "UNKNOWN";
+    }
+}
+
+static int parseIpv4(const char *text, unsigned char bytes[4]) {
+    for (int part = 0; part < 4; part++) {
+        if (*text < '0' || *text > '9') return -1;
+        unsigned int value = 0;
+        while (*text >= '0' && *text <= '9') {
+            value = value * 10 + (unsigned int)(*text++ - '0');
+            if (value > 255) return -1;
+        }
+        bytes[part] = (unsigned char)value;
+        if (part < 3 && *text++ != '.') return -1;
+    }
+    return *text == '\0' ? 0 : -1;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Read an IPv6 address, including the "::" short form and a dotted IPv4
+// address at the end (::ffff:10.0.0.1)
+static int parseIpv6(const char *text, unsigned char bytes[16]) {
+    unsigned char parsed[16];
+    int length = 0;         // Bytes read so far
+    int gap = -1;           // Where "::" was, in bytes
+
+    if (text[0] == ':' && text[1] == ':') {
+        gap = 0;
+        text += 2;
+    }
+
+    while (*text != '\0') {
+        if (length == 16) return -1;
+
+        // A dotted IPv4 address takes up the last four bytes
+        const char *end = text;
+        while (hexValue(*end) >= 0) end++;
+        if (*end == '.') {
+            if (length > 12 || parseIpv4(text, parsed + length) != 0) return -1;
+            length += 4;
+            break;
+        }
+
+        unsigned int group = 0;
+        int digits = 0;
+        while (hexValue(*text) >= 0) {
+            group = (group << 4) | (unsigned int)hexValue(*text++);
+            if (++digits > 4) return -1;
+        }
+        if (digits == 0) return -1;
+        parsed[length++] = (unsigned char)(group >> 8);
+        parsed[length++] = (unsigned char)group;
+
+        if (*text == '\0') break;
+        if (*text++ != ':') return -1;
+        if (*text == ':') {
+            if (gap >= 0) return -1;
+            gap = length;
+            text++;
+        } else if (*text == '\0') {
+            return -1;
+        }
+    }
+
+    if (gap >= 0 && length == 16) return -1;   // "::" has to stand for at least one group
+    if (gap < 0) {
+        if (length != 16) return -1;
+        memcpy(bytes, parsed, 16);
+        return 0;
+    }
+
+    // Fill in the zeros the "::" stood for
+    memset(bytes, 0, 16);
+    memcpy(bytes, parsed, (size_t)gap);
+    memcpy(bytes + 16 - (length - gap), parsed + gap, (size_t)(length - gap));
+    return 0;
+}
+
+int parseAddress(const char *text, unsigned char address[16], AddressFamily *family) {
+    unsigned char bytes[16];
+
+    if (strchr(text, ':') == NULL) {
+        unsigned int ipv4;
+        if (parseIpv4(text, bytes) != 0) return -1;
+        memcpy(&ipv4, bytes, 4);
+        setIpv4Address(address, ipv4);
+        *family = ADDRESS_IPV4;
+        return 0;
+    }
+
+    if (parseIpv6(text, bytes) != 0) return -1;
+    setIpv6Address(address, bytes);
+    *family = ADDRESS_IPV6;
+    return 0;
+}
+
+// Write an IPv6 address the usual short way: hex groups, with the longest
+// run of zero groups replaced by "::"
+static void formatIpv6(const unsigned char *bytes, char *buffer, size_t bufferSize) {
+    unsigned int groups[8];
+    int bestStart = -1, bestLength = 0;
+
+    // IPv4 sockets on a dual-stack listener show up as ::ffff:a.b.c.d
+    if (memcmp(bytes, ipv4MappedPrefix, 12) == 0) {
+        snprintf(buffer, bufferSize, "::ffff:%u.%u.%u.%u", bytes[12], bytes[13], bytes[14], bytes[15]);
+        return;
+    }
+
+    for (int i = 0; i < 8; i++) groups[i] = ((unsigned int)bytes[i * 2] << 8) | bytes[i * 2 + 1];
+
+    for (int i = 0; i < 8;) {
+        if (groups[i] != 0) {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < 8 && groups[i] == 0) i++;
+        if (i - start > bestLength && i - start > 1) {
+            bestStart = start;
+            bestLength = i - start;
+        }
+    }
+
+    size_t used = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < 8 && used < bufferSize; i++) {
+        if (i == bestStart) {
+            used += (size_t)snprintf(buffer + used, bufferSize - used, "::");
+            i += bestLength - 1;
+            continue;
+        }
+        const char *separator = (i == 0 || i == bestStart + bestLength) ? "" : ":";
+        used += (size_t)snprintf(buffer + used, bufferSize - used, "%s%x", separator, groups[i]);
+    }
+}
+
+void formatAddress(const NetworkConnection *connection, int remote, char *buffer, size_t bufferSize) {
+    const unsigned char *bytes = remote ? connection->remoteAddress : connection->localAddress;
+
+    // UDP doesn't have a remote address because it's connectionless
+    if (remote && connection->protocol == PROTOCOL_UDP && connection->remotePort == 0) {
+        snprintf(buffer, bufferSize, "*");
+        return;
+    }
+
+    if (connection->family == ADDRESS_IPV4) {
+        snprintf(buffer, bufferSize, "%u.%u.%u.%u", bytes[12], bytes[13], bytes[14], bytes[15]);
+    } else {
+        formatIpv6(bytes, buffer, bufferSize);
+    }
+}
+
+const char *getStateName(ConnectionState state) {
+    switch (state) {
+        case STATE_CLOSED: return "CLOSED";
+        case STATE_LISTENING: return "LISTENING";
+        case STATE_SYN_SENT: return "SYN_SENT";
+        case STATE_SYN_RCVD: return "SYN_RCVD";
+        case STATE_ESTABLISHED: return "ESTABLISHED";
+        case STATE_FIN_WAIT1: return "FIN_WAIT1";
+        case STATE_FIN_WAIT2: return "FIN_WAIT2";
+        case STATE_CLOSE_WAIT: return "CLOSE_WAIT";
+        case STATE_CLOSING: return "CLOSING";
+        case STATE_LAST_ACK: return "LAST_ACK";
+        case STATE_TIME_WAIT: return "TIME_WAIT";
+        case STATE_DELETE_TCB: return "DELETE_TCB";
+        default: return "UNKNOWN";
+    }
+}
+
+const char *getProtocolName(ConnectionProtocol protocol) {
+    return protocol == PROTOCOL_UDP ? "UDP" : "TCP";
+}
+
+static unsigned long long mix(unsigned long long hash, unsigned long long value) {
+    hash ^= value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+unsigned int hashConnectionKey(unsigned char protocol, unsigned int networkNamespace,
+                               const unsigned char localAddress[16], unsigned short localPort,
+                               const unsigned char remoteAddress[16], unsigned short remotePort) {
+    unsigned long long words[4];
+    memcpy(words, localAddress, 16);
+    memcpy(words + 2, remoteAddress, 16);
+
+    unsigned long long hash = protocol | ((unsigned long long)networkNamespace << 8);
+    hash = mix(hash, ((unsigned long long)localPort << 16) | remotePort);
+    for (int i = 0; i < 4; i++) hash = mix(hash, words[i]);
+    hash *= 0xFF51AFD7ED558CCDull;
+    return (unsigned int)(hash ^ (hash >> 32));
+}
+
+unsigned int hashConnection(const NetworkConnection *connection) {
+    return hashConnectionKey(connection->protocol, 0, connection->localAddress, connection->localPort,
+                             connection->remoteAddress, connection->remotePort);
+}
+
+int sameConnectionKey(const NetworkConnection *a, const NetworkConnection *b) {
+    return a->localPort == b->localPort && a->remotePort == b->remotePort && a->protocol == b->protocol &&
+           memcmp(a->localAddress, b->localAddress, 16) == 0 && memcmp(a->remoteAddress, b->remoteAddress, 16) == 0;
+}
+
+static const NetworkConnection *getIndexedRow(const void *rows, size_t stride, unsigned int slotValue) {
+    return (const NetworkConnection *)((const unsigned char *)rows + (size_t)(slotValue - 1) * stride);
+}
+
+int resizeConnectionIndex(ConnectionIndex *index, int capacity, const void *rows, size_t stride, int count) {
+    unsigned int slotCount = 16;
+    while (slotCount < (unsigned int)capacity * 2) slotCount *= 2;
+    if (slotCount != index->slotCount) {
+        unsigned int *slots = trackedRealloc(index->slots, slotCount * sizeof(unsigned int));
+        if (slots == NULL) return -1;
+        index->slots = slots;
+        index->slotCount = slotCount;
+    }
+
+    clearConnectionIndex(index);
+    for (int row = 0; row < count; row++) {
+        const NetworkConnection *connection = getIndexedRow(rows, stride, (unsigned int)row + 1);
+        *findConnectionSlot(index, connection, rows, stride) = (unsigned int)row + 1;
+    }
+    return 0;
+}
+
+unsigned int *findConnectionSlot(const ConnectionIndex *index, const NetworkConnection *connection,
+                                 const void *rows, size_t stride) {
+    unsigned int mask = index->slotCount - 1;
+    unsigned int slot = hashConnection(connection) & mask;
+    while (index->slots[slot] != 0 && !sameConnectionKey(getIndexedRow(rows, stride, index->slots[slot]), connection)) {
+        slot = (slot + 1) & mask;
+    }
+    return &index->slots[slot];
+}
+
+void removeConnectionSlot(ConnectionIndex *index, unsigned int *slot, const void *rows, size_t stride) {
+    unsigned int mask = index->slotCount - 1;
+    unsigned int hole = (unsigned int)(slot - index->slots);
+    for (unsigned int next = (hole + 1) & mask; index->slots[next] != 0; next = (next + 1) & mask) {
+        unsigned int home = hashConnection(getIndexedRow(rows, stride, index->slots[next])) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            index->slots[hole] = index->slots[next];
+            hole = next;
+        }
+    }
+    index->slots[hole] = 0;
+}
+
+void clearConnectionIndex(ConnectionIndex *index) {
+    if (index->slots != NULL) memset(index->slots, 0, index->slotCount * sizeof(unsigned int));
+}
+
+void freeConnectionIndex(ConnectionIndex *index) {
+    trackedFree(index->slots);
+    index->slots = NULL;
+    index->slotCount = 0;
+}
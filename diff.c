@@ -0,0 +1,214 @@
+#include <string.h>
+#include "diff.h"
+
+#define DIFF_MIN_EVENTS 64
+
+void initDiff(ConnectionDiff *diff) {
+    memset(diff, 0, sizeof(*diff));
+}
+
+void freeDiff(ConnectionDiff *diff) {
+    trackedFree(diff->events);
+    trackedFree(diff->slots);
+    trackedFree(diff->seen);
+    trackedFree(diff->matches);
+    memset(diff, 0, sizeof(*diff));
+}
+
+const char *getEventName(ConnectionEventType type) {
+    switch (type) {
+        case EVENT_OPENED: return "OPENED";
+        case EVENT_CLOSED: return "CLOSED";
+        case EVENT_STATE_CHANGED: return "CHANGED";
+        default: return "UNKNOWN";
+    }
+}
+
+// Hash a row's 5-tuple (and namespace, where the same tuple can be in use
+// in two namespaces at once)
+static unsigned int hashRow(const ConnectionSnapshot *snapshot, int row) {
+    return hashConnectionKey(snapshot->protocol[row], snapshot->networkNamespace[row], snapshot->localAddress[row],
+                             snapshot->localPort[row], snapshot->remoteAddress[row], snapshot->remotePort[row]);
+}
+
+// sameConnectionKey plus the namespace, read straight from the columns
+static int sameKey(const ConnectionSnapshot *a, int rowA, const ConnectionSnapshot *b, int rowB) {
+    return a->localPort[rowA] == b->localPort[rowB] &&
+           a->remotePort[rowA] == b->remotePort[rowB] &&
+           a->protocol[rowA] == b->protocol[rowB] &&
+           a->networkNamespace[rowA] == b->networkNamespace[rowB] &&
+           memcmp(a->localAddress[rowA], b->localAddress[rowB], 16) == 0 &&
+           memcmp(a->remoteAddress[rowA], b->remoteAddress[rowB], 16) == 0;
+}
+
+// Make sure the work space fits rows from the older snapshot, and the
+// match list the rows of the new one
+static int reserveIndex(ConnectionDiff *diff, int rows, int newRows) {
+    unsigned int slotCount = 64;
+    while (slotCount < (unsigned int)rows * 2) slotCount *= 2;
+
+    if (slotCount > diff->slotCount) {
+        unsigned int *slots = trackedRealloc(diff->slots, slotCount * sizeof(unsigned int));
+        if (slots == NULL) return -1;
+        diff->slots = slots;
+        diff->slotCount = slotCount;
+    }
+    if (rows > diff->seenCapacity) {
+        unsigned char *seen = trackedRealloc(diff->seen, (size_t)rows);
+        if (seen == NULL) return -1;
+        diff->seen = seen;
+        diff->seenCapacity = rows;
+    }
+    if (newRows > diff->matchCapacity) {
+        int *matches = trackedRealloc(diff->matches, (size_t)newRows * sizeof(int));
+        if (matches == NULL) return -1;
+        diff->matches = matches;
+        diff->matchCapacity = newRows;
+    }
+    return 0;
+}
+
+static ConnectionEvent *addEvent(ConnectionDiff *diff, ConnectionEventType type) {
+    if (diff->count == diff->capacity) {
+        int newCapacity = diff->capacity ? diff->capacity * 2 : DIFF_MIN_EVENTS;
+        ConnectionEvent *events = trackedRealloc(diff->events, (size_t)newCapacity * sizeof(ConnectionEvent));
+        if (events == NULL) {
+            diff->droppedCount++;
+            return NULL;
+        }
+        diff->events = events;
+        diff->capacity = newCapacity;
+    }
+
+    ConnectionEvent *event = &diff->events[diff->count++];
+    event->type = (unsigned char)type;
+    event->oldState = STATE_UNKNOWN;
+    if (type == EVENT_OPENED) diff->openedCount++;
+    else if (type == EVENT_CLOSED) diff->closedCount++;
+    else diff->changedCount++;
+    return event;
+}
+
+void diffSnapshots(ConnectionDiff *diff, const ConnectionSnapshot *previous, const ConnectionSnapshot *current) {
+    diff->count = 0;
+    diff->openedCount = 0;
+    diff->closedCount = 0;
+    diff->changedCount = 0;
+    diff->droppedCount = 0;
+
+    if (reserveIndex(diff, previous->count, current->count) != 0) {
+        diff->droppedCount = previous->count + current->count;
+        return;
+    }
+
+    // Index the older snapshot by 5-tuple. Only the slots the table can
+    // reach are cleared, not the whole kept array.
+    unsigned int mask = 64;
+    while (mask < (unsigned int)previous->count * 2) mask *= 2;
+    mask--;
+    memset(diff->slots, 0, (mask + 1) * sizeof(unsigned int));
+    if (previous->count > 0) memset(diff->seen, 0, (size_t)previous->count);
+
+    for (int row = 0; row < previous->count; row++) {
+        unsigned int slot = hashRow(previous, row) & mask;
+        while (diff->slots[slot] != 0) slot = (slot + 1) & mask;
+        diff->slots[slot] = (unsigned int)row + 1;
+    }
+
+    // Look every new row up. Two sockets can share a 5-tuple (SO_REUSEPORT
+    // listeners), so a match that was already used is skipped.
+    for (int row = 0; row < current->count; row++) {
+        unsigned int slot = hashRow(current, row) & mask;
+        int match = -1;
+
+        while (diff->slots[slot] != 0) {
+            int candidate = (int)diff->slots[slot] - 1;
+            if (!diff->seen[candidate] && sameKey(previous, candidate, current, row)) {
+                match = candidate;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+
+        diff->matches[row] = match;
+        if (match < 0) {
+            ConnectionEvent *event = addEvent(diff, EVENT_OPENED);
+            if (event != NULL) getSnapshotRow(current, row, &event->connection);
+            continue;
+        }
+
+        diff->seen[match] = 1;
+        if (previous->state[match] != current->state[row]) {
+            ConnectionEvent *event = addEvent(diff, EVENT_STATE_CHANGED);
+            if (event != NULL) {
+                getSnapshotRow(current, row, &event->connection);
+                event->oldState = previous->state[match];
+            }
+        }
+    }
+
+    // Whatever wasn't matched has gone away
+    for (int row = 0; row < previous->count; row++) {
+        if (diff->seen[row]) continue;
+        ConnectionEvent *event = addEvent(diff, EVENT_CLOSED);
+        if (event != NULL) {
+            getSnapshotRow(previous, row, &event->connection);
+            event->oldState = previous->state[row];
+        }
+    }
+}
+
+// Counter change over the interval. A counter that went backwards means the
+// 5-tuple now belongs to a new socket, so it starts again from 0.
+static unsigned long long counterDelta(unsigned long long now, unsigned long long before) {
+    return now >= before ? now - before : now;
+}
+
+void computeConnectionRates(const ConnectionDiff *diff, const ConnectionSnapshot *previous, ConnectionSnapshot *current) {
+    if (!current->hasMetrics) return;
+
+    unsigned long long elapsed = current->collectedAt - previous->collectedAt;
+    if (elapsed == 0 || previous->count == 0 || diff->matchCapacity < current->count || diff->droppedCount > 0) {
+        // Nothing to compare against (or the diff ran out of memory and
+        // its matches are left over from an older one): leave the rates at 0
+        return;
+    }
+
+    // One pass over the packed counter columns. The only branch is whether
+    // the row was there last time.
+    const int *matches = diff->matches;
+    for (int row = 0; row < current->count; row++) {
+        int match = matches[row];
+        unsigned long long sentBefore = match >= 0 ? previous->bytesSent[match] : 0;
+        unsigned long long receivedBefore = match >= 0 ? previous->bytesReceived[match] : 0;
+        unsigned int retransmitsBefore = match >= 0 ? previous->retransmits[match] : 0;
+
+        current->sendRate[row] = counterDelta(current->bytesSent[row], sentBefore) * 1000 / elapsed;
+        current->receiveRate[row] = counterDelta(current->bytesReceived[row], receivedBefore) * 1000 / elapsed;
+        current->newRetransmits[row] = (unsigned int)counterDelta(current->retransmits[row], retransmitsBefore);
+    }
+}
+
+void computeInterfaceChanges(const ConnectionSnapshot *previous, ConnectionSnapshot *current) {
+    if (previous == current || previous->interfaceCount == 0 || current->collectedAt <= previous->collectedAt) return;
+    current->interfaceMillis = current->collectedAt - previous->collectedAt;
+
+    for (int i = 0; i < current->interfaceCount; i++) {
+        InterfaceCounters *now = &current->interfaces[i];
+
+        // The kernel lists them in the same order every time, so the same
+        // place is nearly always the right one
+        const InterfaceCounters *before = NULL;
+        if (i < previous->interfaceCount && strcmp(previous->interfaces[i].name, now->name) == 0) {
+            before = &previous->interfaces[i];
+        }
+        for (int j = 0; before == NULL && j < previous->interfaceCount; j++) {
+            if (strcmp(previous->interfaces[j].name, now->name) == 0) before = &previous->interfaces[j];
+        }
+        if (before == NULL) continue;
+
+        for (int counter = 0; counter < INTERFACE_COUNTER_COUNT; counter++) {
+            now->change[counter] = counterDelta(now->total[counter], before->total[counter]);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "snapshot.h"
+
+typedef enum {
+    EVENT_OPENED,           // In this snapshot but not the last one
+    EVENT_CLOSED,           // In the last snapshot but gone now
+    EVENT_STATE_CHANGED     // In both, with a different state
+} ConnectionEventType;
+
+typedef struct {
+    unsigned char type;             // ConnectionEventType
+    unsigned char oldState;         // State before, for EVENT_STATE_CHANGED
+    NetworkConnection connection;   // The row now (or as last seen, if closed)
+} ConnectionEvent;
+
+// What changed between two snapshots. Connections are matched on their
+// 5-tuple (protocol, local address and port, remote address and port)
+// and network namespace through a hash index of the older snapshot. All the memory is kept
+// between calls, so once the table size settles a diff doesn't allocate.
+typedef struct {
+    ConnectionEvent *events;
+    int count;
+    int capacity;
+    int openedCount;
+    int closedCount;
+    int changedCount;
+    int droppedCount;           // Events we had no memory for
+
+    // Work space
+    unsigned int *slots;        // Open-addressed index of row + 1 (0 = empty)
+    unsigned int slotCount;     // Power of two
+    unsigned char *seen;        // Which rows of the older snapshot were matched
+    int seenCapacity;
+    int *matches;               // Row in the older snapshot for each new row, -1 = opened
+    int matchCapacity;
+} ConnectionDiff;
+
+void initDiff(ConnectionDiff *diff);
+void freeDiff(ConnectionDiff *diff);
+
+// Fill diff with the events that turn previous into current
+void diffSnapshots(ConnectionDiff *diff, const ConnectionSnapshot *previous, const ConnectionSnapshot *current);
+
+// Turn the tcp_info counters into per-second rates, using the row matches
+// from the last diffSnapshots between the same two snapshots. A row that
+// just opened counts everything it has as sent during the interval.
+void computeConnectionRates(const ConnectionDiff *diff, const ConnectionSnapshot *previous, ConnectionSnapshot *current);
+
+// How much each interface's counters went up since the snapshot before.
+// Interfaces are matched by name; one that wasn't there has no changes yet.
+void computeInterfaceChanges(const ConnectionSnapshot *previous, ConnectionSnapshot *current);
+
+const char *getEventName(ConnectionEventType type);
+
+#endif
@@ -0,0 +1,330 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "exporter.h"
+#include "network_monitoring.h"
+#include "string_table.h"
+
+#define REQUEST_TIMEOUT 2000    // Milliseconds a scraper gets to send its request
+
+// Add text to the end of a body, growing it as needed. Only the refresh
+// loop calls this, and only on the body nobody is reading.
+static void appendText(MetricsBody *body, const char *format, ...) {
+    while (1) {
+        va_list arguments;
+        va_start(arguments, format);
+        int needed = vsnprintf(body->text + body->length, body->capacity - body->length, format, arguments);
+        va_end(arguments);
+        if (needed < 0) return;
+        if (body->length + (size_t)needed < body->capacity) {
+            body->length += (size_t)needed;
+            return;
+        }
+
+        size_t newCapacity = body->capacity ? body->capacity * 2 : 16384;
+        while (newCapacity <= body->length + (size_t)needed) newCapacity *= 2;
+        char *text = trackedRealloc(body->text, newCapacity);
+        if (text == NULL) return;
+        body->text = text;
+        body->capacity = newCapacity;
+    }
+}
+
+// Label values are quoted, so quotes, backslashes and newlines in them
+// (program names can have anything) need escaping
+static void appendLabel(MetricsBody *body, const char *text) {
+    char escaped[256];
+    size_t length = 0;
+    for (; *text != '\0' && length < sizeof(escaped) - 3; text++) {
+        if (*text == '"' || *text == '\\') escaped[length++] = '\\';
+        if (*text == '\n') {
+            escaped[length++] = '\\';
+            escaped[length++] = 'n';
+            continue;
+        }
+        escaped[length++] = *text;
+    }
+    escaped[length] = '\0';
+    appendText(body, "%s", escaped);
+}
+
+static void appendLowercase(MetricsBody *body, const char *text) {
+    char lower[32];
+    size_t length = 0;
+    for (; *text != '\0' && length < sizeof(lower) - 1; text++) {
+        lower[length++] = (*text >= 'A' && *text <= 'Z') ? (char)(*text - 'A' + 'a') : *text;
+    }
+    lower[length] = '\0';
+    appendText(body, "%s", lower);
+}
+
+static void appendFamily(MetricsBody *body, const char *name, const char *type, const char *help) {
+    appendText(body, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// A group's labels: {port="443",protocol="tcp"}, {program="nginx",pid="12"}
+// or {network="10.1.2.0/24"}
+static void appendGroupLabels(MetricsBody *body, const Aggregation *groups, const AggregateGroup *group) {
+    if (groups->groupBy == GROUP_LOCAL_PORT) {
+        unsigned short port;
+        memcpy(&port, group->key, sizeof(port));
+        appendText(body, "{port=\"%u\",protocol=\"", port);
+        appendLowercase(body, getProtocolName(group->key[2]));
+        appendText(body, "\"}");
+    } else if (groups->groupBy == GROUP_PROGRAM) {
+        unsigned int programId, programName;
+        memcpy(&programId, group->key, sizeof(programId));
+        memcpy(&programName, group->key + 4, sizeof(programName));
+        appendText(body, "{program=\"");
+        appendLabel(body, getProgramNameText(programName));
+        appendText(body, "\",pid=\"%u\"}", programId);
+    } else {
+        char key[128];
+        formatGroupKey(groups, group, key, sizeof(key));
+        appendText(body, "{%s=\"", groups->groupBy == GROUP_REMOTE_NETWORK ? "network" : "group");
+        appendLabel(body, key);
+        appendText(body, "\"}");
+    }
+}
+
+// Aggregate the snapshot and write the biggest groups: how many sockets
+// each has and, for sources with the TCP counters, their summed rates.
+// The tables keep their size, so a host being scanned doesn't turn into
+// millions of series.
+static void appendGroups(MetricsBody *body, Aggregation *groups, GroupBy groupBy, const ConnectionSnapshot *snapshot,
+                         const char *prefix, const char *help) {
+    int top[METRICS_TOP_GROUPS];
+    char name[64];
+
+    resetAggregation(groups, groupBy);
+    aggregateSnapshot(groups, snapshot, NULL, 0);
+    int count = getTopGroups(groups, top, METRICS_TOP_GROUPS);
+
+    snprintf(name, sizeof(name), "%s_connections", prefix);
+    appendFamily(body, name, "gauge", help);
+    for (int i = 0; i < count; i++) {
+        appendText(body, "%s", name);
+        appendGroupLabels(body, groups, &groups->groups[top[i]]);
+        appendText(body, " %llu\n", groups->groups[top[i]].count);
+    }
+    if (!snapshot->hasMetrics) return;
+
+    for (int direction = 0; direction < 2; direction++) {
+        snprintf(name, sizeof(name), "%s_%s_bytes_per_second", prefix, direction == 0 ? "send" : "receive");
+        appendFamily(body, name, "gauge", direction == 0 ? "Bytes per second sent, summed over the group."
+                                                         : "Bytes per second received, summed over the group.");
+        for (int i = 0; i < count; i++) {
+            const AggregateGroup *group = &groups->groups[top[i]];
+            appendText(body, "%s", name);
+            appendGroupLabels(body, groups, group);
+            appendText(body, " %llu\n", direction == 0 ? group->sendRate : group->receiveRate);
+        }
+    }
+}
+
+// The monitor's own numbers: each stage as a summary with a few
+// quantiles from its histogram, then CPU, memory and what was dropped
+static void appendSelfStats(MetricsBody *body, const SelfStats *self) {
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+
+    appendFamily(body, "netmon_self_stage_seconds", "summary", "Time spent in each stage of a refresh.");
+    for (int stage = 0; stage < PIPELINE_STAGE_COUNT; stage++) {
+        const LatencyHistogram *histogram = &self->stages[stage];
+        const char *name = getStageName((PipelineStage)stage);
+        if (histogram->count == 0) continue;   // The screen stages with --daemon
+        for (int i = 0; i < 3; i++) {
+            appendText(body, "netmon_self_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", name, quantiles[i],
+                       (double)getLatencyPercentile(histogram, quantiles[i] * 100) / 1e9);
+        }
+        appendText(body, "netmon_self_stage_seconds_sum{stage=\"%s\"} %.9f\n", name, (double)histogram->total / 1e9);
+        appendText(body, "netmon_self_stage_seconds_count{stage=\"%s\"} %llu\n", name, histogram->count);
+    }
+
+    appendFamily(body, "netmon_self_cpu_seconds", "counter", "CPU time the monitor has used.");
+    appendText(body, "netmon_self_cpu_seconds_total %.6f\n", (double)self->cpuMicros / 1e6);
+    appendFamily(body, "netmon_self_cpu_budget_exceeded", "counter", "Seconds-long windows the monitor went over its CPU budget in.");
+    appendText(body, "netmon_self_cpu_budget_exceeded_total %llu\n", self->overBudget);
+    appendFamily(body, "netmon_self_resident_bytes", "gauge", "Memory the monitor has resident.");
+    appendText(body, "netmon_self_resident_bytes %llu\n", self->residentBytes);
+    appendFamily(body, "netmon_self_rows", "counter", "Snapshot rows processed.");
+    appendText(body, "netmon_self_rows_total %llu\n", self->rowsProcessed);
+    appendFamily(body, "netmon_self_logged_bytes", "counter", "Bytes written to the connection log.");
+    appendText(body, "netmon_self_logged_bytes_total %llu\n", self->bytesLogged);
+    appendFamily(body, "netmon_self_dropped", "counter", "Samples lost: rows and changes out of memory, log records, skipped refreshes.");
+    appendText(body, "netmon_self_dropped_total{what=\"rows\"} %llu\n", self->droppedRows);
+    appendText(body, "netmon_self_dropped_total{what=\"changes\"} %llu\n", self->droppedEvents);
+    appendText(body, "netmon_self_dropped_total{what=\"log_records\"} %llu\n", self->droppedRecords);
+    appendText(body, "netmon_self_dropped_total{what=\"ticks\"} %llu\n", self->missedTicks);
+}
+
+static void buildBody(MetricsExporter *exporter, MetricsBody *body, const ConnectionSnapshot *snapshot,
+                      const SelfStats *self) {
+    body->length = 0;
+
+    // Protocol and state, counted over just those two columns
+    int counts[2][STATE_COUNT];
+    memset(counts, 0, sizeof(counts));
+    for (int row = 0; row < snapshot->count; row++) counts[snapshot->protocol[row] & 1][snapshot->state[row]]++;
+
+    appendFamily(body, "netmon_connections", "gauge", "Sockets by protocol and state.");
+    for (int protocol = 0; protocol < 2; protocol++) {
+        for (int state = 0; state < STATE_COUNT; state++) {
+            if (counts[protocol][state] == 0) continue;
+            appendText(body, "netmon_connections{protocol=\"");
+            appendLowercase(body, getProtocolName((ConnectionProtocol)protocol));
+            appendText(body, "\",state=\"");
+            appendLowercase(body, getStateName((ConnectionState)state));
+            appendText(body, "\"} %d\n", counts[protocol][state]);
+        }
+    }
+
+    appendGroups(body, &exporter->ports, GROUP_LOCAL_PORT, snapshot, "netmon_port",
+                 "Sockets on the busiest local ports.");
+    appendGroups(body, &exporter->programs, GROUP_PROGRAM, snapshot, "netmon_process",
+                 "Sockets per process, for the processes with the most.");
+    appendGroups(body, &exporter->networks, GROUP_REMOTE_NETWORK, snapshot, "netmon_remote_network",
+                 "Sockets per remote /24 or /64, for the networks with the most.");
+
+    appendFamily(body, "netmon_remote_networks_replaced", "gauge",
+                 "Remote networks that didn't fit the table this refresh (0 means the counts are exact).");
+    appendText(body, "netmon_remote_networks_replaced %llu\n", exporter->networks.replacedCount);
+    appendFamily(body, "netmon_scrapes", "counter", "Metrics requests answered.");
+    appendText(body, "netmon_scrapes_total %llu\n", atomic_load(&exporter->scrapes));
+    if (self != NULL) appendSelfStats(body, self);
+    appendText(body, "# EOF\n");
+}
+
+void publishMetrics(MetricsExporter *exporter, const ConnectionSnapshot *snapshot, const SelfStats *self) {
+    int spare = 1 - atomic_load(&exporter->current);
+
+    // A scraper is still sending the spare (it was current until the last
+    // flip). Skip this one rather than wait; it gets the next refresh.
+    if (atomic_load(&exporter->bodies[spare].readers) != 0) {
+        exporter->skipped++;
+        return;
+    }
+
+    buildBody(exporter, &exporter->bodies[spare], snapshot, self);
+    atomic_store(&exporter->current, spare);
+    exporter->published++;
+}
+
+// Take hold of the current body so it can't be rebuilt while it's being
+// sent. The check after taking hold catches a flip that happened in
+// between.
+static MetricsBody *holdBody(MetricsExporter *exporter) {
+    while (1) {
+        int current = atomic_load(&exporter->current);
+        MetricsBody *body = &exporter->bodies[current];
+        atomic_fetch_add(&body->readers, 1);
+        if (atomic_load(&exporter->current) == current) return body;
+        atomic_fetch_sub(&body->readers, 1);
+    }
+}
+
+static void sendReply(NetSocket client, const char *status, const char *type, const char *text, size_t length,
+                      int withBody) {
+    char header[256];
+    int headerLength = snprintf(header, sizeof(header),
+                                "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                                status, type, length);
+    if (sendTcp(client, header, (size_t)headerLength) != 0) return;
+    if (withBody && length > 0) sendTcp(client, text, length);
+}
+
+static void answerScrape(MetricsExporter *exporter, NetSocket client) {
+    char request[4096];
+    size_t length = 0;
+
+    // Only the request line and headers matter; there's no body to a GET
+    while (length < sizeof(request) - 1) {
+        int received = receiveTcp(client, request + length, sizeof(request) - 1 - length, REQUEST_TIMEOUT);
+        if (received <= 0) break;
+        length += (size_t)received;
+        request[length] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL) break;
+    }
+    request[length] = '\0';
+
+    int head = strncmp(request, "HEAD ", 5) == 0;
+    if (strncmp(request, "GET ", 4) != 0 && !head) {
+        static const char message[] = "Only GET is supported\n";
+        sendReply(client, "405 Method Not Allowed", "text/plain", message, sizeof(message) - 1, 1);
+        return;
+    }
+    const char *path = request + (head ? 5 : 4);
+    if (strncmp(path, "/metrics", 8) != 0 || (path[8] != ' ' && path[8] != '?')) {
+        static const char message[] = "Try /metrics\n";
+        sendReply(client, "404 Not Found", "text/plain", message, sizeof(message) - 1, 1);
+        return;
+    }
+
+    // Prometheus asks for OpenMetrics when it can take it; anything else
+    // gets the same text labelled as the older format, which reads it fine
+    const char *type = strstr(request, "application/openmetrics-text") != NULL
+                           ? "application/openmetrics-text; version=1.0.0; charset=utf-8"
+                           : "text/plain; version=0.0.4; charset=utf-8";
+
+    MetricsBody *body = holdBody(exporter);
+    if (body->length == 0) {
+        static const char message[] = "No refresh yet\n";
+        sendReply(client, "503 Service Unavailable", "text/plain", message, sizeof(message) - 1, 1);
+    } else {
+        sendReply(client, "200 OK", type, body->text, body->length, !head);
+    }
+    atomic_fetch_sub(&body->readers, 1);
+    atomic_fetch_add(&exporter->scrapes, 1);
+}
+
+static int runServer(void *argument) {
+    MetricsExporter *exporter = argument;
+
+    while (!atomic_load(&exporter->stopping)) {
+        NetSocket client = acceptTcp(exporter->listener, 200);
+        if (client == NO_SOCKET) continue;
+        answerScrape(exporter, client);
+        closeTcp(client);
+    }
+    return 0;
+}
+
+int startMetricsExporter(MetricsExporter *exporter, const char *address, int port) {
+    memset(exporter, 0, sizeof(*exporter));
+    exporter->listener = listenTcp(address, port);
+    if (exporter->listener == NO_SOCKET) return -1;
+
+    if (initAggregation(&exporter->ports, GROUP_LOCAL_PORT, DEFAULT_MAX_GROUPS) != 0 ||
+        initAggregation(&exporter->programs, GROUP_PROGRAM, DEFAULT_MAX_GROUPS) != 0 ||
+        initAggregation(&exporter->networks, GROUP_REMOTE_NETWORK, DEFAULT_MAX_GROUPS) != 0) {
+        stopMetricsExporter(exporter);
+        return -1;
+    }
+
+    for (int i = 0; i < METRICS_THREADS; i++) {
+        exporter->threads[i] = startThread(runServer, exporter);
+        if (exporter->threads[i] == NULL) break;
+        exporter->threadCount++;
+    }
+    if (exporter->threadCount == 0) {
+        stopMetricsExporter(exporter);
+        return -1;
+    }
+    return 0;
+}
+
+void stopMetricsExporter(MetricsExporter *exporter) {
+    atomic_store(&exporter->stopping, 1);
+    for (int i = 0; i < exporter->threadCount; i++) joinThread(exporter->threads[i]);
+    exporter->threadCount = 0;
+
+    if (exporter->listener != NO_SOCKET) closeTcp(exporter->listener);
+    exporter->listener = NO_SOCKET;
+    for (int i = 0; i < 2; i++) {
+        trackedFree(exporter->bodies[i].text);
+        exporter->bodies[i].text = NULL;
+    }
+    freeAggregation(&exporter->ports);
+    freeAggregation(&exporter->programs);
+    freeAggregation(&exporter->networks);
+}
@@ -0,0 +1,60 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <stdatomic.h>
+#include "snapshot.h"
+#include "aggregate.h"
+#include "platform.h"
+#include "selfstats.h"
+
+// A small HTTP server that answers GET /metrics with the connection
+// counts in the OpenMetrics text format, for Prometheus to scrape.
+//
+// The refresh loop writes the whole response body once per refresh with
+// publishMetrics, into whichever of two buffers scrapers aren't reading,
+// then flips which one is current. Scrapers only ever send the current
+// buffer as it is: they never build anything, never collect and never
+// wait for the refresh loop, however many of them come at once. If a
+// scraper is still sending the other buffer when the next body is ready,
+// that body is skipped rather than waiting for it.
+
+#define METRICS_DEFAULT_PORT 9469
+#define METRICS_THREADS 2               // Scrapes answered at the same time
+#define METRICS_TOP_GROUPS 20           // Ports, processes and networks exported
+
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+    atomic_int readers;                 // Scrapers sending it right now
+} MetricsBody;
+
+typedef struct {
+    NetSocket listener;
+    Thread *threads[METRICS_THREADS];
+    int threadCount;
+    atomic_int stopping;
+
+    MetricsBody bodies[2];
+    atomic_int current;                 // Which body scrapers get
+
+    // Reused every refresh
+    Aggregation ports;
+    Aggregation programs;
+    Aggregation networks;
+
+    atomic_ullong scrapes;
+    unsigned long long published;
+    unsigned long long skipped;         // Bodies not published because the spare was busy
+} MetricsExporter;
+
+// Listen on address:port (e.g. "127.0.0.1" to keep it local). Returns 0,
+// or -1 if the port can't be opened.
+int startMetricsExporter(MetricsExporter *exporter, const char *address, int port);
+void stopMetricsExporter(MetricsExporter *exporter);
+
+// Build the body for this snapshot and make it the one scrapers get.
+// self (if not NULL) adds the monitor's own stage timings and usage.
+void publishMetrics(MetricsExporter *exporter, const ConnectionSnapshot *snapshot, const SelfStats *self);
+
+#endif
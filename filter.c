@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filter.h"
+#include "string_table.h"
+
+// Rows are checked a block at a time. Each condition runs as its own
+// simple loop over one column of the block, ANDing into keep[], which the
+// compiler can turn into SIMD code, and the block's columns are still in
+// cache when the next condition looks at them.
+#define FILTER_BLOCK 1024
+
+void clearFilter(ConnectionFilter *filter) {
+    memset(filter, 0, sizeof(*filter));
+}
+
+// Fill in the 64-bit halves from address/prefixLength
+static void prepareFilterPrefix(AddressPrefix *prefix) {
+    unsigned char mask[16];
+
+    for (int i = 0; i < 16; i++) {
+        int bits = prefix->prefixLength - i * 8;
+        if (bits >= 8) mask[i] = 0xFF;
+        else if (bits <= 0) mask[i] = 0;
+        else mask[i] = (unsigned char)(0xFF << (8 - bits));
+        prefix->address[i] &= mask[i];
+    }
+
+    memcpy(&prefix->valueHigh, prefix->address, 8);
+    memcpy(&prefix->valueLow, prefix->address + 8, 8);
+    memcpy(&prefix->maskHigh, mask, 8);
+    memcpy(&prefix->maskLow, mask + 8, 8);
+}
+
+void setPresetFilter(ConnectionFilter *filter, FilterType preset) {
+    clearFilter(filter);
+
+    switch (preset) {
+        case FILTER_LOCAL:
+            // Local means the loopback address, 127.x.x.x or ::1
+            filter->localScopes = SCOPE_LOOPBACK;
+            break;
+        case FILTER_INTERNET:
+            filter->localScopes = SCOPE_ALL & ~SCOPE_LOOPBACK;
+            break;
+        case FILTER_ACTIVE:
+            filter->stateMask = 1u << STATE_ESTABLISHED;
+            break;
+        case FILTER_LISTENING:
+            filter->stateMask = 1u << STATE_LISTENING;
+            break;
+        case FILTER_TCP:
+            filter->protocolMask = 1u << PROTOCOL_TCP;
+            break;
+        case FILTER_UDP:
+            filter->protocolMask = 1u << PROTOCOL_UDP;
+            break;
+        default:
+            break;
+    }
+}
+
+// Get the name of the current filter
+const char* getFilterName(FilterType filter) {
+    switch (filter) {
+        case FILTER_ALL: return "ALL";
+        case FILTER_LOCAL: return "LOCAL";
+        case FILTER_INTERNET: return "INTERNET";
+        case FILTER_ACTIVE: return "ACTIVE";
+        case FILTER_LISTENING: return "LISTENING";
+        case FILTER_TCP: return "TCP";
+        case FILTER_UDP: return "UDP";
+        default: return "UNKNOWN";
+    }
+}
+
+// Compare words ignoring case, treating '-' and '_' as the same
+static int sameWord(const char *a, const char *b) {
+    while (*a && *b) {
+        char x = (*a == '-') ? '_' : *a;
+        char y = (*b == '-') ? '_' : *b;
+        if (x >= 'a' && x <= 'z') x = (char)(x - 'a' + 'A');
+        if (y >= 'a' && y <= 'z') y = (char)(y - 'a' + 'A');
+        if (x != y) return 0;
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static int parseState(const char *word) {
+    if (sameWord(word, "LISTEN")) return STATE_LISTENING;
+    if (sameWord(word, "ESTAB")) return STATE_ESTABLISHED;
+    for (int state = 0; state < STATE_COUNT; state++) {
+        if (sameWord(word, getStateName((ConnectionState)state))) return state;
+    }
+    return -1;
+}
+
+static int parseScope(const char *word) {
+    if (sameWord(word, "local")) return SCOPE_LOOPBACK;
+    if (sameWord(word, "linklocal")) return SCOPE_LINK_LOCAL;
+    for (unsigned int scope = 1; scope < SCOPE_ALL; scope <<= 1) {
+        if (sameWord(word, getScopeName((AddressScope)scope))) return (int)scope;
+    }
+    return -1;
+}
+
+static int parseNumber(const char *text, unsigned long maximum, unsigned long *value) {
+    char *end;
+    if (*text < '0' || *text > '9') return -1;
+    *value = strtoul(text, &end, 10);
+    return (*end == '\0' && *value <= maximum) ? 0 : -1;
+}
+
+// Parse one value of a "key=value,value" term
+static int parseValue(ConnectionFilter *filter, const char *key, char *value, int negate,
+                      char *error, size_t errorSize) {
+    if (sameWord(key, "proto")) {
+        unsigned int bit;
+        if (sameWord(value, "tcp")) bit = 1u << PROTOCOL_TCP;
+        else if (sameWord(value, "udp")) bit = 1u << PROTOCOL_UDP;
+        else {
+            snprintf(error, errorSize, "Unknown protocol '%s'", value);
+            return -1;
+        }
+        filter->protocolMask |= bit;
+        return 0;
+    }
+
+    if (sameWord(key, "state")) {
+        int state = parseState(value);
+        if (state < 0) {
+            snprintf(error, errorSize, "Unknown state '%s'", value);
+            return -1;
+        }
+        filter->stateMask |= 1u << state;
+        return 0;
+    }
+
+    if (sameWord(key, "lport") || sameWord(key, "rport")) {
+        PortFilter *ports = sameWord(key, "lport") ? &filter->localPorts : &filter->remotePorts;
+        unsigned long low, high;
+        char *dash = strchr(value, '-');
+
+        if (negate) {
+            snprintf(error, errorSize, "'%s!=' is not supported, list the ports you want", key);
+            return -1;
+        }
+        if (dash != NULL) *dash = '\0';
+        if (parseNumber(value, 65535, &low) != 0 ||
+            (dash != NULL && parseNumber(dash + 1, 65535, &high) != 0)) {
+            snprintf(error, errorSize, "Bad port '%s'", value);
+            return -1;
+        }
+        if (dash == NULL) high = low;
+        if (ports->count == MAX_FILTER_RANGES || high < low) {
+            snprintf(error, errorSize, "Too many or bad port ranges for %s", key);
+            return -1;
+        }
+        ports->ranges[ports->count].low = (unsigned short)low;
+        ports->ranges[ports->count].high = (unsigned short)high;
+        ports->count++;
+        return 0;
+    }
+
+    if (sameWord(key, "lnet") || sameWord(key, "rnet")) {
+        // "=" and "!=" networks go in lists of their own, so a row has to
+        // be in one of the first and in none of the second
+        int local = sameWord(key, "lnet");
+        PrefixFilter *networks = negate ? (local ? &filter->localExcluded : &filter->remoteExcluded) :
+                                          (local ? &filter->localNetworks : &filter->remoteNetworks);
+        AddressPrefix *prefix = &networks->prefixes[networks->count];
+        AddressFamily family;
+        unsigned long length;
+        char *slash = strchr(value, '/');
+
+        if (networks->count == MAX_FILTER_PREFIXES) {
+            snprintf(error, errorSize, "Too many networks for %s", key);
+            return -1;
+        }
+        if (slash != NULL) *slash = '\0';
+        if (parseAddress(value, prefix->address, &family) != 0) {
+            snprintf(error, errorSize, "Bad address '%s'", value);
+            return -1;
+        }
+        unsigned long maximum = (family == ADDRESS_IPV4) ? 32 : 128;
+        if (slash == NULL) length = maximum;
+        else if (parseNumber(slash + 1, maximum, &length) != 0) {
+            snprintf(error, errorSize, "Bad prefix length '/%s'", slash + 1);
+            return -1;
+        }
+        prefix->prefixLength = (int)length + (family == ADDRESS_IPV4 ? 96 : 0);
+        prepareFilterPrefix(prefix);
+        networks->count++;
+        networks->negate = negate;
+        return 0;
+    }
+
+    if (sameWord(key, "lscope") || sameWord(key, "rscope")) {
+        int scope = parseScope(value);
+        if (scope < 0) {
+            snprintf(error, errorSize, "Unknown scope '%s' (loopback, link_local, private, multicast, public, unspecified)",
+                     value);
+            return -1;
+        }
+        if (sameWord(key, "lscope")) filter->localScopes |= (unsigned int)scope;
+        else filter->remoteScopes |= (unsigned int)scope;
+        return 0;
+    }
+
+    if (sameWord(key, "pid")) {
+        unsigned long pid;
+        if (negate || parseNumber(value, 0xFFFFFFFFul, &pid) != 0 || filter->pidCount == MAX_FILTER_PIDS) {
+            snprintf(error, errorSize, "Bad pid '%s'", value);
+            return -1;
+        }
+        filter->pids[filter->pidCount++] = (unsigned int)pid;
+        return 0;
+    }
+
+    if (sameWord(key, "prog")) {
+        if (negate || filter->programCount == MAX_FILTER_PROGRAMS) {
+            snprintf(error, errorSize, "Bad program '%s'", value);
+            return -1;
+        }
+        // Interning the name turns the check into a number compare
+        filter->programs[filter->programCount++] = internProgramName(value);
+        return 0;
+    }
+
+    snprintf(error, errorSize, "Unknown filter '%s' (use proto, state, lport, rport, lnet, rnet, lscope, rscope, pid, prog)", key);
+    return -1;
+}
+
+int parseFilter(const char *text, ConnectionFilter *filter, char *error, size_t errorSize) {
+    char copy[MAX_FILTER_TEXT];
+    ConnectionFilter parsed;
+
+    clearFilter(&parsed);
+    if (strlen(text) >= sizeof(copy)) {
+        snprintf(error, errorSize, "Filter is too long");
+        return -1;
+    }
+    strcpy(copy, text);
+
+    for (char *term = strtok(copy, " \t\r\n"); term != NULL; term = strtok(NULL, " \t\r\n")) {
+        char *equals = strchr(term, '=');
+        if (equals == NULL || equals == term) {
+            snprintf(error, errorSize, "Expected key=value, got '%s'", term);
+            return -1;
+        }
+
+        int negate = (equals[-1] == '!');
+        if (negate) equals[-1] = '\0';
+        *equals = '\0';
+
+        // A negated set term collects its values on their own, and then
+        // takes them out of what the terms before it allowed (or out of
+        // everything): "state!=listen" means every other state
+        unsigned int *mask = NULL;
+        unsigned int all = 0;
+        if (negate && sameWord(term, "proto")) {
+            mask = &parsed.protocolMask;
+            all = 0x3u;
+        } else if (negate && sameWord(term, "state")) {
+            mask = &parsed.stateMask;
+            all = (1u << STATE_COUNT) - 1;
+        } else if (negate && sameWord(term, "lscope")) {
+            mask = &parsed.localScopes;
+            all = SCOPE_ALL;
+        } else if (negate && sameWord(term, "rscope")) {
+            mask = &parsed.remoteScopes;
+            all = SCOPE_ALL;
+        }
+        unsigned int base = mask != NULL ? *mask : 0;
+        if (mask != NULL) *mask = 0;
+
+        char *value = equals + 1;
+        while (value != NULL) {
+            char *comma = strchr(value, ',');
+            if (comma != NULL) *comma = '\0';
+            if (parseValue(&parsed, term, value, negate, error, errorSize) != 0) return -1;
+            value = comma ? comma + 1 : NULL;
+        }
+
+        if (mask != NULL) {
+            *mask = (base ? base : all) & ~*mask;
+            if (*mask == 0) parsed.matchNone = 1;
+        }
+    }
+
+    strcpy(parsed.text, text);
+    *filter = parsed;
+    return 0;
+}
+
+// keep[i] &= bit values[i] of mask
+static void keepMaskedValues(unsigned char *keep, const unsigned char *values, int count, unsigned int mask) {
+    for (int i = 0; i < count; i++) {
+        keep[i] &= (unsigned char)((mask >> values[i]) & 1u);
+    }
+}
+
+static void keepPorts(unsigned char *keep, const unsigned short *ports, int count, const PortFilter *filter) {
+    unsigned char hit[FILTER_BLOCK];
+    memset(hit, 0, (size_t)count);
+
+    for (int r = 0; r < filter->count; r++) {
+        unsigned short low = filter->ranges[r].low;
+        unsigned short span = (unsigned short)(filter->ranges[r].high - low);
+        for (int i = 0; i < count; i++) {
+            hit[i] |= (unsigned char)((unsigned short)(ports[i] - low) <= span);
+        }
+    }
+    for (int i = 0; i < count; i++) keep[i] &= hit[i];
+}
+
+static void keepPrefixes(unsigned char *keep, const unsigned char (*addresses)[16], int count,
+                         const PrefixFilter *filter) {
+    unsigned char hit[FILTER_BLOCK];
+    memset(hit, 0, (size_t)count);
+
+    for (int p = 0; p < filter->count; p++) {
+        const AddressPrefix *prefix = &filter->prefixes[p];
+        for (int i = 0; i < count; i++) {
+            unsigned long long high, low;
+            memcpy(&high, addresses[i], 8);
+            memcpy(&low, addresses[i] + 8, 8);
+            hit[i] |= (unsigned char)((((high ^ prefix->valueHigh) & prefix->maskHigh) |
+                                       ((low ^ prefix->valueLow) & prefix->maskLow)) == 0);
+        }
+    }
+
+    unsigned char flip = (unsigned char)(filter->negate ? 1 : 0);
+    for (int i = 0; i < count; i++) keep[i] &= hit[i] ^ flip;
+}
+
+// The scope bits are worked out on the fly; it's a handful of compares
+// on the address, no lookups
+static void keepScopes(unsigned char *keep, const unsigned char (*addresses)[16], int count, unsigned int scopes) {
+    for (int i = 0; i < count; i++) {
+        keep[i] &= (unsigned char)((getAddressScope(addresses[i]) & scopes) != 0);
+    }
+}
+
+static void keepListedValues(unsigned char *keep, const unsigned int *values, int count,
+                             const unsigned int *wanted, int wantedCount) {
+    unsigned char hit[FILTER_BLOCK];
+    memset(hit, 0, (size_t)count);
+
+    for (int w = 0; w < wantedCount; w++) {
+        for (int i = 0; i < count; i++) hit[i] |= (unsigned char)(values[i] == wanted[w]);
+    }
+    for (int i = 0; i < count; i++) keep[i] &= hit[i];
+}
+
+static int filterIsEmpty(const ConnectionFilter *filter) {
+    return filter->protocolMask == 0 && filter->stateMask == 0 &&
+           filter->localPorts.count == 0 && filter->remotePorts.count == 0 &&
+           filter->localNetworks.count == 0 && filter->remoteNetworks.count == 0 &&
+           filter->localExcluded.count == 0 && filter->remoteExcluded.count == 0 &&
+           filter->localScopes == 0 && filter->remoteScopes == 0 &&
+           filter->pidCount == 0 && filter->programCount == 0;
+}
+
+int applyFilter(const ConnectionFilter *filter, const ConnectionSnapshot *snapshot, int *matches) {
+    unsigned char keep[FILTER_BLOCK];
+    int matchCount = 0;
+
+    if (filter->matchNone) return 0;
+    if (filterIsEmpty(filter)) {
+        if (matches != NULL) {
+            for (int i = 0; i < snapshot->count; i++) matches[i] = i;
+        }
+        return snapshot->count;
+    }
+
+    for (int start = 0; start < snapshot->count; start += FILTER_BLOCK) {
+        int count = snapshot->count - start;
+        if (count > FILTER_BLOCK) count = FILTER_BLOCK;
+
+        memset(keep, 1, (size_t)count);
+        if (filter->protocolMask) keepMaskedValues(keep, snapshot->protocol + start, count, filter->protocolMask);
+        if (filter->stateMask) keepMaskedValues(keep, snapshot->state + start, count, filter->stateMask);
+        if (filter->localPorts.count) keepPorts(keep, snapshot->localPort + start, count, &filter->localPorts);
+        if (filter->remotePorts.count) keepPorts(keep, snapshot->remotePort + start, count, &filter->remotePorts);
+        if (filter->localNetworks.count) keepPrefixes(keep, snapshot->localAddress + start, count, &filter->localNetworks);
+        if (filter->remoteNetworks.count) keepPrefixes(keep, snapshot->remoteAddress + start, count, &filter->remoteNetworks);
+        if (filter->localExcluded.count) keepPrefixes(keep, snapshot->localAddress + start, count, &filter->localExcluded);
+        if (filter->remoteExcluded.count) keepPrefixes(keep, snapshot->remoteAddress + start, count, &filter->remoteExcluded);
+        if (filter->localScopes) keepScopes(keep, snapshot->localAddress + start, count, filter->localScopes);
+        if (filter->remoteScopes) keepScopes(keep, snapshot->remoteAddress + start, count, filter->remoteScopes);
+        if (filter->pidCount) keepListedValues(keep, snapshot->programId + start, count, filter->pids, filter->pidCount);
+        if (filter->programCount) {
+            keepListedValues(keep, snapshot->programName + start, count, filter->programs, filter->programCount);
+        }
+
+        if (matches == NULL) {
+            for (int i = 0; i < count; i++) matchCount += keep[i];
+            continue;
+        }
+
+        // Skip eight rows at a time where nothing matched. Inside a group,
+        // write every index and only move on when it matched, so there's
+        // no branch to mispredict.
+        int i = 0;
+        for (; i + 8 <= count; i += 8) {
+            unsigned long long group;
+            memcpy(&group, keep + i, 8);
+            if (group == 0) continue;
+            for (int j = i; j < i + 8; j++) {
+                matches[matchCount] = start + j;
+                matchCount += keep[j];
+            }
+        }
+        for (; i < count; i++) {
+            matches[matchCount] = start + i;
+            matchCount += keep[i];
+        }
+    }
+
+    return matchCount;
+}
+
+static int portMatches(const PortFilter *filter, unsigned short port) {
+    if (filter->count == 0) return 1;
+    for (int r = 0; r < filter->count; r++) {
+        if (port >= filter->ranges[r].low && port <= filter->ranges[r].high) return 1;
+    }
+    return 0;
+}
+
+static int prefixMatches(const PrefixFilter *filter, const unsigned char address[16]) {
+    if (filter->count == 0) return 1;
+
+    unsigned long long high, low;
+    memcpy(&high, address, 8);
+    memcpy(&low, address + 8, 8);
+    for (int p = 0; p < filter->count; p++) {
+        const AddressPrefix *prefix = &filter->prefixes[p];
+        if ((((high ^ prefix->valueHigh) & prefix->maskHigh) | ((low ^ prefix->valueLow) & prefix->maskLow)) == 0) {
+            return !filter->negate;
+        }
+    }
+    return filter->negate;
+}
+
+static int valueListed(const unsigned int *wanted, int wantedCount, unsigned int value) {
+    if (wantedCount == 0) return 1;
+    for (int w = 0; w < wantedCount; w++) {
+        if (wanted[w] == value) return 1;
+    }
+    return 0;
+}
+
+int filterMatchesRow(const ConnectionFilter *filter, const NetworkConnection *connection) {
+    if (filter->matchNone) return 0;
+    if (filter->protocolMask && !((filter->protocolMask >> connection->protocol) & 1u)) return 0;
+    if (filter->stateMask && !((filter->stateMask >> connection->state) & 1u)) return 0;
+    if (filter->localScopes && !(getAddressScope(connection->localAddress) & filter->localScopes)) return 0;
+    if (filter->remoteScopes && !(getAddressScope(connection->remoteAddress) & filter->remoteScopes)) return 0;
+    return portMatches(&filter->localPorts, connection->localPort) &&
+           portMatches(&filter->remotePorts, connection->remotePort) &&
+           prefixMatches(&filter->localNetworks, connection->localAddress) &&
+           prefixMatches(&filter->remoteNetworks, connection->remoteAddress) &&
+           prefixMatches(&filter->localExcluded, connection->localAddress) &&
+           prefixMatches(&filter->remoteExcluded, connection->remoteAddress) &&
+           valueListed(filter->pids, filter->pidCount, connection->programId) &&
+           valueListed(filter->programs, filter->programCount, connection->programName);
+}
@@ -0,0 +1,94 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include "snapshot.h"
+
+#define MAX_FILTER_RANGES 8
+#define MAX_FILTER_PREFIXES 8
+#define MAX_FILTER_PIDS 16
+#define MAX_FILTER_PROGRAMS 8
+#define MAX_FILTER_TEXT 256
+
+typedef struct {
+    unsigned short low;
+    unsigned short high;
+} PortRange;
+
+// An address block like 10.0.0.0/8. IPv4 blocks are stored the IPv6 way,
+// so the prefix length is always out of 128 bits. The address and mask
+// are also kept as two 64-bit halves, which is what the filter loop
+// compares against.
+typedef struct {
+    unsigned char address[16];
+    int prefixLength;
+    unsigned long long valueHigh, valueLow;
+    unsigned long long maskHigh, maskLow;
+} AddressPrefix;
+
+typedef struct {
+    PortRange ranges[MAX_FILTER_RANGES];
+    int count;                  // 0 = any port
+} PortFilter;
+
+typedef struct {
+    AddressPrefix prefixes[MAX_FILTER_PREFIXES];
+    int count;                  // 0 = any address
+    int negate;                 // Match addresses NOT in any prefix
+} PrefixFilter;
+
+// A combination of conditions on a row. Every condition that is set must
+// match (AND). Inside one condition, any of the listed values can match
+// (OR). A condition left empty matches everything, so a term that rules
+// out every value (proto!=tcp,udp) sets matchNone instead.
+typedef struct {
+    int matchNone;              // No row can match
+    unsigned int protocolMask;  // Bit per ConnectionProtocol, 0 = any
+    unsigned int stateMask;     // Bit per ConnectionState, 0 = any
+    PortFilter localPorts;
+    PortFilter remotePorts;
+    PrefixFilter localNetworks;     // lnet=, in any of them
+    PrefixFilter remoteNetworks;
+    PrefixFilter localExcluded;     // lnet!=, in none of them (negate is set)
+    PrefixFilter remoteExcluded;
+    unsigned int localScopes;   // AddressScope bits, 0 = any
+    unsigned int remoteScopes;
+    unsigned int pids[MAX_FILTER_PIDS];
+    int pidCount;
+    unsigned int programs[MAX_FILTER_PROGRAMS];   // Interned program names
+    int programCount;
+    char text[MAX_FILTER_TEXT]; // What the user typed, for showing it
+} ConnectionFilter;
+
+// The old one-at-a-time filters, now just ready-made ConnectionFilters
+typedef enum {
+    FILTER_ALL,         // Show all connections
+    FILTER_LOCAL,       // Show only local connections
+    FILTER_INTERNET,    // Show only remote connections
+    FILTER_ACTIVE,      // Show only connected connections
+    FILTER_LISTENING,   // Show only ports waiting for connections
+    FILTER_TCP,         // Show only TCP connections
+    FILTER_UDP,         // Show only UDP connections
+    FILTER_PRESET_COUNT
+} FilterType;
+
+void clearFilter(ConnectionFilter *filter);
+void setPresetFilter(ConnectionFilter *filter, FilterType preset);
+const char* getFilterName(FilterType filter);
+
+// Parse a filter like "proto=tcp state=established lport=80,443
+// rnet=10.0.0.0/8 lnet!=127.0.0.0/8 rport=1024-65535 pid=42 prog=nginx
+// rscope=private,link_local".
+// Returns 0 on success, or -1 with a message in error.
+int parseFilter(const char *text, ConnectionFilter *filter, char *error, size_t errorSize);
+
+// Check every row of the snapshot in one pass. The index of each matching
+// row is written to matches (room for snapshot->count ints), which can be
+// NULL when only the number of matches is wanted. Returns the number of
+// matching rows.
+int applyFilter(const ConnectionFilter *filter, const ConnectionSnapshot *snapshot, int *matches);
+
+// Check a single row, for code that only has one at hand
+int filterMatchesRow(const ConnectionFilter *filter, const NetworkConnection *connection);
+
+#endif
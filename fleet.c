@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <string.h>
+#include "fleet.h"
+#include "compress.h"
+#include "arena.h"
+
+#define ANSWER_TIMEOUT 30000    // Milliseconds a query waits for the collector
+
+static void putU16(unsigned char *p, unsigned int value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void putU32(unsigned char *p, unsigned int value) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned int getU32(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+size_t packFrame(unsigned char *frame, FleetFrameType type, const unsigned char *body, size_t size, int compress) {
+    unsigned char *out = frame + FLEET_FRAME_HEADER_SIZE;
+    size_t length = compress ? compressBlock(body, size, out, size) : 0;
+    int compressed = length > 0;
+    if (!compressed) {
+        memcpy(out, body, size);
+        length = size;
+    }
+
+    putU32(frame, (unsigned int)length);
+    frame[4] = (unsigned char)type;
+    frame[5] = compressed ? FLEET_COMPRESSED : 0;
+    putU16(frame + 6, 0);
+    putU32(frame + 8, (unsigned int)size);
+    return FLEET_FRAME_HEADER_SIZE + length;
+}
+
+int readFrameHeader(const unsigned char *p, FleetFrameHeader *header) {
+    header->length = getU32(p);
+    header->type = p[4];
+    header->flags = p[5];
+    header->expandedSize = getU32(p + 8);
+
+    if (header->type < FRAME_HELLO || header->type > FRAME_ANSWER) return -1;
+    if (header->length > FLEET_MAX_FRAME || header->expandedSize > FLEET_MAX_FRAME) return -1;
+    if (!(header->flags & FLEET_COMPRESSED) && header->length != header->expandedSize) return -1;
+    return 0;
+}
+
+// Exactly size bytes, or -1
+static int receiveAll(NetSocket socket, unsigned char *buffer, size_t size) {
+    for (size_t done = 0; done < size;) {
+        int received = receiveTcp(socket, buffer + done, size - done, ANSWER_TIMEOUT);
+        if (received <= 0) return -1;
+        done += (size_t)received;
+    }
+    return 0;
+}
+
+int runFleetQuery(const char *host, int port, const char *filterText, int rowsPerHost) {
+    if (initNetworking() != 0) {
+        printf("Error: Could not initialize network functions.\n");
+        return -1;
+    }
+    NetSocket socket = connectTcp(host, port);
+    if (socket == NO_SOCKET) {
+        printf("Error: Could not connect to the collector at %s port %d\n", host, port);
+        cleanupNetworking();
+        return -1;
+    }
+
+    unsigned char body[4 + 1024];
+    unsigned char query[FLEET_FRAME_HEADER_SIZE + sizeof(body)];
+    size_t textLength = strlen(filterText);
+    if (textLength > sizeof(body) - 4) textLength = sizeof(body) - 4;
+    putU32(body, (unsigned int)rowsPerHost);
+    memcpy(body + 4, filterText, textLength);
+    size_t querySize = packFrame(query, FRAME_QUERY, body, 4 + textLength, 0);
+
+    int result = -1;
+    unsigned char header[FLEET_FRAME_HEADER_SIZE];
+    FleetFrameHeader frame;
+    unsigned char *received = NULL;
+    char *text = NULL;
+    if (sendTcp(socket, query, querySize) != 0 ||
+        receiveAll(socket, header, sizeof(header)) != 0) {
+        printf("Error: No answer from the collector\n");
+    } else if (readFrameHeader(header, &frame) != 0 || frame.type != FRAME_ANSWER) {
+        printf("Error: The collector sent something that isn't an answer\n");
+    } else {
+        received = trackedAlloc(frame.length + 1);
+        text = trackedAlloc(frame.expandedSize + 1);
+        if (received == NULL || text == NULL) {
+            printf("Error: Out of memory for the answer\n");
+        } else if (receiveAll(socket, received, frame.length) != 0) {
+            printf("Error: The answer was cut off\n");
+        } else if (!(frame.flags & FLEET_COMPRESSED)) {
+            memcpy(text, received, frame.length);
+            result = 0;
+        } else if (expandBlock(received, frame.length, (unsigned char *)text, frame.expandedSize) == 0) {
+            result = 0;
+        } else {
+            printf("Error: The answer was damaged\n");
+        }
+    }
+
+    if (result == 0) {
+        text[frame.expandedSize] = '\0';
+        fputs(text, stdout);
+    }
+    trackedFree(received);
+    trackedFree(text);
+    closeTcp(socket);
+    cleanupNetworking();
+    return result;
+}
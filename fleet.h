@@ -0,0 +1,219 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <stdatomic.h>
+#include "snapshot.h"
+#include "diff.h"
+#include "binlog.h"
+#include "platform.h"
+
+// Many monitors reporting to one collector. An agent (--send) streams the
+// same records the log gets (STRINGS, KEYFRAME, DELTA) over TCP, and the
+// collector (--fleet-server) keeps every host's current table in memory,
+// so a question like "who is connected to the database, everywhere" is
+// one query (--fleet-query) instead of a grep over every host's log.
+//
+// Everything on the wire is a frame:
+//
+//   length         u32, bytes after this 12-byte header
+//   type           u8, FleetFrameType
+//   flags          u8, FLEET_COMPRESSED when the body is a compressed block
+//   spare          u16
+//   expanded       u32, the body's size once expanded (= length if not)
+//
+// An agent sends one HELLO and then RECORDS frames, each holding log
+// records back to back, batched up to once every FLEET_BATCH_MILLIS and
+// compressed (see compress.h). A query client sends one QUERY and gets
+// one ANSWER back. All numbers are little-endian.
+//
+// The agent never waits for the collector: the refresh loop encodes the
+// records straight into a ring buffer (like the log does) and a sender
+// thread batches, compresses and sends them. When the collector is down
+// nothing is encoded; when it comes back the agent starts over with its
+// names and a keyframe.
+//
+// The collector spreads connections over FLEET_MAX_SHARDS shards, one
+// thread each (at most one per core), each with its own poller (epoll on
+// Linux) and its own lock. A host's table is only ever touched by its own
+// shard, so ingest scales with the cores and shards never wait for each
+// other. A query takes each shard's lock in turn, filters every host's
+// table and adds up the fleet-wide view (top remote networks) as it goes.
+
+#define FLEET_DEFAULT_PORT 9470
+#define FLEET_VERSION 1
+#define FLEET_FRAME_HEADER_SIZE 12
+#define FLEET_MAX_FRAME (16u * 1024 * 1024)     // Bytes in a frame body, expanded or not
+#define FLEET_QUEUE_SIZE (16u * 1024 * 1024)    // Encoded records waiting for the sender
+#define FLEET_BATCH_MILLIS 1000                 // At most one frame a second from an agent
+#define FLEET_KEYFRAME_EVERY 60                 // Records between keyframes
+#define FLEET_RETRY_MIN 1000                    // Milliseconds before reconnecting, doubling
+#define FLEET_RETRY_MAX 30000                   // up to this
+#define FLEET_MAX_SHARDS 16
+#define FLEET_INBOX_SIZE 64                     // New connections waiting for a shard (a power of 2)
+#define FLEET_QUERY_ROWS 20                     // Rows listed per host in an answer
+#define FLEET_TOP_NETWORKS 10
+#define FLEET_MAX_NAME 64
+
+#define FLEET_COMPRESSED 1
+
+typedef enum {
+    FRAME_HELLO = 1,            // Version u16, name length u16, name
+    FRAME_RECORDS = 2,          // Log records
+    FRAME_QUERY = 3,            // Rows per host u32, filter text
+    FRAME_ANSWER = 4            // Text
+} FleetFrameType;
+
+typedef struct {
+    unsigned int length;
+    unsigned char type;
+    unsigned char flags;
+    unsigned int expandedSize;
+} FleetFrameHeader;
+
+// Put body in a frame, compressed when that makes it smaller. frame needs
+// room for FLEET_FRAME_HEADER_SIZE + size. Returns the frame's size.
+size_t packFrame(unsigned char *frame, FleetFrameType type, const unsigned char *body, size_t size, int compress);
+
+// Read and check a header. Returns 0, or -1 when it is no frame of ours.
+int readFrameHeader(const unsigned char *p, FleetFrameHeader *header);
+
+// The agent, one per monitor
+typedef struct {
+    unsigned long long recordsQueued;
+    unsigned long long recordsDropped;  // No room in the queue
+    int tooLarge;                       // Connections in a keyframe bigger than the whole queue, 0 if none
+    unsigned long long framesSent;
+    unsigned long long bytesEncoded;    // Records before compression
+    unsigned long long bytesSent;       // On the wire
+    unsigned long long connects;
+    int connected;
+} FleetAgentStats;
+
+typedef struct {
+    char host[256];
+    int port;
+    char name[FLEET_MAX_NAME];
+
+    // Refresh loop side
+    unsigned int connectionSeen;        // Value of connects the records below are for
+    unsigned int stringsSent;           // Program names already sent on this connection
+    int recordsSinceKeyframe;
+    int needKeyframe;
+    int tooLarge;                       // The last keyframe could never fit, so nothing is sent until one does
+    unsigned long long recordsQueued;
+    unsigned long long recordsDropped;
+
+    // The queue, one producer (the refresh loop) and one consumer (the sender)
+    unsigned char *queue;
+    atomic_ullong head;
+    atomic_ullong tail;
+    atomic_uint connects;               // Bumped by the sender after every connect
+    atomic_int connected;
+    atomic_int stopping;
+    Event *wake;
+    Thread *sender;
+
+    // Sender side
+    unsigned char *batch;               // Records taken out of the queue
+    unsigned char *frame;               // And packed into a frame
+    atomic_ullong framesSent;
+    atomic_ullong bytesEncoded;
+    atomic_ullong bytesSent;
+} FleetAgent;
+
+// Start the sender thread, which keeps trying host:port until it gets
+// through. name (NULL = this machine's name) is what the collector lists
+// this host as. Returns 0, or -1 when the thread or memory can't be had.
+int startFleetAgent(FleetAgent *agent, const char *host, int port, const char *name);
+void stopFleetAgent(FleetAgent *agent);
+
+// Queue this refresh for the collector, as appendToLog does for the log:
+// a keyframe when diff is NULL or one is due, otherwise just the changes.
+// Never waits. Returns -1 if the records were dropped.
+int sendToFleet(FleetAgent *agent, const ConnectionSnapshot *snapshot, const ConnectionDiff *diff);
+
+void getFleetAgentStats(FleetAgent *agent, FleetAgentStats *stats);
+
+// The collector
+typedef struct {
+    char name[FLEET_MAX_NAME];
+    NetworkConnection *rows;            // The host's table as of its last record
+    int count;
+    int capacity;
+    ConnectionIndex index;              // By 5-tuple (the log has no namespaces)
+    LogSegment names;                   // The agent's program name numbers -> ours
+    int synced;                         // Had a keyframe; deltas before one are skipped
+    unsigned long long updated;         // Timestamp of the last record
+} FleetHost;
+
+typedef struct {
+    NetSocket socket;
+    unsigned char *buffer;              // Bytes received, not yet a whole frame
+    size_t used;
+    size_t capacity;
+    int saidHello;
+    FleetHost host;
+} FleetConnection;
+
+typedef struct FleetServer FleetServer;
+
+typedef struct {
+    FleetServer *server;
+    Thread *thread;
+    Poller *poller;
+    Lock *lock;                         // Held while the hosts change and while a query reads them
+
+    FleetConnection **connections;
+    int connectionCount;
+    int connectionCapacity;
+
+    // Accepted sockets, handed over by the acceptor thread
+    NetSocket inbox[FLEET_INBOX_SIZE];
+    atomic_uint inboxHead;
+    atomic_uint inboxTail;
+
+    unsigned char *expanded;            // Work space for compressed frames
+    ConnectionSnapshot scratch;         // A host's table, for applyFilter
+
+    atomic_ullong frames;
+    atomic_ullong records;
+    atomic_ullong bytesReceived;
+    atomic_ullong badFrames;
+    atomic_ullong queries;
+} FleetShard;
+
+struct FleetServer {
+    NetSocket listener;
+    Thread *acceptor;
+    atomic_int stopping;
+    FleetShard shards[FLEET_MAX_SHARDS];
+    int shardCount;
+    unsigned int nextShard;
+    atomic_ullong accepted;
+    atomic_ullong refused;              // Every shard's inbox was full
+};
+
+typedef struct {
+    int shards;
+    int connections;
+    int hosts;                          // Connections that said hello
+    unsigned long long rows;            // Across all hosts
+    unsigned long long accepted;
+    unsigned long long frames;
+    unsigned long long records;
+    unsigned long long bytesReceived;
+    unsigned long long badFrames;
+    unsigned long long queries;
+} FleetServerStats;
+
+// Listen on address:port with shards threads (0 = one per core). Returns
+// 0, or -1 when the port or the threads can't be had.
+int startFleetServer(FleetServer *server, const char *address, int port, int shards);
+void stopFleetServer(FleetServer *server);
+void getFleetServerStats(FleetServer *server, FleetServerStats *stats);
+
+// Ask the collector at host:port which connections match filterText, on
+// every host, and print the answer. Returns 0, or -1 (with a message).
+int runFleetQuery(const char *host, int port, const char *filterText, int rowsPerHost);
+
+#endif
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <string.h>
+#include "fleet.h"
+#include "compress.h"
+#include "string_table.h"
+#include "arena.h"
+
+#define RECORD_HEADER_SIZE 24   // As in binlog.c
+
+static void putU16(unsigned char *p, unsigned int value) {
+    p[0] = (unsigned char)value;
+    p[1] = (unsigned char)(value >> 8);
+}
+
+static void putU32(unsigned char *p, unsigned int value) {
+    for (int i = 0; i < 4; i++) p[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned int getU32(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// Room for a record in one piece, the same way the log's queue does it
+// (see reserveRecord in binlog.c), except that a full queue never waits
+static unsigned char *reserveRecord(FleetAgent *agent, size_t length) {
+    if (length > FLEET_QUEUE_SIZE) return NULL;
+
+    unsigned long long head = atomic_load_explicit(&agent->head, memory_order_relaxed);
+    size_t position = (size_t)(head % FLEET_QUEUE_SIZE);
+    size_t toEnd = FLEET_QUEUE_SIZE - position;
+
+    if (toEnd < length) {
+        if (head + toEnd - atomic_load_explicit(&agent->tail, memory_order_acquire) > FLEET_QUEUE_SIZE) return NULL;
+        if (toEnd >= 4) putU32(agent->queue + position, 0);
+        head += toEnd;
+        atomic_store_explicit(&agent->head, head, memory_order_release);
+        position = 0;
+    }
+
+    if (head + length - atomic_load_explicit(&agent->tail, memory_order_acquire) > FLEET_QUEUE_SIZE) return NULL;
+    return agent->queue + position;
+}
+
+static void commitRecord(FleetAgent *agent, size_t length) {
+    unsigned long long head = atomic_load_explicit(&agent->head, memory_order_relaxed);
+    atomic_store_explicit(&agent->head, head + length, memory_order_release);
+    agent->recordsQueued++;
+    signalEvent(agent->wake);
+}
+
+static int dropRecord(FleetAgent *agent) {
+    agent->recordsDropped++;
+    agent->needKeyframe = 1;
+    return -1;
+}
+
+static int queueNewStrings(FleetAgent *agent, unsigned long long timestamp) {
+    unsigned int total = getProgramNameCount();
+    if (agent->stringsSent >= total) return 0;
+
+    size_t length = encodeStringsRecord(NULL, 0, agent->stringsSent, total, timestamp);
+    unsigned char *record = reserveRecord(agent, length);
+    if (record == NULL) return dropRecord(agent);
+
+    encodeStringsRecord(record, length, agent->stringsSent, total, timestamp);
+    commitRecord(agent, length);
+    agent->stringsSent = total;
+    return 0;
+}
+
+static int queueKeyframe(FleetAgent *agent, const ConnectionSnapshot *snapshot, unsigned long long timestamp) {
+    size_t length = encodeKeyframeRecord(NULL, 0, snapshot, timestamp);
+
+    // No amount of waiting makes room for this one. Dropping it would ask
+    // for another keyframe next refresh, just as big, so only the size is
+    // looked at until the table shrinks enough to fit.
+    if (length > FLEET_QUEUE_SIZE) {
+        agent->tooLarge = snapshot->count;
+        agent->needKeyframe = 1;
+        return -1;
+    }
+    agent->tooLarge = 0;
+
+    unsigned char *record = reserveRecord(agent, length);
+    if (record == NULL) return dropRecord(agent);
+
+    encodeKeyframeRecord(record, length, snapshot, timestamp);
+    commitRecord(agent, length);
+    agent->recordsSinceKeyframe = 0;
+    agent->needKeyframe = 0;
+    return 0;
+}
+
+static int queueDelta(FleetAgent *agent, const ConnectionDiff *diff, int connectionCount, unsigned long long timestamp) {
+    size_t length = encodeDeltaRecord(NULL, 0, diff, connectionCount, timestamp);
+    unsigned char *record = reserveRecord(agent, length);
+    if (record == NULL) return dropRecord(agent);
+
+    encodeDeltaRecord(record, length, diff, connectionCount, timestamp);
+    commitRecord(agent, length);
+    agent->recordsSinceKeyframe++;
+    return 0;
+}
+
+int sendToFleet(FleetAgent *agent, const ConnectionSnapshot *snapshot, const ConnectionDiff *diff) {
+    if (agent->sender == NULL) return -1;
+
+    // Nothing is encoded while there's nobody to send it to. A new
+    // connection starts over: the collector has none of our names and no
+    // table to apply deltas to.
+    if (!atomic_load(&agent->connected)) return 0;
+    unsigned int connects = atomic_load(&agent->connects);
+    if (connects != agent->connectionSeen) {
+        agent->connectionSeen = connects;
+        agent->stringsSent = 0;
+        agent->needKeyframe = 1;
+    }
+
+    // The collector only keeps the table as it is now, so unlike the log
+    // a keyframe doesn't need the changes that led up to it
+    int keyframe = diff == NULL || diff->droppedCount > 0 || agent->needKeyframe ||
+                   agent->recordsSinceKeyframe >= FLEET_KEYFRAME_EVERY;
+    if (!keyframe && diff->count == 0) return 0;
+
+    unsigned long long now = wallClockMillis();
+    if (queueNewStrings(agent, now) != 0) return -1;
+    if (keyframe) return queueKeyframe(agent, snapshot, now);
+    return queueDelta(agent, diff, snapshot->count, now);
+}
+
+static NetSocket connectToCollector(FleetAgent *agent) {
+    NetSocket socket = connectTcp(agent->host, agent->port);
+    if (socket == NO_SOCKET) return NO_SOCKET;
+
+    unsigned char hello[4 + FLEET_MAX_NAME];
+    unsigned char frame[FLEET_FRAME_HEADER_SIZE + sizeof(hello)];
+    size_t nameLength = strlen(agent->name);
+    putU16(hello, FLEET_VERSION);
+    putU16(hello + 2, (unsigned int)nameLength);
+    memcpy(hello + 4, agent->name, nameLength);
+    size_t frameSize = packFrame(frame, FRAME_HELLO, hello, 4 + nameLength, 0);
+    if (sendTcp(socket, frame, frameSize) != 0) {
+        closeTcp(socket);
+        return NO_SOCKET;
+    }
+
+    // What's queued was for the last connection. Tell the refresh loop to
+    // start over only after it's gone, so the keyframe can't be thrown
+    // out with it.
+    atomic_store_explicit(&agent->tail, atomic_load_explicit(&agent->head, memory_order_acquire), memory_order_release);
+    atomic_fetch_add(&agent->connects, 1);
+    atomic_store(&agent->connected, 1);
+    return socket;
+}
+
+// Send everything between tail and head, as few frames as fit. Frames
+// end on a record, so the collector never sees half of one.
+static int sendQueued(FleetAgent *agent, NetSocket socket, unsigned long long tail, unsigned long long head) {
+    while (tail < head) {
+        size_t used = 0;
+        while (tail < head) {
+            size_t position = (size_t)(tail % FLEET_QUEUE_SIZE);
+            size_t toEnd = FLEET_QUEUE_SIZE - position;
+            const unsigned char *record = agent->queue + position;
+
+            if (toEnd < RECORD_HEADER_SIZE || getU32(record) == 0) {
+                tail += toEnd;
+                continue;
+            }
+            unsigned int length = getU32(record);
+            if (used + length > FLEET_MAX_FRAME) break;
+            memcpy(agent->batch + used, record, length);
+            used += length;
+            tail += length;
+        }
+
+        if (used > 0) {
+            size_t frameSize = packFrame(agent->frame, FRAME_RECORDS, agent->batch, used, 1);
+            if (sendTcp(socket, agent->frame, frameSize) != 0) return -1;
+            atomic_fetch_add(&agent->framesSent, 1);
+            atomic_fetch_add(&agent->bytesEncoded, used);
+            atomic_fetch_add(&agent->bytesSent, frameSize);
+        }
+        atomic_store_explicit(&agent->tail, tail, memory_order_release);
+    }
+    return 0;
+}
+
+// Connect (and reconnect, backing off), then send what's queued at most
+// once every FLEET_BATCH_MILLIS, so a fast refresh still makes few frames
+static int runSender(void *argument) {
+    FleetAgent *agent = argument;
+    NetSocket socket = NO_SOCKET;
+    int retry = FLEET_RETRY_MIN;
+    unsigned long long lastSend = 0;
+
+    while (!atomic_load(&agent->stopping)) {
+        if (socket == NO_SOCKET) {
+            socket = connectToCollector(agent);
+            if (socket == NO_SOCKET) {
+                waitEvent(agent->wake, retry);
+                retry = retry * 2 < FLEET_RETRY_MAX ? retry * 2 : FLEET_RETRY_MAX;
+                continue;
+            }
+            retry = FLEET_RETRY_MIN;
+        }
+
+        unsigned long long now = monotonicMillis();
+        unsigned long long head = atomic_load_explicit(&agent->head, memory_order_acquire);
+        unsigned long long tail = atomic_load_explicit(&agent->tail, memory_order_relaxed);
+        if (now - lastSend < FLEET_BATCH_MILLIS || head == tail) {
+            int wait = now - lastSend < FLEET_BATCH_MILLIS ? (int)(FLEET_BATCH_MILLIS - (now - lastSend)) : FLEET_BATCH_MILLIS;
+            waitEvent(agent->wake, wait);
+            continue;
+        }
+
+        lastSend = now;
+        if (sendQueued(agent, socket, tail, head) != 0) {
+            atomic_store(&agent->connected, 0);
+            closeTcp(socket);
+            socket = NO_SOCKET;
+        }
+    }
+
+    // The last few refreshes still go out
+    if (socket != NO_SOCKET) {
+        sendQueued(agent, socket, atomic_load(&agent->tail), atomic_load(&agent->head));
+        closeTcp(socket);
+    }
+    atomic_store(&agent->connected, 0);
+    return 0;
+}
+
+int startFleetAgent(FleetAgent *agent, const char *host, int port, const char *name) {
+    memset(agent, 0, sizeof(*agent));
+    snprintf(agent->host, sizeof(agent->host), "%s", host);
+    agent->port = port;
+    if (name != NULL) snprintf(agent->name, sizeof(agent->name), "%s", name);
+    else getHostName(agent->name, sizeof(agent->name));
+
+    // The batch and frame buffers are only touched as far as the biggest
+    // batch so far, so most of them never takes real memory
+    agent->queue = trackedAlloc(FLEET_QUEUE_SIZE);
+    agent->batch = trackedAlloc(FLEET_MAX_FRAME);
+    agent->frame = trackedAlloc(FLEET_FRAME_HEADER_SIZE + FLEET_MAX_FRAME);
+    agent->wake = createEvent();
+    if (agent->queue != NULL && agent->batch != NULL && agent->frame != NULL && agent->wake != NULL) {
+        agent->sender = startThread(runSender, agent);
+    }
+    if (agent->sender == NULL) {
+        printf("Error: Could not start sending to the collector\n");
+        if (agent->wake != NULL) destroyEvent(agent->wake);
+        trackedFree(agent->queue);
+        trackedFree(agent->batch);
+        trackedFree(agent->frame);
+        memset(agent, 0, sizeof(*agent));
+        return -1;
+    }
+    return 0;
+}
+
+void stopFleetAgent(FleetAgent *agent) {
+    if (agent->sender == NULL) return;
+    atomic_store(&agent->stopping, 1);
+    signalEvent(agent->wake);
+    joinThread(agent->sender);
+    destroyEvent(agent->wake);
+    trackedFree(agent->queue);
+    trackedFree(agent->batch);
+    trackedFree(agent->frame);
+    agent->sender = NULL;
+    agent->wake = NULL;
+    agent->queue = NULL;
+    agent->batch = NULL;
+    agent->frame = NULL;
+}
+
+void getFleetAgentStats(FleetAgent *agent, FleetAgentStats *stats) {
+    stats->recordsQueued = agent->recordsQueued;
+    stats->recordsDropped = agent->recordsDropped;
+    stats->tooLarge = agent->tooLarge;
+    stats->framesSent = atomic_load(&agent->framesSent);
+    stats->bytesEncoded = atomic_load(&agent->bytesEncoded);
+    stats->bytesSent = atomic_load(&agent->bytesSent);
+    stats->connects = atomic_load(&agent->connects);
+    stats->connected = atomic_load(&agent->connected);
+}
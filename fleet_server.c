@@ -0,0 +1,491 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "fleet.h"
+#include "compress.h"
+#include "filter.h"
+#include "aggregate.h"
+#include "string_table.h"
+#include "arena.h"
+
+#define RECEIVE_CHUNK 65536     // Room kept free for the next receive
+#define POLL_MILLIS 100         // Longest a new connection waits in a shard's inbox
+#define MAX_READY 64
+#define INBOX_MASK (FLEET_INBOX_SIZE - 1)
+
+static unsigned int getU16(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8);
+}
+
+static unsigned int getU32(const unsigned char *p) {
+    return (unsigned int)p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+// The slot with connection's row, or the empty one where it would go
+static unsigned int *findRow(FleetHost *host, const NetworkConnection *connection) {
+    return findConnectionSlot(&host->index, connection, host->rows, sizeof(NetworkConnection));
+}
+
+// Room for one more row, with the index at most half full
+static int growHost(FleetHost *host) {
+    if (host->count < host->capacity && (unsigned int)host->count < host->index.slotCount / 2) return 0;
+
+    int capacity = host->capacity ? host->capacity * 2 : 256;
+    NetworkConnection *rows = trackedRealloc(host->rows, (size_t)capacity * sizeof(NetworkConnection));
+    if (rows == NULL) return -1;
+    host->rows = rows;
+    host->capacity = capacity;
+    return resizeConnectionIndex(&host->index, capacity, rows, sizeof(NetworkConnection), host->count);
+}
+
+// Add the row, or update the one with the same 5-tuple. The rows come
+// off the network, so numbers the rest of the code looks things up by
+// are kept in range.
+static void putRow(FleetHost *host, const NetworkConnection *connection) {
+    NetworkConnection row = *connection;
+    if (row.state >= STATE_COUNT) row.state = STATE_UNKNOWN;
+    if (row.protocol != PROTOCOL_UDP) row.protocol = PROTOCOL_TCP;
+    if (row.family != ADDRESS_IPV4) row.family = ADDRESS_IPV6;
+
+    if (growHost(host) != 0) return;
+    unsigned int *slot = findRow(host, &row);
+    if (*slot != 0) {
+        host->rows[*slot - 1] = row;
+        return;
+    }
+    host->rows[host->count] = row;
+    *slot = (unsigned int)++host->count;
+}
+
+static void removeRow(FleetHost *host, const NetworkConnection *connection) {
+    if (host->count == 0) return;
+    unsigned int *slot = findRow(host, connection);
+    if (*slot == 0) return;
+    int row = (int)*slot - 1;
+    removeConnectionSlot(&host->index, slot, host->rows, sizeof(NetworkConnection));
+
+    // The last row fills the gap
+    int last = host->count - 1;
+    if (row != last) {
+        *findRow(host, &host->rows[last]) = (unsigned int)row + 1;
+        host->rows[row] = host->rows[last];
+    }
+    host->count--;
+}
+
+static void clearHost(FleetHost *host) {
+    host->count = 0;
+    clearConnectionIndex(&host->index);
+}
+
+static void freeHost(FleetHost *host) {
+    trackedFree(host->rows);
+    freeConnectionIndex(&host->index);
+    closeLogSegment(&host->names);
+    memset(host, 0, sizeof(*host));
+}
+
+// Bring the host's table up to date with a RECORDS frame
+static int applyRecords(FleetShard *shard, FleetHost *host, const unsigned char *p, size_t size) {
+    const unsigned char *end = p + size;
+    while (p < end) {
+        LogRecord record;
+        if (parseLogRecord(p, (size_t)(end - p), &record) != 0) return -1;
+        p = record.body + record.bodySize;
+        atomic_fetch_add(&shard->records, 1);
+
+        if (record.type == RECORD_STRINGS) {
+            // A name number past any real log's is a bad frame, not a map to grow
+            if (addLogRecordStrings(&host->names, &record) != 0) return -1;
+        } else if (record.type == RECORD_KEYFRAME) {
+            clearHost(host);
+            for (unsigned int i = 0; i < record.count; i++) {
+                NetworkConnection connection;
+                getLogRecordRow(&host->names, &record, i, &connection);
+                putRow(host, &connection);
+            }
+            host->synced = 1;
+            host->updated = record.timestamp;
+        } else if (record.type == RECORD_DELTA && host->synced) {
+            for (unsigned int i = 0; i < record.count; i++) {
+                ConnectionEvent event;
+                getLogRecordEvent(&host->names, &record, i, &event);
+                if (event.type == EVENT_CLOSED) removeRow(host, &event.connection);
+                else putRow(host, &event.connection);
+            }
+            host->updated = record.timestamp;
+        }
+    }
+    return 0;
+}
+
+// The answer to a query, grown as it's written
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+} AnswerText;
+
+static void appendAnswer(AnswerText *answer, const char *format, ...) {
+    while (1) {
+        va_list arguments;
+        va_start(arguments, format);
+        int needed = vsnprintf(answer->text + answer->length, answer->capacity - answer->length, format, arguments);
+        va_end(arguments);
+        if (needed < 0) return;
+        if (answer->length + (size_t)needed < answer->capacity) {
+            answer->length += (size_t)needed;
+            return;
+        }
+
+        size_t newCapacity = answer->capacity ? answer->capacity * 2 : 16384;
+        while (newCapacity <= answer->length + (size_t)needed) newCapacity *= 2;
+        if (newCapacity > FLEET_MAX_FRAME) return;
+        char *text = trackedRealloc(answer->text, newCapacity);
+        if (text == NULL) return;
+        answer->text = text;
+        answer->capacity = newCapacity;
+    }
+}
+
+// Like a line of --query: "10.0.0.5:5432 -> 10.0.0.9:51234 [TCP] ESTABLISHED (postgres (812))"
+static void appendRow(AnswerText *answer, const NetworkConnection *connection) {
+    char local[MAX_ADDRESS_TEXT], remote[MAX_ADDRESS_TEXT];
+    formatAddress(connection, 0, local, sizeof(local));
+    formatAddress(connection, 1, remote, sizeof(remote));
+    appendAnswer(answer, "  %s:%d -> %s:%d [%s] %s (%s", local, connection->localPort, remote, connection->remotePort,
+                 getProtocolName(connection->protocol), getStateName(connection->state),
+                 getProgramNameText(connection->programName));
+    if (connection->programId != 0) appendAnswer(answer, " (%u))\n", connection->programId);
+    else appendAnswer(answer, ")\n");
+}
+
+// Filter one host's table and add its part to the answer
+static void answerHost(FleetShard *shard, const FleetHost *host, const ConnectionFilter *filter, int rowsPerHost,
+                       Aggregation *networks, AnswerText *answer, int *matched) {
+    ConnectionSnapshot *scratch = &shard->scratch;
+    clearSnapshot(scratch);
+    for (int i = 0; i < host->count; i++) addSnapshotRow(scratch, &host->rows[i]);
+    int *matches = snapshotScratch(scratch, (size_t)scratch->count * sizeof(int) + sizeof(int));
+    if (matches == NULL) return;
+
+    int count = applyFilter(filter, scratch, matches);
+    *matched += count;
+    appendAnswer(answer, "%s: %d of %d connections\n", host->name, count, host->count);
+    for (int i = 0; i < count && i < rowsPerHost; i++) appendRow(answer, &host->rows[matches[i]]);
+    if (count > rowsPerHost && rowsPerHost > 0) appendAnswer(answer, "  ... %d more\n", count - rowsPerHost);
+    aggregateSnapshot(networks, scratch, matches, count);
+}
+
+// Answered by whichever shard the query came in on. It takes each shard's
+// lock in turn, so ingest elsewhere only waits for its own shard's part.
+static void answerQuery(FleetShard *shard, FleetConnection *connection, const unsigned char *body, size_t size) {
+    atomic_fetch_add(&shard->queries, 1);
+    AnswerText answer = {NULL, 0, 0};
+    char filterText[1024 + 1];
+    char error[128];
+    ConnectionFilter filter;
+    Aggregation networks;
+    int rowsPerHost = size >= 4 ? (int)getU32(body) : FLEET_QUERY_ROWS;
+    size_t textLength = size > 4 ? size - 4 : 0;
+    if (textLength > sizeof(filterText) - 1) textLength = sizeof(filterText) - 1;
+    memcpy(filterText, body + 4, textLength);
+    filterText[textLength] = '\0';
+
+    if (parseFilter(filterText, &filter, error, sizeof(error)) != 0) {
+        appendAnswer(&answer, "Error: %s\n", error);
+    } else if (initAggregation(&networks, GROUP_REMOTE_NETWORK, DEFAULT_MAX_GROUPS) != 0) {
+        appendAnswer(&answer, "Error: Out of memory\n");
+    } else {
+        int hosts = 0, total = 0, matched = 0;
+        FleetServer *server = shard->server;
+        for (int s = 0; s < server->shardCount; s++) {
+            FleetShard *other = &server->shards[s];
+            acquireLock(other->lock);
+            for (int i = 0; i < other->connectionCount; i++) {
+                const FleetHost *host = &other->connections[i]->host;
+                if (!other->connections[i]->saidHello) continue;
+                answerHost(shard, host, &filter, rowsPerHost, &networks, &answer, &matched);
+                hosts++;
+                total += host->count;
+            }
+            releaseLock(other->lock);
+        }
+
+        appendAnswer(&answer, "Fleet: %d hosts, %d of %d connections match \"%s\"\n", hosts, matched, total, filterText);
+        int top[FLEET_TOP_NETWORKS];
+        int topCount = getTopGroups(&networks, top, FLEET_TOP_NETWORKS);
+        if (topCount > 0) appendAnswer(&answer, "Top remote networks:\n");
+        for (int i = 0; i < topCount; i++) {
+            char key[64];
+            formatGroupKey(&networks, &networks.groups[top[i]], key, sizeof(key));
+            appendAnswer(&answer, "  %-28s %llu\n", key, networks.groups[top[i]].count);
+        }
+        freeAggregation(&networks);
+    }
+
+    unsigned char *frame = trackedAlloc(FLEET_FRAME_HEADER_SIZE + answer.length);
+    if (frame != NULL) {
+        size_t frameSize = packFrame(frame, FRAME_ANSWER, (const unsigned char *)answer.text, answer.length, 1);
+        sendTcp(connection->socket, frame, frameSize);
+    }
+    trackedFree(frame);
+    trackedFree(answer.text);
+}
+
+static int handleFrame(FleetShard *shard, FleetConnection *connection, const FleetFrameHeader *header,
+                       const unsigned char *body) {
+    size_t size = header->length;
+    if (header->flags & FLEET_COMPRESSED) {
+        if (expandBlock(body, header->length, shard->expanded, header->expandedSize) != 0) return -1;
+        body = shard->expanded;
+        size = header->expandedSize;
+    }
+    atomic_fetch_add(&shard->frames, 1);
+
+    if (header->type == FRAME_HELLO) {
+        if (size < 4 || getU16(body) != FLEET_VERSION) return -1;
+        size_t nameLength = getU16(body + 2);
+        if (nameLength > size - 4) return -1;
+        if (nameLength >= sizeof(connection->host.name)) nameLength = sizeof(connection->host.name) - 1;
+        acquireLock(shard->lock);
+        memcpy(connection->host.name, body + 4, nameLength);
+        connection->host.name[nameLength] = '\0';
+        connection->saidHello = 1;
+        releaseLock(shard->lock);
+        return 0;
+    }
+    if (header->type == FRAME_RECORDS) {
+        if (!connection->saidHello) return -1;
+        acquireLock(shard->lock);
+        int result = applyRecords(shard, &connection->host, body, size);
+        releaseLock(shard->lock);
+        return result;
+    }
+    if (header->type == FRAME_QUERY) {
+        answerQuery(shard, connection, body, size);
+        return 0;
+    }
+    return -1;
+}
+
+// Take what has arrived and act on every whole frame in it. Returns -1
+// when the connection is done (closed, or it sent something bad).
+static int readConnection(FleetShard *shard, FleetConnection *connection) {
+    if (connection->capacity - connection->used < RECEIVE_CHUNK) {
+        size_t capacity = connection->capacity ? connection->capacity * 2 : RECEIVE_CHUNK * 2;
+        unsigned char *buffer = trackedRealloc(connection->buffer, capacity);
+        if (buffer == NULL) return -1;
+        connection->buffer = buffer;
+        connection->capacity = capacity;
+    }
+
+    int received = receiveTcp(connection->socket, connection->buffer + connection->used,
+                              connection->capacity - connection->used, 0);
+    if (received <= 0) return -1;
+    connection->used += (size_t)received;
+    atomic_fetch_add(&shard->bytesReceived, (unsigned long long)received);
+
+    size_t start = 0;
+    while (connection->used - start >= FLEET_FRAME_HEADER_SIZE) {
+        FleetFrameHeader header;
+        if (readFrameHeader(connection->buffer + start, &header) != 0) {
+            atomic_fetch_add(&shard->badFrames, 1);
+            return -1;
+        }
+        size_t frameSize = FLEET_FRAME_HEADER_SIZE + header.length;
+        if (connection->used - start < frameSize) break;
+        if (handleFrame(shard, connection, &header, connection->buffer + start + FLEET_FRAME_HEADER_SIZE) != 0) {
+            atomic_fetch_add(&shard->badFrames, 1);
+            return -1;
+        }
+        start += frameSize;
+    }
+
+    // Keep the part of a frame still to come at the front
+    memmove(connection->buffer, connection->buffer + start, connection->used - start);
+    connection->used -= start;
+    return 0;
+}
+
+static void addConnection(FleetShard *shard, NetSocket socket) {
+    FleetConnection *connection = trackedAlloc(sizeof(FleetConnection));
+    if (connection == NULL) {
+        closeTcp(socket);
+        return;
+    }
+    memset(connection, 0, sizeof(*connection));
+    connection->socket = socket;
+
+    acquireLock(shard->lock);
+    if (shard->connectionCount == shard->connectionCapacity) {
+        int capacity = shard->connectionCapacity ? shard->connectionCapacity * 2 : 64;
+        FleetConnection **connections = trackedRealloc(shard->connections, (size_t)capacity * sizeof(FleetConnection *));
+        if (connections != NULL) {
+            shard->connections = connections;
+            shard->connectionCapacity = capacity;
+        }
+    }
+    int added = shard->connectionCount < shard->connectionCapacity;
+    if (added) shard->connections[shard->connectionCount++] = connection;
+    releaseLock(shard->lock);
+
+    if (!added || watchSocket(shard->poller, socket, connection) != 0) {
+        if (added) {
+            acquireLock(shard->lock);
+            shard->connectionCount--;
+            releaseLock(shard->lock);
+        }
+        closeTcp(socket);
+        trackedFree(connection);
+    }
+}
+
+static void closeConnection(FleetShard *shard, FleetConnection *connection) {
+    unwatchSocket(shard->poller, connection->socket);
+    closeTcp(connection->socket);
+
+    acquireLock(shard->lock);
+    for (int i = 0; i < shard->connectionCount; i++) {
+        if (shard->connections[i] != connection) continue;
+        shard->connections[i] = shard->connections[--shard->connectionCount];
+        break;
+    }
+    releaseLock(shard->lock);
+
+    freeHost(&connection->host);
+    trackedFree(connection->buffer);
+    trackedFree(connection);
+}
+
+static int runShard(void *argument) {
+    FleetShard *shard = argument;
+    void *ready[MAX_READY];
+
+    while (!atomic_load(&shard->server->stopping)) {
+        unsigned int tail = atomic_load_explicit(&shard->inboxTail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&shard->inboxHead, memory_order_acquire);
+        for (; tail != head; tail++) addConnection(shard, shard->inbox[tail & INBOX_MASK]);
+        atomic_store_explicit(&shard->inboxTail, tail, memory_order_release);
+
+        int count = waitPoller(shard->poller, ready, MAX_READY, POLL_MILLIS);
+        for (int i = 0; i < count; i++) {
+            if (readConnection(shard, ready[i]) != 0) closeConnection(shard, ready[i]);
+        }
+    }
+
+    while (shard->connectionCount > 0) closeConnection(shard, shard->connections[0]);
+    return 0;
+}
+
+// Hand each new connection to the next shard round the ring, so the
+// connections (and the hosts) spread evenly over the cores
+static int runAcceptor(void *argument) {
+    FleetServer *server = argument;
+
+    while (!atomic_load(&server->stopping)) {
+        NetSocket client = acceptTcp(server->listener, 200);
+        if (client == NO_SOCKET) continue;
+
+        int placed = 0;
+        for (int tries = 0; tries < server->shardCount && !placed; tries++) {
+            FleetShard *shard = &server->shards[server->nextShard++ % (unsigned int)server->shardCount];
+            unsigned int head = atomic_load_explicit(&shard->inboxHead, memory_order_relaxed);
+            if (head - atomic_load_explicit(&shard->inboxTail, memory_order_acquire) >= FLEET_INBOX_SIZE) continue;
+            shard->inbox[head & INBOX_MASK] = client;
+            atomic_store_explicit(&shard->inboxHead, head + 1, memory_order_release);
+            placed = 1;
+        }
+        if (placed) {
+            atomic_fetch_add(&server->accepted, 1);
+        } else {
+            atomic_fetch_add(&server->refused, 1);
+            closeTcp(client);
+        }
+    }
+    return 0;
+}
+
+int startFleetServer(FleetServer *server, const char *address, int port, int shards) {
+    memset(server, 0, sizeof(*server));
+    server->listener = listenTcp(address, port);
+    if (server->listener == NO_SOCKET) return -1;
+
+    if (shards <= 0) shards = getProcessorCount();
+    if (shards < 1) shards = 1;
+    if (shards > FLEET_MAX_SHARDS) shards = FLEET_MAX_SHARDS;
+
+    for (int i = 0; i < shards; i++) {
+        FleetShard *shard = &server->shards[i];
+        shard->server = server;
+        initSnapshot(&shard->scratch);
+        shard->poller = createPoller();
+        shard->lock = createLock();
+        shard->expanded = trackedAlloc(FLEET_MAX_FRAME);
+        if (shard->poller != NULL && shard->lock != NULL && shard->expanded != NULL) {
+            shard->thread = startThread(runShard, shard);
+        }
+        server->shardCount++;
+        if (shard->thread == NULL) {
+            stopFleetServer(server);
+            return -1;
+        }
+    }
+
+    server->acceptor = startThread(runAcceptor, server);
+    if (server->acceptor == NULL) {
+        stopFleetServer(server);
+        return -1;
+    }
+    return 0;
+}
+
+void stopFleetServer(FleetServer *server) {
+    atomic_store(&server->stopping, 1);
+    if (server->acceptor != NULL) joinThread(server->acceptor);
+    server->acceptor = NULL;
+
+    for (int i = 0; i < server->shardCount; i++) {
+        FleetShard *shard = &server->shards[i];
+        if (shard->thread != NULL) joinThread(shard->thread);
+
+        // Sockets the shard never got to
+        unsigned int tail = atomic_load(&shard->inboxTail);
+        for (; tail != atomic_load(&shard->inboxHead); tail++) closeTcp(shard->inbox[tail & INBOX_MASK]);
+
+        if (shard->poller != NULL) destroyPoller(shard->poller);
+        if (shard->lock != NULL) destroyLock(shard->lock);
+        trackedFree(shard->expanded);
+        trackedFree(shard->connections);
+        freeSnapshot(&shard->scratch);
+        memset(shard, 0, sizeof(*shard));
+    }
+    server->shardCount = 0;
+
+    if (server->listener != NO_SOCKET) closeTcp(server->listener);
+    server->listener = NO_SOCKET;
+}
+
+void getFleetServerStats(FleetServer *server, FleetServerStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->shards = server->shardCount;
+    stats->accepted = atomic_load(&server->accepted);
+
+    for (int s = 0; s < server->shardCount; s++) {
+        FleetShard *shard = &server->shards[s];
+        acquireLock(shard->lock);
+        stats->connections += shard->connectionCount;
+        for (int i = 0; i < shard->connectionCount; i++) {
+            if (!shard->connections[i]->saidHello) continue;
+            stats->hosts++;
+            stats->rows += (unsigned long long)shard->connections[i]->host.count;
+        }
+        releaseLock(shard->lock);
+
+        stats->frames += atomic_load(&shard->frames);
+        stats->records += atomic_load(&shard->records);
+        stats->bytesReceived += atomic_load(&shard->bytesReceived);
+        stats->badFrames += atomic_load(&shard->badFrames);
+        stats->queries += atomic_load(&shard->queries);
+    }
+}
@@ -0,0 +1,586 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "logquery.h"
+#include "arena.h"
+
+// A block that made it past the time range and its summary
+typedef struct {
+    const LogQuery *query;
+    LogSegment *segment;
+    const LogBlockSummary *block;
+    int start;                      // Index position of the keyframe
+    int end;                        // Of the next keyframe, or indexCount
+    int replay;                     // The first one: work out the table at the start time
+    LogMatch *matches;
+    int count;
+    int capacity;
+    int failed;                     // Ran out of memory
+} QueryUnit;
+
+typedef struct {
+    const LogQuery *query;
+    QueryUnit *units;
+    int unitCount;
+    atomic_int next;                // Next unit for a worker to take
+    atomic_ullong rowsScanned;
+} QueryJob;
+
+// The connections open at some moment, rebuilt from a keyframe and the
+// events after it. Closed rows stay in the array, just not alive, so the
+// open-addressed index never has to delete anything.
+typedef struct {
+    NetworkConnection *rows;
+    unsigned char *alive;
+    int count;
+    int capacity;
+    ConnectionIndex index;          // By 5-tuple (the log has no namespaces)
+} ReplayTable;
+
+static void freeReplayTable(ReplayTable *table) {
+    trackedFree(table->rows);
+    trackedFree(table->alive);
+    freeConnectionIndex(&table->index);
+    memset(table, 0, sizeof(*table));
+}
+
+// The slot a connection is in, or the empty one where it would go
+static unsigned int *findReplaySlot(ReplayTable *table, const NetworkConnection *connection) {
+    return findConnectionSlot(&table->index, connection, table->rows, sizeof(NetworkConnection));
+}
+
+static int growReplayTable(ReplayTable *table) {
+    int newCapacity = table->capacity ? table->capacity * 2 : 1024;
+    NetworkConnection *rows = trackedRealloc(table->rows, (size_t)newCapacity * sizeof(NetworkConnection));
+    if (rows == NULL) return -1;
+    table->rows = rows;
+    unsigned char *alive = trackedRealloc(table->alive, (size_t)newCapacity);
+    if (alive == NULL) return -1;
+    table->alive = alive;
+    table->capacity = newCapacity;
+    return resizeConnectionIndex(&table->index, newCapacity, table->rows, sizeof(NetworkConnection), table->count);
+}
+
+// Opened, or seen in a keyframe: add it, or bring it back
+static int openReplayRow(ReplayTable *table, const NetworkConnection *connection) {
+    if (table->count == table->capacity && growReplayTable(table) != 0) return -1;
+    unsigned int *slot = findReplaySlot(table, connection);
+    if (*slot == 0) *slot = (unsigned int)table->count++ + 1;
+    table->rows[*slot - 1] = *connection;
+    table->alive[*slot - 1] = 1;
+    return 0;
+}
+
+static void closeReplayRow(ReplayTable *table, const NetworkConnection *connection, int closed) {
+    if (table->count == 0) return;
+    unsigned int *slot = findReplaySlot(table, connection);
+    if (*slot == 0) return;
+    if (closed) table->alive[*slot - 1] = 0;
+    else table->rows[*slot - 1] = *connection;
+}
+
+// Each worker's own decode space, kept from one unit to the next
+typedef struct {
+    ConnectionSnapshot rows;        // Decoded rows, for applyFilter
+    ConnectionEvent *events;        // What the rows came from, for a DELTA
+    int eventCapacity;
+    int *matches;
+    int matchCapacity;
+    ReplayTable table;
+} QueryWorker;
+
+static int addMatch(QueryUnit *unit, unsigned long long timestamp, LogMatchType type, int oldState,
+                    const NetworkConnection *connection) {
+    if (unit->count == unit->capacity) {
+        int newCapacity = unit->capacity ? unit->capacity * 2 : 64;
+        LogMatch *matches = trackedRealloc(unit->matches, (size_t)newCapacity * sizeof(LogMatch));
+        if (matches == NULL) {
+            unit->failed = 1;
+            return -1;
+        }
+        unit->matches = matches;
+        unit->capacity = newCapacity;
+    }
+    LogMatch *match = &unit->matches[unit->count++];
+    match->timestamp = timestamp;
+    match->type = (unsigned char)type;
+    match->oldState = (unsigned char)(oldState >= 0 ? oldState : 0);
+    match->connection = *connection;
+    return 0;
+}
+
+// Run the filter over the rows decoded into worker->rows. Returns the
+// number of matches, in worker->matches.
+static int filterRows(QueryJob *job, QueryWorker *worker) {
+    int count = worker->rows.count;
+    if (count > worker->matchCapacity) {
+        int *matches = trackedRealloc(worker->matches, (size_t)count * sizeof(int));
+        if (matches == NULL) return -1;
+        worker->matches = matches;
+        worker->matchCapacity = count;
+    }
+    atomic_fetch_add_explicit(&job->rowsScanned, (unsigned long long)count, memory_order_relaxed);
+    return applyFilter(&job->query->filter, &worker->rows, worker->matches);
+}
+
+// The table at the start time: the keyframe, with the events up to then
+// played over it. Returns the first index position after them.
+static int replayUnit(QueryJob *job, QueryWorker *worker, QueryUnit *unit) {
+    LogSegment *segment = unit->segment;
+    ReplayTable *table = &worker->table;
+    unsigned long long from = job->query->from;
+    unsigned long long at = 0;
+    int i;
+
+    table->count = 0;
+    clearConnectionIndex(&table->index);
+
+    for (i = unit->start; i < unit->end; i++) {
+        LogRecord record;
+        if (readLogRecord(segment, i, &record) != 0) break;
+        if (i > unit->start && record.timestamp > from) break;
+        if (at == 0) at = record.timestamp;
+
+        for (unsigned int n = 0; n < record.count; n++) {
+            if (record.type == RECORD_KEYFRAME) {
+                NetworkConnection connection;
+                getLogRecordRow(segment, &record, n, &connection);
+                if (openReplayRow(table, &connection) != 0) unit->failed = 1;
+            } else if (record.type == RECORD_DELTA) {
+                ConnectionEvent event;
+                getLogRecordEvent(segment, &record, n, &event);
+                if (event.type == EVENT_OPENED) {
+                    if (openReplayRow(table, &event.connection) != 0) unit->failed = 1;
+                } else {
+                    closeReplayRow(table, &event.connection, event.type == EVENT_CLOSED);
+                }
+            }
+        }
+    }
+
+    clearSnapshot(&worker->rows);
+    for (int row = 0; row < table->count; row++) {
+        if (table->alive[row]) addSnapshotRow(&worker->rows, &table->rows[row]);
+    }
+    int matched = filterRows(job, worker);
+    if (matched < 0) {
+        unit->failed = 1;
+        return i;
+    }
+    if (at < from) at = from;
+    for (int m = 0; m < matched; m++) {
+        NetworkConnection connection;
+        getSnapshotRow(&worker->rows, worker->matches[m], &connection);
+        addMatch(unit, at, MATCH_PRESENT, -1, &connection);
+    }
+    return i;
+}
+
+static void scanUnit(QueryJob *job, QueryWorker *worker, QueryUnit *unit) {
+    LogSegment *segment = unit->segment;
+    unsigned long long from = job->query->from;
+    unsigned long long to = job->query->to ? job->query->to : ~0ull;
+    int i = unit->replay ? replayUnit(job, worker, unit) : unit->start + 1;
+
+    // Only the events from here; a later keyframe is just the same table again
+    for (; i < unit->end; i++) {
+        if (segment->index[i].type != RECORD_DELTA) continue;
+        if (segment->index[i].timestamp <= from) continue;
+        if (segment->index[i].timestamp > to) break;
+
+        LogRecord record;
+        if (readLogRecord(segment, i, &record) != 0) break;
+        if ((int)record.count > worker->eventCapacity) {
+            ConnectionEvent *events = trackedRealloc(worker->events, record.count * sizeof(ConnectionEvent));
+            if (events == NULL) {
+                unit->failed = 1;
+                break;
+            }
+            worker->events = events;
+            worker->eventCapacity = (int)record.count;
+        }
+
+        clearSnapshot(&worker->rows);
+        for (unsigned int n = 0; n < record.count; n++) {
+            getLogRecordEvent(segment, &record, n, &worker->events[n]);
+            addSnapshotRow(&worker->rows, &worker->events[n].connection);
+        }
+        int matched = filterRows(job, worker);
+        if (matched < 0) {
+            unit->failed = 1;
+            break;
+        }
+        for (int m = 0; m < matched; m++) {
+            const ConnectionEvent *event = &worker->events[worker->matches[m]];
+            LogMatchType type = event->type == EVENT_OPENED ? MATCH_OPENED :
+                                event->type == EVENT_CLOSED ? MATCH_CLOSED : MATCH_CHANGED;
+            addMatch(unit, record.timestamp, type, event->oldState, &event->connection);
+        }
+    }
+}
+
+static int runQueryWorker(void *argument) {
+    QueryJob *job = argument;
+    QueryWorker worker;
+    memset(&worker, 0, sizeof(worker));
+    initSnapshot(&worker.rows);
+
+    for (;;) {
+        int next = atomic_fetch_add(&job->next, 1);
+        if (next >= job->unitCount) break;
+        scanUnit(job, &worker, &job->units[next]);
+    }
+
+    freeSnapshot(&worker.rows);
+    trackedFree(worker.events);
+    trackedFree(worker.matches);
+    freeReplayTable(&worker.table);
+    return 0;
+}
+
+static int portsOverlap(const PortFilter *ports, unsigned short low, unsigned short high) {
+    if (ports->count == 0) return 1;
+    for (int i = 0; i < ports->count; i++) {
+        if (ports->ranges[i].low <= high && ports->ranges[i].high >= low) return 1;
+    }
+    return 0;
+}
+
+static int prefixesOverlap(const PrefixFilter *networks, const unsigned char *low, const unsigned char *high) {
+    // A NOT can match anything in a range unless the range is all inside
+    // one of its prefixes, which is too rare to be worth working out
+    if (networks->count == 0 || networks->negate) return 1;
+
+    for (int i = 0; i < networks->count; i++) {
+        const AddressPrefix *prefix = &networks->prefixes[i];
+        unsigned char first[16], last[16];
+        for (int byte = 0; byte < 16; byte++) {
+            int bits = prefix->prefixLength - byte * 8;
+            unsigned char mask = bits >= 8 ? 0xFF : bits <= 0 ? 0 : (unsigned char)(0xFF << (8 - bits));
+            first[byte] = prefix->address[byte] & mask;
+            last[byte] = first[byte] | (unsigned char)~mask;
+        }
+        if (memcmp(first, high, 16) <= 0 && memcmp(last, low, 16) >= 0) return 1;
+    }
+    return 0;
+}
+
+// Could any row of the block match? Only what the summary has ranges for
+// is checked; scopes and program names always could.
+static int blockMayMatch(const LogBlockSummary *block, const ConnectionFilter *filter) {
+    if (filter->matchNone) return 0;
+    if (!block->summarized) return 1;
+    if (block->rows == 0) return 0;
+    if (filter->protocolMask && !(filter->protocolMask & block->protocols)) return 0;
+    if (filter->stateMask && !(filter->stateMask & block->states)) return 0;
+    if (!portsOverlap(&filter->localPorts, block->minLocalPort, block->maxLocalPort)) return 0;
+    if (!portsOverlap(&filter->remotePorts, block->minRemotePort, block->maxRemotePort)) return 0;
+    if (!prefixesOverlap(&filter->localNetworks, block->minLocalAddress, block->maxLocalAddress)) return 0;
+    if (!prefixesOverlap(&filter->remoteNetworks, block->minRemoteAddress, block->maxRemoteAddress)) return 0;
+
+    if (filter->pidCount == 0) return 1;
+    for (int i = 0; i < filter->pidCount; i++) {
+        if (filter->pids[i] >= block->minProgramId && filter->pids[i] <= block->maxProgramId) return 1;
+    }
+    return 0;
+}
+
+// The ALERT records in the time range. The index says which records they
+// are, so nothing else is read.
+static int collectAlerts(LogQueryResult *result, LogSegment *segment, unsigned long long from, unsigned long long to) {
+    for (int i = findLogRecord(segment, from, 0); i < segment->indexCount; i++) {
+        if (segment->index[i].timestamp > to) break;
+        if (segment->index[i].type != RECORD_ALERT) continue;
+
+        LogRecord record;
+        if (readLogRecord(segment, i, &record) != 0) continue;
+        for (unsigned int n = 0; n < record.count; n++) {
+            if (result->alertCount == result->alertCapacity) {
+                int capacity = result->alertCapacity ? result->alertCapacity * 2 : 64;
+                AnomalyAlert *alerts = trackedRealloc(result->alerts, (size_t)capacity * sizeof(AnomalyAlert));
+                if (alerts == NULL) return -1;
+                result->alerts = alerts;
+                result->alertCapacity = capacity;
+            }
+            getLogRecordAlert(&record, n, &result->alerts[result->alertCount++]);
+        }
+    }
+    return 0;
+}
+
+// What each interface sent and received in the time range, added up from
+// its INTERFACES records, found the same way
+static int addInterfaceTotals(LogQueryResult *result, LogSegment *segment, unsigned long long from,
+                              unsigned long long to) {
+    for (int i = findLogRecord(segment, from, 0); i < segment->indexCount; i++) {
+        if (segment->index[i].timestamp > to) break;
+        if (segment->index[i].type != RECORD_INTERFACES) continue;
+
+        LogRecord record;
+        if (readLogRecord(segment, i, &record) != 0) continue;
+        for (unsigned int n = 0; n < record.count; n++) {
+            InterfaceCounters counters;
+            unsigned int millis;
+            getLogRecordInterface(&record, n, &counters, &millis);
+
+            int found = 0;
+            while (found < result->interfaceCount && strcmp(result->interfaces[found].name, counters.name) != 0) found++;
+            if (found == result->interfaceCount) {
+                if (result->interfaceCount == result->interfaceCapacity) {
+                    int capacity = result->interfaceCapacity ? result->interfaceCapacity * 2 : 16;
+                    InterfaceCounters *interfaces = trackedRealloc(result->interfaces,
+                                                                   (size_t)capacity * sizeof(InterfaceCounters));
+                    if (interfaces == NULL) return -1;
+                    result->interfaces = interfaces;
+                    result->interfaceCapacity = capacity;
+                }
+                memset(&result->interfaces[found], 0, sizeof(InterfaceCounters));
+                memcpy(result->interfaces[found].name, counters.name, sizeof(counters.name));
+                result->interfaceCount++;
+            }
+            for (int counter = 0; counter < INTERFACE_COUNTER_COUNT; counter++) {
+                result->interfaces[found].change[counter] += counters.change[counter];
+            }
+        }
+    }
+    return 0;
+}
+
+static void skipSegment(LogQueryResult *result, LogSegment *segment) {
+    result->segmentsSkipped++;
+    result->blocks += segment->blockCount;
+    result->blocksSkipped += segment->blockCount;
+    closeLogSegment(segment);
+}
+
+// Queue a block for the workers if its summary says it could match
+static void addUnit(LogQueryResult *result, const QueryUnit *unit, QueryUnit *units, int *unitCount) {
+    if (blockMayMatch(unit->block, &unit->query->filter)) units[(*unitCount)++] = *unit;
+    else result->blocksSkipped++;
+}
+
+int runLogQuery(const char *prefix, const LogQuery *query, LogQueryResult *result) {
+    memset(result, 0, sizeof(*result));
+    unsigned long long from = query->from;
+    unsigned long long to = query->to ? query->to : ~0ull;
+
+    unsigned int first, last;
+    if (!findLogSegments(prefix, &first, &last)) return -1;
+
+    LogSegment *segments = trackedAlloc((size_t)(last - first + 1) * sizeof(LogSegment));
+    if (segments == NULL) return -1;
+
+    // Segments after the end time are closed again straight away, and of
+    // those that end before the start time only the last is kept, for the
+    // table at the start
+    int opened = 0;
+    int blockCount = 0;
+    int keptForStart = 0;       // segments[opened - 1] ends before the start time
+    for (unsigned int number = first; number <= last; number++) {
+        char path[256];
+        LogSegment *segment = &segments[opened];
+        getSegmentPath(prefix, number, path, sizeof(path));
+        if (openLogSegment(segment, path) != 0) continue;
+        result->segments++;
+
+        if (segment->indexCount == 0 || segment->index[0].timestamp > to) {
+            skipSegment(result, segment);
+            continue;
+        }
+        if (keptForStart && segment->index[0].timestamp <= from) {
+            opened--;
+            blockCount -= segments[opened].blockCount;
+            skipSegment(result, &segments[opened]);
+            segments[opened] = *segment;
+            segment = &segments[opened];
+        }
+        keptForStart = segment->index[segment->indexCount - 1].timestamp < from;
+        blockCount += segment->blockCount;
+        opened++;
+    }
+
+    QueryUnit *units = trackedAlloc((size_t)(blockCount ? blockCount : 1) * sizeof(QueryUnit));
+    if (units == NULL) {
+        for (int s = 0; s < opened; s++) closeLogSegment(&segments[s]);
+        trackedFree(segments);
+        return -1;
+    }
+
+    // Every block that starts in the time range, after the last one that
+    // starts before it (the table at the start time comes from there). If
+    // the log starts after the start time, its first block gives the table.
+    int unitCount = 0;
+    QueryUnit before;
+    int haveBefore = 0;
+    int firstInRange = 1;
+    for (int s = 0; s < opened; s++) {
+        LogSegment *segment = &segments[s];
+        for (int b = 0; b < segment->blockCount; b++) {
+            QueryUnit unit;
+            memset(&unit, 0, sizeof(unit));
+            unit.query = query;
+            unit.segment = segment;
+            unit.block = &segment->blocks[b];
+            unit.start = segment->blocks[b].firstRecord;
+            unit.end = b + 1 < segment->blockCount ? segment->blocks[b + 1].firstRecord : segment->indexCount;
+            unsigned long long startTime = segment->index[unit.start].timestamp;
+            result->blocks++;
+
+            if (startTime <= from) {
+                if (haveBefore) result->blocksSkipped++;
+                before = unit;
+                before.replay = 1;
+                haveBefore = 1;
+                continue;
+            }
+            if (startTime > to) {
+                result->blocksSkipped++;
+                continue;
+            }
+            if (haveBefore) addUnit(result, &before, units, &unitCount);
+            else if (firstInRange) unit.replay = 1;
+            haveBefore = 0;
+            firstInRange = 0;
+            addUnit(result, &unit, units, &unitCount);
+        }
+    }
+    if (haveBefore) addUnit(result, &before, units, &unitCount);
+
+    // The workers decode in parallel, so the names have to be there first
+    for (int s = 0; s < opened; s++) loadLogStrings(&segments[s]);
+
+    QueryJob job;
+    job.query = query;
+    job.units = units;
+    job.unitCount = unitCount;
+    atomic_init(&job.next, 0);
+    atomic_init(&job.rowsScanned, 0);
+
+    int threads = query->threads > 0 ? query->threads : getProcessorCount();
+    if (threads > MAX_QUERY_THREADS) threads = MAX_QUERY_THREADS;
+    if (threads > unitCount) threads = unitCount;
+    if (threads < 1) threads = 1;
+
+    // This thread is one of the workers
+    Thread *workers[MAX_QUERY_THREADS];
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        workers[started] = startThread(runQueryWorker, &job);
+        if (workers[started] != NULL) started++;
+    }
+    runQueryWorker(&job);
+    for (int t = 0; t < started; t++) joinThread(workers[t]);
+    result->threads = started + 1;
+    result->rowsScanned = atomic_load(&job.rowsScanned);
+
+    // Put the blocks' matches together, oldest first
+    int total = 0;
+    int failed = 0;
+    for (int u = 0; u < unitCount; u++) {
+        total += units[u].count;
+        failed |= units[u].failed;
+    }
+    if (total > 0) {
+        result->matches = trackedAlloc((size_t)total * sizeof(LogMatch));
+        if (result->matches == NULL) failed = 1;
+    }
+    for (int u = 0; u < unitCount; u++) {
+        if (result->matches != NULL) {
+            memcpy(result->matches + result->count, units[u].matches, (size_t)units[u].count * sizeof(LogMatch));
+            result->count += units[u].count;
+        }
+        trackedFree(units[u].matches);
+    }
+    result->capacity = result->count;
+
+    for (int s = 0; s < opened; s++) {
+        if (collectAlerts(result, &segments[s], from, to) != 0) failed = 1;
+        if (addInterfaceTotals(result, &segments[s], from, to) != 0) failed = 1;
+    }
+
+    trackedFree(units);
+    for (int s = 0; s < opened; s++) closeLogSegment(&segments[s]);
+    trackedFree(segments);
+    return failed ? -1 : 0;
+}
+
+void freeLogQueryResult(LogQueryResult *result) {
+    trackedFree(result->matches);
+    trackedFree(result->alerts);
+    trackedFree(result->interfaces);
+    result->matches = NULL;
+    result->count = 0;
+    result->capacity = 0;
+    result->alerts = NULL;
+    result->alertCount = 0;
+    result->alertCapacity = 0;
+    result->interfaces = NULL;
+    result->interfaceCount = 0;
+    result->interfaceCapacity = 0;
+}
+
+// "HH:MM" or "HH:MM:SS" at text. Returns the characters used, or 0.
+static int parseClock(const char *text, struct tm *fields) {
+    int hour, minute, second = 0, used = 0, more = 0;
+    if (sscanf(text, "%2d:%2d%n", &hour, &minute, &used) != 2) return 0;
+    if (sscanf(text + used, ":%2d%n", &second, &more) == 1) used += more;
+    if (hour > 23 || minute > 59 || second > 60) return 0;
+    fields->tm_hour = hour;
+    fields->tm_min = minute;
+    fields->tm_sec = second;
+    return used;
+}
+
+int parseLogTime(const char *text, unsigned long long now, unsigned long long *millis) {
+    if (strcmp(text, "now") == 0) {
+        *millis = now;
+        return 0;
+    }
+
+    if (text[0] == '-') {
+        char *end;
+        unsigned long long amount = strtoull(text + 1, &end, 10);
+        unsigned long long unit;
+        if (end == text + 1 || end[0] == '\0' || end[1] != '\0') return -1;
+        switch (end[0]) {
+            case 's': unit = 1000; break;
+            case 'm': unit = 60000; break;
+            case 'h': unit = 3600000; break;
+            case 'd': unit = 86400000; break;
+            default: return -1;
+        }
+        // Before the log started is the same as from the start (0 would
+        // mean "no limit", which for --to is the wrong way round)
+        *millis = amount * unit < now ? now - amount * unit : 1;
+        return 0;
+    }
+
+    time_t seconds = (time_t)(now / 1000);
+    struct tm fields = *localtime(&seconds);
+    int year, month, day, used = 0;
+    if (sscanf(text, "%4d-%2d-%2d%n", &year, &month, &day, &used) == 3) {
+        fields.tm_year = year - 1900;
+        fields.tm_mon = month - 1;
+        fields.tm_mday = day;
+        fields.tm_hour = fields.tm_min = fields.tm_sec = 0;
+        text += used;
+        if (*text == ' ' || *text == 'T') {
+            used = parseClock(text + 1, &fields);
+            if (used == 0) return -1;
+            text += used + 1;
+        }
+    } else {
+        used = parseClock(text, &fields);
+        if (used == 0) return -1;
+        text += used;
+    }
+    if (*text != '\0') return -1;
+
+    fields.tm_isdst = -1;
+    time_t when = mktime(&fields);
+    if (when == (time_t)-1) return -1;
+    *millis = (unsigned long long)when * 1000;
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef LOGQUERY_H
+#define LOGQUERY_H
+
+#include "binlog.h"
+#include "filter.h"
+
+// Searching the connection log: which connections matching a filter were
+// there, or came and went, between two times. Whole segments outside the
+// time range are never opened past their trailer, and inside a segment a
+// block (a keyframe and its deltas) is skipped without decoding when its
+// summary says no row in it can match. What is left is decoded into
+// snapshots and checked with applyFilter, a block at a time on several
+// threads.
+//
+// The result is the table as it was at the start time (MATCH_PRESENT),
+// then every change after it up to the end time, oldest first. The
+// anomaly alerts logged in the time range come with it, and what each
+// network interface sent and received in it, whatever the filter (both
+// are found from the index alone).
+
+#define MAX_QUERY_THREADS 16
+
+typedef struct {
+    unsigned long long from;        // Milliseconds since 1970, 0 = from the start of the log
+    unsigned long long to;          // 0 = up to the end
+    ConnectionFilter filter;
+    int threads;                    // 0 = one per processor
+} LogQuery;
+
+typedef enum {
+    MATCH_PRESENT,                  // Open at the start time
+    MATCH_OPENED,
+    MATCH_CLOSED,
+    MATCH_CHANGED
+} LogMatchType;
+
+typedef struct {
+    unsigned long long timestamp;
+    unsigned char type;             // LogMatchType
+    unsigned char oldState;         // For MATCH_CHANGED
+    NetworkConnection connection;
+} LogMatch;
+
+typedef struct {
+    LogMatch *matches;
+    int count;
+    int capacity;
+    AnomalyAlert *alerts;           // Oldest first
+    int alertCount;
+    int alertCapacity;
+    InterfaceCounters *interfaces;  // change[] is the sum over the time range
+    int interfaceCount;
+    int interfaceCapacity;
+
+    // What it took
+    int segments;
+    int segmentsSkipped;            // Outside the time range
+    int blocks;
+    int blocksSkipped;              // By time or by their summary
+    unsigned long long rowsScanned; // Rows and events run through the filter
+    int threads;
+} LogQueryResult;
+
+// Run a query over the segments with this prefix. Returns 0, or -1 when
+// there is no log or no memory (result then holds what was found).
+int runLogQuery(const char *prefix, const LogQuery *query, LogQueryResult *result);
+void freeLogQueryResult(LogQueryResult *result);
+
+// A time for --from/--to: "2024-05-01 13:00[:00]", "13:00[:00]" (today),
+// "-15m", "-2h", "-1d", "-30s" (before now) or "now". Local time.
+// Returns 0, or -1 if the text isn't one of those.
+int parseLogTime(const char *text, unsigned long long now, unsigned long long *millis);
+
+#endif
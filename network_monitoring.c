@@ -2,604 +2,1244 @@
 #include <stdlib.h>     
 #include <string.h>     
 #include <time.h>       
-#include <conio.h>      // For getting keyboard input
-#include <windows.h>    
-#include <winsock2.h>   
-#include <ws2tcpip.h>   
-#include <iphlpapi.h>   // For IP information
-#include <tlhelp32.h>   // For process info
-
-// for compiler to use these files
-#pragma comment(lib, "ws2_32.lib")
-#pragma comment(lib, "iphlpapi.lib")
-
-
-#define LOG_FILE "network_monitoring_log.txt"  
-#define UPDATE_INTERVAL 5                   
-#define MAX_CONNECTIONS 100                 
-#define MAX_NAME_LENGTH 256                 
-
-//connection filters
-typedef enum {
-    FILTER_ALL,         // Show all connections
-    FILTER_LOCAL,       // Show only local connections 
-    FILTER_INTERNET,    // Show only remote connections 
-    FILTER_ACTIVE,      // Show only connected connections
-    FILTER_LISTENING,   // Show only ports waiting for connections
-    FILTER_TCP,         // Show only TCP connections
-    FILTER_UDP          // Show only UDP connections
-} FilterType;
-
-// info about a network connection
+#include "network_monitoring.h"
+#include "collector.h"  // Where the connection list comes from
+#include "snapshot.h"   // Holds the connections from one refresh
+#include "string_table.h"
+#include "filter.h"     // Which connections to show
+#include "diff.h"       // What changed since the last refresh
+#include "binlog.h"     // The binary connection log
+#include "platform.h"   // Console and socket calls for Windows/Linux
+#include "scheduler.h"  // Wakes us for each refresh
+#include "screen.h"     // Draws the frame without flicker
+#include "aggregate.h"  // Connections added up by host, port, state or program
+#include "exporter.h"   // Metrics for Prometheus
+#include "selfstats.h"  // What the monitor itself costs
+#include "logquery.h"   // Searching the log
+#include "resolver.h"   // Host names, looked up in the background
+#include "services.h"   // Port numbers to service names
+#include "anomaly.h"    // Floods, scans and churn
+#include "fleet.h"      // Sending to, and running, the fleet collector
+
+// What the table part of the screen is showing
 typedef struct {
-    char localAddress[46];       // The IP address on your computer
-    int localPort;               // The port on your computer
-    char remoteAddress[46];      // The IP address of the other computer
-    int remotePort;              // The port on the other computer
-    char protocol[10];           // TCP or UDP
-    char state[20];              // Connection state like LISTENING or ESTABLISHED
-    char programName[MAX_NAME_LENGTH]; 
-    DWORD programId;             // The ID number of the program
-} NetworkConnection;
-
-
-void getNetworkConnections(NetworkConnection connectionList[], int *connectionCount);
-void getTcpConnections(NetworkConnection connectionList[], int *connectionCount);
-void getUdpConnections(NetworkConnection connectionList[], int *connectionCount);
-void showConnections(NetworkConnection connectionList[], int connectionCount, FilterType filter);
-void saveConnectionsToLog(NetworkConnection connectionList[], int connectionCount);
-void showMenu(FilterType currentFilter);
+    int *rows;          // Rows that pass the filter, in the order shown
+    int rowCount;
+    int firstRow;       // Scroll position
+    int height;         // How many rows fit on the screen
+    SortKey sortKey;
+} TableView;
+
+#define TABLE_FRAME_LINES 11    // Title, headings and footer around the table rows
+#define MIN_TABLE_ROWS 3
+#define MAX_CHANGES_SHOWN 20
+#define TOP_GROUPS_SHOWN 5
+#define MAX_HOST_COLUMN 40      // Longer host names are cut to this
+#define MAX_PORT_COLUMN 12
+#define ALERTS_SHOWN 3
+#define INTERFACES_SHOWN 8
+#define ALERT_SHOW_MILLIS 600000    // How long an alert stays on the screen
+
+void selectRows(ConnectionSnapshot *snapshot, const ConnectionFilter *filter, TableView *view);
+void drawScreen(Screen *screen, const ConnectionSnapshot *snapshot, TableView *view, const ConnectionDiff *diff,
+                const ConnectionFilter *filter, const char *filterName, BinaryLog *log, const Aggregation *rollup,
+                const SelfStats *self, Resolver *names, const AnomalyDetector *anomalies, FleetAgent *fleet,
+                int showHelpScreen);
+void showConnections(Screen *screen, const ConnectionSnapshot *snapshot, TableView *view, const char *filterName,
+                     Resolver *names);
+void formatPort(unsigned short port, ConnectionProtocol protocol, int useNames, char *text, size_t size);
+void showChanges(Screen *screen, const ConnectionDiff *diff, const ConnectionFilter *filter, int maxShown);
+void showMenu(Screen *screen, const char *filterName);
 void showLogFile();
-char* getConnectionStateName(DWORD state);
-void getProgramName(DWORD processId, char* nameBuffer, int maxLength);
+void printLogLine(char marker, const NetworkConnection *connection, int oldState);
+void printLogMatches(const LogQueryResult *result);
+int runQueryCommand(const char *filterText, const char *fromText, const char *toText, int threads);
+void getProgramName(const NetworkConnection *connection, char* nameBuffer, int maxLength);
+void formatRate(unsigned long long bytesPerSecond, char *text, size_t size);
 void clearConsoleScreen();
-void showHeader();
-void showHelp();
-void showStatistics(NetworkConnection connectionList[], int connectionCount);
-const char* getFilterName(FilterType filter);
+void showHeader(Screen *screen);
+void showHelp(Screen *screen);
+void showStatistics(Screen *screen, const ConnectionSnapshot *snapshot);
+void showInterfaceStatistics(Screen *screen, const ConnectionSnapshot *snapshot);
+void showTopGroups(Screen *screen, const Aggregation *rollup);
+void showLogStatistics(Screen *screen, BinaryLog *log);
+void showSelfStatistics(Screen *screen, const SelfStats *self);
+void showNameStatistics(Screen *screen, const Resolver *names);
+void showAlerts(Screen *screen, const AnomalyDetector *anomalies);
+void showAnomalyStatistics(Screen *screen, const AnomalyDetector *anomalies);
+void showFleetStatistics(Screen *screen, FleetAgent *fleet);
+void printAlerts(const AnomalyAlert *alerts, int count);
+void printSelfReport(const SelfStats *self);
+void askForFilter(ConnectionFilter *filter);
+int parseListenAddress(const char *text, char *address, size_t addressSize, int *port);
+int runFleetServer(const char *address, int port, int shards);
 
 
-int main() {
+int main(int argc, char *argv[]) {
   
-    NetworkConnection connectionList[MAX_CONNECTIONS];
-    int connectionCount = 0;
+    // No fixed limit: the snapshot grows to whatever the table needs and
+    // keeps that memory for the next refresh. We keep this refresh and the
+    // one before it, and swap them each time, so we can see what changed.
+    ConnectionSnapshot snapshots[2];
+    ConnectionSnapshot *snapshot = &snapshots[0];
+    ConnectionSnapshot *previousSnapshot = &snapshots[1];
+    ConnectionDiff diff;
+    int haveFirstSnapshot = 0;
+    int redrawScreen = 1;   // Set when something other than the table changed
+    initSnapshot(snapshot);
+    initSnapshot(previousSnapshot);
+    initDiff(&diff);
+
+    Screen screen;
+    TableView view;
+    initScreen(&screen);
+    memset(&view, 0, sizeof(view));
+
+    // The statistics' top groups; the table inside is reused every refresh
+    Aggregation rollup;
+    initAggregation(&rollup, GROUP_REMOTE_NETWORK, DEFAULT_MAX_GROUPS);
     
 
-    int refreshInterval = UPDATE_INTERVAL; 
-    time_t lastUpdateTime = 0;  
+    int refreshInterval = UPDATE_INTERVAL;  // Milliseconds
+    int refreshNow = 1;     // Collect without waiting for the next tick
+    int headless = 0;       // --daemon: collect and log, no screen or keys
     FilterType currentFilter = FILTER_ALL;
+    ConnectionFilter activeFilter;  // The preset, or what the user typed with [E]
+    setPresetFilter(&activeFilter, currentFilter);
     int showHelpScreen = 0;
     int showStats = 0;
+    const char *sourceName = NULL;  // NULL picks the best one available
+    LogOptions logOptions;
+    getDefaultLogOptions(&logOptions);
+    char metricsAddress[64] = "";   // --metrics: where to serve them, empty = don't
+    int metricsPort = METRICS_DEFAULT_PORT;
+    double cpuBudget = DEFAULT_CPU_BUDGET;
+    const char *queryText = NULL;   // --query/--from/--to: search the log and exit
+    const char *fromText = NULL;
+    const char *toText = NULL;
+    int queryThreads = 0;
+    int showNames = 0;              // [N]: host and service names instead of numbers
+    const char *hostsFile = NULL;   // --hosts: look names up in this file, not DNS
+    static Resolver resolver;       // Big (the cache), so not on the stack
+    int resolving = 0;
+    static AnomalyDetector anomalies;   // Fixed tables, big
+    initAnomalyDetector(&anomalies);
+    int pushFilter = 0;             // --kernel-filter: collect only what the filter lets through
+    int filterChanged = 1;
+    char filterError[128];
+    char fleetAddress[256] = "";    // --send: the collector to stream to, empty = don't
+    int fleetPort = FLEET_DEFAULT_PORT;
+    const char *agentName = NULL;   // --agent-name: what the collector calls us (default: the host name)
+    static FleetAgent fleet;
+    int sending = 0;
+    char collectorAddress[64] = ""; // --fleet-server: be the collector instead
+    int collectorPort = FLEET_DEFAULT_PORT;
+    const char *fleetQuery = NULL;  // --fleet-query: ask a collector and exit
+    int fleetRows = FLEET_QUERY_ROWS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--source") == 0 && i + 1 < argc) {
+            sourceName = argv[++i];
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            headless = 1;
+        } else if (strcmp(argv[i], "--interval-ms") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= MIN_INTERVAL_MS) {
+            refreshInterval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-full") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "drop") == 0 || strcmp(argv[i + 1], "block") == 0)) {
+            logOptions.fullPolicy = strcmp(argv[++i], "block") == 0 ? LOG_BLOCK_WHEN_FULL : LOG_DROP_WHEN_FULL;
+        } else if (strcmp(argv[i], "--log-sync") == 0 && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (strcmp(policy, "never") == 0) logOptions.syncPolicy = LOG_SYNC_NEVER;
+            else if (strcmp(policy, "batch") == 0) logOptions.syncPolicy = LOG_SYNC_EVERY_BATCH;
+            else {
+                logOptions.syncPolicy = LOG_SYNC_PERIODIC;
+                logOptions.syncInterval = atoi(policy);
+                if (logOptions.syncInterval <= 0) logOptions.syncInterval = LOG_SYNC_INTERVAL;
+            }
+        } else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc &&
+                   parseListenAddress(argv[i + 1], metricsAddress, sizeof(metricsAddress), &metricsPort) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "--cpu-budget") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0) {
+            cpuBudget = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc) {
+            queryText = argv[++i];
+        } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            fromText = argv[++i];
+        } else if (strcmp(argv[i], "--to") == 0 && i + 1 < argc) {
+            toText = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            queryThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            if (parseFilter(argv[++i], &activeFilter, filterError, sizeof(filterError)) != 0) {
+                printf("Error: %s\n", filterError);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--kernel-filter") == 0) {
+            pushFilter = 1;
+        } else if (strcmp(argv[i], "--names") == 0) {
+            showNames = 1;
+        } else if (strcmp(argv[i], "--hosts") == 0 && i + 1 < argc) {
+            hostsFile = argv[++i];
+            showNames = 1;
+        } else if (strcmp(argv[i], "--send") == 0 && i + 1 < argc &&
+                   parseListenAddress(argv[i + 1], fleetAddress, sizeof(fleetAddress), &fleetPort) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "--agent-name") == 0 && i + 1 < argc) {
+            agentName = argv[++i];
+        } else if (strcmp(argv[i], "--fleet-server") == 0 && i + 1 < argc &&
+                   parseListenAddress(argv[i + 1], collectorAddress, sizeof(collectorAddress), &collectorPort) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "--fleet-query") == 0 && i + 2 < argc &&
+                   parseListenAddress(argv[i + 1], fleetAddress, sizeof(fleetAddress), &fleetPort) == 0) {
+            fleetQuery = argv[i + 2];
+            i += 2;
+        } else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            fleetRows = atoi(argv[++i]);
+        } else {
+            printf("Usage: %s [--daemon] [--interval-ms <milliseconds>] [--source windows|netlink|procfs|netns|events]\n"
+                   "       [--log-full drop|block] [--log-sync never|batch|<milliseconds>]\n"
+                   "       [--metrics [<address>:]<port>] [--cpu-budget <percent>] [--names] [--hosts <file>]\n"
+                   "       [--filter \"<filter>\"] [--kernel-filter] [--send [<host>:]<port>] [--agent-name <name>]\n"
+                   "       --query \"<filter>\" [--from <time>] [--to <time>] [--threads <count>]\n"
+                   "       --fleet-server [<address>:]<port> [--threads <count>]\n"
+                   "       --fleet-query [<host>:]<port> \"<filter>\" [--rows <count>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (queryText != NULL || fromText != NULL || toText != NULL) {
+        return runQueryCommand(queryText ? queryText : "", fromText, toText, queryThreads);
+    }
+    if (fleetQuery != NULL) {
+        char error[128];
+        ConnectionFilter check;
+        if (parseFilter(fleetQuery, &check, error, sizeof(error)) != 0) {
+            printf("Error: %s\n", error);
+            return 1;
+        }
+        return runFleetQuery(fleetAddress, fleetPort, fleetQuery, fleetRows) == 0 ? 0 : 1;
+    }
+    if (collectorAddress[0] != '\0') return runFleetServer(collectorAddress, collectorPort, queryThreads);
     
     // Initialize Windows Sockets
-    WSADATA wsaData;
-    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+    if (initNetworking() != 0) {
         printf("Error: Could not initialize network functions.\n");
-        printf("Press any key to exit...");
-        _getch(); 
+        if (!headless) {
+            printf("Press any key to exit...");
+            readKey();
+        }
         return 1;
     }
-    
 
-    clearConsoleScreen();
-    showHeader();
-    
+    // Before the log starts its writer thread, so the stop signals only
+    // ever reach us through the scheduler
+    Scheduler *scheduler = createScheduler(refreshInterval, !headless);
+    if (scheduler == NULL) {
+        printf("Error: Could not create the refresh timer.\n");
+        cleanupNetworking();
+        return 1;
+    }
+
+    ConnectionSource *source = createConnectionSource(sourceName);
+    if (source == NULL) {
+        printf("Error: Connection source %s is not available on this system.\n",
+               sourceName ? sourceName : "(any)");
+        destroyScheduler(scheduler);
+        cleanupNetworking();
+        return 1;
+    }
+    setConnectionSource(source);
+
+    BinaryLog binaryLog;
+    if (openBinaryLog(&binaryLog, LOG_FILE_PREFIX, &logOptions) != 0) {
+        printf("Warning: Connections will not be logged.\n");
+        if (!headless) sleepMilliseconds(1000);
+    }
+    MetricsExporter exporter;
+    int exporting = 0;
+    if (metricsAddress[0] != '\0') {
+        exporting = startMetricsExporter(&exporter, metricsAddress, metricsPort) == 0;
+        if (exporting) printf("Serving metrics on http://%s:%d/metrics\n", metricsAddress, metricsPort);
+        else printf("Warning: Could not listen on %s port %d, metrics are off.\n", metricsAddress, metricsPort);
+        if (!headless) sleepMilliseconds(1000);
+    }
+    if (fleetAddress[0] != '\0') {
+        sending = startFleetAgent(&fleet, fleetAddress, fleetPort, agentName) == 0;
+        if (sending) printf("Sending connections to the collector at %s port %d\n", fleetAddress, fleetPort);
+        if (!headless) sleepMilliseconds(1000);
+    }
+    if (showNames && !headless) {
+        resolving = startResolver(&resolver, hostsFile) == 0;
+        if (!resolving) {
+            showNames = 0;
+            sleepMilliseconds(1000);
+        }
+    }
+    if (!headless) initConsole();
+
+    // Every stage of every refresh is timed, and our CPU use checked
+    // against the budget
+    SelfStats self;
+    initSelfStats(&self, cpuBudget);
+    unsigned long long lastReport = monotonicMillis();
     
-    while (1) {
+    int running = 1;
+    while (running) {
+        unsigned long long refreshStart = 0;
 
-        if (difftime(time(NULL), lastUpdateTime) >= refreshInterval) {
-           
-            clearConsoleScreen();
-            showHeader();
-            
-            // Get all the network connections and show them
-            getNetworkConnections(connectionList, &connectionCount);
-            showConnections(connectionList, connectionCount, currentFilter);
+        if (refreshNow) {
+            ConnectionSnapshot *swap = previousSnapshot;
+            previousSnapshot = snapshot;
+            snapshot = swap;
 
-            saveConnectionsToLog(connectionList, connectionCount);
-            
+            // With the filter pushed down, rows it drops are never read.
+            // A new filter brings in and leaves out rows all at once, so
+            // that refresh isn't compared with the one before and the log
+            // starts again from a keyframe.
+            int restartDiff = 0;
+            if (pushFilter && filterChanged) {
+                setCollectorFilter(&activeFilter);
+                restartDiff = haveFirstSnapshot;
+            }
+            filterChanged = 0;
+
+            // Get all the network connections and work out what changed
+            refreshStart = monotonicNanos();
+            getNetworkConnections(snapshot);
+            endStage(&self, STAGE_COLLECT, refreshStart);
+
+            unsigned long long start = monotonicNanos();
+            const ConnectionSnapshot *compareWith = restartDiff ? snapshot : previousSnapshot;
+            diffSnapshots(&diff, compareWith, snapshot);
+            computeConnectionRates(&diff, compareWith, snapshot);
+            computeInterfaceChanges(previousSnapshot, snapshot);     // The filter has no say over these
+            endStage(&self, STAGE_DIFF, start);
+
+            if (exporting) {
+                start = monotonicNanos();
+                publishMetrics(&exporter, snapshot, &self);
+                endStage(&self, STAGE_EXPORT, start);
+            }
+
+            // The log gets the whole table once, then only the changes
+            // (with the whole table again now and then as a keyframe)
+            start = monotonicNanos();
+            appendToLog(&binaryLog, snapshot, haveFirstSnapshot && !restartDiff ? &diff : NULL);
+            appendInterfacesToLog(&binaryLog, snapshot);
+            endStage(&self, STAGE_LOG, start);
+
+            // Alerts go in the log after the refresh they came from, and
+            // on the screen or out of the daemon
+            start = monotonicNanos();
+            int alertCount = detectAnomalies(&anomalies, snapshot, haveFirstSnapshot && !restartDiff ? &diff : NULL,
+                                             wallClockMillis());
+            if (alertCount > 0) {
+                appendAlertsToLog(&binaryLog, anomalies.alerts, alertCount);
+                if (headless) printAlerts(anomalies.alerts, alertCount);
+                else redrawScreen = 1;
+            }
+            endStage(&self, STAGE_DETECT, start);
 
-            if (showStats) showStatistics(connectionList, connectionCount);
-            if (showHelpScreen) showHelp();
-            
+            // The collector gets the same records as the log
+            if (sending) {
+                start = monotonicNanos();
+                sendToFleet(&fleet, snapshot, haveFirstSnapshot && !restartDiff ? &diff : NULL);
+                endStage(&self, STAGE_SEND, start);
+            }
+
+            // The rows on screen are picked again every time (they point
+            // into this snapshot), but nothing is redrawn if no
+            // connection changed and the user didn't change the view.
+            // With TCP counters the rates move every time anyway.
+            if (!headless) {
+                start = monotonicNanos();
+                selectRows(snapshot, &activeFilter, &view);
+                if (diff.count > 0 || snapshot->hasMetrics) redrawScreen = 1;
+                if (showNames && haveHostAnswers(&resolver)) redrawScreen = 1;
+                if (showStats) {
+                    resetAggregation(&rollup, rollup.groupBy);
+                    aggregateSnapshot(&rollup, snapshot, NULL, 0);
+                    redrawScreen = 1;   // The monitor's own numbers move every time
+                }
+                endStage(&self, STAGE_SELECT, start);
+            }
+
+            LogStats logStats;
+            getLogStats(&binaryLog, &logStats);
+            self.refreshes++;
+            self.rowsProcessed += (unsigned long long)snapshot->count;
+            self.droppedRows += (unsigned long long)snapshot->droppedCount;
+            self.droppedEvents += (unsigned long long)diff.droppedCount;
+            self.droppedRecords = logStats.recordsDropped;
+            self.bytesLogged = logStats.bytesWritten;
+            self.missedTicks = getMissedTicks(scheduler);
+
+            // In the daemon, say so when we go over the CPU budget and
+            // when we're back under it, not every time
+            if (updateSelfUsage(&self) && headless) {
+                if (self.isOverBudget) printf("Warning: using %.1f%% CPU, over the %.1f%% budget\n", self.cpuPercent, self.cpuBudget);
+                else printf("CPU back under the budget: %.1f%%\n", self.cpuPercent);
+                fflush(stdout);
+            }
+            if (headless && monotonicMillis() - lastReport >= SELF_REPORT_INTERVAL) {
+                printSelfReport(&self);
+                lastReport = monotonicMillis();
+            }
 
-            lastUpdateTime = time(NULL);
+            haveFirstSnapshot = 1;
+            refreshNow = 0;
         }
+
+        if (redrawScreen && !headless) {
+            unsigned long long start = monotonicNanos();
+            drawScreen(&screen, snapshot, &view, &diff, &activeFilter,
+                       activeFilter.text[0] ? activeFilter.text : getFilterName(currentFilter),
+                       showStats ? &binaryLog : NULL, &rollup, &self, showNames ? &resolver : NULL, &anomalies,
+                       sending ? &fleet : NULL, showHelpScreen);
+            endStage(&self, STAGE_SCREEN, start);
+            redrawScreen = 0;
+        }
+        if (refreshStart != 0) endStage(&self, STAGE_REFRESH, refreshStart);
         
-        // Show the menu at the bottom of the screen
-        showMenu(currentFilter);
-        
-        // Check if the user pressed a key
-        if (_kbhit()) {
-            // Get the key they pressed
-            int key = _getch();
-            
-
-            switch (key) {
-                case '1':  // Change refresh interval
-                    printf("\nEnter new refresh time in seconds: ");
-                    scanf("%d", &refreshInterval);
-                    printf("Refresh time set to %d seconds.\n", refreshInterval);
-                    Sleep(1000);  
-                    break;
-                    
-                case '2':  
-                    showLogFile();
-                    lastUpdateTime = 0;  // refresh  
-                    break;
-                    
-                case '3':  // Exit program
-                    printf("\nExiting program. Goodbye!\n");
-                    WSACleanup();
-                    return 0;
-                    
-                case 'f': case 'F':  // Change filter
-                    currentFilter = (FilterType)((currentFilter + 1) % 7);
-                    lastUpdateTime = 0;  
-                    break;
-                    
-                case 'h': case 'H':  //help screen
-                    showHelpScreen = !showHelpScreen;
-                    lastUpdateTime = 0; 
-                    break;
-                case 's': case 'S':  // Toggle statistics
-                    showStats = !showStats;
-                    lastUpdateTime = 0;  //refresh
-                    break;
-                    
-                case 'r': case 'R': case 'c': case 'C':  
-                    lastUpdateTime = 0;  
-                    break;
-            }
+        // Sleep until the next refresh is due or the user presses a key
+        WakeReason wake = waitForWake(scheduler);
+        if (wake == WAKE_STOP) break;
+        if (wake == WAKE_TICK) {
+            refreshNow = 1;
+            continue;
         }
+        if (!keyPressed()) {
+            redrawScreen = 1;   // The console was resized
+            continue;
+        }
+
+        // Get the key they pressed
+        int key = readKey();
         
-                Sleep(100);  // Small delay to prevent high CPU usage
+
+        switch (key) {
+            case '1':  // Change refresh interval
+                printf("\nEnter new refresh time in milliseconds: ");
+                setLineInput(1);
+                int newInterval = 0;
+                if (scanf("%d", &newInterval) == 1 && newInterval >= MIN_INTERVAL_MS) {
+                    refreshInterval = newInterval;
+                    setSchedulerInterval(scheduler, refreshInterval);
+                }
+                setLineInput(0);
+                printf("Refresh time set to %d milliseconds.\n", refreshInterval);
+                sleepMilliseconds(1000);  
+                invalidateScreen(&screen);
+                redrawScreen = 1;
+                break;
+                
+            case '2':  
+                showLogFile();
+                invalidateScreen(&screen);
+                refreshNow = 1;  // refresh  
+                redrawScreen = 1;
+                break;
+                
+            case '3':  // Exit program
+                printf("\nExiting program. Goodbye!\n");
+                running = 0;
+                break;
+                
+            case 'f': case 'F':  // Change filter
+                currentFilter = (FilterType)((currentFilter + 1) % FILTER_PRESET_COUNT);
+                setPresetFilter(&activeFilter, currentFilter);
+                filterChanged = 1;
+                view.firstRow = 0;
+                refreshNow = 1;  
+                redrawScreen = 1;
+                break;
+
+            case 'e': case 'E':  // Type in a filter
+                askForFilter(&activeFilter);
+                filterChanged = 1;
+                invalidateScreen(&screen);
+                view.firstRow = 0;
+                refreshNow = 1;
+                redrawScreen = 1;
+                break;
+
+            case 'o': case 'O':  // Change the sort order
+                view.sortKey = (SortKey)((view.sortKey + 1) % SORT_KEY_COUNT);
+                sortSnapshotRows(snapshot, view.rows, view.rowCount, view.sortKey);
+                redrawScreen = 1;
+                break;
+
+            case 't': case 'T':  // Top connections: by bandwidth, then by retransmits
+                view.sortKey = view.sortKey == SORT_BANDWIDTH ? SORT_RETRANSMITS : SORT_BANDWIDTH;
+                sortSnapshotRows(snapshot, view.rows, view.rowCount, view.sortKey);
+                view.firstRow = 0;
+                redrawScreen = 1;
+                break;
+
+            // Scroll the table; drawScreen keeps firstRow in range
+            case KEY_UP: view.firstRow--; redrawScreen = 1; break;
+            case KEY_DOWN: view.firstRow++; redrawScreen = 1; break;
+            case KEY_PAGE_UP: view.firstRow -= view.height; redrawScreen = 1; break;
+            case KEY_PAGE_DOWN: view.firstRow += view.height; redrawScreen = 1; break;
+            case KEY_HOME: view.firstRow = 0; redrawScreen = 1; break;
+            case KEY_END: view.firstRow = view.rowCount; redrawScreen = 1; break;
+                
+            case 'h': case 'H':  //help screen
+                showHelpScreen = !showHelpScreen;
+                redrawScreen = 1;
+                break;
+            case 's': case 'S':  // Toggle statistics
+                showStats = !showStats;
+                resetAggregation(&rollup, rollup.groupBy);
+                if (showStats) aggregateSnapshot(&rollup, snapshot, NULL, 0);
+                redrawScreen = 1;
+                break;
+
+            case 'g': case 'G':  // Change what the statistics add up by
+                resetAggregation(&rollup, (GroupBy)((rollup.groupBy + 1) % GROUP_BY_COUNT));
+                if (showStats) aggregateSnapshot(&rollup, snapshot, NULL, 0);
+                redrawScreen = 1;
+                break;
+                
+            case 'n': case 'N':  // Host and service names, started the first time
+                if (!resolving) resolving = startResolver(&resolver, hostsFile) == 0;
+                showNames = resolving && !showNames;
+                redrawScreen = 1;
+                break;
+
+            case 'r': case 'R': case 'c': case 'C':  
+                refreshNow = 1;  
+                redrawScreen = 1;
+                break;
+        }
     }
     
    
-    WSACleanup();
+    if (!headless) restoreConsole();
+    if (exporting) stopMetricsExporter(&exporter);
+    if (resolving) stopResolver(&resolver);
+    if (sending) stopFleetAgent(&fleet);
+    closeBinaryLog(&binaryLog);
+    destroyConnectionSource(source);
+    destroyScheduler(scheduler);
+    freeScreen(&screen);
+    freeSnapshot(&snapshots[0]);
+    freeSnapshot(&snapshots[1]);
+    freeDiff(&diff);
+    freeAggregation(&rollup);
+    cleanupNetworking();
     return 0;
 }
 
-// Get the name of the current filter
-const char* getFilterName(FilterType filter) {
-    switch (filter) {
-        case FILTER_ALL: return "ALL";
-        case FILTER_LOCAL: return "LOCAL";
-        case FILTER_INTERNET: return "INTERNET";
-        case FILTER_ACTIVE: return "ACTIVE";
-        case FILTER_LISTENING: return "LISTENING";
-        case FILTER_TCP: return "TCP";
-        case FILTER_UDP: return "UDP";
-        default: return "UNKNOWN";
-    }
-}
-
-// Clear the console screen
+// Clear the console screen (initConsole turns escape codes on for Windows)
 void clearConsoleScreen() {
-    system("cls"); 
+    printf("\033[H\033[2J");
 }
 
 // Display the program title
-void showHeader() {
-    printf("\033[1;36m");  // Cyan colour
-    printf("======================================================================\n");
-    printf("                  NETWORK MONITORING TOOL\n");
-    printf("======================================================================\n");
-    printf("\033[0m");  // Reset colour
+void showHeader(Screen *screen) {
+    screenPrintf(screen, "\033[1;36m======================================================================\033[0m\n");
+    screenPrintf(screen, "\033[1;36m                  NETWORK MONITORING TOOL\033[0m\n");
+    screenPrintf(screen, "\033[1;36m======================================================================\033[0m\n");
 }
 
 // Display help information
-void showHelp() {
-    printf("\n\033[1;33mHow to use this program:\033[0m\n");
-    printf("  [1] Change how often the program updates (in seconds)\n");
-    printf("  [2] View saved connection logs\n");
-    printf("  [3] Exit the program\n");
-    printf("  [F] Change what connections to show\n");
-    printf("  [S] Show/hide connection statistics\n");
-    printf("  [H] Show/hide this help screen\n");
-    printf("  [R] Refresh the screen now\n\n");
+void showHelp(Screen *screen) {
+    screenPrintf(screen, "\n\033[1;33mHow to use this program:\033[0m\n");
+    screenPrintf(screen, "  [1] Change how often the program updates (in milliseconds)\n");
+    screenPrintf(screen, "  [2] View saved connection logs\n");
+    screenPrintf(screen, "  [3] Exit the program\n");
+    screenPrintf(screen, "  [F] Change what connections to show\n");
+    screenPrintf(screen, "  [E] Type in your own filter\n");
+    screenPrintf(screen, "  [O] Change what the table is sorted by\n");
+    screenPrintf(screen, "  [T] Show the busiest connections first (press again for the most retransmits)\n");
+    screenPrintf(screen, "  [G] Change how the statistics group connections (network, port, state, program, namespace)\n");
+    screenPrintf(screen, "  Up/Down/PgUp/PgDn/Home/End scroll the table\n");
+    screenPrintf(screen, "  [S] Show/hide connection statistics\n");
+    screenPrintf(screen, "  [N] Show host and service names instead of addresses and port numbers\n");
+    screenPrintf(screen, "  [H] Show/hide this help screen\n");
+    screenPrintf(screen, "  [R] Refresh the screen now\n\n");
     
-    printf("\033[1;33mTypes of connections you can filter:\033[0m\n");
-    printf("  ALL: Show all connections\n");
-    printf("  LOCAL: Show only connections to your own computer (127.0.0.1)\n");
-    printf("  INTERNET: Show only connections to other computers\n");
-    printf("  ACTIVE: Show only established connections\n");
-    printf("  LISTENING: Show only listening ports (waiting for connections)\n");
-    printf("  TCP: Show only TCP connections\n");
-    printf("  UDP: Show only UDP connections\n");
-}
+    screenPrintf(screen, "\033[1;33mTypes of connections you can filter:\033[0m\n");
+    screenPrintf(screen, "  ALL: Show all connections\n");
+    screenPrintf(screen, "  LOCAL: Show only connections to your own computer (127.0.0.1)\n");
+    screenPrintf(screen, "  INTERNET: Show only connections to other computers\n");
+    screenPrintf(screen, "  ACTIVE: Show only established connections\n");
+    screenPrintf(screen, "  LISTENING: Show only listening ports (waiting for connections)\n");
+    screenPrintf(screen, "  TCP: Show only TCP connections\n");
+    screenPrintf(screen, "  UDP: Show only UDP connections\n");
 
-// Display connection statistics
-void showStatistics(NetworkConnection connectionList[], int connectionCount) {
-    // Variables for counting each type of connection
-    int activeCount = 0;
-    int listeningCount = 0;
-    int localCount = 0;
-    int internetCount = 0;
-    int tcpCount = 0;
-    int udpCount = 0;
-    
-    // Count each type of connection
-    for (int i = 0; i < connectionCount; i++) {
-        // Count by state
-        if (strcmp(connectionList[i].state, "ESTABLISHED") == 0) activeCount++;
-        if (strcmp(connectionList[i].state, "LISTENING") == 0) listeningCount++;
-        
-        // Count by address
-        if (strncmp(connectionList[i].localAddress, "127.", 4) == 0) localCount++;
-        else internetCount++;
-        
-        // Count by protocol
-        if (strcmp(connectionList[i].protocol, "TCP") == 0) tcpCount++;
-        if (strcmp(connectionList[i].protocol, "UDP") == 0) udpCount++;
-    }
-    
-    // Display statistics
-    printf("\n\033[1;32mConnection Statistics:\033[0m\n");
-    printf("  Total Connections: %d\n", connectionCount);
-    printf("  Active: %d | Listening: %d\n", activeCount, listeningCount);
-    printf("  Local: %d | Internet: %d\n", localCount, internetCount);
-    printf("  TCP: %d | UDP: %d\n", tcpCount, udpCount);
+    screenPrintf(screen, "\n\033[1;33mYour own filters ([E]) combine any of these:\033[0m\n");
+    screenPrintf(screen, "  proto=tcp,udp          state=established,listen   (state!=time_wait)\n");
+    screenPrintf(screen, "  lport=80,443,8000-8100 rport=1024-65535\n");
+    screenPrintf(screen, "  lnet=127.0.0.0/8,::1   rnet=10.0.0.0/8            (rnet!=192.168.0.0/16)\n");
+    screenPrintf(screen, "  lscope=loopback        rscope=private,link_local,public,multicast\n");
+    screenPrintf(screen, "  pid=1234               prog=nginx\n");
+    screenPrintf(screen, "  e.g.  proto=tcp state=established rport=443 rnet!=10.0.0.0/8\n");
 }
 
-// Get all network connections (both TCP and UDP)
-void getNetworkConnections(NetworkConnection connectionList[], int *connectionCount) {
-    *connectionCount = 0;  
-       
-    getTcpConnections(connectionList, connectionCount);
+// Ask the user for a filter like "proto=tcp lport=80". An empty line goes
+// back to the current preset.
+void askForFilter(ConnectionFilter *filter) {
+    char line[MAX_FILTER_TEXT];
+    char error[128];
 
+    printf("\nEnter filter (empty to cancel): ");
+    setLineInput(1);
+    if (fgets(line, sizeof(line), stdin) == NULL) line[0] = '\0';
+    setLineInput(0);
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0') return;
 
-    getUdpConnections(connectionList, connectionCount);
+    if (parseFilter(line, filter, error, sizeof(error)) != 0) {
+        printf("Error: %s\n", error);
+        sleepMilliseconds(2000);
+    }
 }
 
-// getting TCP information
-void getTcpConnections(NetworkConnection connectionList[], int *connectionCount) {
-    // to store all TCP connections
-    MIB_TCPTABLE* tcpTable;
-    DWORD bufferSize = 0;
-    
-  
-    //  GetTcpTable with NULL tells required memory/buffer size
-    if (GetTcpTable(NULL, &bufferSize, TRUE) != ERROR_INSUFFICIENT_BUFFER) {
-        printf("Error: Could not get TCP connection information\n");
-        return; 
+// "9469", "0.0.0.0:9469" or "[::1]:9469". Only a port means loopback.
+int parseListenAddress(const char *text, char *address, size_t addressSize, int *port) {
+    const char *colon = strrchr(text, ':');
+    const char *portText = colon ? colon + 1 : text;
+    char *end;
+    long value = strtol(portText, &end, 10);
+    if (*end != '\0' || value <= 0 || value > 65535) return -1;
+    *port = (int)value;
+
+    if (colon == NULL) {
+        snprintf(address, addressSize, "127.0.0.1");
+        return 0;
     }
-    
-    tcpTable = (MIB_TCPTABLE*)malloc(bufferSize);  // Allocate memory
-    if (tcpTable == NULL) {
-        printf("Error: Out of memory\n"); 
-        return;
+    const char *start = text;
+    size_t length = (size_t)(colon - text);
+    if (length >= 2 && text[0] == '[' && text[length - 1] == ']') {
+        start++;
+        length -= 2;
     }
-    
-    //fetching  TCP connection table
-    if (GetTcpTable(tcpTable, &bufferSize, TRUE) != NO_ERROR) {
-        printf("Error: Could not get TCP connection information\n");
-        free(tcpTable); 
+    if (length == 0 || length >= addressSize) return -1;
+    memcpy(address, start, length);
+    address[length] = '\0';
+    return 0;
+}
+
+// Pick the rows the filter lets through, in the order they're sorted by.
+// Done once a refresh; scrolling and redraws reuse the list.
+void selectRows(ConnectionSnapshot *snapshot, const ConnectionFilter *filter, TableView *view) {
+    view->rows = snapshotScratch(snapshot, (size_t)snapshot->count * sizeof(int) + sizeof(int));
+    if (view->rows == NULL) {
+        view->rowCount = 0;
         return;
     }
-    
+    view->rowCount = applyFilter(filter, snapshot, view->rows);
+    sortSnapshotRows(snapshot, view->rows, view->rowCount, view->sortKey);
+}
 
-    for (DWORD i = 0; i < tcpTable->dwNumEntries && *connectionCount < MAX_CONNECTIONS; i++) {
-        MIB_TCPROW* row = &tcpTable->table[i];
-        NetworkConnection* connection = &connectionList[*connectionCount]; 
-        
-        // Get local address and port 
-        struct in_addr addr;
-        addr.s_addr = row->dwLocalAddr;
-        strcpy(connection->localAddress, inet_ntoa(addr));  // Convert to text form
-        connection->localPort = ntohs((u_short)row->dwLocalPort);  // Get port number
-        
-        // Get remote address and port
-        addr.s_addr = row->dwRemoteAddr;
-        strcpy(connection->remoteAddress, inet_ntoa(addr)); 
-        connection->remotePort = ntohs((u_short)row->dwRemotePort); 
-       
-
-        strcpy(connection->protocol, "TCP");
-        strcpy(connection->state, getConnectionStateName(row->dwState));
-        
+// Build the whole screen and send it out. The table gets whatever height
+// is left after everything else, so the sections under it are built
+// first to see how many lines they need.
+void drawScreen(Screen *screen, const ConnectionSnapshot *snapshot, TableView *view, const ConnectionDiff *diff,
+                const ConnectionFilter *filter, const char *filterName, BinaryLog *log, const Aggregation *rollup,
+                const SelfStats *self, Resolver *names, const AnomalyDetector *anomalies, FleetAgent *fleet,
+                int showHelpScreen) {
+    static Screen belowTable;   // Only used as a text buffer, never drawn by itself
+    belowTable.length = 0;
 
-        connection->programId = 0;
-        strcpy(connection->programName, "Unknown");
-        
+    beginFrame(screen);
+    showAlerts(&belowTable, anomalies);
+    showChanges(&belowTable, diff, filter, screen->rows / 4);
+    if (log != NULL) {
+        showStatistics(&belowTable, snapshot);
+        showInterfaceStatistics(&belowTable, snapshot);
+        showTopGroups(&belowTable, rollup);
+        showLogStatistics(&belowTable, log);
+        showSelfStatistics(&belowTable, self);
+        showAnomalyStatistics(&belowTable, anomalies);
+        if (names != NULL) showNameStatistics(&belowTable, names);
+        if (fleet != NULL) showFleetStatistics(&belowTable, fleet);
+    }
+    if (showHelpScreen) showHelp(&belowTable);
+    showMenu(&belowTable, filter->text[0] ? "CUSTOM" : filterName);
 
-        (*connectionCount)++;
+    int belowLines = 0;
+    for (size_t i = 0; i < belowTable.length; i++) {
+        if (belowTable.text[i] == '\n') belowLines++;
     }
-    free(tcpTable);
-}
+    view->height = screen->rows - TABLE_FRAME_LINES - belowLines;
+    if (view->height < MIN_TABLE_ROWS) view->height = MIN_TABLE_ROWS;
 
-// getting UDP connection information
-void getUdpConnections(NetworkConnection connectionList[], int *connectionCount) {
+    showHeader(screen);
+    showConnections(screen, snapshot, view, filterName, names);
+    screenPrintf(screen, "%.*s", (int)belowTable.length, belowTable.text);
+    endFrame(screen);
+}
 
-    MIB_UDPTABLE* udpTable;
-    DWORD bufferSize = 0;
+// Display connection statistics
+void showStatistics(Screen *screen, const ConnectionSnapshot *snapshot) {
+    ConnectionCounts counts;
+    countConnections(snapshot, &counts);
+    int internetCount = counts.total - counts.localCount;
     
-    if (GetUdpTable(NULL, &bufferSize, TRUE) != ERROR_INSUFFICIENT_BUFFER) {
-        printf("Error: Could not get UDP connection information\n");
-        return;  // Stop if there's an error
+    // Display statistics
+    screenPrintf(screen, "\n\033[1;32mConnection Statistics:\033[0m\n");
+    screenPrintf(screen, "  Total Connections: %d\n", counts.total);
+    screenPrintf(screen, "  Active: %d | Listening: %d\n", counts.stateCounts[STATE_ESTABLISHED], counts.stateCounts[STATE_LISTENING]);
+    screenPrintf(screen, "  Local: %d | Internet: %d\n", counts.localCount, internetCount);
+    screenPrintf(screen, "  TCP: %d | UDP: %d\n", counts.protocolCounts[PROTOCOL_TCP], counts.protocolCounts[PROTOCOL_UDP]);
+    screenPrintf(screen, "  IPv4: %d | IPv6: %d\n", counts.total - counts.ipv6Count, counts.ipv6Count);
+    screenPrintf(screen, "  Remote end: loopback %d | link-local %d | private %d | public %d | multicast %d | none %d\n",
+                 counts.scopeCounts[SCOPE_LOOPBACK], counts.scopeCounts[SCOPE_LINK_LOCAL], counts.scopeCounts[SCOPE_PRIVATE],
+                 counts.scopeCounts[SCOPE_PUBLIC], counts.scopeCounts[SCOPE_MULTICAST], counts.scopeCounts[SCOPE_UNSPECIFIED]);
+}
+
+// What each network interface moved since the refresh before: bytes and
+// packets a second, and the errors and drops in red when there are any
+void showInterfaceStatistics(Screen *screen, const ConnectionSnapshot *snapshot) {
+    if (snapshot->interfaceCount == 0) return;
+    unsigned long long millis = snapshot->interfaceMillis;
+    int shown = 0, idle = 0;
+
+    screenPrintf(screen, "  Interfaces: %d%s\n", snapshot->interfaceCount, millis ? "" : " (rates from the next refresh)");
+    for (int i = 0; i < snapshot->interfaceCount; i++) {
+        const InterfaceCounters *counters = &snapshot->interfaces[i];
+        if (counters->total[COUNTER_RX_PACKETS] == 0 && counters->total[COUNTER_TX_PACKETS] == 0) {
+            idle++;     // Never used, not worth a line
+            continue;
+        }
+        if (shown == INTERFACES_SHOWN || millis == 0) continue;
+
+        const unsigned long long *change = counters->change;
+        char receiveRate[16], sendRate[16];
+        formatRate(change[COUNTER_RX_BYTES] * 1000 / millis, receiveRate, sizeof(receiveRate));
+        formatRate(change[COUNTER_TX_BYTES] * 1000 / millis, sendRate, sizeof(sendRate));
+        int trouble = change[COUNTER_RX_ERRORS] || change[COUNTER_TX_ERRORS] ||
+                      change[COUNTER_RX_DROPPED] || change[COUNTER_TX_DROPPED];
+        screenPrintf(screen, "    %-16s recv %7s/s %8llu pkt/s | send %7s/s %8llu pkt/s | %serrors %llu/%llu"
+                     " dropped %llu/%llu\033[0m\n", counters->name,
+                     receiveRate, change[COUNTER_RX_PACKETS] * 1000 / millis,
+                     sendRate, change[COUNTER_TX_PACKETS] * 1000 / millis, trouble ? "\033[1;31m" : "",
+                     change[COUNTER_RX_ERRORS], change[COUNTER_TX_ERRORS],
+                     change[COUNTER_RX_DROPPED], change[COUNTER_TX_DROPPED]);
+        shown++;
     }
-    
- 
-    udpTable = (MIB_UDPTABLE*)malloc(bufferSize);  // Get the memory
-    if (udpTable == NULL) {
-        printf("Error: Out of memory\n");
-        return;  // Stop here
+    int hidden = snapshot->interfaceCount - idle - shown;
+    if (millis != 0 && hidden > 0) screenPrintf(screen, "    ... and %d more\n", hidden);
+}
+
+// The biggest groups from the last aggregateSnapshot
+void showTopGroups(Screen *screen, const Aggregation *rollup) {
+    int top[TOP_GROUPS_SHOWN];
+    int count = getTopGroups(rollup, top, TOP_GROUPS_SHOWN);
+
+    screenPrintf(screen, "  Top by %s ([G] to change): %d groups", getGroupByName(rollup->groupBy), rollup->groupCount);
+    if (rollup->replacedCount > 0) {
+        // More keys than groups: the counts are upper bounds
+        screenPrintf(screen, ", approximate (%llu replaced)", rollup->replacedCount);
     }
-    
+    screenPrintf(screen, "\n");
 
-    if (GetUdpTable(udpTable, &bufferSize, TRUE) != NO_ERROR) {
-        printf("Error: Could not get UDP connection information\n");
-        free(udpTable);
-        return;
+    for (int i = 0; i < count; i++) {
+        const AggregateGroup *group = &rollup->groups[top[i]];
+        char key[128];
+        char sendRate[16], receiveRate[16];
+        formatGroupKey(rollup, group, key, sizeof(key));
+        formatRate(group->sendRate, sendRate, sizeof(sendRate));
+        formatRate(group->receiveRate, receiveRate, sizeof(receiveRate));
+        screenPrintf(screen, "    %-30s %7llu connections | send %7s/s | recv %7s/s | %llu retransmits\n",
+                     key, group->count, sendRate, receiveRate, group->newRetransmits);
     }
-    
+}
 
-    for (DWORD i = 0; i < udpTable->dwNumEntries && *connectionCount < MAX_CONNECTIONS; i++) {
-        MIB_UDPROW* row = &udpTable->table[i];
-        NetworkConnection* connection = &connectionList[*connectionCount];
-        
-        // Get local address and port
-        struct in_addr addr;
-        addr.s_addr = row->dwLocalAddr;
-        strcpy(connection->localAddress, inet_ntoa(addr));  // Convert to text form
-        connection->localPort = ntohs((u_short)row->dwLocalPort);  // Get port number
-        
-        // UDP doesn't have a remote address because it's connectionless
+// How the log writer is keeping up
+void showLogStatistics(Screen *screen, BinaryLog *log) {
+    LogStats stats;
+    getLogStats(log, &stats);
 
-        strcpy(connection->remoteAddress, "*");
-        connection->remotePort = 0;
-        
-        // Set protocol and state
-        strcpy(connection->protocol, "UDP");
-        strcpy(connection->state, "LISTENING");
-      
+    screenPrintf(screen, "  Log: %llu records written (%llu KiB), %llu dropped, %llu write errors, queue %zu/%zu KiB\n",
+           stats.recordsWritten, stats.bytesWritten / 1024, stats.recordsDropped, stats.writeErrors,
+           stats.queueUsed / 1024, stats.queueSize / 1024);
+}
 
-        connection->programId = 0;
-        
-        strcpy(connection->programName, "Unknown");
-        
+// What the monitor itself is costing: CPU against the budget, memory,
+// and how long each stage of a refresh takes
+void showSelfStatistics(Screen *screen, const SelfStats *self) {
+    screenPrintf(screen, "  Monitor: %sCPU %.1f%%\033[0m (budget %.1f%%, over %llu times) | RSS %.1f MiB, peak %.1f MiB"
+                 " | %llu refreshes, %llu rows\n",
+                 self->isOverBudget ? "\033[1;31m" : "", self->cpuPercent, self->cpuBudget, self->overBudget,
+                 (double)self->residentBytes / (1024 * 1024), (double)self->peakResidentBytes / (1024 * 1024),
+                 self->refreshes, self->rowsProcessed);
+    screenPrintf(screen, "  Dropped: %llu rows, %llu changes, %llu log records, %llu ticks\n",
+                 self->droppedRows, self->droppedEvents, self->droppedRecords, self->missedTicks);
 
-        switch (connection->localPort) {
-            case 53:
-                strcpy(connection->programName, "DNS");  // DNS server uses port 53
-                break;
+    // p50/p99/max of the stages that ran, four to a line
+    int shown = 0;
+    for (int stage = 0; stage < PIPELINE_STAGE_COUNT; stage++) {
+        const LatencyHistogram *histogram = &self->stages[stage];
+        if (histogram->count == 0) continue;
+        char p50[16], p99[16], max[16];
+        formatLatency(getLatencyPercentile(histogram, 50), p50, sizeof(p50));
+        formatLatency(getLatencyPercentile(histogram, 99), p99, sizeof(p99));
+        formatLatency(histogram->max, max, sizeof(max));
+        if (shown % 4 == 0) screenPrintf(screen, shown == 0 ? "  p50/p99/max:" : "\n              ");
+        else screenPrintf(screen, " |");
+        screenPrintf(screen, " %s %s/%s/%s", getStageName((PipelineStage)stage), p50, p99, max);
+        shown++;
+    }
+    if (shown > 0) screenPrintf(screen, "\n");
+}
 
-            case 123:
-                strcpy(connection->programName, "NTP");  // Network Time Protocol uses port 123
-                break;
-            case 137:
-            case 138:
-                strcpy(connection->programName, "NetBIOS");  // NetBIOS uses ports 137 and 138
-                break;
-            case 161:
-            case 162:
-                strcpy(connection->programName, "SNMP");  // SNMP uses ports 161 and 162
-                break;
-        }
-        
-        (*connectionCount)++;
+// How the host name cache is doing
+void showNameStatistics(Screen *screen, const Resolver *names) {
+    const ResolverStats *stats = &names->stats;
+    screenPrintf(screen, "  Names: %d cached, %llu named | %llu lookups, %llu from cache, %llu asked, %llu not asked (queue full)"
+                 ", %llu evicted\n", names->count, stats->named, stats->lookups, stats->hits, stats->queued,
+                 stats->dropped, stats->evicted);
+}
+
+// The last few alerts, for a while after they were raised
+void showAlerts(Screen *screen, const AnomalyDetector *anomalies) {
+    unsigned long long now = wallClockMillis();
+    int shown = 0;
+
+    for (unsigned long long i = anomalies->recentCount; i > 0 && shown < ALERTS_SHOWN; i--) {
+        const AnomalyAlert *alert = &anomalies->recent[(i - 1) % ANOMALY_RECENT];
+        if (i + ANOMALY_RECENT <= anomalies->recentCount || alert->timestamp + ALERT_SHOW_MILLIS < now) break;
+
+        char text[160];
+        char timeString[16];
+        time_t seconds = (time_t)(alert->timestamp / 1000);
+        strftime(timeString, sizeof(timeString), "%H:%M:%S", localtime(&seconds));
+        formatAlert(alert, text, sizeof(text));
+        if (shown == 0) screenPrintf(screen, "\n\033[1;31mAlerts:\033[0m\n");
+        screenPrintf(screen, "  [%s] %s\n", timeString, text);
+        shown++;
     }
-   
+}
 
-    free(udpTable);
+// What the anomaly detector is following
+void showAnomalyStatistics(Screen *screen, const AnomalyDetector *anomalies) {
+    const AnomalyStats *stats = &anomalies->stats;
+    screenPrintf(screen, "  Anomalies: following %d networks, %d ports (of %d each), %llu evicted | %llu alerts, %llu not shown\n",
+                 stats->networks, stats->ports, ANOMALY_TRACKED, stats->evicted, stats->alerts, stats->suppressed);
 }
 
-// Get program name from process ID 
-void getProgramName(DWORD processId, char* nameBuffer, int maxLength) {
-    // For system processes
-    if (processId == 0 || processId == 4) {
-        strcpy(nameBuffer, "System");
-        return;
+// How the stream to the fleet collector is going
+void showFleetStatistics(Screen *screen, FleetAgent *fleet) {
+    FleetAgentStats stats;
+    getFleetAgentStats(fleet, &stats);
+    screenPrintf(screen, "  Fleet: %s %s:%d as %s | %llu records queued, %llu dropped | %llu frames, %llu KiB"
+                 " (%llu KiB before compression), %llu connects\n",
+                 stats.connected ? "sending to" : "\033[1;31mretrying\033[0m", fleet->host, fleet->port, fleet->name,
+                 stats.recordsQueued, stats.recordsDropped, stats.framesSent, stats.bytesSent / 1024,
+                 stats.bytesEncoded / 1024, stats.connects);
+    if (stats.tooLarge > 0) {
+        screenPrintf(screen, "  \033[1;31mFleet: %d connections is too many to send in one keyframe, nothing is sent"
+                     " until there are fewer\033[0m\n", stats.tooLarge);
     }
+}
+
+// The daemon's alerts, one line each
+void printAlerts(const AnomalyAlert *alerts, int count) {
+    for (int i = 0; i < count; i++) {
+        char text[160];
+        char timeString[32];
+        time_t seconds = (time_t)(alerts[i].timestamp / 1000);
+        strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+        formatAlert(&alerts[i], text, sizeof(text));
+        printf("%s Alert: %s\n", timeString, text);
+    }
+    fflush(stdout);
+}
 
-    sprintf(nameBuffer, "PID: %lu", processId);
+// The --daemon's status line, every SELF_REPORT_INTERVAL
+void printSelfReport(const SelfStats *self) {
+    char timeString[32];
+    time_t now = time(NULL);
+    strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+    printf("%s cpu %.1f%% (budget %.1f%%) rss %.1fMiB refreshes %llu rows %llu logged %lluKiB"
+           " dropped rows %llu changes %llu records %llu ticks %llu |",
+           timeString, self->cpuPercent, self->cpuBudget, (double)self->residentBytes / (1024 * 1024),
+           self->refreshes, self->rowsProcessed, self->bytesLogged / 1024,
+           self->droppedRows, self->droppedEvents, self->droppedRecords, self->missedTicks);
+    for (int stage = 0; stage < PIPELINE_STAGE_COUNT; stage++) {
+        const LatencyHistogram *histogram = &self->stages[stage];
+        if (histogram->count == 0) continue;
+        char p50[16], p99[16], max[16];
+        formatLatency(getLatencyPercentile(histogram, 50), p50, sizeof(p50));
+        formatLatency(getLatencyPercentile(histogram, 99), p99, sizeof(p99));
+        formatLatency(histogram->max, max, sizeof(max));
+        printf(" %s %s/%s/%s", getStageName((PipelineStage)stage), p50, p99, max);
+    }
+    printf("\n");
+    fflush(stdout);
 }
 
-// Convert TCP state number to a readable name
-char* getConnectionStateName(DWORD state) {
-    // TCP states and their names
-    switch (state) {
-        case MIB_TCP_STATE_CLOSED:
-            return "CLOSED";
-        case MIB_TCP_STATE_LISTEN:
-            return "LISTENING";
-        case MIB_TCP_STATE_SYN_SENT:
-            return "SYN_SENT";
-        case MIB_TCP_STATE_SYN_RCVD:
-            return "SYN_RCVD";
-        case MIB_TCP_STATE_ESTAB:
-            return "ESTABLISHED";
-        case MIB_TCP_STATE_FIN_WAIT1:
-            return "FIN_WAIT1";
-        case MIB_TCP_STATE_FIN_WAIT2:
-            return "FIN_WAIT2";
-        case MIB_TCP_STATE_CLOSE_WAIT:
-            return "CLOSE_WAIT";
-        case MIB_TCP_STATE_CLOSING:
-            return "CLOSING";
-        case MIB_TCP_STATE_LAST_ACK:
-            return "LAST_ACK";
-        case MIB_TCP_STATE_TIME_WAIT:
-            return "TIME_WAIT";
-        case MIB_TCP_STATE_DELETE_TCB:
-            return "DELETE_TCB";
-        default:
-            return "UNKNOWN";
+// The program column: "name (pid)", or just the name when there's no pid
+void getProgramName(const NetworkConnection *connection, char* nameBuffer, int maxLength) {
+    const char *name = getProgramNameText(connection->programName);
+
+    if (connection->programId == 0) {
+        snprintf(nameBuffer, maxLength, "%s", name);
+        return;
     }
+
+    snprintf(nameBuffer, maxLength, "%s (%u)", name, connection->programId);
 }
 
-// Display connections with filtering
-void showConnections(NetworkConnection connectionList[], int connectionCount, FilterType filter) {
+// The table: column headings, then the rows that fit, starting at the
+// scroll position. Only the rows on screen are turned into text.
+void showConnections(Screen *screen, const ConnectionSnapshot *snapshot, TableView *view, const char *filterName,
+                     Resolver *names) {
     time_t currentTime = time(NULL);
-    char* timeString = ctime(&currentTime);
-     int shownCount = 0;
-    
-    printf("Network Connections as of %s", timeString);
-    printf("Filter: \033[1;33m%s\033[0m\n", getFilterName(filter));
-    printf("=========================================================================================\n");
-        printf("\033[1;37m");  //white
-    printf("%-15s | %-6s | %-15s | %-6s | %-6s | %-12s | %-20s\n", 
-           "Local Address", "Port", "Remote Address", "Port", "Type", "State", "Program");
-    printf("\033[0m");  //resets the text colour
-
-    printf("-----------------------------------------------------------------------------------------\n");
+    char timeString[32];
+    strftime(timeString, sizeof(timeString), "%a %b %d %H:%M:%S %Y", localtime(&currentTime));
+
+    // Keep the scroll position inside the table (it shrinks, the keys
+    // don't check)
+    if (view->firstRow > view->rowCount - view->height) view->firstRow = view->rowCount - view->height;
+    if (view->firstRow < 0) view->firstRow = 0;
+    int lastRow = view->firstRow + view->height;
+    if (lastRow > view->rowCount) lastRow = view->rowCount;
     
+    screenPrintf(screen, "Network Connections as of %s\n", timeString);
+    screenPrintf(screen, "Filter: \033[1;33m%s\033[0m | Sorted by: \033[1;33m%s\033[0m\n",
+                 filterName, getSortName(view->sortKey));
+    screenPrintf(screen, "=========================================================================================\n");
+    // The address columns are as wide as the longest address on screen,
+    // so IPv4-only screens stay narrow and IPv6 ones still line up. With
+    // names on, the remote end is its host name once the lookup is back
+    // (never waited for here) and ports are service names.
+    int addressWidth = 15;
+    int portWidth = 6;
+    for (int m = view->firstRow; m < lastRow; m++) {
+        NetworkConnection connection;
+        char text[MAX_ADDRESS_TEXT];
+        getSnapshotRow(snapshot, view->rows[m], &connection);
+        for (int remote = 0; remote < 2; remote++) {
+            const char *host = remote && names ? lookupHostName(names, connection.remoteAddress, connection.family) : NULL;
+            int length = host ? (int)strlen(host) : 0;
+            if (host == NULL) {
+                formatAddress(&connection, remote, text, sizeof(text));
+                length = (int)strlen(text);
+            }
+            if (length > addressWidth) addressWidth = length > MAX_HOST_COLUMN ? MAX_HOST_COLUMN : length;
 
-    for (int i = 0; i < connectionCount; i++) {
+            formatPort(remote ? connection.remotePort : connection.localPort, connection.protocol, names != NULL,
+                       text, sizeof(text));
+            length = (int)strlen(text);
+            if (length > portWidth) portWidth = length > MAX_PORT_COLUMN ? MAX_PORT_COLUMN : length;
+        }
+    }
+    screenPrintf(screen, "\033[1;37m%-*s | %-*s | %-*s | %-*s | %-6s | %-12s | %-20s",
+                 addressWidth, "Local Address", portWidth, "Port", addressWidth, names ? "Remote Host" : "Remote Address",
+                 portWidth, "Port", "Type", "State", "Program");
+    if (snapshot->hasMetrics) {
+        screenPrintf(screen, " | %7s | %7s | %8s | %5s", "Send/s", "Recv/s", "RTT ms", "Retr");
+    }
+    if (snapshot->hasNamespaces) screenPrintf(screen, " | %-22s", "Namespace");
+    screenPrintf(screen, "\033[0m\n");
+    screenPrintf(screen, "-----------------------------------------------------------------------------------------\n");
 
-        int showThisConnection = 1;
-        
-        // Check if this connection should be shown based on the current filter
-        switch (filter) {
-            case FILTER_LOCAL:
-                // Show only local connections (127.0.0.1)
-                showThisConnection = (strncmp(connectionList[i].localAddress, "127.", 4) == 0);
-                break;
-                
-            case FILTER_INTERNET:
-                // Show only internet connections (not 127.0.0.1)
-                showThisConnection = (strncmp(connectionList[i].localAddress, "127.", 4) != 0);
-                break;
-                
-            case FILTER_ACTIVE:
-                // Show only established connections
-                showThisConnection = (strcmp(connectionList[i].state, "ESTABLISHED") == 0);
-                break;
-                
-            case FILTER_LISTENING:
-                // Show only listening ports
-                showThisConnection = (strcmp(connectionList[i].state, "LISTENING") == 0);
-                break;
-                
-            case FILTER_TCP:
-                // Show only TCP connections
-                showThisConnection = (strcmp(connectionList[i].protocol, "TCP") == 0);
-                break;
-                
-            case FILTER_UDP:
-                // Show only UDP connections
-                showThisConnection = (strcmp(connectionList[i].protocol, "UDP") == 0);
-                break;
-                
-            default:
-                // FILTER_ALL: show everything
-                showThisConnection = 1;
+    for (int m = view->firstRow; m < view->firstRow + view->height; m++) {
+        if (m >= lastRow) {
+            screenPrintf(screen, "\n");   // Keep the lines under the table where they are
+            continue;
+        }
+        NetworkConnection connection;
+        getSnapshotRow(snapshot, view->rows[m], &connection);
+
+        const char *colour;
+        if (connection.protocol == PROTOCOL_UDP) {
+            colour = "\033[1;33m";  // Yellow for UDP
+        } else if (connection.state == STATE_ESTABLISHED) {
+            colour = "\033[1;32m";  // Green for established connections
+        } else if (connection.state == STATE_LISTENING) {
+            colour = "\033[1;36m";  // Cyan for listening ports
+        } else {
+            colour = "\033[0;37m";  // Gray for other states
         }
         
+        // Addresses are only turned into text here, for the rows we show
+        char localAddress[MAX_ADDRESS_TEXT];
+        char remoteAddress[MAX_ADDRESS_TEXT];
+        char localPort[MAX_PORT_COLUMN + 1], remotePort[MAX_PORT_COLUMN + 1];
+        formatAddress(&connection, 0, localAddress, sizeof(localAddress));
+        const char *remoteHost = names ? lookupHostName(names, connection.remoteAddress, connection.family) : NULL;
+        if (remoteHost == NULL) {
+            formatAddress(&connection, 1, remoteAddress, sizeof(remoteAddress));
+            remoteHost = remoteAddress;
+        }
+        formatPort(connection.localPort, connection.protocol, names != NULL, localPort, sizeof(localPort));
+        formatPort(connection.remotePort, connection.protocol, names != NULL, remotePort, sizeof(remotePort));
+        char programName[MAX_NAME_LENGTH];
+        getProgramName(&connection, programName, sizeof(programName));
 
-        if (showThisConnection) {
-
-            
-            // Yellow for UDP connections
-            if (strcmp(connectionList[i].protocol, "UDP") == 0) {
-                printf("\033[1;33m");  // Yellow for UDP
-            } else if (strcmp(connectionList[i].state, "ESTABLISHED") == 0) {
-                printf("\033[1;32m");  // Green for established connections
-            }             else if (strcmp(connectionList[i].state, "LISTENING") == 0) {
-                printf("\033[1;36m");  // Cyan for listening ports
-            }             else {
-                printf("\033[0;37m");  // Gray for other states
-            }
-            
-            // Print the connection details
-            printf("%-15s | %-6d | %-15s | %-6d | %-6s | %-12s | %-20s\n", 
-                  connectionList[i].localAddress,   // Local IP address
-                  connectionList[i].localPort,      // Local port
-                  connectionList[i].remoteAddress,  // Remote IP address
-                  connectionList[i].remotePort,     // Remote port
-                  connectionList[i].protocol,       // TCP or UDP
-                  connectionList[i].state,          // Connection state
-                  connectionList[i].programName);   // Program name
-                  
-            // Reset colour back to normal
-            printf("\033[0m");
-            
-            shownCount++;
+        // Print the connection details
+        screenPrintf(screen, "%s%-*s | %-*s | %-*.*s | %-*s | %-6s | %-12s | %-20s",
+              colour,
+              addressWidth, localAddress,       // Local IP address
+              portWidth, localPort,             // Local port
+              addressWidth, addressWidth, remoteHost,   // Remote IP address or host name
+              portWidth, remotePort,            // Remote port
+              getProtocolName(connection.protocol),  // TCP or UDP
+              getStateName(connection.state),        // Connection state
+              programName);                     // Program name and pid
+
+        // The TCP counters, for sources that have them
+        if (snapshot->hasMetrics) {
+            int row = view->rows[m];
+            char sendRate[16], receiveRate[16];
+            formatRate(snapshot->sendRate[row], sendRate, sizeof(sendRate));
+            formatRate(snapshot->receiveRate[row], receiveRate, sizeof(receiveRate));
+            screenPrintf(screen, " | %7s | %7s | %8.1f | %5u", sendRate, receiveRate,
+                         snapshot->roundTripTime[row] / 1000.0, snapshot->newRetransmits[row]);
         }
+        if (snapshot->hasNamespaces) {
+            screenPrintf(screen, " | %-22s", getNamespaceNameText(snapshot->networkNamespace[view->rows[m]]));
+        }
+        screenPrintf(screen, "\033[0m\n");
     }
     
-    // Show a summary of how many connections we displayed
-    printf("=========================================================================================\n");
-    printf("Showing %d of %d connections\n\n", shownCount, connectionCount);
+    // Show which part of the table is on screen
+    screenPrintf(screen, "=========================================================================================\n");
+    screenPrintf(screen, "Showing %d-%d of %d (%d connections in all) | Up/Down/PgUp/PgDn to scroll\n\n",
+                 lastRow > 0 ? view->firstRow + 1 : 0, lastRow, view->rowCount, snapshot->count);
 }
 
-// Save connection information to a log file
-void saveConnectionsToLog(NetworkConnection connectionList[], int connectionCount) {
+// List what changed since the last refresh, for the connections the
+// filter lets through
+void showChanges(Screen *screen, const ConnectionDiff *diff, const ConnectionFilter *filter, int maxShown) {
+    int shown = 0;
+    int hidden = 0;
+    if (maxShown > MAX_CHANGES_SHOWN) maxShown = MAX_CHANGES_SHOWN;
 
-    FILE *logFile = fopen(LOG_FILE, "a");
+    screenPrintf(screen, "Changes since last refresh: \033[1;32m+%d opened\033[0m | \033[1;31m-%d closed\033[0m | "
+                 "\033[1;33m~%d changed\033[0m\n", diff->openedCount, diff->closedCount, diff->changedCount);
 
-    if (logFile == NULL) {
-        printf("Error: Could not open log file.\n");
-        return;
-    }
-    
+    for (int i = 0; i < diff->count; i++) {
+        const ConnectionEvent *event = &diff->events[i];
+        if (!filterMatchesRow(filter, &event->connection)) continue;
+        if (shown >= maxShown) {
+            hidden++;
+            continue;
+        }
 
-    time_t currentTime = time(NULL);
-    char timeString[26];
-    
-    // Convert time to text and copy it to our string
-    strcpy(timeString, ctime(&currentTime));
-    
-    // The time string ends with a newline,replace the \n with \0 
-    timeString[24] = '\0';
-    
+        char localAddress[MAX_ADDRESS_TEXT];
+        char remoteAddress[MAX_ADDRESS_TEXT];
+        formatAddress(&event->connection, 0, localAddress, sizeof(localAddress));
+        formatAddress(&event->connection, 1, remoteAddress, sizeof(remoteAddress));
 
-    fprintf(logFile, "[%s] - %d connections\n", timeString, connectionCount);
-    
+        if (event->type == EVENT_OPENED) screenPrintf(screen, "\033[1;32m  + ");
+        else if (event->type == EVENT_CLOSED) screenPrintf(screen, "\033[1;31m  - ");
+        else screenPrintf(screen, "\033[1;33m  ~ ");
 
-    for (int i = 0; i < connectionCount; i++) {
-        // Format: local_ip:port -> remote_ip:port [protocol] state (program)
-        fprintf(logFile, "%s:%d -> %s:%d [%s] %s (%s)\n", 
-                connectionList[i].localAddress,  // Local IP
-                connectionList[i].localPort,     // Local port
-                connectionList[i].remoteAddress, // Remote IP
-                connectionList[i].remotePort,    // Remote port
-                connectionList[i].protocol,      // TCP or UDP
-                connectionList[i].state,         // Connection state
-                connectionList[i].programName);  // Program name
+        screenPrintf(screen, "%s:%d -> %s:%d [%s] ", localAddress, event->connection.localPort,
+                     remoteAddress, event->connection.remotePort, getProtocolName(event->connection.protocol));
+        if (event->type == EVENT_STATE_CHANGED) screenPrintf(screen, "%s -> ", getStateName(event->oldState));
+        screenPrintf(screen, "%s\033[0m\n", getStateName(event->connection.state));
+        shown++;
     }
-    
 
-    fprintf(logFile, "--------------------------------\n");
-    
+    if (hidden > 0) screenPrintf(screen, "  ... and %d more\n", hidden);
+    screenPrintf(screen, "\n");
+}
 
-    fclose(logFile);
+// A port column: the number, or with names on the service's name when
+// it has one (cut to fit the column)
+void formatPort(unsigned short port, ConnectionProtocol protocol, int useNames, char *text, size_t size) {
+    const char *service = useNames && port != 0 ? getServiceName(port, protocol) : NULL;
+    if (service != NULL) snprintf(text, size, "%s", service);
+    else snprintf(text, size, "%d", port);
 }
 
 // Display the menu options at the bottom of the screen
-void showMenu(FilterType currentFilter) {
+void showMenu(Screen *screen, const char *filterName) {
 
-    printf("Menu: [1] Update Time | [2] View Logs | [3] Exit | [F] Filter: %s | [S] Statistics | [H] Help | [R] Refresh\n", 
-           getFilterName(currentFilter));  // Show which filter is currently active
+    screenPrintf(screen, "Menu: [1] Update Time | [2] View Logs | [3] Exit | [F] Filter: %s | [E] Edit Filter | [O] Sort | "
+                 "[T] Top | [N] Names | [S] Statistics | [H] Help | [R] Refresh\n",
+                 filterName);  // Show which filter is currently active
 }
 
-// View the saved log file
+// Bytes per second, shortened to fit a narrow column: 512, 12.3K, 4.5M
+void formatRate(unsigned long long bytesPerSecond, char *text, size_t size) {
+    static const char units[] = "KMGT";
+    double value = (double)bytesPerSecond;
+    int unit = -1;
+
+    while (value >= 1000.0 && unit < 3) {
+        value /= 1024.0;
+        unit++;
+    }
+    if (unit < 0) snprintf(text, size, "%llu", bytesPerSecond);
+    else snprintf(text, size, "%.1f%c", value, units[unit]);
+}
+
+// One connection in the log view: marker local -> remote [protocol] state (program)
+void printLogLine(char marker, const NetworkConnection *connection, int oldState) {
+    char localAddress[MAX_ADDRESS_TEXT];
+    char remoteAddress[MAX_ADDRESS_TEXT];
+    formatAddress(connection, 0, localAddress, sizeof(localAddress));
+    formatAddress(connection, 1, remoteAddress, sizeof(remoteAddress));
+
+    printf("%c %s:%d -> %s:%d [%s] ", marker, localAddress, connection->localPort,
+           remoteAddress, connection->remotePort, getProtocolName(connection->protocol));
+    if (oldState >= 0) printf("%s -> ", getStateName((ConnectionState)oldState));
+    char programName[MAX_NAME_LENGTH];
+    getProgramName(connection, programName, sizeof(programName));
+    printf("%s (%s)\n", getStateName(connection->state), programName);
+}
+
+// The matches of a log query, one per line, with what it took at the end
+void printLogMatches(const LogQueryResult *result) {
+    static const char markers[] = {' ', '+', '-', '~'};
+
+    for (int i = 0; i < result->count; i++) {
+        const LogMatch *match = &result->matches[i];
+        time_t seconds = (time_t)(match->timestamp / 1000);
+        char timeString[32];
+        strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+        printf("[%s] ", timeString);
+        printLogLine(markers[match->type], &match->connection, match->type == MATCH_CHANGED ? match->oldState : -1);
+    }
+    for (int i = 0; i < result->alertCount; i++) {
+        const AnomalyAlert *alert = &result->alerts[i];
+        time_t seconds = (time_t)(alert->timestamp / 1000);
+        char timeString[32];
+        char text[160];
+        strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", localtime(&seconds));
+        formatAlert(alert, text, sizeof(text));
+        if (i == 0) printf("--------------------------------\nAlerts:\n");
+        printf("[%s] ! %s\n", timeString, text);
+    }
+    for (int i = 0; i < result->interfaceCount; i++) {
+        const unsigned long long *change = result->interfaces[i].change;
+        char received[16], sent[16];
+        formatRate(change[COUNTER_RX_BYTES], received, sizeof(received));
+        formatRate(change[COUNTER_TX_BYTES], sent, sizeof(sent));
+        if (i == 0) printf("--------------------------------\nInterfaces:\n");
+        printf("  %-16s received %sB in %llu packets (%llu errors, %llu dropped) | sent %sB in %llu packets"
+               " (%llu errors, %llu dropped)\n", result->interfaces[i].name,
+               received, change[COUNTER_RX_PACKETS], change[COUNTER_RX_ERRORS], change[COUNTER_RX_DROPPED],
+               sent, change[COUNTER_TX_PACKETS], change[COUNTER_TX_ERRORS], change[COUNTER_TX_DROPPED]);
+    }
+    printf("--------------------------------\n");
+    printf("%d matches, %d alerts. Read %d of %d blocks in %d of %d segments, %llu rows checked on %d thread%s.\n",
+           result->count, result->alertCount, result->blocks - result->blocksSkipped, result->blocks,
+           result->segments - result->segmentsSkipped, result->segments, result->rowsScanned,
+           result->threads, result->threads == 1 ? "" : "s");
+}
+
+// --query: search the log from the command line and print what matched
+int runQueryCommand(const char *filterText, const char *fromText, const char *toText, int threads) {
+    LogQuery query;
+    char error[128];
+    unsigned long long now = wallClockMillis();
+    memset(&query, 0, sizeof(query));
+    query.threads = threads;
+
+    if (parseFilter(filterText, &query.filter, error, sizeof(error)) != 0) {
+        printf("Error: %s\n", error);
+        return 1;
+    }
+    if ((fromText != NULL && parseLogTime(fromText, now, &query.from) != 0) ||
+        (toText != NULL && parseLogTime(toText, now, &query.to) != 0)) {
+        printf("Error: Times look like \"2024-05-01 13:00\", \"13:00:30\", \"-15m\", \"-2h\" or \"now\".\n");
+        return 1;
+    }
+
+    LogQueryResult result;
+    unsigned long long start = monotonicNanos();
+    int status = runLogQuery(LOG_FILE_PREFIX, &query, &result);
+    if (status != 0 && result.segments == 0) {
+        printf("No logs found! Run the program for a while to make some logs!\n");
+        return 1;
+    }
+    printLogMatches(&result);
+    char took[32];
+    formatLatency(monotonicNanos() - start, took, sizeof(took));
+    printf("Took %s.%s\n", took, status != 0 ? " Ran out of memory, some matches are missing." : "");
+    freeLogQueryResult(&result);
+    return status != 0;
+}
+
+// --fleet-server: collect what the agents send until stopped, with a
+// status line every SELF_REPORT_INTERVAL
+int runFleetServer(const char *address, int port, int shards) {
+    if (initNetworking() != 0) {
+        printf("Error: Could not initialize network functions.\n");
+        return 1;
+    }
+    Scheduler *scheduler = createScheduler(1000, 0);
+    static FleetServer server;      // The shards' inboxes, not for the stack
+    if (scheduler == NULL || startFleetServer(&server, address, port, shards) != 0) {
+        printf("Error: Could not start the collector on %s port %d\n", address, port);
+        if (scheduler != NULL) destroyScheduler(scheduler);
+        cleanupNetworking();
+        return 1;
+    }
+    printf("Collecting from agents on %s port %d, %d shards\n", address, port, server.shardCount);
+    fflush(stdout);
+
+    unsigned long long lastReport = monotonicMillis();
+    while (waitForWake(scheduler) != WAKE_STOP) {
+        if (monotonicMillis() - lastReport < SELF_REPORT_INTERVAL) continue;
+        lastReport = monotonicMillis();
+
+        FleetServerStats stats;
+        char timeString[32];
+        time_t now = time(NULL);
+        getFleetServerStats(&server, &stats);
+        strftime(timeString, sizeof(timeString), "%Y-%m-%d %H:%M:%S", localtime(&now));
+        printf("%s hosts %d connections %d rows %llu | accepted %llu frames %llu records %llu received %lluKiB"
+               " bad %llu queries %llu\n", timeString, stats.hosts, stats.connections, stats.rows, stats.accepted,
+               stats.frames, stats.records, stats.bytesReceived / 1024, stats.badFrames, stats.queries);
+        fflush(stdout);
+    }
+
+    stopFleetServer(&server);
+    destroyScheduler(scheduler);
+    cleanupNetworking();
+    return 0;
+}
+
+// View the saved log: the connections open some minutes ago and what
+// changed since, optionally only those matching a filter
 void showLogFile() {
 
-    system("cls");
+    clearConsoleScreen();
     printf("====== Network Connection Logs ======\n\n");
-    
-    FILE *logFile;
-    logFile = fopen(LOG_FILE, "r");
 
-    if (logFile == NULL) {
+    unsigned int first, last;
+    if (!findLogSegments(LOG_FILE_PREFIX, &first, &last)) {
         printf("No logs found! Run the program for a while to make some logs!\n");
         printf("\nPress any key to go back to main screen...");
-        _getch();
+        readKey();
         return;
     }
-     
-    char line[256];
-    
 
-    while (fgets(line, sizeof(line), logFile) != NULL) {
-        printf("%s", line);
+    LogQuery query;
+    memset(&query, 0, sizeof(query));
+    int minutes = 0;
+    char line[MAX_FILTER_TEXT];
+    char error[128];
+
+    printf("Show the last how many minutes? (0 for everything): ");
+    setLineInput(1);
+    if (fgets(line, sizeof(line), stdin) == NULL || sscanf(line, "%d", &minutes) != 1) minutes = 0;
+    printf("Only connections matching (Enter for all): ");
+    if (fgets(line, sizeof(line), stdin) == NULL) line[0] = '\0';
+    setLineInput(0);
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (parseFilter(line, &query.filter, error, sizeof(error)) != 0) {
+        printf("Error: %s\n", error);
+    } else {
+        query.from = minutes > 0 ? wallClockMillis() - (unsigned long long)minutes * 60000 : 0;
+        LogQueryResult result;
+        if (runLogQuery(LOG_FILE_PREFIX, &query, &result) != 0) printf("Ran out of memory, some matches are missing.\n");
+        printLogMatches(&result);
+        freeLogQueryResult(&result);
     }
-    
 
-    fclose(logFile);
-    
     printf("\nPress any key to go back to main screen...");
-    _getch();
-}
\ No newline at end of file
+    readKey();
+}
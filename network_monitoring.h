@@ -0,0 +1,121 @@
+#ifndef NETWORK_MONITORING_H
+#define NETWORK_MONITORING_H
+
+#include <stddef.h>
+
+#define UPDATE_INTERVAL 5000    // Milliseconds between refreshes
+#define MAX_NAME_LENGTH 256
+#define MAX_ADDRESS_TEXT 46     // Longest IPv6 address plus the \0
+
+typedef enum {
+    PROTOCOL_TCP,
+    PROTOCOL_UDP
+} ConnectionProtocol;
+
+// Connection states, the same for every platform. The collectors turn
+// the Windows MIB_TCP_STATE_* and Linux TCP_* numbers into these.
+typedef enum {
+    STATE_UNKNOWN,
+    STATE_CLOSED,
+    STATE_LISTENING,
+    STATE_SYN_SENT,
+    STATE_SYN_RCVD,
+    STATE_ESTABLISHED,
+    STATE_FIN_WAIT1,
+    STATE_FIN_WAIT2,
+    STATE_CLOSE_WAIT,
+    STATE_CLOSING,
+    STATE_LAST_ACK,
+    STATE_TIME_WAIT,
+    STATE_DELETE_TCB,
+    STATE_COUNT
+} ConnectionState;
+
+// Our own family numbers, because AF_INET6 isn't the same on every system
+typedef enum {
+    ADDRESS_IPV4 = 4,
+    ADDRESS_IPV6 = 6
+} AddressFamily;
+
+// info about a network connection, kept small (48 bytes) so big tables
+// stay in cache. Addresses are stored as 16 raw bytes, with IPv4 written
+// the IPv6 way (::ffff:a.b.c.d) so both kinds can be handled alike.
+// Nothing is turned into text until a row is printed.
+typedef struct {
+    unsigned char localAddress[16];     // The IP address on your computer
+    unsigned char remoteAddress[16];    // The IP address of the other computer
+    unsigned short localPort;           // The port on your computer
+    unsigned short remotePort;          // The port on the other computer
+    unsigned char family;               // AddressFamily
+    unsigned char protocol;             // ConnectionProtocol
+    unsigned char state;                // ConnectionState
+    unsigned int programId;             // The ID number of the program
+    unsigned int programName;           // Number from internProgramName
+} NetworkConnection;
+
+// Store an IPv4 address (in network byte order, like in_addr.s_addr)
+void setIpv4Address(unsigned char address[16], unsigned int networkOrderAddress);
+void setIpv6Address(unsigned char address[16], const unsigned char bytes[16]);
+
+// What kind of address it is. One bit each, so a filter can ask for
+// several at once.
+typedef enum {
+    SCOPE_UNSPECIFIED = 1 << 0,     // 0.0.0.0 and ::, nothing on the other end
+    SCOPE_LOOPBACK = 1 << 1,        // 127.0.0.0/8, ::1
+    SCOPE_LINK_LOCAL = 1 << 2,      // 169.254.0.0/16, fe80::/10
+    SCOPE_PRIVATE = 1 << 3,         // 10/8, 172.16/12, 192.168/16, 100.64/10 (CGNAT), fc00::/7
+    SCOPE_MULTICAST = 1 << 4,       // 224.0.0.0/4 and broadcast, ff00::/8
+    SCOPE_PUBLIC = 1 << 5,          // Everything else
+    SCOPE_ALL = (1 << 6) - 1
+} AddressScope;
+
+// Work out the scope with a few masked compares. IPv4-mapped IPv6
+// addresses count as the IPv4 address inside them. Runs for every row,
+// so it only looks at the 16 bytes.
+AddressScope getAddressScope(const unsigned char address[16]);
+
+// The network an address belongs to, as a 16-byte key: the /24 of an
+// IPv4-mapped address, else the /64. Goes by the address itself, since
+// dual-stack sockets report IPv4 peers with the IPv6 family. Returns the
+// family to print the key as.
+AddressFamily getNetworkKey(const unsigned char address[16], unsigned char key[16]);
+const char *getScopeName(AddressScope scope);
+
+// Read an IPv4 (a.b.c.d) or IPv6 address. Returns 0 on success.
+int parseAddress(const char *text, unsigned char address[16], AddressFamily *family);
+
+// Text versions, only used when a row is shown or written out
+void formatAddress(const NetworkConnection *connection, int remote, char *buffer, size_t bufferSize);
+const char *getStateName(ConnectionState state);
+const char *getProtocolName(ConnectionProtocol protocol);
+
+// The 5-tuple every table of connections is keyed on: the diff, the
+// event collector, the log replay and the fleet collector. Tables that
+// can hold several namespaces add networkNamespace; the rest pass 0.
+unsigned int hashConnectionKey(unsigned char protocol, unsigned int networkNamespace,
+                               const unsigned char localAddress[16], unsigned short localPort,
+                               const unsigned char remoteAddress[16], unsigned short remotePort);
+unsigned int hashConnection(const NetworkConnection *connection);
+int sameConnectionKey(const NetworkConnection *a, const NetworkConnection *b);
+
+// An open-addressed 5-tuple index over an array of rows, each holding a
+// NetworkConnection stride bytes after the one before (rows points at the
+// first). Slots hold row + 1, 0 = empty, and are at most half full.
+typedef struct {
+    unsigned int *slots;
+    unsigned int slotCount;             // Power of two, 0 until the first resize
+} ConnectionIndex;
+
+// Size the index for capacity rows and index the first count of them.
+// Returns 0, or -1 when out of memory (the old index is kept).
+int resizeConnectionIndex(ConnectionIndex *index, int capacity, const void *rows, size_t stride, int count);
+// The slot a connection is in, or the empty one where it would go
+unsigned int *findConnectionSlot(const ConnectionIndex *index, const NetworkConnection *connection,
+                                 const void *rows, size_t stride);
+// Empty a slot, moving later entries of the same run back so lookups still
+// find them without tombstones
+void removeConnectionSlot(ConnectionIndex *index, unsigned int *slot, const void *rows, size_t stride);
+void clearConnectionIndex(ConnectionIndex *index);
+void freeConnectionIndex(ConnectionIndex *index);
+
+#endif
@@ -0,0 +1,1054 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "platform.h"
+
+#ifdef _WIN32
+
+#include <conio.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <psapi.h>      // For GetProcessMemoryInfo
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "psapi.lib")
+
+int initNetworking() {
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0 ? 0 : -1;
+}
+
+void cleanupNetworking() {
+    WSACleanup();
+}
+
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+
+static HANDLE consoleOutput = NULL;
+static DWORD savedOutputMode;
+
+// The Windows console already gives us single keys through _getch. We
+// only turn on escape codes (Windows 10 and later) so colours and clearing
+// the screen work the same as on Linux.
+void initConsole() {
+    HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (!GetConsoleMode(output, &savedOutputMode)) return;
+    if (SetConsoleMode(output, savedOutputMode | ENABLE_VIRTUAL_TERMINAL_PROCESSING)) consoleOutput = output;
+}
+
+void restoreConsole() {
+    if (consoleOutput != NULL) SetConsoleMode(consoleOutput, savedOutputMode);
+}
+
+int keyPressed() {
+    return _kbhit();
+}
+
+// The arrow and paging keys come as 0 or 0xE0 and then a scan code
+int readKey() {
+    int key = _getch();
+    if (key != 0 && key != 0xE0) return key;
+
+    switch (_getch()) {
+        case 72: return KEY_UP;
+        case 80: return KEY_DOWN;
+        case 73: return KEY_PAGE_UP;
+        case 81: return KEY_PAGE_DOWN;
+        case 71: return KEY_HOME;
+        case 79: return KEY_END;
+        default: return 0;
+    }
+}
+
+void setLineInput(int enabled) {
+    (void)enabled;
+}
+
+void sleepMilliseconds(int milliseconds) {
+    Sleep(milliseconds);
+}
+
+void getConsoleSize(int *rows, int *columns) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (!GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)) {
+        *rows = 24;
+        *columns = 80;
+        return;
+    }
+    *rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+    *columns = info.srWindow.Right - info.srWindow.Left + 1;
+}
+
+void writeConsole(const void *data, size_t size) {
+    HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+    const char *next = data;
+    fflush(stdout);
+    while (size > 0) {
+        DWORD written;
+        if (!WriteFile(output, next, (DWORD)size, &written, NULL) || written == 0) return;
+        next += written;
+        size -= written;
+    }
+}
+
+unsigned long long monotonicMillis() {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart / frequency.QuadPart * 1000 +
+                                now.QuadPart % frequency.QuadPart * 1000 / frequency.QuadPart);
+}
+
+unsigned long long monotonicNanos() {
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER now;
+    if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)(now.QuadPart / frequency.QuadPart * 1000000000 +
+                                now.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+}
+
+const void *mapFile(const char *path, size_t *size, void **handle) {
+    *size = 0;
+    *handle = NULL;
+
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    // The mapping keeps the file open, so our handle can go straight away
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) return NULL;
+
+    const void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        CloseHandle(mapping);
+        return NULL;
+    }
+
+    *size = (size_t)fileSize.QuadPart;
+    *handle = mapping;
+    return data;
+}
+
+void unmapFile(const void *data, size_t size, void *handle) {
+    (void)size;
+    if (data != NULL) UnmapViewOfFile(data);
+    if (handle != NULL) CloseHandle((HANDLE)handle);
+}
+
+int listDirectory(const char *directory, void (*visit)(const char *name, void *context), void *context) {
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*", directory);
+
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA(pattern, &found);
+    if (search == INVALID_HANDLE_VALUE) return -1;
+
+    do {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) visit(found.cFileName, context);
+    } while (FindNextFileA(search, &found));
+
+    FindClose(search);
+    return 0;
+}
+
+
+int createFile(const char *path) {
+    return _open(path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+}
+
+// Windows has no writev, so the parts go one after the other
+int writeFileParts(int file, const void *const *parts, const size_t *sizes, int count) {
+    for (int i = 0; i < count; i++) {
+        const char *data = parts[i];
+        size_t left = sizes[i];
+        while (left > 0) {
+            unsigned int chunk = left > 0x40000000 ? 0x40000000 : (unsigned int)left;
+            int written = _write(file, data, chunk);
+            if (written <= 0) return -1;
+            data += written;
+            left -= (size_t)written;
+        }
+    }
+    return 0;
+}
+
+int syncFile(int file) {
+    return _commit(file);
+}
+
+void closeFile(int file) {
+    _close(file);
+}
+
+NetSocket listenTcp(const char *address, int port) {
+    struct addrinfo hints;
+    struct addrinfo *found;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(address, service, &hints, &found) != 0) return NO_SOCKET;
+
+    SOCKET listener = socket(found->ai_family, SOCK_STREAM, IPPROTO_TCP);
+    if (listener != INVALID_SOCKET) {
+        // Non-blocking, so several threads can wait on it and only one gets each connection
+        u_long nonBlocking = 1;
+        if (bind(listener, found->ai_addr, (int)found->ai_addrlen) != 0 || listen(listener, SOMAXCONN) != 0 ||
+            ioctlsocket(listener, FIONBIO, &nonBlocking) != 0) {
+            closesocket(listener);
+            listener = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(found);
+    return listener == INVALID_SOCKET ? NO_SOCKET : (NetSocket)listener;
+}
+
+NetSocket acceptTcp(NetSocket listener, int milliseconds) {
+    WSAPOLLFD poll;
+    poll.fd = (SOCKET)listener;
+    poll.events = POLLRDNORM;
+    poll.revents = 0;
+    if (WSAPoll(&poll, 1, milliseconds) <= 0) return NO_SOCKET;
+
+    SOCKET client = accept((SOCKET)listener, NULL, NULL);
+    if (client == INVALID_SOCKET) return NO_SOCKET;
+
+    // Accepted sockets inherit non-blocking mode on Windows
+    u_long nonBlocking = 0;
+    DWORD timeout = 5000;
+    ioctlsocket(client, FIONBIO, &nonBlocking);
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+    return (NetSocket)client;
+}
+
+int receiveTcp(NetSocket socket, void *buffer, size_t size, int milliseconds) {
+    WSAPOLLFD poll;
+    poll.fd = (SOCKET)socket;
+    poll.events = POLLRDNORM;
+    poll.revents = 0;
+    if (WSAPoll(&poll, 1, milliseconds) <= 0) return -1;
+    int received = recv((SOCKET)socket, buffer, (int)size, 0);
+    return received < 0 ? -1 : received;
+}
+
+int sendTcp(NetSocket socket, const void *data, size_t size) {
+    const char *next = data;
+    while (size > 0) {
+        int sent = send((SOCKET)socket, next, size > 0x40000000 ? 0x40000000 : (int)size, 0);
+        if (sent <= 0) return -1;
+        next += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+void closeTcp(NetSocket socket) {
+    closesocket((SOCKET)socket);
+}
+
+NetSocket connectTcp(const char *host, int port) {
+    struct addrinfo hints;
+    struct addrinfo *found;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &found) != 0) return NO_SOCKET;
+
+    SOCKET connected = INVALID_SOCKET;
+    for (struct addrinfo *candidate = found; candidate != NULL && connected == INVALID_SOCKET; candidate = candidate->ai_next) {
+        connected = socket(candidate->ai_family, SOCK_STREAM, IPPROTO_TCP);
+        if (connected == INVALID_SOCKET) continue;
+        if (connect(connected, candidate->ai_addr, (int)candidate->ai_addrlen) != 0) {
+            closesocket(connected);
+            connected = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(found);
+    if (connected == INVALID_SOCKET) return NO_SOCKET;
+
+    DWORD timeout = 5000;
+    setsockopt(connected, SOL_SOCKET, SO_SNDTIMEO, (const char *)&timeout, sizeof(timeout));
+    return (NetSocket)connected;
+}
+
+// WSAPoll over a list: fine for the few hundred sockets a shard holds
+struct Poller {
+    WSAPOLLFD *sockets;
+    void **contexts;
+    int count;
+    int capacity;
+};
+
+Poller *createPoller() {
+    return calloc(1, sizeof(Poller));
+}
+
+void destroyPoller(Poller *poller) {
+    free(poller->sockets);
+    free(poller->contexts);
+    free(poller);
+}
+
+int watchSocket(Poller *poller, NetSocket socket, void *context) {
+    if (poller->count == poller->capacity) {
+        int capacity = poller->capacity ? poller->capacity * 2 : 64;
+        WSAPOLLFD *sockets = realloc(poller->sockets, (size_t)capacity * sizeof(WSAPOLLFD));
+        if (sockets == NULL) return -1;
+        poller->sockets = sockets;
+        void **contexts = realloc(poller->contexts, (size_t)capacity * sizeof(void *));
+        if (contexts == NULL) return -1;
+        poller->contexts = contexts;
+        poller->capacity = capacity;
+    }
+    poller->sockets[poller->count].fd = (SOCKET)socket;
+    poller->sockets[poller->count].events = POLLRDNORM;
+    poller->sockets[poller->count].revents = 0;
+    poller->contexts[poller->count++] = context;
+    return 0;
+}
+
+void unwatchSocket(Poller *poller, NetSocket socket) {
+    for (int i = 0; i < poller->count; i++) {
+        if (poller->sockets[i].fd != (SOCKET)socket) continue;
+        poller->count--;
+        poller->sockets[i] = poller->sockets[poller->count];
+        poller->contexts[i] = poller->contexts[poller->count];
+        return;
+    }
+}
+
+int waitPoller(Poller *poller, void **ready, int maxReady, int milliseconds) {
+    if (poller->count == 0) {
+        Sleep((DWORD)milliseconds);
+        return 0;
+    }
+    if (WSAPoll(poller->sockets, (ULONG)poller->count, milliseconds) <= 0) return 0;
+
+    int found = 0;
+    for (int i = 0; i < poller->count && found < maxReady; i++) {
+        if (poller->sockets[i].revents != 0) ready[found++] = poller->contexts[i];
+    }
+    return found;
+}
+
+void getSystemFilePath(const char *name, char *path, size_t size) {
+    char system[MAX_PATH];
+    if (GetSystemDirectoryA(system, sizeof(system)) == 0) strcpy(system, "C:\\Windows\\System32");
+    snprintf(path, size, "%s\\drivers\\etc\\%s", system, name);
+}
+
+struct Thread {
+    HANDLE handle;
+    int (*run)(void *argument);
+    void *argument;
+};
+
+static DWORD WINAPI threadMain(LPVOID parameter) {
+    Thread *thread = parameter;
+    return (DWORD)thread->run(thread->argument);
+}
+
+Thread *startThread(int (*run)(void *argument), void *argument) {
+    Thread *thread = malloc(sizeof(Thread));
+    if (thread == NULL) return NULL;
+    thread->run = run;
+    thread->argument = argument;
+    thread->handle = CreateThread(NULL, 0, threadMain, thread, 0, NULL);
+    if (thread->handle == NULL) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void joinThread(Thread *thread) {
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+    free(thread);
+}
+
+// An auto-reset event does exactly what we need
+Event *createEvent() {
+    return (Event *)CreateEventA(NULL, FALSE, FALSE, NULL);
+}
+
+void signalEvent(Event *event) {
+    SetEvent((HANDLE)event);
+}
+
+int waitEvent(Event *event, int milliseconds) {
+    return WaitForSingleObject((HANDLE)event, (DWORD)milliseconds) == WAIT_OBJECT_0;
+}
+
+void destroyEvent(Event *event) {
+    CloseHandle((HANDLE)event);
+}
+
+static SRWLOCK sharedLock = SRWLOCK_INIT;
+
+void lockShared() {
+    AcquireSRWLockExclusive(&sharedLock);
+}
+
+void unlockShared() {
+    ReleaseSRWLockExclusive(&sharedLock);
+}
+
+struct Lock {
+    SRWLOCK handle;
+};
+
+Lock *createLock() {
+    Lock *lock = malloc(sizeof(Lock));
+    if (lock != NULL) InitializeSRWLock(&lock->handle);
+    return lock;
+}
+
+void acquireLock(Lock *lock) {
+    AcquireSRWLockExclusive(&lock->handle);
+}
+
+void releaseLock(Lock *lock) {
+    ReleaseSRWLockExclusive(&lock->handle);
+}
+
+void destroyLock(Lock *lock) {
+    free(lock);
+}
+
+int getProcessorCount() {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+}
+
+int getProcessUsage(unsigned long long *cpuMicros, unsigned long long *residentBytes) {
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return -1;
+    // 100 ns units
+    unsigned long long kernelTime = ((unsigned long long)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+    unsigned long long userTime = ((unsigned long long)user.dwHighDateTime << 32) | user.dwLowDateTime;
+    *cpuMicros = (kernelTime + userTime) / 10;
+
+    PROCESS_MEMORY_COUNTERS memory;
+    *residentBytes = 0;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory))) *residentBytes = memory.WorkingSetSize;
+    return 0;
+}
+
+#else
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+static struct termios savedTerminal;
+static int terminalSaved = 0;
+
+int initNetworking() {
+    return 0;
+}
+
+void cleanupNetworking() {
+}
+
+void initConsole() {
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &savedTerminal) != 0) return;
+    terminalSaved = 1;
+    setLineInput(0);
+}
+
+void restoreConsole() {
+    if (terminalSaved) tcsetattr(STDIN_FILENO, TCSANOW, &savedTerminal);
+}
+
+// Switch between the normal line-by-line input (needed for scanf) and
+// the raw single-key input the menu uses
+void setLineInput(int enabled) {
+    if (!terminalSaved) return;
+
+    struct termios terminal = savedTerminal;
+    if (!enabled) {
+        terminal.c_lflag &= ~(ICANON | ECHO);
+        terminal.c_cc[VMIN] = 1;
+        terminal.c_cc[VTIME] = 0;
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &terminal);
+}
+
+int keyPressed() {
+    fd_set readSet;
+    struct timeval noWait = {0, 0};
+
+    FD_ZERO(&readSet);
+    FD_SET(STDIN_FILENO, &readSet);
+    return select(STDIN_FILENO + 1, &readSet, NULL, NULL, &noWait) > 0;
+}
+
+int readKey() {
+    unsigned char key;
+    fflush(stdout);
+    if (read(STDIN_FILENO, &key, 1) != 1) return EOF;
+    if (key != 27 || !keyPressed()) return key;
+
+    // The arrow and paging keys send ESC [ and a letter, or a number and ~
+    unsigned char sequence[3];
+    if (read(STDIN_FILENO, &sequence[0], 1) != 1 || (sequence[0] != '[' && sequence[0] != 'O')) return 27;
+    if (read(STDIN_FILENO, &sequence[1], 1) != 1) return 27;
+    switch (sequence[1]) {
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+    }
+    if (sequence[1] < '1' || sequence[1] > '8' || read(STDIN_FILENO, &sequence[2], 1) != 1 || sequence[2] != '~') {
+        return 27;
+    }
+    switch (sequence[1]) {
+        case '1': case '7': return KEY_HOME;
+        case '4': case '8': return KEY_END;
+        case '5': return KEY_PAGE_UP;
+        case '6': return KEY_PAGE_DOWN;
+        default: return 27;
+    }
+}
+
+void sleepMilliseconds(int milliseconds) {
+    usleep((useconds_t)milliseconds * 1000);
+}
+
+void getConsoleSize(int *rows, int *columns) {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0 || size.ws_row == 0 || size.ws_col == 0) {
+        *rows = 24;
+        *columns = 80;
+        return;
+    }
+    *rows = size.ws_row;
+    *columns = size.ws_col;
+}
+
+// One write for the whole frame, unless the terminal takes less
+void writeConsole(const void *data, size_t size) {
+    const char *next = data;
+    fflush(stdout);
+    while (size > 0) {
+        ssize_t written = write(STDOUT_FILENO, next, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) return;
+        next += written;
+        size -= (size_t)written;
+    }
+}
+
+unsigned long long monotonicMillis() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000 + (unsigned long long)now.tv_nsec / 1000000;
+}
+
+unsigned long long monotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000 + (unsigned long long)now.tv_nsec;
+}
+
+const void *mapFile(const char *path, size_t *size, void **handle) {
+    *size = 0;
+    *handle = NULL;
+
+    int file = open(path, O_RDONLY);
+    if (file < 0) return NULL;
+
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size == 0) {
+        close(file);
+        return NULL;
+    }
+
+    // The mapping keeps its own reference to the file
+    void *data = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+    close(file);
+    if (data == MAP_FAILED) return NULL;
+
+    *size = (size_t)info.st_size;
+    return data;
+}
+
+void unmapFile(const void *data, size_t size, void *handle) {
+    (void)handle;
+    if (data != NULL) munmap((void *)data, size);
+}
+
+int listDirectory(const char *directory, void (*visit)(const char *name, void *context), void *context) {
+    DIR *dir = opendir(directory);
+    if (dir == NULL) return -1;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') visit(entry->d_name, context);
+    }
+
+    closedir(dir);
+    return 0;
+}
+
+
+int createFile(const char *path) {
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+int writeFileParts(int file, const void *const *parts, const size_t *sizes, int count) {
+    struct iovec vectors[64];
+    int first = 0;
+    size_t skip = 0;    // Bytes of parts[first] already written
+
+    while (first < count) {
+        int n = 0;
+        for (int i = first; i < count && n < 64; i++, n++) {
+            vectors[n].iov_base = (char *)parts[i] + (i == first ? skip : 0);
+            vectors[n].iov_len = sizes[i] - (i == first ? skip : 0);
+        }
+
+        ssize_t written = writev(file, vectors, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        // Step over what went out; a short write carries on mid-part
+        size_t left = (size_t)written;
+        while (first < count && left >= sizes[first] - skip) {
+            left -= sizes[first] - skip;
+            first++;
+            skip = 0;
+        }
+        skip += left;
+    }
+    return 0;
+}
+
+int syncFile(int file) {
+    return fsync(file);
+}
+
+void closeFile(int file) {
+    close(file);
+}
+
+NetSocket listenTcp(const char *address, int port) {
+    struct addrinfo hints;
+    struct addrinfo *found;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST | AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(address, service, &hints, &found) != 0) return NO_SOCKET;
+
+    // Non-blocking, so several threads can wait on it and only one gets
+    // each connection
+    int listener = socket(found->ai_family, SOCK_STREAM, 0);
+    if (listener >= 0) {
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        fcntl(listener, F_SETFD, FD_CLOEXEC);
+        if (bind(listener, found->ai_addr, found->ai_addrlen) != 0 || listen(listener, SOMAXCONN) != 0 ||
+            fcntl(listener, F_SETFL, O_NONBLOCK) != 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return listener < 0 ? NO_SOCKET : listener;
+}
+
+NetSocket acceptTcp(NetSocket listener, int milliseconds) {
+    struct pollfd waiting = {(int)listener, POLLIN, 0};
+    if (poll(&waiting, 1, milliseconds) <= 0) return NO_SOCKET;
+
+    int client = accept((int)listener, NULL, NULL);
+    if (client < 0) return NO_SOCKET;
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    fcntl(client, F_SETFL, 0);      // Some systems pass O_NONBLOCK on
+
+    // Don't let a client that stops reading hold a thread forever
+    struct timeval timeout = {5, 0};
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return client;
+}
+
+int receiveTcp(NetSocket socket, void *buffer, size_t size, int milliseconds) {
+    struct pollfd waiting = {(int)socket, POLLIN, 0};
+    if (poll(&waiting, 1, milliseconds) <= 0) return -1;
+    ssize_t received = recv((int)socket, buffer, size, 0);
+    return received < 0 ? -1 : (int)received;
+}
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0      // Not everywhere; SIGPIPE is then left to the caller
+#endif
+
+int sendTcp(NetSocket socket, const void *data, size_t size) {
+    const char *next = data;
+    while (size > 0) {
+        ssize_t sent = send((int)socket, next, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        next += sent;
+        size -= (size_t)sent;
+    }
+    return 0;
+}
+
+void closeTcp(NetSocket socket) {
+    close((int)socket);
+}
+
+NetSocket connectTcp(const char *host, int port) {
+    struct addrinfo hints;
+    struct addrinfo *found;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &found) != 0) return NO_SOCKET;
+
+    int connected = -1;
+    for (struct addrinfo *candidate = found; candidate != NULL && connected < 0; candidate = candidate->ai_next) {
+        connected = socket(candidate->ai_family, SOCK_STREAM, 0);
+        if (connected < 0) continue;
+        fcntl(connected, F_SETFD, FD_CLOEXEC);
+        if (connect(connected, candidate->ai_addr, candidate->ai_addrlen) != 0) {
+            close(connected);
+            connected = -1;
+        }
+    }
+    freeaddrinfo(found);
+    if (connected < 0) return NO_SOCKET;
+
+    struct timeval timeout = {5, 0};
+    setsockopt(connected, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return connected;
+}
+
+#ifdef __linux__
+
+struct Poller {
+    int poller;
+};
+
+Poller *createPoller() {
+    Poller *poller = malloc(sizeof(Poller));
+    if (poller == NULL) return NULL;
+    poller->poller = epoll_create1(EPOLL_CLOEXEC);
+    if (poller->poller < 0) {
+        free(poller);
+        return NULL;
+    }
+    return poller;
+}
+
+void destroyPoller(Poller *poller) {
+    close(poller->poller);
+    free(poller);
+}
+
+int watchSocket(Poller *poller, NetSocket socket, void *context) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = context;
+    return epoll_ctl(poller->poller, EPOLL_CTL_ADD, (int)socket, &event) == 0 ? 0 : -1;
+}
+
+void unwatchSocket(Poller *poller, NetSocket socket) {
+    epoll_ctl(poller->poller, EPOLL_CTL_DEL, (int)socket, NULL);
+}
+
+int waitPoller(Poller *poller, void **ready, int maxReady, int milliseconds) {
+    struct epoll_event events[64];
+    if (maxReady > 64) maxReady = 64;
+    int count = epoll_wait(poller->poller, events, maxReady, milliseconds);
+    for (int i = 0; i < count; i++) ready[i] = events[i].data.ptr;
+    return count > 0 ? count : 0;
+}
+
+#else
+
+// poll over a list, for the BSDs and macOS
+struct Poller {
+    struct pollfd *sockets;
+    void **contexts;
+    int count;
+    int capacity;
+};
+
+Poller *createPoller() {
+    return calloc(1, sizeof(Poller));
+}
+
+void destroyPoller(Poller *poller) {
+    free(poller->sockets);
+    free(poller->contexts);
+    free(poller);
+}
+
+int watchSocket(Poller *poller, NetSocket socket, void *context) {
+    if (poller->count == poller->capacity) {
+        int capacity = poller->capacity ? poller->capacity * 2 : 64;
+        struct pollfd *sockets = realloc(poller->sockets, (size_t)capacity * sizeof(struct pollfd));
+        if (sockets == NULL) return -1;
+        poller->sockets = sockets;
+        void **contexts = realloc(poller->contexts, (size_t)capacity * sizeof(void *));
+        if (contexts == NULL) return -1;
+        poller->contexts = contexts;
+        poller->capacity = capacity;
+    }
+    poller->sockets[poller->count].fd = (int)socket;
+    poller->sockets[poller->count].events = POLLIN;
+    poller->sockets[poller->count].revents = 0;
+    poller->contexts[poller->count++] = context;
+    return 0;
+}
+
+void unwatchSocket(Poller *poller, NetSocket socket) {
+    for (int i = 0; i < poller->count; i++) {
+        if (poller->sockets[i].fd != (int)socket) continue;
+        poller->count--;
+        poller->sockets[i] = poller->sockets[poller->count];
+        poller->contexts[i] = poller->contexts[poller->count];
+        return;
+    }
+}
+
+int waitPoller(Poller *poller, void **ready, int maxReady, int milliseconds) {
+    if (poll(poller->sockets, (nfds_t)poller->count, milliseconds) <= 0) return 0;
+
+    int found = 0;
+    for (int i = 0; i < poller->count && found < maxReady; i++) {
+        if (poller->sockets[i].revents != 0) ready[found++] = poller->contexts[i];
+    }
+    return found;
+}
+
+#endif
+
+void getSystemFilePath(const char *name, char *path, size_t size) {
+    snprintf(path, size, "/etc/%s", name);
+}
+
+struct Thread {
+    pthread_t handle;
+    int (*run)(void *argument);
+    void *argument;
+};
+
+static void *threadMain(void *parameter) {
+    Thread *thread = parameter;
+    thread->run(thread->argument);
+    return NULL;
+}
+
+Thread *startThread(int (*run)(void *argument), void *argument) {
+    Thread *thread = malloc(sizeof(Thread));
+    if (thread == NULL) return NULL;
+    thread->run = run;
+    thread->argument = argument;
+    if (pthread_create(&thread->handle, NULL, threadMain, thread) != 0) {
+        free(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+void joinThread(Thread *thread) {
+    pthread_join(thread->handle, NULL);
+    free(thread);
+}
+
+// Works like a Windows auto-reset event: a signal with nobody waiting is
+// remembered until the next wait
+struct Event {
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+    int signalled;
+};
+
+Event *createEvent() {
+    Event *event = malloc(sizeof(Event));
+    if (event == NULL) return NULL;
+    pthread_mutex_init(&event->lock, NULL);
+    pthread_cond_init(&event->condition, NULL);
+    event->signalled = 0;
+    return event;
+}
+
+void signalEvent(Event *event) {
+    pthread_mutex_lock(&event->lock);
+    event->signalled = 1;
+    pthread_cond_signal(&event->condition);
+    pthread_mutex_unlock(&event->lock);
+}
+
+int waitEvent(Event *event, int milliseconds) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += milliseconds / 1000;
+    deadline.tv_nsec += (long)(milliseconds % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&event->lock);
+    while (!event->signalled) {
+        if (pthread_cond_timedwait(&event->condition, &event->lock, &deadline) != 0) break;
+    }
+    int signalled = event->signalled;
+    event->signalled = 0;
+    pthread_mutex_unlock(&event->lock);
+    return signalled;
+}
+
+void destroyEvent(Event *event) {
+    pthread_cond_destroy(&event->condition);
+    pthread_mutex_destroy(&event->lock);
+    free(event);
+}
+
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+void lockShared() {
+    pthread_mutex_lock(&sharedLock);
+}
+
+void unlockShared() {
+    pthread_mutex_unlock(&sharedLock);
+}
+
+struct Lock {
+    pthread_mutex_t handle;
+};
+
+Lock *createLock() {
+    Lock *lock = malloc(sizeof(Lock));
+    if (lock != NULL) pthread_mutex_init(&lock->handle, NULL);
+    return lock;
+}
+
+void acquireLock(Lock *lock) {
+    pthread_mutex_lock(&lock->handle);
+}
+
+void releaseLock(Lock *lock) {
+    pthread_mutex_unlock(&lock->handle);
+}
+
+void destroyLock(Lock *lock) {
+    pthread_mutex_destroy(&lock->handle);
+    free(lock);
+}
+
+int getProcessorCount() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+int getProcessUsage(unsigned long long *cpuMicros, unsigned long long *residentBytes) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+    *cpuMicros = (unsigned long long)usage.ru_utime.tv_sec * 1000000 + (unsigned long long)usage.ru_utime.tv_usec +
+                 (unsigned long long)usage.ru_stime.tv_sec * 1000000 + (unsigned long long)usage.ru_stime.tv_usec;
+
+#ifdef __linux__
+    // The second number in statm is resident pages
+    *residentBytes = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        unsigned long long size, resident;
+        if (fscanf(file, "%llu %llu", &size, &resident) == 2) {
+            *residentBytes = resident * (unsigned long long)sysconf(_SC_PAGESIZE);
+        }
+        fclose(file);
+    }
+#else
+    // Only the peak is known here (kilobytes on most systems)
+    *residentBytes = (unsigned long long)usage.ru_maxrss * 1024;
+#endif
+    return 0;
+}
+
+#endif
+
+unsigned long long wallClockMillis() {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (unsigned long long)now.tv_sec * 1000 + (unsigned long long)now.tv_nsec / 1000000;
+}
+
+// The same on both, once the socket headers are in
+int lookupAddressName(const unsigned char address[16], int ipv6, char *name, size_t size) {
+    struct sockaddr_storage storage;
+    socklen_t length;
+    memset(&storage, 0, sizeof(storage));
+
+    if (ipv6) {
+        struct sockaddr_in6 *socketAddress = (struct sockaddr_in6 *)&storage;
+        socketAddress->sin6_family = AF_INET6;
+        memcpy(&socketAddress->sin6_addr, address, 16);
+        length = sizeof(*socketAddress);
+    } else {
+        // The IPv4 address is the last 4 bytes (::ffff:a.b.c.d)
+        struct sockaddr_in *socketAddress = (struct sockaddr_in *)&storage;
+        socketAddress->sin_family = AF_INET;
+        memcpy(&socketAddress->sin_addr, address + 12, 4);
+        length = sizeof(*socketAddress);
+    }
+    return getnameinfo((struct sockaddr *)&storage, length, name, (socklen_t)size, NULL, 0, NI_NAMEREQD) == 0 ? 0 : -1;
+}
+
+void getHostName(char *name, size_t size) {
+    if (gethostname(name, (int)size) != 0 || name[0] == '\0') snprintf(name, size, "localhost");
+    name[size - 1] = '\0';
+}
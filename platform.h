@@ -0,0 +1,121 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stddef.h>
+
+// Small wrappers around the console and socket calls that differ between
+// Windows and Linux, so the rest of the program doesn't need #ifdefs
+
+int initNetworking();           // WSAStartup on Windows, nothing on Linux
+void cleanupNetworking();
+void initConsole();             // Put the terminal into single-key mode
+void restoreConsole();          // Put the terminal back the way we found it
+int keyPressed();               // Like _kbhit(): 1 if a key is waiting
+int readKey();                  // Like _getch(): read one key without echo, or a KEY_ code
+void setLineInput(int enabled); // Turn normal line input on for scanf
+void sleepMilliseconds(int milliseconds);
+void getConsoleSize(int *rows, int *columns);   // 24x80 when it can't tell
+void writeConsole(const void *data, size_t size);   // Straight to the terminal, after stdout
+
+// readKey returns these for keys that don't have a character
+typedef enum {
+    KEY_UP = 0x100,
+    KEY_DOWN,
+    KEY_PAGE_UP,
+    KEY_PAGE_DOWN,
+    KEY_HOME,
+    KEY_END
+} SpecialKey;
+
+unsigned long long wallClockMillis();   // Milliseconds since 1970
+unsigned long long monotonicMillis();   // Milliseconds since some fixed point, never goes back
+unsigned long long monotonicNanos();    // The same in nanoseconds, for timing short stretches of code
+
+// Map a whole file into memory read-only. Returns NULL for a missing or
+// empty file. handle is whatever unmapFile needs to undo it.
+const void *mapFile(const char *path, size_t *size, void **handle);
+void unmapFile(const void *data, size_t size, void *handle);
+
+// Call visit with the name of every file in directory
+int listDirectory(const char *directory, void (*visit)(const char *name, void *context), void *context);
+
+// Plain file handles, for writing the log without stdio buffering
+int createFile(const char *path);       // Empty file opened for writing, -1 on failure
+int writeFileParts(int file, const void *const *parts, const size_t *sizes, int count);  // All or -1
+int syncFile(int file);                 // fsync / _commit
+void closeFile(int file);
+
+// TCP sockets, for the metrics endpoint and the fleet collector. A
+// NetSocket is a SOCKET on Windows and a file descriptor elsewhere.
+typedef long long NetSocket;
+#define NO_SOCKET ((NetSocket)-1)
+
+NetSocket listenTcp(const char *address, int port);         // Numeric address; NO_SOCKET on failure
+NetSocket acceptTcp(NetSocket listener, int milliseconds);  // NO_SOCKET if nobody connected in time
+int receiveTcp(NetSocket socket, void *buffer, size_t size, int milliseconds);  // Bytes, 0 at the end, -1 on error/timeout
+int sendTcp(NetSocket socket, const void *data, size_t size);   // All of it, or -1
+void closeTcp(NetSocket socket);
+
+// Connect to host (a name or a numeric address). Blocks until connected
+// or refused; sends time out after a few seconds. NO_SOCKET on failure.
+NetSocket connectTcp(const char *host, int port);
+
+// Waiting on many sockets at once: epoll on Linux, poll (WSAPoll)
+// elsewhere. Level-triggered: a socket with data left unread is ready
+// again on the next wait. Only the thread that waits may watch or
+// unwatch sockets.
+typedef struct Poller Poller;
+
+Poller *createPoller();
+void destroyPoller(Poller *poller);
+int watchSocket(Poller *poller, NetSocket socket, void *context);  // 0, or -1
+void unwatchSocket(Poller *poller, NetSocket socket);
+
+// Wait until some sockets have data (or were closed) and put their
+// contexts in ready. Returns how many, 0 on timeout.
+int waitPoller(Poller *poller, void **ready, int maxReady, int milliseconds);
+
+// Reverse DNS for an address (16 bytes, IPv4 in the last 4). Blocks for as
+// long as the resolver takes, so keep it off the main thread. Returns -1
+// when the address has no name.
+int lookupAddressName(const unsigned char address[16], int ipv6, char *name, size_t size);
+
+// Where the system keeps files like hosts and services: /etc/<name>, or
+// the drivers\etc folder on Windows
+void getSystemFilePath(const char *name, char *path, size_t size);
+
+// This machine's name, "localhost" when it has none
+void getHostName(char *name, size_t size);
+
+// Threads, and an event one thread can wait on until another signals it
+typedef struct Thread Thread;
+typedef struct Event Event;
+
+Thread *startThread(int (*run)(void *argument), void *argument);
+void joinThread(Thread *thread);        // Waits for it to finish and frees it
+
+Event *createEvent();
+void signalEvent(Event *event);
+int waitEvent(Event *event, int milliseconds);  // 1 if signalled, 0 on timeout
+void destroyEvent(Event *event);
+
+// One process-wide lock that works before anything is set up, for the
+// few shared tables threads can add to (the interned strings)
+void lockShared();
+void unlockShared();
+
+// A plain lock, for data a few threads take turns at
+typedef struct Lock Lock;
+
+Lock *createLock();
+void acquireLock(Lock *lock);
+void releaseLock(Lock *lock);
+void destroyLock(Lock *lock);
+
+int getProcessorCount();
+
+// CPU time this process has used (user + kernel, all threads) and how much
+// of its memory is resident right now. Returns -1 if the system won't say.
+int getProcessUsage(unsigned long long *cpuMicros, unsigned long long *residentBytes);
+
+#endif
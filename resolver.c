@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <string.h>
+#include "resolver.h"
+#include "arena.h"
+
+#define QUEUE_MASK (RESOLVER_QUEUE_SIZE - 1)
+
+static unsigned int hashAddress(const unsigned char address[16]) {
+    unsigned long long words[2];
+    memcpy(words, address, 16);
+    unsigned long long hash = (words[0] ^ (words[1] * 0x9E3779B97F4A7C15ull)) * 0xFF51AFD7ED558CCDull;
+    return (unsigned int)(hash >> 32) & (RESOLVER_CACHE_SIZE - 1);
+}
+
+// "address name aliases # comment", like /etc/hosts. The first name for
+// an address wins.
+static int readHostsFile(Resolver *resolver, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Error: Could not open hosts file %s\n", path);
+        return -1;
+    }
+
+    int capacity = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char addressText[64], name[MAX_HOST_NAME];
+        HostLookup host;
+        AddressFamily family;
+        if (sscanf(line, "%63s %255s", addressText, name) != 2) continue;
+        if (parseAddress(addressText, host.address, &family) != 0) continue;
+
+        if (resolver->hostCount == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            HostLookup *hosts = trackedRealloc(resolver->hosts, (size_t)capacity * sizeof(HostLookup));
+            if (hosts == NULL) break;
+            resolver->hosts = hosts;
+        }
+        host.family = (unsigned char)family;
+        host.found = 1;
+        snprintf(host.name, sizeof(host.name), "%s", name);
+        resolver->hosts[resolver->hostCount++] = host;
+    }
+    fclose(file);
+    resolver->useHostsFile = 1;
+    return 0;
+}
+
+static void resolveAddress(const Resolver *resolver, HostLookup *lookup) {
+    lookup->found = 0;
+    lookup->name[0] = '\0';
+
+    if (!resolver->useHostsFile) {
+        lookup->found = lookupAddressName(lookup->address, lookup->family == ADDRESS_IPV6,
+                                          lookup->name, sizeof(lookup->name)) == 0;
+        return;
+    }
+    for (int i = 0; i < resolver->hostCount; i++) {
+        if (memcmp(resolver->hosts[i].address, lookup->address, 16) == 0) {
+            memcpy(lookup->name, resolver->hosts[i].name, sizeof(lookup->name));
+            lookup->found = 1;
+            return;
+        }
+    }
+}
+
+// The worker: take a request, resolve it, hand back the answer. The
+// refresh loop never has more requests out than the answer ring holds,
+// so there is always room for the answer.
+static int runResolver(void *argument) {
+    Resolver *resolver = argument;
+
+    while (!atomic_load(&resolver->stopping)) {
+        unsigned int tail = atomic_load_explicit(&resolver->requestTail, memory_order_relaxed);
+        if (tail == atomic_load_explicit(&resolver->requestHead, memory_order_acquire)) {
+            waitEvent(resolver->wake, 1000);
+            continue;
+        }
+
+        HostLookup lookup = resolver->requests[tail & QUEUE_MASK];
+        atomic_store_explicit(&resolver->requestTail, tail + 1, memory_order_release);
+        resolveAddress(resolver, &lookup);
+
+        unsigned int head = atomic_load_explicit(&resolver->answerHead, memory_order_relaxed);
+        resolver->answers[head & QUEUE_MASK] = lookup;
+        atomic_store_explicit(&resolver->answerHead, head + 1, memory_order_release);
+    }
+    return 0;
+}
+
+int startResolver(Resolver *resolver, const char *hostsFile) {
+    memset(resolver, 0, sizeof(*resolver));
+    for (int i = 0; i < RESOLVER_CACHE_SIZE; i++) resolver->buckets[i] = -1;
+    resolver->newest = -1;
+    resolver->oldest = -1;
+
+    if (hostsFile != NULL && readHostsFile(resolver, hostsFile) != 0) return -1;
+
+    resolver->wake = createEvent();
+    if (resolver->wake != NULL) resolver->worker = startThread(runResolver, resolver);
+    if (resolver->worker == NULL) {
+        printf("Error: Could not start the name lookup thread\n");
+        if (resolver->wake != NULL) destroyEvent(resolver->wake);
+        trackedFree(resolver->hosts);
+        resolver->wake = NULL;
+        resolver->hosts = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void stopResolver(Resolver *resolver) {
+    if (resolver->worker == NULL) return;
+    // A DNS call already under way has to finish first
+    atomic_store(&resolver->stopping, 1);
+    signalEvent(resolver->wake);
+    joinThread(resolver->worker);
+    destroyEvent(resolver->wake);
+    trackedFree(resolver->hosts);
+    resolver->worker = NULL;
+    resolver->wake = NULL;
+    resolver->hosts = NULL;
+}
+
+static int findEntry(const Resolver *resolver, const unsigned char address[16]) {
+    int index = resolver->buckets[hashAddress(address)];
+    while (index >= 0 && memcmp(resolver->entries[index].address, address, 16) != 0) {
+        index = resolver->entries[index].next;
+    }
+    return index;
+}
+
+static void unlinkRecent(Resolver *resolver, int index) {
+    HostEntry *entry = &resolver->entries[index];
+    if (entry->newer >= 0) resolver->entries[entry->newer].older = entry->older;
+    else resolver->newest = entry->older;
+    if (entry->older >= 0) resolver->entries[entry->older].newer = entry->newer;
+    else resolver->oldest = entry->newer;
+}
+
+static void makeNewest(Resolver *resolver, int index) {
+    HostEntry *entry = &resolver->entries[index];
+    entry->newer = -1;
+    entry->older = resolver->newest;
+    if (resolver->newest >= 0) resolver->entries[resolver->newest].newer = index;
+    resolver->newest = index;
+    if (resolver->oldest < 0) resolver->oldest = index;
+}
+
+// A fresh entry, in place of the least recently used one when full
+static int addEntry(Resolver *resolver, const unsigned char address[16]) {
+    int index;
+    if (resolver->count < RESOLVER_CACHE_SIZE) {
+        index = resolver->count++;
+    } else {
+        index = resolver->oldest;
+        unlinkRecent(resolver, index);
+        int *link = &resolver->buckets[hashAddress(resolver->entries[index].address)];
+        while (*link != index) link = &resolver->entries[*link].next;
+        *link = resolver->entries[index].next;
+        resolver->stats.evicted++;
+    }
+
+    HostEntry *entry = &resolver->entries[index];
+    unsigned int bucket = hashAddress(address);
+    memcpy(entry->address, address, 16);
+    entry->state = HOST_PENDING;
+    entry->name[0] = '\0';
+    entry->next = resolver->buckets[bucket];
+    resolver->buckets[bucket] = index;
+    makeNewest(resolver, index);
+    return index;
+}
+
+static void takeAnswers(Resolver *resolver, unsigned long long now) {
+    unsigned int tail = atomic_load_explicit(&resolver->answerTail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&resolver->answerHead, memory_order_acquire);
+
+    for (; tail != head; tail++) {
+        const HostLookup *answer = &resolver->answers[tail & QUEUE_MASK];
+        int index = findEntry(resolver, answer->address);
+        if (index < 0) index = addEntry(resolver, answer->address);
+
+        HostEntry *entry = &resolver->entries[index];
+        entry->state = answer->found ? HOST_NAMED : HOST_NO_NAME;
+        entry->expires = now + (answer->found ? RESOLVER_NAME_TTL : RESOLVER_MISS_TTL);
+        memcpy(entry->name, answer->name, sizeof(entry->name));
+        if (answer->found) resolver->stats.named++;
+    }
+    atomic_store_explicit(&resolver->answerTail, tail, memory_order_release);
+}
+
+static int queueRequest(Resolver *resolver, const unsigned char address[16], AddressFamily family) {
+    // Counting answers not taken yet keeps the answer ring from overflowing
+    unsigned int head = atomic_load_explicit(&resolver->requestHead, memory_order_relaxed);
+    if (head - atomic_load_explicit(&resolver->answerTail, memory_order_relaxed) >= RESOLVER_QUEUE_SIZE) return -1;
+
+    HostLookup *request = &resolver->requests[head & QUEUE_MASK];
+    memcpy(request->address, address, 16);
+    request->family = (unsigned char)family;
+    atomic_store_explicit(&resolver->requestHead, head + 1, memory_order_release);
+    signalEvent(resolver->wake);
+    return 0;
+}
+
+const char *lookupHostName(Resolver *resolver, const unsigned char address[16], AddressFamily family) {
+    if (resolver->worker == NULL) return NULL;
+    if (getAddressScope(address) == SCOPE_UNSPECIFIED) return NULL;
+
+    unsigned long long now = monotonicMillis();
+    takeAnswers(resolver, now);
+    resolver->stats.lookups++;
+
+    int index = findEntry(resolver, address);
+    if (index >= 0) {
+        HostEntry *entry = &resolver->entries[index];
+        unlinkRecent(resolver, index);
+        makeNewest(resolver, index);
+        if (entry->expires > now) {
+            if (entry->state != HOST_PENDING) resolver->stats.hits++;
+            return entry->state == HOST_NAMED ? entry->name : NULL;
+        }
+    }
+
+    // New, or too old to trust: ask again. An old name is still shown
+    // until the answer comes back.
+    if (queueRequest(resolver, address, family) != 0) {
+        resolver->stats.dropped++;
+    } else {
+        resolver->stats.queued++;
+        if (index < 0) index = addEntry(resolver, address);
+        resolver->entries[index].expires = now + RESOLVER_MISS_TTL;
+    }
+    if (index < 0) return NULL;
+    return resolver->entries[index].state == HOST_NAMED ? resolver->entries[index].name : NULL;
+}
+
+int haveHostAnswers(Resolver *resolver) {
+    if (resolver->worker == NULL) return 0;
+    return atomic_load_explicit(&resolver->answerTail, memory_order_relaxed) !=
+           atomic_load_explicit(&resolver->answerHead, memory_order_acquire);
+}
@@ -0,0 +1,97 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stdatomic.h>
+#include "network_monitoring.h"
+#include "platform.h"
+
+// Host names for remote addresses, looked up in the background.
+//
+// lookupHostName never waits: it answers from the cache, or queues the
+// address for a worker thread and returns NULL, and the name shows up on
+// a later refresh. The worker does the slow reverse-DNS calls, one at a
+// time. Requests go to it and answers come back through two fixed rings
+// with one writer each, so neither side takes a lock.
+//
+// The cache belongs to the refresh loop. It holds RESOLVER_CACHE_SIZE
+// addresses, drops the least recently shown one when full, and forgets
+// names after a while so a changed record gets picked up. Addresses with
+// no name are remembered too, for less time.
+
+#define RESOLVER_CACHE_SIZE 4096
+#define RESOLVER_QUEUE_SIZE 256         // Lookups waiting for the worker (a power of 2)
+#define RESOLVER_NAME_TTL 600000        // Milliseconds a name is trusted
+#define RESOLVER_MISS_TTL 60000         // And the lack of one, or a lookup that never came back
+#define MAX_HOST_NAME 256
+
+typedef struct {
+    unsigned char address[16];
+    unsigned char family;               // AddressFamily
+    unsigned char found;                // Answers only: 0 = no name
+    char name[MAX_HOST_NAME];
+} HostLookup;
+
+typedef enum {
+    HOST_PENDING,                       // Asked for, no answer yet
+    HOST_NAMED,
+    HOST_NO_NAME
+} HostState;
+
+typedef struct {
+    unsigned char address[16];
+    unsigned char state;                // HostState
+    unsigned long long expires;         // monotonicMillis when it has to be asked for again
+    int newer, older;                   // Recently-used list, -1 at the ends
+    int next;                           // Next entry in the same hash bucket
+    char name[MAX_HOST_NAME];
+} HostEntry;
+
+typedef struct {
+    unsigned long long lookups;
+    unsigned long long hits;            // Answered from the cache, name or not
+    unsigned long long queued;          // Sent to the worker
+    unsigned long long dropped;         // Not sent because the queue was full
+    unsigned long long named;           // Answers with a name
+    unsigned long long evicted;
+} ResolverStats;
+
+typedef struct {
+    // Cache, only touched by the refresh loop
+    HostEntry entries[RESOLVER_CACHE_SIZE];
+    int buckets[RESOLVER_CACHE_SIZE];   // First entry for each hash, -1 = none
+    int count;
+    int newest, oldest;
+
+    // Refresh loop -> worker and back
+    HostLookup requests[RESOLVER_QUEUE_SIZE];
+    atomic_uint requestHead, requestTail;
+    HostLookup answers[RESOLVER_QUEUE_SIZE];
+    atomic_uint answerHead, answerTail;
+
+    Thread *worker;
+    Event *wake;
+    atomic_int stopping;
+
+    // With a hosts file the worker only looks there and never uses DNS
+    HostLookup *hosts;
+    int hostCount;
+    int useHostsFile;
+
+    ResolverStats stats;
+} Resolver;
+
+// Start the worker. hostsFile (a file like /etc/hosts) replaces DNS, for
+// testing without a network; NULL uses the system resolver. Returns 0, or
+// -1 when the thread or the file can't be had.
+int startResolver(Resolver *resolver, const char *hostsFile);
+void stopResolver(Resolver *resolver);
+
+// The name for an address if it is known, or NULL (not known yet, or it
+// has none). Never blocks.
+const char *lookupHostName(Resolver *resolver, const unsigned char address[16], AddressFamily family);
+
+// 1 when answers have come back that no lookup has picked up yet, so the
+// screen is worth drawing again
+int haveHostAnswers(Resolver *resolver);
+
+#endif
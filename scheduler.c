@@ -0,0 +1,296 @@
+#include <stdlib.h>
+#include "platform.h"
+#include "scheduler.h"
+
+// The part every platform shares: where the grid is and how many ticks
+// went by since the last wake
+typedef struct {
+    int interval;
+    unsigned long long nextTick;      // monotonicMillis() of the next tick
+    unsigned long long missedTicks;
+} TickGrid;
+
+static void startGrid(TickGrid *grid, int intervalMs) {
+    if (intervalMs < MIN_INTERVAL_MS) intervalMs = MIN_INTERVAL_MS;
+    grid->interval = intervalMs;
+    grid->nextTick = monotonicMillis() + (unsigned long long)intervalMs;
+}
+
+// Move past every tick that is due now, counting all but one as missed
+static void passTicks(TickGrid *grid, unsigned long long now) {
+    if (now < grid->nextTick) return;
+    unsigned long long due = (now - grid->nextTick) / (unsigned long long)grid->interval + 1;
+    grid->missedTicks += due - 1;
+    grid->nextTick += due * (unsigned long long)grid->interval;
+}
+
+#ifdef _WIN32
+
+#include <windows.h>
+
+struct Scheduler {
+    TickGrid grid;
+    HANDLE timer;
+    HANDLE input;       // NULL when we don't watch the console
+};
+
+// Set by the console control handler. There is only one console, so one
+// event is enough however many schedulers there are.
+static HANDLE stopEvent = NULL;
+
+static BOOL WINAPI handleConsoleControl(DWORD type) {
+    (void)type;
+    SetEvent(stopEvent);
+    return TRUE;    // The main loop closes the log and exits
+}
+
+// The timer's own period keeps it on the grid; we only restart it when
+// the interval changes
+static void startTimer(Scheduler *scheduler) {
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)scheduler->grid.interval * 10000;    // Relative, in 100ns units
+    SetWaitableTimer(scheduler->timer, &due, scheduler->grid.interval, NULL, NULL, FALSE);
+}
+
+Scheduler *createScheduler(int intervalMs, int watchInput) {
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+    if (scheduler == NULL) return NULL;
+
+    if (stopEvent == NULL) {
+        stopEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        SetConsoleCtrlHandler(handleConsoleControl, TRUE);
+    }
+    // High resolution timers (Windows 10 1803+) don't round up to the
+    // 15.6 ms system tick; fall back to a normal one before that
+#ifdef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+    scheduler->timer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+    if (scheduler->timer == NULL) scheduler->timer = CreateWaitableTimerW(NULL, FALSE, NULL);
+    if (scheduler->timer == NULL || stopEvent == NULL) {
+        if (scheduler->timer != NULL) CloseHandle(scheduler->timer);
+        free(scheduler);
+        return NULL;
+    }
+    if (watchInput) {
+        DWORD mode;
+        HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+        if (GetConsoleMode(input, &mode)) scheduler->input = input;
+    }
+
+    startGrid(&scheduler->grid, intervalMs);
+    startTimer(scheduler);
+    return scheduler;
+}
+
+void destroyScheduler(Scheduler *scheduler) {
+    if (scheduler == NULL) return;
+    CancelWaitableTimer(scheduler->timer);
+    CloseHandle(scheduler->timer);
+    free(scheduler);
+}
+
+void setSchedulerInterval(Scheduler *scheduler, int intervalMs) {
+    startGrid(&scheduler->grid, intervalMs);
+    startTimer(scheduler);
+}
+
+WakeReason waitForWake(Scheduler *scheduler) {
+    HANDLE handles[3] = {stopEvent, scheduler->timer, scheduler->input};
+    DWORD count = scheduler->input != NULL ? 3 : 2;
+
+    DWORD result = WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+    if (result == WAIT_OBJECT_0 + 1) {
+        passTicks(&scheduler->grid, monotonicMillis());
+        return WAKE_TICK;
+    }
+    if (result == WAIT_OBJECT_0 + 2) return WAKE_INPUT;
+    return WAKE_STOP;
+}
+
+#elif defined(__linux__)
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+struct Scheduler {
+    TickGrid grid;
+    int timer;          // timerfd on CLOCK_MONOTONIC
+    int signals;        // signalfd for SIGINT/SIGTERM (and SIGWINCH)
+    int poller;         // epoll over the two, and stdin when watching input
+};
+
+// A periodic timerfd re-arms from its last expiry, not from when we read
+// it, which is exactly the grid we want
+static void startTimer(Scheduler *scheduler) {
+    struct itimerspec period;
+    period.it_interval.tv_sec = scheduler->grid.interval / 1000;
+    period.it_interval.tv_nsec = (long)(scheduler->grid.interval % 1000) * 1000000;
+    period.it_value = period.it_interval;
+    timerfd_settime(scheduler->timer, 0, &period, NULL);
+}
+
+static int watch(int poller, int file, WakeReason reason) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u32 = reason;
+    return epoll_ctl(poller, EPOLL_CTL_ADD, file, &event);
+}
+
+Scheduler *createScheduler(int intervalMs, int watchInput) {
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+    if (scheduler == NULL) return NULL;
+    scheduler->timer = scheduler->signals = scheduler->poller = -1;
+
+    // SIGWINCH (the terminal was resized) counts as console input
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (watchInput) sigaddset(&signals, SIGWINCH);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    scheduler->signals = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    scheduler->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    scheduler->poller = epoll_create1(EPOLL_CLOEXEC);
+    if (scheduler->signals < 0 || scheduler->timer < 0 || scheduler->poller < 0 ||
+        watch(scheduler->poller, scheduler->timer, WAKE_TICK) != 0 ||
+        watch(scheduler->poller, scheduler->signals, WAKE_STOP) != 0) {
+        destroyScheduler(scheduler);
+        return NULL;
+    }
+    // epoll refuses regular files, so input redirected from a file just
+    // isn't watched
+    if (watchInput) watch(scheduler->poller, STDIN_FILENO, WAKE_INPUT);
+
+    startGrid(&scheduler->grid, intervalMs);
+    startTimer(scheduler);
+    return scheduler;
+}
+
+void destroyScheduler(Scheduler *scheduler) {
+    if (scheduler == NULL) return;
+    if (scheduler->poller >= 0) close(scheduler->poller);
+    if (scheduler->timer >= 0) close(scheduler->timer);
+    if (scheduler->signals >= 0) close(scheduler->signals);
+    free(scheduler);
+}
+
+void setSchedulerInterval(Scheduler *scheduler, int intervalMs) {
+    startGrid(&scheduler->grid, intervalMs);
+    startTimer(scheduler);
+}
+
+WakeReason waitForWake(Scheduler *scheduler) {
+    while (1) {
+        struct epoll_event events[3];
+        int count = epoll_wait(scheduler->poller, events, 3, -1);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return WAKE_STOP;
+        }
+
+        // Stop wins, then the tick; input that is still waiting comes
+        // back on the next call
+        int ready[3] = {0, 0, 0};
+        for (int i = 0; i < count; i++) {
+            ready[events[i].data.u32] = 1;
+            if (events[i].data.u32 == WAKE_INPUT && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                // Input closed: stop watching it or we'd wake forever
+                epoll_ctl(scheduler->poller, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            }
+        }
+
+        if (ready[WAKE_STOP]) {
+            struct signalfd_siginfo signal;
+            if (read(scheduler->signals, &signal, sizeof(signal)) == sizeof(signal)) {
+                return signal.ssi_signo == SIGWINCH ? WAKE_INPUT : WAKE_STOP;
+            }
+        }
+        if (ready[WAKE_TICK]) {
+            unsigned long long expirations;
+            if (read(scheduler->timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                passTicks(&scheduler->grid, monotonicMillis());
+                return WAKE_TICK;
+            }
+        }
+        if (ready[WAKE_INPUT]) return WAKE_INPUT;
+    }
+}
+
+#else
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+// Other POSIX systems: poll() with a timeout worked out from the grid,
+// and a flag set by the signal handler
+
+struct Scheduler {
+    TickGrid grid;
+    int watchInput;
+};
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void handleStopSignal(int signal) {
+    (void)signal;
+    stopRequested = 1;
+}
+
+Scheduler *createScheduler(int intervalMs, int watchInput) {
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+    if (scheduler == NULL) return NULL;
+
+    struct sigaction action;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;    // No SA_RESTART, so poll() returns when a signal arrives
+    action.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    scheduler->watchInput = watchInput;
+    startGrid(&scheduler->grid, intervalMs);
+    return scheduler;
+}
+
+void destroyScheduler(Scheduler *scheduler) {
+    free(scheduler);
+}
+
+void setSchedulerInterval(Scheduler *scheduler, int intervalMs) {
+    startGrid(&scheduler->grid, intervalMs);
+}
+
+WakeReason waitForWake(Scheduler *scheduler) {
+    while (!stopRequested) {
+        unsigned long long now = monotonicMillis();
+        if (now >= scheduler->grid.nextTick) {
+            passTicks(&scheduler->grid, now);
+            return WAKE_TICK;
+        }
+
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        int result = poll(&input, scheduler->watchInput ? 1 : 0, (int)(scheduler->grid.nextTick - now));
+        if (result > 0) {
+            if (input.revents & (POLLHUP | POLLERR | POLLNVAL)) scheduler->watchInput = 0;
+            return WAKE_INPUT;
+        }
+    }
+    return WAKE_STOP;
+}
+
+#endif
+
+int getSchedulerInterval(const Scheduler *scheduler) {
+    return scheduler->grid.interval;
+}
+
+unsigned long long getMissedTicks(const Scheduler *scheduler) {
+    return scheduler->grid.missedTicks;
+}
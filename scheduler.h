@@ -0,0 +1,40 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+// Wakes the main loop every interval milliseconds, when a key is pressed,
+// or when we are asked to stop (Ctrl+C, SIGTERM, the console closing).
+// Ticks are kept on a fixed grid on the monotonic clock (start + n *
+// interval), so a slow refresh doesn't push the later ones back and a
+// clock change doesn't matter. A tick that is missed completely because
+// a refresh took longer than the interval is skipped, not run late.
+//
+// Linux sleeps in epoll on a timerfd, Windows in WaitForMultipleObjects
+// on a waitable timer, so nothing runs between ticks.
+
+#define MIN_INTERVAL_MS 10
+
+typedef enum {
+    WAKE_TICK,      // Time for the next refresh
+    WAKE_INPUT,     // Something is waiting on the console, or it was resized
+    WAKE_STOP       // Asked to shut down
+} WakeReason;
+
+typedef struct Scheduler Scheduler;
+
+// watchInput also wakes for console input (for the interactive screen).
+// Create the scheduler before starting any other thread: on Linux it
+// blocks SIGINT/SIGTERM so they can be read from a signalfd, and threads
+// started later inherit that.
+Scheduler *createScheduler(int intervalMs, int watchInput);
+void destroyScheduler(Scheduler *scheduler);
+
+// Start a new grid: next tick is intervalMs from now
+void setSchedulerInterval(Scheduler *scheduler, int intervalMs);
+int getSchedulerInterval(const Scheduler *scheduler);
+
+WakeReason waitForWake(Scheduler *scheduler);
+
+// Ticks skipped because a refresh ran past them
+unsigned long long getMissedTicks(const Scheduler *scheduler);
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include "arena.h"
+#include "platform.h"
+#include "screen.h"
+
+void initScreen(Screen *screen) {
+    memset(screen, 0, sizeof(*screen));
+    screen->fullRedraw = 1;
+}
+
+void freeScreen(Screen *screen) {
+    trackedFree(screen->text);
+    trackedFree(screen->shown);
+    trackedFree(screen->output);
+    memset(screen, 0, sizeof(*screen));
+}
+
+// The buffers keep their size between frames, so once the screen has
+// been drawn a couple of times nothing is allocated any more
+static int reserveText(char **buffer, size_t *capacity, size_t needed) {
+    if (needed <= *capacity) return 0;
+
+    size_t newCapacity = *capacity ? *capacity : 4096;
+    while (newCapacity < needed) newCapacity *= 2;
+    char *newBuffer = trackedRealloc(*buffer, newCapacity);
+    if (newBuffer == NULL) return -1;
+    *buffer = newBuffer;
+    *capacity = newCapacity;
+    return 0;
+}
+
+static void addOutput(Screen *screen, const char *text, size_t length) {
+    if (screen->outOfMemory) return;
+    if (reserveText(&screen->output, &screen->outputCapacity, screen->outputLength + length) != 0) {
+        screen->outOfMemory = 1;
+        return;
+    }
+    memcpy(screen->output + screen->outputLength, text, length);
+    screen->outputLength += length;
+}
+
+static void moveCursor(Screen *screen, int row) {
+    char move[24];
+    int length = snprintf(move, sizeof(move), "\033[%d;1H\033[0m", row + 1);
+    addOutput(screen, move, (size_t)length);
+}
+
+void beginFrame(Screen *screen) {
+    int rows, columns;
+    getConsoleSize(&rows, &columns);
+    if (rows != screen->rows || columns != screen->columns) {
+        screen->rows = rows;
+        screen->columns = columns;
+        screen->fullRedraw = 1;
+    }
+    screen->length = 0;
+    screen->outOfMemory = 0;
+}
+
+void screenPrintf(Screen *screen, const char *format, ...) {
+    if (screen->outOfMemory) return;
+    if (screen->capacity == 0 && reserveText(&screen->text, &screen->capacity, 4096) != 0) {
+        screen->outOfMemory = 1;
+        return;
+    }
+
+    va_list arguments;
+    size_t room = screen->capacity - screen->length;
+    va_start(arguments, format);
+    int length = vsnprintf(screen->text + screen->length, room, format, arguments);
+    va_end(arguments);
+    if (length < 0) return;
+
+    if ((size_t)length >= room) {
+        if (reserveText(&screen->text, &screen->capacity, screen->length + (size_t)length + 1) != 0) {
+            screen->outOfMemory = 1;
+            return;
+        }
+        va_start(arguments, format);
+        vsnprintf(screen->text + screen->length, (size_t)length + 1, format, arguments);
+        va_end(arguments);
+    }
+    screen->length += (size_t)length;
+}
+
+// How many bytes of the line fit in the width. Escape codes take no room
+// and UTF-8 continuation bytes don't start a new column.
+static size_t fitLine(const char *line, size_t length, int columns) {
+    int used = 0;
+    size_t i = 0;
+    while (i < length) {
+        if (line[i] == '\033' && i + 1 < length && line[i + 1] == '[') {
+            i += 2;
+            while (i < length && (line[i] < 0x40 || line[i] > 0x7E)) i++;
+            i++;
+            continue;
+        }
+        if (((unsigned char)line[i] & 0xC0) != 0x80) {
+            if (used == columns) return i;
+            used++;
+        }
+        i++;
+    }
+    return length;
+}
+
+// Where the line starting at *position ends, and move *position past it
+static size_t nextLine(const char **position, const char *end) {
+    const char *line = *position;
+    const char *newline = memchr(line, '\n', (size_t)(end - line));
+    if (newline == NULL) newline = end;
+    *position = newline < end ? newline + 1 : end;
+    return (size_t)(newline - line);
+}
+
+void endFrame(Screen *screen) {
+    // A frame that ran out of memory part way is still drawn as far as
+    // it got, and that's what the next frame is compared with
+    screen->outputLength = 0;
+    screen->outOfMemory = 0;
+
+    addOutput(screen, "\033[?25l", 6);     // No cursor jumping around while we draw
+    if (screen->fullRedraw) {
+        addOutput(screen, "\033[0m\033[H\033[2J", 10);
+        screen->shownLength = 0;
+    }
+
+    // Writing the very last column can wrap or scroll on some consoles
+    int columns = screen->columns > 1 ? screen->columns - 1 : 1;
+    const char *line = screen->text;
+    const char *lineEnd = screen->text + screen->length;
+    const char *old = screen->shown;
+    const char *oldEnd = screen->shown + screen->shownLength;
+    int row = 0;
+    int lineCount = 0;
+
+    while (row < screen->rows && (line < lineEnd || old < oldEnd)) {
+        int haveLine = line < lineEnd;
+        int haveOld = old < oldEnd;
+        const char *newText = line;
+        const char *oldText = old;
+        size_t newLength = haveLine ? nextLine(&line, lineEnd) : 0;
+        size_t oldLength = haveOld ? nextLine(&old, oldEnd) : 0;
+
+        if (haveLine) {
+            lineCount = row + 1;
+            if (!haveOld || newLength != oldLength || memcmp(newText, oldText, newLength) != 0) {
+                moveCursor(screen, row);
+                addOutput(screen, newText, fitLine(newText, newLength, columns));
+                addOutput(screen, "\033[0m\033[K", 7);
+            }
+        } else {
+            moveCursor(screen, row);
+            addOutput(screen, "\033[K", 3);
+        }
+        row++;
+    }
+
+    // Leave the cursor under the frame, where a prompt would go
+    moveCursor(screen, lineCount < screen->rows ? lineCount : screen->rows - 1);
+    addOutput(screen, "\033[?25h", 6);
+
+    if (screen->outOfMemory) {
+        // Couldn't build the update, so we don't know what's on the
+        // terminal now; start over next time
+        screen->fullRedraw = 1;
+        return;
+    }
+    writeConsole(screen->output, screen->outputLength);
+
+    // What we just drew is what the terminal shows now
+    char *swap = screen->shown;
+    size_t swapCapacity = screen->shownCapacity;
+    screen->shown = screen->text;
+    screen->shownCapacity = screen->capacity;
+    screen->shownLength = screen->length;
+    screen->text = swap;
+    screen->capacity = swapCapacity;
+    screen->length = 0;
+    screen->fullRedraw = 0;
+}
+
+void invalidateScreen(Screen *screen) {
+    screen->fullRedraw = 1;
+}
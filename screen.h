@@ -0,0 +1,43 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stddef.h>
+
+// Draws the interactive view without flicker. A frame is built up in
+// memory with screenPrintf, one '\n' per line, and endFrame compares it
+// line by line with what is on the terminal: only the lines that changed
+// are rewritten, each one addressed with the cursor, and the whole update
+// goes out in a single write. Lines are cut at the terminal width and
+// lines past the bottom are dropped, so nothing ever scrolls.
+//
+// Every line has to set its own colours: a line redrawn on its own
+// doesn't see the escape codes of the lines above it.
+typedef struct {
+    char *text;             // This frame
+    size_t length;
+    size_t capacity;
+    char *shown;            // What the terminal shows now
+    size_t shownLength;
+    size_t shownCapacity;
+    char *output;           // Escape codes and text for the update
+    size_t outputLength;
+    size_t outputCapacity;
+    int rows;
+    int columns;
+    int fullRedraw;         // Clear the terminal and draw every line
+    int outOfMemory;        // Part of this frame didn't fit
+} Screen;
+
+void initScreen(Screen *screen);
+void freeScreen(Screen *screen);
+
+// Start a new frame. Also picks up a change in the terminal size.
+void beginFrame(Screen *screen);
+void screenPrintf(Screen *screen, const char *format, ...);
+void endFrame(Screen *screen);
+
+// Something else was printed over the screen (a prompt, the log view),
+// so the next frame has to draw everything again
+void invalidateScreen(Screen *screen);
+
+#endif
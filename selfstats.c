@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+#include "selfstats.h"
+#include "platform.h"
+
+// Values under 2 * LATENCY_SUB_BUCKETS get a bucket each. Above that, the
+// highest bit picks the power of two and the 4 bits under it the bucket.
+static int getBucket(unsigned long long nanos) {
+    if (nanos < 2 * LATENCY_SUB_BUCKETS) return (int)nanos;
+
+    int highestBit = 5;
+    while (highestBit < 63 && (nanos >> (highestBit + 1)) != 0) highestBit++;
+    int shift = highestBit - 4;
+    int bucket = shift * LATENCY_SUB_BUCKETS + (int)(nanos >> shift);
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+// The smallest value that goes in a bucket
+static unsigned long long getBucketStart(int bucket) {
+    if (bucket < 2 * LATENCY_SUB_BUCKETS) return (unsigned long long)bucket;
+    int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    return (unsigned long long)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift;
+}
+
+void recordLatency(LatencyHistogram *histogram, unsigned long long nanos) {
+    histogram->counts[getBucket(nanos)]++;
+    histogram->count++;
+    histogram->total += nanos;
+    if (nanos > histogram->max) histogram->max = nanos;
+}
+
+unsigned long long getLatencyPercentile(const LatencyHistogram *histogram, double percent) {
+    if (histogram->count == 0) return 0;
+
+    unsigned long long wanted = (unsigned long long)((double)histogram->count * percent / 100.0 + 0.999999);
+    if (wanted < 1) wanted = 1;
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+        seen += histogram->counts[bucket];
+        if (seen >= wanted) {
+            unsigned long long end = bucket + 1 < LATENCY_BUCKETS ? getBucketStart(bucket + 1) - 1 : histogram->max;
+            return end < histogram->max ? end : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+void initSelfStats(SelfStats *stats, double cpuBudget) {
+    memset(stats, 0, sizeof(*stats));
+    stats->cpuBudget = cpuBudget;
+}
+
+void endStage(SelfStats *stats, PipelineStage stage, unsigned long long start) {
+    recordLatency(&stats->stages[stage], monotonicNanos() - start);
+}
+
+int updateSelfUsage(SelfStats *stats) {
+    unsigned long long now = monotonicMillis();
+    if (stats->lastUpdate != 0 && now - stats->lastUpdate < SELF_USAGE_WINDOW) return 0;
+
+    unsigned long long cpuMicros, residentBytes;
+    if (getProcessUsage(&cpuMicros, &residentBytes) != 0) return 0;
+
+    int first = stats->lastUpdate == 0;
+    if (!first) {
+        stats->cpuPercent = (double)(cpuMicros - stats->cpuMicros) / (double)((now - stats->lastUpdate) * 1000) * 100.0;
+    }
+    stats->cpuMicros = cpuMicros;
+    stats->residentBytes = residentBytes;
+    if (residentBytes > stats->peakResidentBytes) stats->peakResidentBytes = residentBytes;
+    stats->lastUpdate = now;
+
+    if (first) return 0;
+
+    int over = stats->cpuPercent > stats->cpuBudget;
+    stats->overBudget += (unsigned long long)over;
+    if (over == stats->isOverBudget) return 0;
+    stats->isOverBudget = over;
+    return 1;
+}
+
+const char *getStageName(PipelineStage stage) {
+    switch (stage) {
+        case STAGE_COLLECT: return "collect";
+        case STAGE_DIFF: return "diff";
+        case STAGE_EXPORT: return "export";
+        case STAGE_LOG: return "log";
+        case STAGE_DETECT: return "detect";
+        case STAGE_SEND: return "send";
+        case STAGE_SELECT: return "select";
+        case STAGE_SCREEN: return "screen";
+        case STAGE_REFRESH: return "refresh";
+        default: return "?";
+    }
+}
+
+void formatLatency(unsigned long long nanos, char *text, size_t size) {
+    if (nanos < 1000000) snprintf(text, size, "%lluus", nanos / 1000);
+    else if (nanos < 1000000000) snprintf(text, size, "%.1fms", (double)nanos / 1e6);
+    else snprintf(text, size, "%.2fs", (double)nanos / 1e9);
+}
@@ -0,0 +1,288 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "services.h"
+#include "arena.h"
+#include "platform.h"
+
+#define MAX_SEED_TRIES 65536    // Seeds tried for one bucket before making the table bigger
+
+// Used when there is no services file (or it doesn't have them)
+static const struct {
+    unsigned short port;
+    unsigned char protocol;
+    const char *name;
+} builtinServices[] = {
+    {20, PROTOCOL_TCP, "ftp-data"}, {21, PROTOCOL_TCP, "ftp"}, {22, PROTOCOL_TCP, "ssh"},
+    {23, PROTOCOL_TCP, "telnet"}, {25, PROTOCOL_TCP, "smtp"}, {53, PROTOCOL_TCP, "domain"},
+    {53, PROTOCOL_UDP, "domain"}, {67, PROTOCOL_UDP, "bootps"}, {68, PROTOCOL_UDP, "bootpc"},
+    {69, PROTOCOL_UDP, "tftp"}, {80, PROTOCOL_TCP, "http"}, {110, PROTOCOL_TCP, "pop3"},
+    {123, PROTOCOL_UDP, "ntp"}, {137, PROTOCOL_UDP, "netbios-ns"}, {138, PROTOCOL_UDP, "netbios-dgm"},
+    {139, PROTOCOL_TCP, "netbios-ssn"}, {143, PROTOCOL_TCP, "imap"}, {161, PROTOCOL_UDP, "snmp"},
+    {162, PROTOCOL_UDP, "snmp-trap"}, {389, PROTOCOL_TCP, "ldap"}, {443, PROTOCOL_TCP, "https"},
+    {443, PROTOCOL_UDP, "https"}, {445, PROTOCOL_TCP, "microsoft-ds"}, {465, PROTOCOL_TCP, "submissions"},
+    {500, PROTOCOL_UDP, "isakmp"}, {514, PROTOCOL_UDP, "syslog"}, {587, PROTOCOL_TCP, "submission"},
+    {636, PROTOCOL_TCP, "ldaps"}, {853, PROTOCOL_TCP, "domain-s"}, {993, PROTOCOL_TCP, "imaps"},
+    {995, PROTOCOL_TCP, "pop3s"}, {1194, PROTOCOL_UDP, "openvpn"}, {1433, PROTOCOL_TCP, "ms-sql-s"},
+    {1883, PROTOCOL_TCP, "mqtt"}, {1900, PROTOCOL_UDP, "ssdp"}, {3306, PROTOCOL_TCP, "mysql"},
+    {3389, PROTOCOL_TCP, "ms-wbt-server"}, {4500, PROTOCOL_UDP, "ipsec-nat-t"}, {5353, PROTOCOL_UDP, "mdns"},
+    {5355, PROTOCOL_UDP, "llmnr"}, {5432, PROTOCOL_TCP, "postgresql"}, {5672, PROTOCOL_TCP, "amqp"},
+    {6379, PROTOCOL_TCP, "redis"}, {8080, PROTOCOL_TCP, "http-alt"}, {9100, PROTOCOL_TCP, "jetdirect"},
+    {11211, PROTOCOL_TCP, "memcache"}, {27017, PROTOCOL_TCP, "mongodb"}
+};
+
+// Hash and displace: every key hashes to a bucket, and each bucket has a
+// seed picked so its keys land on free slots. A lookup is one bucket read
+// and one slot read.
+static struct {
+    unsigned int *keys;         // Per slot: key + 1, 0 = empty
+    unsigned int *names;        // Per slot: offset of the name in text
+    unsigned short *seeds;      // Per bucket
+    unsigned int slotMask;
+    unsigned int bucketMask;
+    char *text;
+    int loaded;
+} services;
+
+// One entry while the table is being built
+typedef struct {
+    unsigned int key;
+    unsigned int name;
+} ServiceEntry;
+
+static unsigned int makeKey(unsigned short port, ConnectionProtocol protocol) {
+    return ((unsigned int)port << 1) | (protocol == PROTOCOL_UDP);
+}
+
+// murmur3's finisher, with the seed folded in
+static unsigned int hashKey(unsigned int key, unsigned int seed) {
+    unsigned int hash = key * 0x9E3779B1u ^ seed * 0x85EBCA6Bu;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Grows with the entries as they are read
+typedef struct {
+    ServiceEntry *entries;
+    int count;
+    int capacity;
+    char *text;
+    size_t textSize;
+    size_t textCapacity;
+} ServiceList;
+
+static int addService(ServiceList *list, unsigned int key, const char *name, size_t length) {
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        ServiceEntry *entries = trackedRealloc(list->entries, (size_t)capacity * sizeof(ServiceEntry));
+        if (entries == NULL) return -1;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    if (list->textSize + length + 1 > list->textCapacity) {
+        size_t capacity = list->textCapacity ? list->textCapacity * 2 : 4096;
+        while (capacity < list->textSize + length + 1) capacity *= 2;
+        char *text = trackedRealloc(list->text, capacity);
+        if (text == NULL) return -1;
+        list->text = text;
+        list->textCapacity = capacity;
+    }
+
+    memcpy(list->text + list->textSize, name, length);
+    list->text[list->textSize + length] = '\0';
+    list->entries[list->count].key = key;
+    list->entries[list->count].name = (unsigned int)list->textSize;
+    list->count++;
+    list->textSize += length + 1;
+    return 0;
+}
+
+// "name  port/protocol  aliases  # comment", one per line
+static int readServicesFile(const char *path, ServiceList *list) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return -1;
+
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+
+        char name[64], number[32];
+        if (sscanf(line, "%63s %31s", name, number) != 2) continue;
+        char *slash = strchr(number, '/');
+        if (slash == NULL) continue;
+        *slash = '\0';
+
+        ConnectionProtocol protocol;
+        if (strcmp(slash + 1, "tcp") == 0) protocol = PROTOCOL_TCP;
+        else if (strcmp(slash + 1, "udp") == 0) protocol = PROTOCOL_UDP;
+        else continue;
+        int port = atoi(number);
+        if (port <= 0 || port > 65535) continue;
+
+        if (addService(list, makeKey((unsigned short)port, protocol), name, strlen(name)) != 0) break;
+    }
+    fclose(file);
+    return 0;
+}
+
+static int compareEntries(const void *a, const void *b) {
+    const ServiceEntry *left = a;
+    const ServiceEntry *right = b;
+    if (left->key != right->key) return left->key < right->key ? -1 : 1;
+    // The first line for a port wins, as in getservbyport
+    return left->name < right->name ? -1 : left->name > right->name;
+}
+
+// Biggest buckets first; qsort has no context argument, so the sizes are
+// passed on the side
+static const unsigned int *sortingSizes;
+
+static int compareBuckets(const void *a, const void *b) {
+    unsigned int left = sortingSizes[*(const unsigned int *)a];
+    unsigned int right = sortingSizes[*(const unsigned int *)b];
+    return left > right ? -1 : left < right;
+}
+
+// Find a seed for each bucket, biggest buckets first while the table is
+// still empty. Returns 0 when some bucket has no seed that fits, and the
+// caller tries again with more slots.
+static int seedBuckets(const ServiceEntry *entries, unsigned int *scratch, unsigned int bucketCount, int count) {
+    unsigned int *sizes = scratch;
+    unsigned int *starts = sizes + bucketCount;         // bucketCount + 1 of them
+    unsigned int *order = starts + bucketCount + 1;
+    unsigned int *byBucket = order + bucketCount;       // Entries grouped by bucket
+    unsigned int *slots = byBucket + count;             // Where the bucket being placed would go
+    unsigned int slotMask = services.slotMask;
+
+    memset(sizes, 0, bucketCount * sizeof(unsigned int));
+    for (int i = 0; i < count; i++) sizes[hashKey(entries[i].key, 0) & (bucketCount - 1)]++;
+    starts[0] = 0;
+    for (unsigned int b = 0; b < bucketCount; b++) starts[b + 1] = starts[b] + sizes[b];
+    for (unsigned int b = 0; b < bucketCount; b++) order[b] = starts[b];
+    for (int i = 0; i < count; i++) byBucket[order[hashKey(entries[i].key, 0) & (bucketCount - 1)]++] = (unsigned int)i;
+
+    for (unsigned int b = 0; b < bucketCount; b++) order[b] = b;
+    sortingSizes = sizes;
+    qsort(order, bucketCount, sizeof(unsigned int), compareBuckets);
+
+    for (unsigned int o = 0; o < bucketCount && sizes[order[o]] > 0; o++) {
+        unsigned int bucket = order[o];
+        unsigned int size = sizes[bucket];
+        const unsigned int *members = byBucket + starts[bucket];
+        int placed = 0;
+
+        for (unsigned int seed = 1; seed < MAX_SEED_TRIES && !placed; seed++) {
+            placed = 1;
+            for (unsigned int i = 0; i < size && placed; i++) {
+                unsigned int slot = hashKey(entries[members[i]].key, seed) & slotMask;
+                if (services.keys[slot] != 0) placed = 0;
+                for (unsigned int j = 0; j < i && placed; j++) {
+                    if (slots[j] == slot) placed = 0;
+                }
+                slots[i] = slot;
+            }
+            if (placed) {
+                for (unsigned int i = 0; i < size; i++) {
+                    services.keys[slots[i]] = entries[members[i]].key + 1;
+                    services.names[slots[i]] = entries[members[i]].name;
+                }
+                services.seeds[bucket] = (unsigned short)seed;
+            }
+        }
+        if (!placed) return 0;
+    }
+    return 1;
+}
+
+static void freeServices() {
+    trackedFree(services.keys);     // names share its block
+    trackedFree(services.seeds);
+    trackedFree(services.text);
+    memset(&services, 0, sizeof(services));
+}
+
+// Build the table with as few slots as will work. Returns -1 when out of
+// memory.
+static int buildTable(const ServiceEntry *entries, int count) {
+    // Half-full slots and about four keys a bucket keep the seed search short
+    unsigned int slotCount = 16;
+    while (slotCount < (unsigned int)count * 2) slotCount *= 2;
+    unsigned int bucketCount = 4;
+    while (bucketCount * 4 < (unsigned int)count) bucketCount *= 2;
+
+    unsigned int *scratch = trackedAlloc((bucketCount * 3 + 1 + (size_t)count * 2) * sizeof(unsigned int));
+    services.seeds = trackedAlloc(bucketCount * sizeof(unsigned short));
+    if (scratch == NULL || services.seeds == NULL) {
+        trackedFree(scratch);
+        return -1;
+    }
+    services.bucketMask = bucketCount - 1;
+
+    for (;;) {
+        services.keys = trackedAlloc(slotCount * 2 * sizeof(unsigned int));
+        if (services.keys == NULL) break;
+        services.names = services.keys + slotCount;
+        services.slotMask = slotCount - 1;
+        memset(services.keys, 0, slotCount * sizeof(unsigned int));
+        memset(services.seeds, 0, bucketCount * sizeof(unsigned short));
+
+        if (seedBuckets(entries, scratch, bucketCount, count)) break;
+        trackedFree(services.keys);
+        services.keys = NULL;
+        slotCount *= 2;
+    }
+    trackedFree(scratch);
+    return services.keys != NULL ? 0 : -1;
+}
+
+int loadServices(const char *path) {
+    char systemPath[MAX_NAME_LENGTH];
+    if (path == NULL) {
+        getSystemFilePath("services", systemPath, sizeof(systemPath));
+        path = systemPath;
+    }
+
+    ServiceList list = {0};
+    int fromFile = readServicesFile(path, &list) == 0;
+    int fileCount = list.count;
+    for (size_t i = 0; i < sizeof(builtinServices) / sizeof(builtinServices[0]); i++) {
+        const char *name = builtinServices[i].name;
+        addService(&list, makeKey(builtinServices[i].port, builtinServices[i].protocol), name, strlen(name));
+    }
+
+    // Sort by key and keep the first of each, so the file's names come
+    // before the built-in ones
+    qsort(list.entries, (size_t)list.count, sizeof(ServiceEntry), compareEntries);
+    int unique = 0;
+    for (int i = 0; i < list.count; i++) {
+        if (unique > 0 && list.entries[unique - 1].key == list.entries[i].key) continue;
+        list.entries[unique++] = list.entries[i];
+    }
+
+    freeServices();
+    buildTable(list.entries, unique);
+
+    services.text = list.text;
+    services.loaded = 1;
+    trackedFree(list.entries);
+    if (services.keys == NULL) {
+        printf("Error: Not enough memory for the services table\n");
+        return -1;
+    }
+    return fromFile ? fileCount : -1;
+}
+
+const char *getServiceName(unsigned short port, ConnectionProtocol protocol) {
+    if (!services.loaded) loadServices(NULL);
+    if (services.keys == NULL) return NULL;
+
+    unsigned int key = makeKey(port, protocol);
+    unsigned int seed = services.seeds[hashKey(key, 0) & services.bucketMask];
+    unsigned int slot = hashKey(key, seed) & services.slotMask;
+    return services.keys[slot] == key + 1 ? services.text + services.names[slot] : NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef SERVICES_H
+#define SERVICES_H
+
+#include "network_monitoring.h"
+
+// Port numbers to service names ("https", "domain", ...). The system's
+// services file is read once, the first time a name is asked for, and
+// packed into a perfect hash: one probe per lookup, no collisions to walk.
+// A short built-in list covers the common ports when the file is missing.
+
+// Read the table from path (NULL = the system's services file). Called on
+// first use anyway; call it up front to pick another file. Returns the
+// number of entries, or -1 when only the built-in list could be loaded.
+int loadServices(const char *path);
+
+// The name for a port, or NULL when it has none. Not thread-safe until
+// the table has been loaded.
+const char *getServiceName(unsigned short port, ConnectionProtocol protocol);
+
+#endif
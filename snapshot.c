@@ -0,0 +1,271 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "string_table.h"
+
+#define SNAPSHOT_MIN_ROWS 256
+#define SNAPSHOT_MIN_INTERFACES 16
+
+// Every column in the snapshot and how big one entry is. Adding a column
+// to ConnectionSnapshot only needs a line here plus the copy in
+// addSnapshotRow/getSnapshotRow (or setSnapshotMetrics for the counters).
+static const struct {
+    size_t offset;
+    size_t size;
+} columns[] = {
+    {offsetof(ConnectionSnapshot, localAddress), 16},
+    {offsetof(ConnectionSnapshot, remoteAddress), 16},
+    {offsetof(ConnectionSnapshot, localPort), sizeof(unsigned short)},
+    {offsetof(ConnectionSnapshot, remotePort), sizeof(unsigned short)},
+    {offsetof(ConnectionSnapshot, family), 1},
+    {offsetof(ConnectionSnapshot, protocol), 1},
+    {offsetof(ConnectionSnapshot, state), 1},
+    {offsetof(ConnectionSnapshot, programId), sizeof(unsigned int)},
+    {offsetof(ConnectionSnapshot, programName), sizeof(unsigned int)},
+    {offsetof(ConnectionSnapshot, networkNamespace), sizeof(unsigned int)},
+    {offsetof(ConnectionSnapshot, socketInode), sizeof(unsigned long long)},
+    {offsetof(ConnectionSnapshot, bytesSent), sizeof(unsigned long long)},
+    {offsetof(ConnectionSnapshot, bytesReceived), sizeof(unsigned long long)},
+    {offsetof(ConnectionSnapshot, roundTripTime), sizeof(unsigned int)},
+    {offsetof(ConnectionSnapshot, retransmits), sizeof(unsigned int)},
+    {offsetof(ConnectionSnapshot, congestionWindow), sizeof(unsigned int)},
+    {offsetof(ConnectionSnapshot, sendRate), sizeof(unsigned long long)},
+    {offsetof(ConnectionSnapshot, receiveRate), sizeof(unsigned long long)},
+    {offsetof(ConnectionSnapshot, newRetransmits), sizeof(unsigned int)},
+};
+
+#define COLUMN_COUNT (sizeof(columns) / sizeof(columns[0]))
+
+static void **columnPointer(ConnectionSnapshot *snapshot, size_t column) {
+    return (void **)((char *)snapshot + columns[column].offset);
+}
+
+static size_t rowSize() {
+    size_t size = 0;
+    for (size_t i = 0; i < COLUMN_COUNT; i++) size += columns[i].size;
+    return size;
+}
+
+// Give every column room for capacity rows, keeping the rows already there
+static int reserveRows(ConnectionSnapshot *snapshot, int capacity) {
+    void *newColumns[COLUMN_COUNT];
+
+    for (size_t i = 0; i < COLUMN_COUNT; i++) {
+        newColumns[i] = arenaAlloc(&snapshot->arena, (size_t)capacity * columns[i].size);
+        if (newColumns[i] == NULL) return -1;
+    }
+
+    for (size_t i = 0; i < COLUMN_COUNT; i++) {
+        void **column = columnPointer(snapshot, i);
+        if (snapshot->count > 0) memcpy(newColumns[i], *column, (size_t)snapshot->count * columns[i].size);
+        *column = newColumns[i];
+    }
+    snapshot->capacity = capacity;
+    return 0;
+}
+
+static int reserveInterfaces(ConnectionSnapshot *snapshot, int capacity) {
+    InterfaceCounters *interfaces = arenaAlloc(&snapshot->arena, (size_t)capacity * sizeof(InterfaceCounters));
+    if (interfaces == NULL) return -1;
+    if (snapshot->interfaceCount > 0) {
+        memcpy(interfaces, snapshot->interfaces, (size_t)snapshot->interfaceCount * sizeof(InterfaceCounters));
+    }
+    snapshot->interfaces = interfaces;
+    snapshot->interfaceCapacity = capacity;
+    return 0;
+}
+
+void initSnapshot(ConnectionSnapshot *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    arenaInit(&snapshot->arena, SNAPSHOT_MIN_ROWS * rowSize());
+}
+
+void freeSnapshot(ConnectionSnapshot *snapshot) {
+    arenaFree(&snapshot->arena);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
+
+void clearSnapshot(ConnectionSnapshot *snapshot) {
+    if (snapshot->count > snapshot->peakCount) snapshot->peakCount = snapshot->count;
+
+    arenaReset(&snapshot->arena);
+    snapshot->count = 0;
+    snapshot->capacity = 0;
+    snapshot->droppedCount = 0;
+    snapshot->hasMetrics = 0;
+    snapshot->hasNamespaces = 0;
+
+    // Reserve room for the biggest table so far straight away, so the rows
+    // don't need to be copied around while they are collected
+    int reserve = snapshot->peakCount + snapshot->peakCount / 8;
+    if (reserve < SNAPSHOT_MIN_ROWS) reserve = SNAPSHOT_MIN_ROWS;
+    reserveRows(snapshot, reserve);
+
+    if (snapshot->interfaceCount > snapshot->peakInterfaces) snapshot->peakInterfaces = snapshot->interfaceCount;
+    snapshot->interfaceCount = 0;
+    snapshot->interfaceCapacity = 0;
+    snapshot->interfaceMillis = 0;
+    reserveInterfaces(snapshot, snapshot->peakInterfaces > SNAPSHOT_MIN_INTERFACES ? snapshot->peakInterfaces
+                                                                                    : SNAPSHOT_MIN_INTERFACES);
+}
+
+int addSnapshotRow(ConnectionSnapshot *snapshot, const NetworkConnection *connection) {
+    if (snapshot->count == snapshot->capacity) {
+        // Out of room: move to columns twice as big. The old ones stay in
+        // the arena until the next reset, which then folds everything into
+        // one block.
+        int newCapacity = snapshot->capacity ? snapshot->capacity * 2 : SNAPSHOT_MIN_ROWS;
+        if (reserveRows(snapshot, newCapacity) != 0) {
+            snapshot->droppedCount++;
+            return -1;
+        }
+    }
+
+    int i = snapshot->count++;
+    memcpy(snapshot->localAddress[i], connection->localAddress, 16);
+    memcpy(snapshot->remoteAddress[i], connection->remoteAddress, 16);
+    snapshot->localPort[i] = connection->localPort;
+    snapshot->remotePort[i] = connection->remotePort;
+    snapshot->family[i] = connection->family;
+    snapshot->protocol[i] = connection->protocol;
+    snapshot->state[i] = connection->state;
+    snapshot->programId[i] = connection->programId;
+    snapshot->programName[i] = connection->programName;
+    snapshot->networkNamespace[i] = 0;
+    snapshot->socketInode[i] = 0;
+    snapshot->bytesSent[i] = 0;
+    snapshot->bytesReceived[i] = 0;
+    snapshot->roundTripTime[i] = 0;
+    snapshot->retransmits[i] = 0;
+    snapshot->congestionWindow[i] = 0;
+    snapshot->sendRate[i] = 0;
+    snapshot->receiveRate[i] = 0;
+    snapshot->newRetransmits[i] = 0;
+    return 0;
+}
+
+InterfaceCounters *addSnapshotInterface(ConnectionSnapshot *snapshot) {
+    if (snapshot->interfaceCount == snapshot->interfaceCapacity &&
+        reserveInterfaces(snapshot, snapshot->interfaceCapacity ? snapshot->interfaceCapacity * 2
+                                                                : SNAPSHOT_MIN_INTERFACES) != 0) {
+        return NULL;
+    }
+    InterfaceCounters *counters = &snapshot->interfaces[snapshot->interfaceCount++];
+    memset(counters, 0, sizeof(*counters));
+    return counters;
+}
+
+void setSnapshotMetrics(ConnectionSnapshot *snapshot, int index, const ConnectionMetrics *metrics) {
+    snapshot->bytesSent[index] = metrics->bytesSent;
+    snapshot->bytesReceived[index] = metrics->bytesReceived;
+    snapshot->roundTripTime[index] = metrics->roundTripTime;
+    snapshot->retransmits[index] = metrics->retransmits;
+    snapshot->congestionWindow[index] = metrics->congestionWindow;
+    snapshot->hasMetrics = 1;
+}
+
+int appendSnapshotRows(ConnectionSnapshot *snapshot, const ConnectionSnapshot *from) {
+    if (from->count == 0) return 0;
+    if (snapshot->count + from->count > snapshot->capacity) {
+        int newCapacity = snapshot->capacity ? snapshot->capacity : SNAPSHOT_MIN_ROWS;
+        while (newCapacity < snapshot->count + from->count) newCapacity *= 2;
+        if (reserveRows(snapshot, newCapacity) != 0) {
+            snapshot->droppedCount += from->count;
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < COLUMN_COUNT; i++) {
+        char *to = *columnPointer(snapshot, i);
+        const void *rows = *(void *const *)((const char *)from + columns[i].offset);
+        memcpy(to + (size_t)snapshot->count * columns[i].size, rows, (size_t)from->count * columns[i].size);
+    }
+    snapshot->count += from->count;
+    snapshot->hasMetrics |= from->hasMetrics;
+    snapshot->hasNamespaces |= from->hasNamespaces;
+    return 0;
+}
+
+void getSnapshotRow(const ConnectionSnapshot *snapshot, int index, NetworkConnection *connection) {
+    memcpy(connection->localAddress, snapshot->localAddress[index], 16);
+    memcpy(connection->remoteAddress, snapshot->remoteAddress[index], 16);
+    connection->localPort = snapshot->localPort[index];
+    connection->remotePort = snapshot->remotePort[index];
+    connection->family = snapshot->family[index];
+    connection->protocol = snapshot->protocol[index];
+    connection->state = snapshot->state[index];
+    connection->programId = snapshot->programId[index];
+    connection->programName = snapshot->programName[index];
+}
+
+void *snapshotScratch(ConnectionSnapshot *snapshot, size_t size) {
+    return arenaAlloc(&snapshot->arena, size);
+}
+
+// qsort has no context argument, so the comparison reads these
+static const ConnectionSnapshot *sortSnapshot;
+static SortKey sortKey;
+
+static int compareRows(const void *left, const void *right) {
+    int a = *(const int *)left;
+    int b = *(const int *)right;
+    const ConnectionSnapshot *snapshot = sortSnapshot;
+    int order = 0;
+
+    switch (sortKey) {
+        case SORT_LOCAL_PORT:
+            order = (int)snapshot->localPort[a] - (int)snapshot->localPort[b];
+            break;
+        case SORT_REMOTE_ADDRESS:
+            order = memcmp(snapshot->remoteAddress[a], snapshot->remoteAddress[b], 16);
+            if (order == 0) order = (int)snapshot->remotePort[a] - (int)snapshot->remotePort[b];
+            break;
+        case SORT_STATE:
+            order = (int)snapshot->state[a] - (int)snapshot->state[b];
+            if (order == 0) order = (int)snapshot->localPort[a] - (int)snapshot->localPort[b];
+            break;
+        case SORT_PROGRAM:
+            if (snapshot->programName[a] != snapshot->programName[b]) {
+                order = strcmp(getProgramNameText(snapshot->programName[a]),
+                               getProgramNameText(snapshot->programName[b]));
+            }
+            if (order == 0) order = (snapshot->programId[a] > snapshot->programId[b]) -
+                                    (snapshot->programId[a] < snapshot->programId[b]);
+            break;
+        case SORT_BANDWIDTH: {
+            unsigned long long rateA = snapshot->sendRate[a] + snapshot->receiveRate[a];
+            unsigned long long rateB = snapshot->sendRate[b] + snapshot->receiveRate[b];
+            order = (rateA < rateB) - (rateA > rateB);
+            break;
+        }
+        case SORT_RETRANSMITS:
+            order = (snapshot->newRetransmits[a] < snapshot->newRetransmits[b]) -
+                    (snapshot->newRetransmits[a] > snapshot->newRetransmits[b]);
+            if (order == 0) order = (snapshot->retransmits[a] < snapshot->retransmits[b]) -
+                                    (snapshot->retransmits[a] > snapshot->retransmits[b]);
+            break;
+        default:
+            break;
+    }
+    return order != 0 ? order : a - b;
+}
+
+void sortSnapshotRows(const ConnectionSnapshot *snapshot, int *rows, int count, SortKey key) {
+    if (key == SORT_NONE || count < 2) return;     // applyFilter already gives table order
+    sortSnapshot = snapshot;
+    sortKey = key;
+    qsort(rows, (size_t)count, sizeof(int), compareRows);
+}
+
+const char *getSortName(SortKey key) {
+    switch (key) {
+        case SORT_LOCAL_PORT: return "LOCAL PORT";
+        case SORT_REMOTE_ADDRESS: return "REMOTE ADDRESS";
+        case SORT_STATE: return "STATE";
+        case SORT_PROGRAM: return "PROGRAM";
+        case SORT_BANDWIDTH: return "BANDWIDTH";
+        case SORT_RETRANSMITS: return "RETRANSMITS";
+        default: return "NONE";
+    }
+}
@@ -0,0 +1,132 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "arena.h"
+#include "network_monitoring.h"
+
+// The counters the kernel keeps for every network interface
+typedef enum {
+    COUNTER_RX_BYTES,
+    COUNTER_TX_BYTES,
+    COUNTER_RX_PACKETS,
+    COUNTER_TX_PACKETS,
+    COUNTER_RX_ERRORS,
+    COUNTER_TX_ERRORS,
+    COUNTER_RX_DROPPED,
+    COUNTER_TX_DROPPED,
+    INTERFACE_COUNTER_COUNT
+} InterfaceCounter;
+
+#define MAX_INTERFACE_NAME 32
+
+typedef struct {
+    char name[MAX_INTERFACE_NAME];
+    unsigned long long total[INTERFACE_COUNTER_COUNT];      // Since the interface came up
+    unsigned long long change[INTERFACE_COUNTER_COUNT];     // Since the snapshot before
+} InterfaceCounters;
+
+// All the connections read in one refresh. The table is stored by column
+// (all the states together, all the local ports together, ...) rather than
+// as an array of NetworkConnection, so a filter or a count that only looks
+// at one or two fields reads just those and the loops can use SIMD.
+//
+// The columns live in an arena that is reset, not freed, at the start of
+// every refresh, and the snapshot reserves as many rows as the biggest
+// refresh so far. Once the table size settles, collecting a new snapshot
+// does no malloc or free at all.
+typedef struct {
+    int count;
+    int capacity;
+    int peakCount;          // Largest count seen, used to size the next round
+    int droppedCount;       // Rows we had no memory for this round
+
+    unsigned char (*localAddress)[16];
+    unsigned char (*remoteAddress)[16];
+    unsigned short *localPort;
+    unsigned short *remotePort;
+    unsigned char *family;
+    unsigned char *protocol;
+    unsigned char *state;
+    unsigned int *programId;
+    unsigned int *programName;
+    unsigned int *networkNamespace;         // Interned namespace name, NAMESPACE_HOST = ours
+    unsigned long long *socketInode;        // 0 if the source doesn't say
+    int hasNamespaces;                      // Rows came from more than our own namespace
+
+    // TCP counters from the kernel's tcp_info (Linux netlink only), 0 for
+    // rows the source has none for. The rates are worked out by
+    // computeConnectionRates from the snapshot before.
+    unsigned long long *bytesSent;          // Acknowledged by the other end
+    unsigned long long *bytesReceived;
+    unsigned int *roundTripTime;            // Smoothed, microseconds
+    unsigned int *retransmits;              // Segments retransmitted in total
+    unsigned int *congestionWindow;         // Segments
+    unsigned long long *sendRate;           // Bytes per second since the last snapshot
+    unsigned long long *receiveRate;
+    unsigned int *newRetransmits;           // Retransmits since the last snapshot
+    int hasMetrics;                         // Some row has the counters above
+    unsigned long long collectedAt;         // monotonicMillis() when read
+
+    // The network interfaces' counters, read in the same refresh (see
+    // collectInterfaces). Kept in the same arena as the rows.
+    InterfaceCounters *interfaces;
+    int interfaceCount;
+    int interfaceCapacity;
+    int peakInterfaces;
+    unsigned long long interfaceMillis;     // What the changes are over, 0 = no changes yet
+
+    Arena arena;
+} ConnectionSnapshot;
+
+// The tcp_info counters for one row
+typedef struct {
+    unsigned long long bytesSent;
+    unsigned long long bytesReceived;
+    unsigned int roundTripTime;
+    unsigned int retransmits;
+    unsigned int congestionWindow;
+} ConnectionMetrics;
+
+void initSnapshot(ConnectionSnapshot *snapshot);
+void freeSnapshot(ConnectionSnapshot *snapshot);
+
+// Empty the snapshot for a new refresh, keeping its memory
+void clearSnapshot(ConnectionSnapshot *snapshot);
+
+// Copy a row onto the end. Returns -1 (and counts the row as dropped)
+// when out of memory.
+int addSnapshotRow(ConnectionSnapshot *snapshot, const NetworkConnection *connection);
+
+// Room for one more interface, zeroed. NULL when out of memory.
+InterfaceCounters *addSnapshotInterface(ConnectionSnapshot *snapshot);
+
+// Fill in the counters of a row already added (they start out 0)
+void setSnapshotMetrics(ConnectionSnapshot *snapshot, int index, const ConnectionMetrics *metrics);
+
+// Add every row of from to the end of snapshot, all columns at once
+int appendSnapshotRows(ConnectionSnapshot *snapshot, const ConnectionSnapshot *from);
+
+// Put row i back together into one struct
+void getSnapshotRow(const ConnectionSnapshot *snapshot, int index, NetworkConnection *connection);
+
+// Scratch memory that lasts until the next clearSnapshot
+void *snapshotScratch(ConnectionSnapshot *snapshot, size_t size);
+
+// Orders for the rows on screen
+typedef enum {
+    SORT_NONE,              // The order the source gave us
+    SORT_LOCAL_PORT,
+    SORT_REMOTE_ADDRESS,
+    SORT_STATE,
+    SORT_PROGRAM,
+    SORT_BANDWIDTH,         // Busiest first (send + receive rate)
+    SORT_RETRANSMITS,       // Most retransmits since the last snapshot first
+    SORT_KEY_COUNT
+} SortKey;
+
+// Sort a list of row numbers (from applyFilter) by one column. Rows that
+// are equal stay in table order so the screen doesn't shuffle them.
+void sortSnapshotRows(const ConnectionSnapshot *snapshot, int *rows, int count, SortKey key);
+const char *getSortName(SortKey key);
+
+#endif
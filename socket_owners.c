@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <string.h>
+#include "arena.h"
+#include "platform.h"
+#include "socket_owners.h"
+#include "string_table.h"
+
+void initSocketOwners(SocketOwners *owners) {
+    memset(owners, 0, sizeof(*owners));
+}
+
+void freeSocketOwners(SocketOwners *owners) {
+    trackedFree(owners->processes);
+    trackedFree(owners->oldProcesses);
+    trackedFree(owners->sockets);
+    trackedFree(owners->oldSockets);
+    trackedFree(owners->processSlots);
+    trackedFree(owners->socketSlots);
+    trackedFree(owners->missed);
+    memset(owners, 0, sizeof(*owners));
+}
+
+static unsigned int hashNumber(unsigned long long value) {
+    value *= 0x9E3779B97F4A7C15ull;
+    return (unsigned int)(value >> 32);
+}
+
+// Add inode to the missed set. Returns 1 if it wasn't there before (or
+// there's no memory to remember it), 0 if it was.
+static int addMissed(SocketOwners *owners, unsigned long long inode) {
+    if ((owners->missedCount + 1) * 2 > owners->missedSlotCount) {
+        unsigned int newSlotCount = owners->missedSlotCount ? owners->missedSlotCount * 2 : 64;
+        unsigned long long *newSlots = trackedAlloc(newSlotCount * sizeof(unsigned long long));
+        if (newSlots == NULL) return 1;
+        memset(newSlots, 0, newSlotCount * sizeof(unsigned long long));
+        for (unsigned int i = 0; i < owners->missedSlotCount; i++) {
+            if (owners->missed[i] == 0) continue;
+            unsigned int slot = hashNumber(owners->missed[i]) & (newSlotCount - 1);
+            while (newSlots[slot] != 0) slot = (slot + 1) & (newSlotCount - 1);
+            newSlots[slot] = owners->missed[i];
+        }
+        trackedFree(owners->missed);
+        owners->missed = newSlots;
+        owners->missedSlotCount = newSlotCount;
+    }
+
+    unsigned int mask = owners->missedSlotCount - 1;
+    unsigned int slot = hashNumber(inode) & mask;
+    for (; owners->missed[slot] != 0; slot = (slot + 1) & mask) {
+        if (owners->missed[slot] == inode) return 0;
+    }
+    owners->missed[slot] = inode;
+    owners->missedCount++;
+    return 1;
+}
+
+int findSocketOwner(SocketOwners *owners, unsigned long long inode, unsigned int *pid, unsigned int *programName) {
+    if (inode == 0) return 0;
+
+    if (owners->socketSlotCount > 0) {
+        unsigned int mask = owners->socketSlotCount - 1;
+        for (unsigned int slot = hashNumber(inode) & mask; owners->socketSlots[slot] != 0; slot = (slot + 1) & mask) {
+            const SocketOwnerEntry *socket = &owners->sockets[owners->socketSlots[slot] - 1];
+            if (socket->inode != inode) continue;
+
+            const SocketOwnerProcess *process = &owners->processes[socket->process];
+            *pid = process->pid;
+            *programName = process->programName;
+            return 1;
+        }
+    }
+
+    // Right after a look through everybody, a miss is a socket no process
+    // we can see has, and is only remembered. Otherwise it counts once.
+    if (addMissed(owners, inode) && !owners->fullRescan) owners->unresolved++;
+    return 0;
+}
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Grow one of the arrays so it holds at least count entries
+static int reserve(void **array, unsigned int *capacity, unsigned int count, size_t entrySize) {
+    if (count <= *capacity) return 0;
+
+    unsigned int newCapacity = *capacity ? *capacity : 256;
+    while (newCapacity < count) newCapacity *= 2;
+    void *newArray = trackedRealloc(*array, (size_t)newCapacity * entrySize);
+    if (newArray == NULL) return -1;
+    *array = newArray;
+    *capacity = newCapacity;
+    return 0;
+}
+
+static int addSocket(SocketOwners *owners, unsigned long long inode) {
+    if (reserve((void **)&owners->sockets, &owners->socketCapacity, owners->socketCount + 1, sizeof(SocketOwnerEntry)) != 0) {
+        return -1;
+    }
+    SocketOwnerEntry *socket = &owners->sockets[owners->socketCount++];
+    socket->inode = inode;
+    socket->process = owners->processCount - 1;
+    return 0;
+}
+
+// The short command name from /proc/<pid>/comm
+static unsigned int readProgramName(int procDirectory, unsigned int pid) {
+    char path[32];
+    char name[64];
+    snprintf(path, sizeof(path), "%u/comm", pid);
+
+    int file = openat(procDirectory, path, O_RDONLY | O_CLOEXEC);
+    if (file < 0) return PROGRAM_NAME_UNKNOWN;
+    ssize_t length = read(file, name, sizeof(name) - 1);
+    close(file);
+    if (length <= 0) return PROGRAM_NAME_UNKNOWN;
+
+    if (name[length - 1] == '\n') length--;
+    name[length] = '\0';
+    return internProgramName(name);
+}
+
+// Look through every open file of the newest process for sockets. A
+// process we may not look at (another user's, when not root) just ends up
+// with no sockets.
+static void scanProcess(SocketOwners *owners, int procDirectory) {
+    SocketOwnerProcess *process = &owners->processes[owners->processCount - 1];
+    char path[32];
+    snprintf(path, sizeof(path), "%u/fd", process->pid);
+
+    int fdDirectory = openat(procDirectory, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fdDirectory < 0) return;
+    DIR *files = fdopendir(fdDirectory);
+    if (files == NULL) {
+        close(fdDirectory);
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(files)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+
+        // Sockets show up as links to "socket:[12345]"
+        char target[64];
+        ssize_t length = readlinkat(fdDirectory, entry->d_name, target, sizeof(target) - 1);
+        if (length < 9 || memcmp(target, "socket:[", 8) != 0) continue;
+        target[length] = '\0';
+
+        unsigned long long inode = strtoull(target + 8, NULL, 10);
+        if (inode == 0) continue;
+        if (addSocket(owners, inode) != 0) break;
+        process->socketCount++;
+    }
+    closedir(files);
+}
+
+// Where pid was last refresh, or NULL if it's new
+static const SocketOwnerProcess *findOldProcess(const SocketOwners *owners, unsigned int pid) {
+    if (owners->processSlotCount == 0) return NULL;
+
+    unsigned int mask = owners->processSlotCount - 1;
+    for (unsigned int slot = hashNumber(pid) & mask; owners->processSlots[slot] != 0; slot = (slot + 1) & mask) {
+        const SocketOwnerProcess *process = &owners->oldProcesses[owners->processSlots[slot] - 1];
+        if (process->pid == pid) return process;
+    }
+    return NULL;
+}
+
+// Size an open-addressed table to at least twice count and empty it
+static int resetSlots(unsigned int **slots, unsigned int *slotCount, unsigned int count) {
+    unsigned int wanted = 64;
+    while (wanted < count * 2) wanted *= 2;
+
+    if (wanted > *slotCount) {
+        unsigned int *newSlots = trackedRealloc(*slots, wanted * sizeof(unsigned int));
+        if (newSlots == NULL) return -1;
+        *slots = newSlots;
+        *slotCount = wanted;
+    }
+    memset(*slots, 0, *slotCount * sizeof(unsigned int));
+    return 0;
+}
+
+static void buildLookups(SocketOwners *owners) {
+    if (resetSlots(&owners->socketSlots, &owners->socketSlotCount, owners->socketCount) == 0) {
+        unsigned int mask = owners->socketSlotCount - 1;
+        for (unsigned int i = 0; i < owners->socketCount; i++) {
+            unsigned int slot = hashNumber(owners->sockets[i].inode) & mask;
+            while (owners->socketSlots[slot] != 0) slot = (slot + 1) & mask;
+            owners->socketSlots[slot] = i + 1;
+        }
+    } else {
+        owners->socketSlotCount = 0;
+    }
+
+    // The pid lookup is only used on the next refresh, when these
+    // processes have become the old ones
+    if (resetSlots(&owners->processSlots, &owners->processSlotCount, owners->processCount) == 0) {
+        unsigned int mask = owners->processSlotCount - 1;
+        for (unsigned int i = 0; i < owners->processCount; i++) {
+            unsigned int slot = hashNumber(owners->processes[i].pid) & mask;
+            while (owners->processSlots[slot] != 0) slot = (slot + 1) & mask;
+            owners->processSlots[slot] = i + 1;
+        }
+    } else {
+        owners->processSlotCount = 0;
+    }
+}
+
+void refreshSocketOwners(SocketOwners *owners) {
+    // New sockets we couldn't match last time mean something changed that
+    // the open file counts didn't show, so look through everybody again.
+    // What is still missed after that is what nobody we can see has.
+    unsigned long long now = monotonicMillis();
+    int rescanAll = owners->unresolved > 0 && now - owners->lastRescan >= OWNERS_RESCAN_INTERVAL;
+    if (rescanAll) {
+        owners->lastRescan = now;
+        if (owners->missedSlotCount > 0) memset(owners->missed, 0, owners->missedSlotCount * sizeof(unsigned long long));
+        owners->missedCount = 0;
+    }
+    owners->fullRescan = rescanAll || owners->processCount == 0;  // The first refresh looks at everybody too
+    owners->unresolved = 0;
+
+    int procDirectory = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procDirectory < 0) return;
+    DIR *proc = fdopendir(procDirectory);
+    if (proc == NULL) {
+        close(procDirectory);
+        return;
+    }
+
+    // What we have now becomes the old state to copy from
+    SocketOwnerProcess *processes = owners->oldProcesses;
+    unsigned int processCapacity = owners->oldProcessCapacity;
+    owners->oldProcesses = owners->processes;
+    owners->oldProcessCapacity = owners->processCapacity;
+    owners->oldProcessCount = owners->processCount;
+    owners->processes = processes;
+    owners->processCapacity = processCapacity;
+    owners->processCount = 0;
+
+    SocketOwnerEntry *sockets = owners->oldSockets;
+    unsigned int socketCapacity = owners->oldSocketCapacity;
+    owners->oldSockets = owners->sockets;
+    owners->oldSocketCapacity = owners->socketCapacity;
+    owners->sockets = sockets;
+    owners->socketCapacity = socketCapacity;
+    owners->socketCount = 0;
+    owners->processesScanned = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(proc)) != NULL) {
+        if (entry->d_name[0] < '1' || entry->d_name[0] > '9') continue;
+        unsigned int pid = (unsigned int)strtoul(entry->d_name, NULL, 10);
+
+        char path[32];
+        struct stat info;
+        snprintf(path, sizeof(path), "%u/fd", pid);
+        if (fstatat(procDirectory, path, &info, 0) != 0) continue;   // Gone already
+
+        if (reserve((void **)&owners->processes, &owners->processCapacity, owners->processCount + 1,
+                    sizeof(SocketOwnerProcess)) != 0) {
+            break;
+        }
+        SocketOwnerProcess *process = &owners->processes[owners->processCount++];
+        process->pid = pid;
+        process->fdDirectory = info.st_ino;
+        process->fdCount = info.st_size;
+        process->firstSocket = owners->socketCount;
+        process->socketCount = 0;
+
+        // Same process, same number of open files: keep what we found
+        const SocketOwnerProcess *old = findOldProcess(owners, pid);
+        if (old != NULL && !rescanAll && old->fdDirectory == process->fdDirectory && old->fdCount == process->fdCount) {
+            process->programName = old->programName;
+            if (reserve((void **)&owners->sockets, &owners->socketCapacity, owners->socketCount + old->socketCount,
+                        sizeof(SocketOwnerEntry)) != 0) {
+                break;
+            }
+            for (unsigned int i = 0; i < old->socketCount; i++) {
+                SocketOwnerEntry *socket = &owners->sockets[owners->socketCount++];
+                socket->inode = owners->oldSockets[old->firstSocket + i].inode;
+                socket->process = owners->processCount - 1;
+            }
+            process->socketCount = old->socketCount;
+            continue;
+        }
+
+        process->programName = readProgramName(procDirectory, pid);
+        scanProcess(owners, procDirectory);
+        owners->processesScanned++;
+    }
+    closedir(proc);
+
+    buildLookups(owners);
+}
+
+#else
+
+// Windows tables come with the owning pid already, nothing to index
+void refreshSocketOwners(SocketOwners *owners) {
+    (void)owners;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef SOCKET_OWNERS_H
+#define SOCKET_OWNERS_H
+
+// Which process has each socket open. On Linux the sockets in the tables
+// only carry an inode number, and the only way to find the process is to
+// look through every /proc/<pid>/fd directory for "socket:[inode]" links.
+// That is slow with thousands of processes, so what we find is kept: on
+// each refresh only processes that are new, or whose number of open files
+// changed, are looked through again.
+//
+// Linux reports the open file count as the size of /proc/<pid>/fd since
+// 6.2. On older kernels a process is only looked through again when a
+// socket couldn't be matched, and then at most every OWNERS_RESCAN_INTERVAL.
+//
+// Some sockets have no process we can see (the kernel's own, other users'
+// when not root, other pid namespaces). The ones still unmatched after a
+// look through everybody are remembered, and only a socket that hasn't
+// been missed before sets off another one.
+
+#define OWNERS_RESCAN_INTERVAL 10000    // Milliseconds
+
+typedef struct {
+    unsigned int pid;
+    unsigned int programName;           // Interned /proc/<pid>/comm
+    unsigned long long fdDirectory;     // Inode of /proc/<pid>/fd, new if the pid is reused
+    long long fdCount;                  // Open files when we looked, 0 if the kernel doesn't say
+    unsigned int firstSocket;           // This process's sockets in the sockets array
+    unsigned int socketCount;
+} SocketOwnerProcess;
+
+typedef struct {
+    unsigned long long inode;
+    unsigned int process;               // Index into processes
+} SocketOwnerEntry;
+
+typedef struct {
+    // What we know now, and what we knew last refresh (swapped each time
+    // so nothing is allocated once the sizes settle)
+    SocketOwnerProcess *processes;
+    unsigned int processCount;
+    unsigned int processCapacity;
+    SocketOwnerProcess *oldProcesses;
+    unsigned int oldProcessCount;
+    unsigned int oldProcessCapacity;
+
+    SocketOwnerEntry *sockets;
+    unsigned int socketCount;
+    unsigned int socketCapacity;
+    SocketOwnerEntry *oldSockets;
+    unsigned int oldSocketCapacity;
+
+    // Open-addressed lookups of index + 1 (0 = empty)
+    unsigned int *processSlots;         // pid -> processes
+    unsigned int processSlotCount;
+    unsigned int *socketSlots;          // inode -> sockets
+    unsigned int socketSlotCount;
+
+    // Inodes nobody had, since the last look through everybody
+    unsigned long long *missed;         // Open-addressed set (0 = empty)
+    unsigned int missedSlotCount;
+    unsigned int missedCount;
+    int fullRescan;                     // The last refresh looked through every process
+
+    unsigned int unresolved;            // Inodes missed for the first time since the last refresh
+    unsigned long long lastRescan;
+    unsigned int processesScanned;      // How many had to be looked through last refresh
+} SocketOwners;
+
+void initSocketOwners(SocketOwners *owners);
+void freeSocketOwners(SocketOwners *owners);
+
+// Bring the index up to date. Call once per refresh, before the lookups.
+void refreshSocketOwners(SocketOwners *owners);
+
+// Find the process with this socket open. Returns 1 if there is one, or
+// 0 (leaving pid and programName alone) when nobody has it or inode is 0.
+int findSocketOwner(SocketOwners *owners, unsigned long long inode, unsigned int *pid, unsigned int *programName);
+
+#endif
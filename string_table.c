@@ -0,0 +1,146 @@
+#include <string.h>
+#include "string_table.h"
+#include "platform.h"
+
+#define STRING_TABLE_MIN_SLOTS 64
+
+static unsigned int hashString(const char *text, size_t length) {
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void initStringTable(StringTable *table) {
+    memset(table, 0, sizeof(*table));
+    atomic_init(&table->strings, NULL);
+    atomic_init(&table->count, 0);
+    arenaInit(&table->text, 4096);
+}
+
+void freeStringTable(StringTable *table) {
+    arenaFree(&table->text);
+    trackedFree(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Double the hash slots and put every string back in
+static int growSlots(StringTable *table) {
+    unsigned int newSlotCount = table->slotCount ? table->slotCount * 2 : STRING_TABLE_MIN_SLOTS;
+    unsigned int *newSlots = trackedAlloc(newSlotCount * sizeof(unsigned int));
+    if (newSlots == NULL) return -1;
+    memset(newSlots, 0, newSlotCount * sizeof(unsigned int));
+
+    // Only the adding thread gets here, so its own loads need no ordering
+    const char **strings = atomic_load_explicit(&table->strings, memory_order_relaxed);
+    unsigned int count = atomic_load_explicit(&table->count, memory_order_relaxed);
+    for (unsigned int id = 0; id < count; id++) {
+        const char *text = strings[id];
+        unsigned int slot = hashString(text, strlen(text)) & (newSlotCount - 1);
+        while (newSlots[slot] != 0) slot = (slot + 1) & (newSlotCount - 1);
+        newSlots[slot] = id + 1;
+    }
+
+    trackedFree(table->slots);
+    table->slots = newSlots;
+    table->slotCount = newSlotCount;
+    return 0;
+}
+
+unsigned int internString(StringTable *table, const char *text) {
+    size_t length = strlen(text);
+    unsigned int hash = hashString(text, length);
+    const char **strings = atomic_load_explicit(&table->strings, memory_order_relaxed);
+    unsigned int count = atomic_load_explicit(&table->count, memory_order_relaxed);
+
+    if (table->slotCount != 0) {
+        unsigned int slot = hash & (table->slotCount - 1);
+        while (table->slots[slot] != 0) {
+            unsigned int id = table->slots[slot] - 1;
+            if (strcmp(strings[id], text) == 0) return id;
+            slot = (slot + 1) & (table->slotCount - 1);
+        }
+    }
+
+    // New string. Keep the hash at most half full so lookups stay short.
+    if ((count + 1) * 2 > table->slotCount && growSlots(table) != 0) return 0;
+    if (count == table->capacity) {
+        // The list is copied into the arena rather than reallocated, so
+        // the old copy stays valid for anyone still reading it. The copy
+        // is finished before a reader can see the new list.
+        unsigned int newCapacity = table->capacity ? table->capacity * 2 : 32;
+        const char **newStrings = arenaAlloc(&table->text, newCapacity * sizeof(const char *));
+        if (newStrings == NULL) return 0;
+        if (count > 0) memcpy((void *)newStrings, (const void *)strings, count * sizeof(const char *));
+        strings = newStrings;
+        atomic_store_explicit(&table->strings, strings, memory_order_release);
+        table->capacity = newCapacity;
+    }
+
+    char *copy = arenaAlloc(&table->text, length + 1);
+    if (copy == NULL) return 0;
+    memcpy(copy, text, length + 1);
+
+    // The entry is in place before the count lets readers ask for it
+    unsigned int id = count;
+    strings[id] = copy;
+    atomic_store_explicit(&table->count, count + 1, memory_order_release);
+
+    unsigned int slot = hash & (table->slotCount - 1);
+    while (table->slots[slot] != 0) slot = (slot + 1) & (table->slotCount - 1);
+    table->slots[slot] = id + 1;
+    return id;
+}
+
+const char *getInternedString(const StringTable *table, unsigned int id) {
+    // The count first: any list loaded after it holds at least that many
+    if (id >= atomic_load_explicit(&table->count, memory_order_acquire)) return "";
+    return atomic_load_explicit(&table->strings, memory_order_acquire)[id];
+}
+
+// The shared tables. Adding takes the lock, since collector threads (and
+// the fleet collector's shards) can intern too. Reading doesn't: the
+// acquire loads above see a list and count no older than the number being
+// looked up, and neither the text nor the lists it was in move.
+static StringTable programNames;
+static atomic_int programNamesReady = 0;
+static StringTable namespaceNames;
+static atomic_int namespaceNamesReady = 0;
+
+static unsigned int internShared(StringTable *table, atomic_int *ready, const char *first, const char *text) {
+    lockShared();
+    if (!atomic_load_explicit(ready, memory_order_relaxed)) {
+        initStringTable(table);
+        internString(table, first);
+        atomic_store_explicit(ready, 1, memory_order_release);
+    }
+    unsigned int id = internString(table, text);
+    unlockShared();
+    return id;
+}
+
+unsigned int internProgramName(const char *name) {
+    return internShared(&programNames, &programNamesReady, "Unknown", name);   // PROGRAM_NAME_UNKNOWN
+}
+
+const char *getProgramNameText(unsigned int id) {
+    if (!atomic_load_explicit(&programNamesReady, memory_order_acquire)) return "Unknown";
+    return getInternedString(&programNames, id);
+}
+
+unsigned int getProgramNameCount() {
+    if (!atomic_load_explicit(&programNamesReady, memory_order_acquire)) return 1;
+    return atomic_load_explicit(&programNames.count, memory_order_acquire);
+}
+
+unsigned int internNamespaceName(const char *name) {
+    return internShared(&namespaceNames, &namespaceNamesReady, "host", name);   // NAMESPACE_HOST
+}
+
+const char *getNamespaceNameText(unsigned int id) {
+    if (!atomic_load_explicit(&namespaceNamesReady, memory_order_acquire)) return "host";
+    return getInternedString(&namespaceNames, id);
+}
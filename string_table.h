@@ -0,0 +1,43 @@
+#ifndef STRING_TABLE_H
+#define STRING_TABLE_H
+
+#include <stdatomic.h>
+#include "arena.h"
+
+// Stores each distinct string once and hands out a small number for it.
+// Rows keep the number instead of a copy of the text. Numbers never
+// change once given out, so they can be compared between refreshes.
+//
+// One thread adds at a time, but others may look numbers up meanwhile:
+// the list and the count are published with release stores after what
+// they point at is written, and read with acquire loads.
+typedef struct {
+    Arena text;                 // The characters, never reset
+    _Atomic(const char **) strings;     // Number -> text
+    atomic_uint count;
+    unsigned int capacity;
+    unsigned int *slots;        // Open-addressed hash of number + 1 (0 = empty)
+    unsigned int slotCount;     // Always a power of two
+} StringTable;
+
+void initStringTable(StringTable *table);
+void freeStringTable(StringTable *table);
+
+// Returns the number for text, adding it if it's new. Returns 0 (the
+// first string added) if we run out of memory.
+unsigned int internString(StringTable *table, const char *text);
+const char *getInternedString(const StringTable *table, unsigned int id);
+
+// The table shared by all rows for program names. Number 0 is "Unknown".
+// Adding to the shared tables is safe from any thread.
+#define PROGRAM_NAME_UNKNOWN 0
+unsigned int internProgramName(const char *name);
+const char *getProgramNameText(unsigned int id);
+unsigned int getProgramNameCount();     // Numbers handed out so far
+
+// The same for network namespace names. Number 0 is our own, "host".
+#define NAMESPACE_HOST 0
+unsigned int internNamespaceName(const char *name);
+const char *getNamespaceNameText(unsigned int id);
+
+#endif